@@ -28,6 +28,6 @@ LINKFLAGS="-Ldeps/chaste -lrt"
 #TESTS="--begintests  tests/*.c --endtests"
 TESTS=""
 
-SRC=src/q2pc.c
+SRC="src/q2pc.c src/q2pc_stats.c src/q2pc_metrics.c src/q2pc_bench.c"
 
 cake $SRC --config=build/cake/$CAKECONFIG --append-CFLAGS="$CFLAGS"  --LINKFLAGS="$LINKFLAGS"  --LINKFLAGS="$LINKFLAGS" $@ $TEST 
@@ -6,11 +6,13 @@
  */
 #include <signal.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
 
 #include "q2pc_client.h"
 #include "../../deps/chaste/chaste.h"
 #include "../transport/q2pc_transport.h"
+#include "../clock/q2pc_clock.h"
+#include "../trace/q2pc_trace.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
@@ -21,6 +23,7 @@ static i64 client_num       = -1;
 static u64 vote_count       = 0;
 extern i64 msg_size; //HAXK! XXX This is in server.c
 static i64 total_rtos       = 0;
+static char* msg_copy       = NULL; //The last message read, the transport may hand its buffer to someone else
 #define RTOS_MAX (200L * 1000L)
 
 static void term(int signo)
@@ -29,6 +32,9 @@ static void term(int signo)
     (void)signo;
 
     ch_log_info("Total RTOS fired=%li\n", total_rtos);
+    if(conn.priv && conn.get_rto){
+        ch_log_info("Final RTO=%lius\n", conn.get_rto(&conn));
+    }
 
     if(trans){ trans->delete(trans); }
     //if(conn.priv) { conn.delete(&conn); }
@@ -86,6 +92,7 @@ static void init(const transport_s* transport)
                     total_rtos++;
                     continue;
                 case Q2PC_EFIN:
+                    Q2PC_TRACE1(client_conn_efin, transport->client_id);
                     ch_log_warn("Cannot write any more from closed stream\n");
                     term(0);
                     break;
@@ -111,14 +118,9 @@ static q2pc_msg* get_messge(i64 wait_usecs)
     i64 len = 0;
 
 
-    struct timeval ts_start = {0};
-    struct timeval ts_now = {0};
-    i64 ts_start_us = 0;
+    const i64 ts_start_us = q2pc_clock_us();
     i64 ts_now_us = 0;
 
-    gettimeofday(&ts_start, NULL);
-    ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
-
     ch_log_debug3("Waiting for new requests...\n");
 
     i64 result = Q2PC_EAGAIN;
@@ -127,23 +129,28 @@ static q2pc_msg* get_messge(i64 wait_usecs)
         result = conn.beg_read(&conn,&data, &len);
 
         if(result == Q2PC_ENONE){
-            q2pc_msg* msg = (q2pc_msg*)data;
+            //Read buffers can go straight back out on the next write, so keep a copy that outlives end_read
+            const i64 copy_len = MIN(len, msg_size);
+            memcpy(msg_copy, data, copy_len);
+            bzero(msg_copy + copy_len, msg_size - copy_len);
+            conn.end_read(&conn);
+
+            q2pc_msg* msg = (q2pc_msg*)msg_copy;
             ch_log_debug3("Got ts with %li\n", msg->ts) ;
             ch_log_debug3("Got crto with %i\n", msg->c_rto) ;
             ch_log_debug3("Got srto with %i\n", msg->s_rto) ;
-            conn.end_read(&conn);
             return msg;
         }
 
         if(result == Q2PC_EFIN){
+            Q2PC_TRACE1(client_conn_efin, client_num);
             ch_log_warn("Server has quit. Cannot read\n");
             conn.end_read(&conn);
             return NULL;
         }
 
         if(wait_usecs >= 0){
-            gettimeofday(&ts_now, NULL);
-            ts_now_us = ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+            ts_now_us = q2pc_clock_us();
             if(ts_now_us > ts_start_us + wait_usecs){
                 ch_log_warn("Timed out waiting for server response\n");
                 return NULL;
@@ -156,13 +163,14 @@ static q2pc_msg* get_messge(i64 wait_usecs)
 }
 
 
-static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
+static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg, const u64* batch)
 {
     char* data;
     i64 len;
     int result = conn.beg_write(&conn,&data,&len);
     if(result){
         if(result == Q2PC_EFIN){
+            Q2PC_TRACE1(client_conn_efin, client_num);
             ch_log_warn("Cannot write anymore to closed stream. Terminating\n");
             term(0);
         }
@@ -181,7 +189,16 @@ static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
     msg->s_rto      = old_msg->s_rto;
     msg->c_rto      = old_msg->c_rto;
     msg->ts         = old_msg->ts;
+    msg->txn_id     = old_msg->txn_id;
+    msg->batch_len  = batch ? old_msg->batch_len : 0;
+    if(batch){
+        if((i64)(sizeof(q2pc_msg) + Q2PC_BATCH_BYTES(msg->batch_len)) > msg_size){
+            ch_log_fatal("Not enough space to vote on a batch of %i transactions\n", msg->batch_len);
+        }
+        memcpy(q2pc_msg_batch(msg), batch, Q2PC_BATCH_BYTES(msg->batch_len));
+    }
 
+    Q2PC_TRACE3(client_vote_send, client_num, msg->txn_id, msg_type);
     ch_log_debug3("Sent ts with %li\n", msg->ts) ;
     ch_log_debug3("Sent crto with %i\n", msg->c_rto) ;
     ch_log_debug3("Sent srto with %i\n", msg->s_rto) ;
@@ -200,8 +217,10 @@ static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
             continue;
         case Q2PC_RTOFIRED:
             rtos++;
+            Q2PC_TRACE3(client_rto_fire, client_num, old_msg->txn_id, rtos);
             continue;
         case Q2PC_EFIN:
+            Q2PC_TRACE1(client_conn_efin, client_num);
             ch_log_error("Stream has ended. Cannot write\n");
             term(0);
         default:
@@ -212,72 +231,106 @@ static void send_response(q2pc_msg_type_t msg_type, q2pc_msg* old_msg)
 }
 
 
-static int do_phase1(i64 timeout)
+//Vote on each logical transaction in a group commit request. Returns true if every vote was yes.
+static bool vote_batch(q2pc_msg* msg, u64* batch)
 {
-    q2pc_msg* msg = get_messge(timeout);
-    if(!msg){
-        ch_log_error("Server has terminated. Cannot continue\n");
-        term(0);
+    bool all_yes = true;
+    bzero(batch, Q2PC_BATCH_BYTES(msg->batch_len));
+    for(int i = 0; i < msg->batch_len; i++){
+        //XXX HACK: 1 in 5 votes will fail
+        if(vote_count % 5){
+            batch[i / 64] |= 1ULL << (i % 64);
+        }
+        else{
+            all_yes = false;
+        }
+        vote_count++;
     }
 
-    //XXX HACK: 1 in 5 votes will fail
-    u64 vote_yes = (vote_count % 5);
+    return all_yes;
+}
 
+static int do_phase1(q2pc_msg* msg)
+{
+    ch_log_debug2("Q2PC Client: [M]<-- request (%li)\n", msg->txn_id);
+
+    if(msg->batch_len > 0){
+        u64 batch[Q2PC_BATCH_WORDS(INT16_MAX)];
+        const bool all_yes = vote_batch(msg, batch);
+        ch_log_debug2("Q2PC Client: [M]--> vote on batch of %i\n", msg->batch_len);
+        send_response(all_yes ? q2pc_vote_yes_msg : q2pc_vote_no_msg, msg, batch);
+        return !all_yes;
+    }
 
-    switch(msg->type){
-    case q2pc_request_msg:
-        ch_log_debug2("Q2PC Client: [M]<-- request\n");
+    //XXX HACK: 1 in 5 votes will fail
+    u64 vote_yes = (vote_count % 5);
 
-        if(vote_yes){
-            ch_log_debug2("Q2PC Client: [M]--> vote yes\n");
-            send_response(q2pc_vote_yes_msg, msg);
-            break;
-        }
-        else{
-            ch_log_debug2("Q2PC Client: [M]--> vote no\n");
-            send_response(q2pc_vote_no_msg, msg);
-            break;
-        }
-    default:
-        ch_log_debug2("Q2PC Client: [M]<-- Unknown message (%i)\n", msg->type);
-        ch_log_error("Protocol failure, in phase 1 unexpected message type %i\n", msg->type);
-        term(0);
+    if(vote_yes){
+        ch_log_debug2("Q2PC Client: [M]--> vote yes\n");
+        send_response(q2pc_vote_yes_msg, msg, NULL);
+    }
+    else{
+        ch_log_debug2("Q2PC Client: [M]--> vote no\n");
+        send_response(q2pc_vote_no_msg, msg, NULL);
     }
 
     vote_count++;
     return !vote_yes;
 }
 
-static int do_phase2(i64 timeout)
+//The number of logical transactions a decision commits. A commit on a batch carries a bitmap of the transactions that
+//every client voted yes on, the rest of the batch is aborted.
+static i64 decision_commits(q2pc_msg* msg)
 {
-    int result = 0;
-    q2pc_msg* msg = get_messge(timeout);
-    if(!msg){
-        ch_log_error("Server has terminated. Cannot continue\n");
+    if(msg->type != q2pc_commit_msg){
+        return 0;
+    }
+
+    if(msg->batch_len <= 0){
+        return 1;
+    }
+
+    if((i64)(sizeof(q2pc_msg) + Q2PC_BATCH_BYTES(msg->batch_len)) > msg_size){
+        ch_log_error("Protocol failure, a decision on a batch of %i does not fit in a %liB message\n", msg->batch_len, msg_size);
         term(0);
     }
 
+    i64 commits = 0;
+    const char* batch = q2pc_msg_batch(msg);
+    for(int w = 0; w < Q2PC_BATCH_WORDS(msg->batch_len); w++){
+        const i64 bits = MIN(msg->batch_len - w * 64, 64);
+        u64 committed;
+        memcpy(&committed, batch + w * sizeof(u64), sizeof(u64));
+        committed &= bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+        commits   += __builtin_popcountll(committed);
+    }
+
+    return commits;
+}
+
+
+//Acknowledge a decision. Returns the number of logical transactions it aborted.
+static i64 do_phase2(q2pc_msg* msg)
+{
+    const i64 txns    = MAX(msg->batch_len, 1);
+    const i64 commits = decision_commits(msg);
 
     switch(msg->type){
     case q2pc_commit_msg:
-        ch_log_debug2("Q2PC Client: [M]<-- commit\n");
-        send_response(q2pc_ack_msg, msg);
-        ch_log_debug2("Q2PC Client: [M]--> ack\n");
-        result = 0;
+        ch_log_debug2("Q2PC Client: [M]<-- commit (%li), %li of %li transactions\n", msg->txn_id, commits, txns);
         break;
     case q2pc_cancel_msg:
-        ch_log_debug2("Q2PC Client: [M]<-- cancel\n");
-        send_response(q2pc_ack_msg, msg);
-        ch_log_debug2("Q2PC Client: [M]--> ack\n");
-        result = 1;
+        ch_log_debug2("Q2PC Client: [M]<-- cancel (%li)\n", msg->txn_id);
         break;
     default:
         ch_log_error("Protocol failure, in phase 2 unexpected message type %i\n", msg->type);
         term(0);
     }
 
+    send_response(q2pc_ack_msg, msg, NULL);
+    ch_log_debug2("Q2PC Client: [M]--> ack\n");
 
-    return result;
+    return txns - commits;
 }
 
 
@@ -288,15 +341,44 @@ void run_client(const transport_s* transport, i64 client_id, i64 wait_time, i64
     msg_size  = MAX(msize, (i64)sizeof(q2pc_msg));
     ch_log_info("Using message size of %li\n", msg_size);
 
+    msg_copy = calloc(1, msg_size);
+    if(!msg_copy){
+        ch_log_fatal("Could not allocate message buffer\n");
+    }
+
     init(transport);
 
+    //The server may pipeline transactions, so requests for new transactions can arrive before the
+    //decision on older ones. Handle messages as they come, only timing out while a vote is outstanding.
+    i64 outstanding = 0;
     while(1){
-        do_phase1(-1);
-        if(do_phase2(wait_time)){
-            ch_log_debug1("Commit aborted\n");
+        q2pc_msg* msg = get_messge(outstanding ? wait_time : -1);
+        if(!msg){
+            ch_log_error("Server has terminated. Cannot continue\n");
+            term(0);
         }
-        else{
-            ch_log_debug1("Commit succeed\n");
+
+        Q2PC_TRACE3(client_request_recv, client_num, msg->txn_id, msg->type);
+        switch(msg->type){
+        case q2pc_request_msg:
+            do_phase1(msg);
+            outstanding++;
+            break;
+        case q2pc_commit_msg:
+        case q2pc_cancel_msg:
+            Q2PC_TRACE3(client_outcome, client_num, msg->txn_id, msg->type == q2pc_cancel_msg);
+            if(do_phase2(msg)){
+                ch_log_debug1("Commit aborted, in whole or in part\n");
+            }
+            else{
+                ch_log_debug1("Commit succeed\n");
+            }
+            outstanding = MAX(outstanding - 1, 0);
+            break;
+        default:
+            ch_log_debug2("Q2PC Client: [M]<-- Unknown message (%i)\n", msg->type);
+            ch_log_error("Protocol failure, unexpected message type %i\n", msg->type);
+            term(0);
         }
     }
 
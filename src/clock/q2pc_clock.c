@@ -0,0 +1,97 @@
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "q2pc_clock.h"
+
+#define CALIBRATE_NS (50L * 1000 * 1000)
+
+q2pc_clock_t q2pc_clock = {0};
+
+
+static i64 read_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+
+#if defined(__x86_64__)
+static u64 read_tsc()
+{
+    u32 lo, hi;
+    __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi) :: "rcx");
+    return ((u64)hi << 32) | lo;
+}
+
+
+//The TSC has to tick at the same rate in every power state, and rdtscp has to be there to read it
+static bool tsc_usable()
+{
+    u32 eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))){
+        ch_log_debug1("TSC is not invariant\n");
+        return false;
+    }
+
+    if(!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27))){
+        ch_log_debug1("No rdtscp instruction\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+//Read the TSC and a clock as close together as we can, keeping the tightest of a few tries
+static void read_pair(clockid_t clock, u64* tsc_o, i64* ns_o)
+{
+    u64 best = ~0ULL;
+    for(int i = 0; i < 8; i++){
+        const u64 before = read_tsc();
+        const i64 ns     = read_ns(clock);
+        const u64 after  = read_tsc();
+        if(after - before < best){
+            best   = after - before;
+            *tsc_o = before + (after - before) / 2;
+            *ns_o  = ns;
+        }
+    }
+}
+#endif
+
+
+void q2pc_clock_init()
+{
+    q2pc_clock.mono_offset_ns = read_ns(CLOCK_REALTIME) - read_ns(CLOCK_MONOTONIC);
+    q2pc_clock.use_tsc        = false;
+
+#if defined(__x86_64__)
+    if(!tsc_usable()){
+        ch_log_debug1("Using CLOCK_MONOTONIC for timing\n");
+        return;
+    }
+
+    u64 tsc_start, tsc_end;
+    i64 ns_start, ns_end;
+    read_pair(CLOCK_MONOTONIC, &tsc_start, &ns_start);
+    const struct timespec wait = { .tv_sec = 0, .tv_nsec = CALIBRATE_NS };
+    nanosleep(&wait, NULL);
+    read_pair(CLOCK_MONOTONIC, &tsc_end, &ns_end);
+
+    if(tsc_end <= tsc_start || ns_end <= ns_start){
+        ch_log_warn("TSC calibration failed, using CLOCK_MONOTONIC for timing\n");
+        return;
+    }
+
+    q2pc_clock.mult = (u64)(((q2pc_clock_u128)(ns_end - ns_start) << Q2PC_CLOCK_SHIFT) / (tsc_end - tsc_start));
+    read_pair(CLOCK_REALTIME, &q2pc_clock.base_tsc, &q2pc_clock.base_ns);
+    q2pc_clock.use_tsc = true;
+
+    ch_log_debug1("Using TSC for timing at %0.3lf MHz\n", (double)(tsc_end - tsc_start) * 1000 / (ns_end - ns_start));
+#else
+    ch_log_debug1("Using CLOCK_MONOTONIC for timing\n");
+#endif
+}
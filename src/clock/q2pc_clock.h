@@ -0,0 +1,53 @@
+#ifndef Q2PC_CLOCK_H_
+#define Q2PC_CLOCK_H_
+
+#include <time.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//A cheap clock for the hot paths. On x86 with an invariant TSC, time comes from rdtscp scaled by a rate that is
+//calibrated at start up, which costs a few ns and never calls into the kernel. Everywhere else it falls back to
+//clock_gettime(CLOCK_MONOTONIC). Either way the clock is monotonic, and it starts out lined up with CLOCK_REALTIME so
+//that it can be compared with kernel socket timestamps (which drift apart from it only as fast as NTP slews).
+
+#define Q2PC_CLOCK_SHIFT 32
+
+__extension__ typedef unsigned __int128 q2pc_clock_u128; //Keeps -pedantic happy
+
+typedef struct {
+    bool use_tsc;
+    u64 base_tsc;
+    i64 base_ns;
+    u64 mult;           //Nanoseconds per tick, scaled up by 2^Q2PC_CLOCK_SHIFT
+    i64 mono_offset_ns; //CLOCK_REALTIME - CLOCK_MONOTONIC, for the fallback
+} q2pc_clock_t;
+
+extern q2pc_clock_t q2pc_clock;
+
+//Calibrate the clock. Call once at start up, before any threads are running. Takes a few tens of milliseconds.
+void q2pc_clock_init();
+
+
+static inline i64 q2pc_clock_ns()
+{
+#if defined(__x86_64__)
+    if(likely(q2pc_clock.use_tsc)){
+        u32 lo, hi;
+        __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi) :: "rcx");
+        const u64 ticks = (((u64)hi << 32) | lo) - q2pc_clock.base_tsc;
+        return q2pc_clock.base_ns + (i64)(((q2pc_clock_u128)ticks * q2pc_clock.mult) >> Q2PC_CLOCK_SHIFT);
+    }
+#endif
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec + q2pc_clock.mono_offset_ns;
+}
+
+
+static inline i64 q2pc_clock_us()
+{
+    return q2pc_clock_ns() / 1000;
+}
+
+#endif /* Q2PC_CLOCK_H_ */
@@ -27,7 +27,19 @@ typedef struct __attribute__((__packed__)) {
     i16 c_rto;
     i16 s_rto;
     i64 ts;
+    i64 txn_id; //Transaction this message belongs to, echoed back by clients
+    i16 batch_len; //Number of logical transactions grouped into this round, 0 if not batching
 
 } q2pc_msg;
 
+//When batching, a bitmap with one bit per logical transaction follows the message header. In votes, a set bit is a
+//yes vote for that transaction. In commits, a set bit means that transaction is committed.
+#define Q2PC_BATCH_WORDS(batch_len) (((batch_len) + 63) / 64)
+#define Q2PC_BATCH_BYTES(batch_len) (Q2PC_BATCH_WORDS(batch_len) * sizeof(u64))
+
+static inline char* q2pc_msg_batch(q2pc_msg* msg)
+{
+    return (char*)msg + sizeof(q2pc_msg);
+}
+
 #endif /* Q2PC_PROTOCOL_H_ */
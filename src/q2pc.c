@@ -5,6 +5,8 @@
 #include "server/q2pc_server.h"
 #include "client/q2pc_client.h"
 #include "transport/q2pc_transport.h"
+#include "transport/q2pc_trans_rudp.h"
+#include "clock/q2pc_clock.h"
 
 USE_CH_LOGGER(CH_LOG_LVL_INFO,true,ch_log_tostderr,NULL);
 USE_CH_OPTIONS;
@@ -13,6 +15,12 @@ static struct {
 	//Server Options
 	i64 server;
 	i64 threads;
+	i64 window;
+	i64 batch;
+	i64 batch_wait;
+	i64 rate;
+	bool epoll;
+	i64 poll_spin;
 
 	//Client Options
 	char* client;
@@ -23,6 +31,12 @@ static struct {
 	bool trans_udp_ln;
 	bool trans_rdp_ln;
 	bool trans_udp_qj;
+	bool trans_udp_mm;
+	bool trans_udp_ur;
+	bool trans_shm_ln;
+	bool trans_udp_mc;
+	bool trans_udp_pk;
+	bool trans_udp_xd;
 
 	//Transport options
     char* bcast;
@@ -30,6 +44,12 @@ static struct {
 	i64 qjump_epoch;
 	i64 qjump_psize;
 	char* iface;
+	char* mcast_group;
+	i64 mcast_ttl;
+	bool nack;
+	i64 nack_drop;
+	bool shard;
+	i64 tstamp;
 	i64 msize;
 
 	//Logging options
@@ -43,8 +63,15 @@ static struct {
 	//General
 	i64 waittime;
 	i64 rto_us;
+	i64 rto_min_us;
+	i64 rto_max_us;
+	i64 rdp_window;
 	i64 report_int;
 	i64 stats_len;
+	bool stats_stream;
+	char* stats_file;
+	char* metrics_shm;
+	i64 metrics_port;
 
 } options;
 
@@ -54,6 +81,12 @@ int main(int argc, char** argv)
 	//Server options
     ch_opt_addii(CH_OPTION_OPTIONAL,'s',"server","Put q2pc in server mode, specify the number of clients", &options.server, 0);
     ch_opt_addii(CH_OPTION_OPTIONAL,'T',"threads","The number of threads to use", &options.threads, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'W',"window","The number of transactions to keep in flight (pipelining)", &options.window, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'b',"batch","The maximum number of transactions to group into one commit round", &options.batch, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'L',"batch-wait","How long to wait for a batch to fill up (us)", &options.batch_wait, 0);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'a',"rate","Rate at which new transactions arrive (txn/s), 0 means as fast as possible", &options.rate, 0);
+    ch_opt_addbi(CH_OPTION_FLAG,    'E',"epoll","Worker threads wait for readable connections with epoll instead of polling them all", &options.epoll, false);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'P',"poll-spin","How long an idle epoll worker spins before blocking (us), -1 means never block", &options.poll_spin, 50);
 
     //Client options
     ch_opt_addsi(CH_OPTION_OPTIONAL,'c',"client","Put q2pc in client mode, specify server address in x.x.x.x format", &options.client, NULL);
@@ -63,12 +96,25 @@ int main(int argc, char** argv)
     ch_opt_addbi(CH_OPTION_FLAG,    'u',"udp-ln","Use Linux based UDP transport [default]", &options.trans_udp_ln, false);
     ch_opt_addbi(CH_OPTION_FLAG,    't',"tcp-ln","Use Linux based TCP transport", &options.trans_tcp_ln, false);
     ch_opt_addbi(CH_OPTION_FLAG,    'r',"rdp-ln","Use Linux based UDP transport with reliability", &options.trans_rdp_ln, false);
-    ch_opt_addbi(CH_OPTION_FLAG,    'q',"udp-qj","Use NetMap based UDP transport over Q-Jump", &options.trans_udp_qj, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'q',"udp-qj","Use Linux based UDP broadcast transport with Q-Jump priorities", &options.trans_udp_qj, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'M',"udp-mm","Use Linux based UDP transport with batched sendmmsg/recvmmsg on a single server port", &options.trans_udp_mm, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'U',"udp-ur","Use Linux io_uring based UDP transport (Linux 6.0+, otherwise falls back to udp-ln)", &options.trans_udp_ur, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'H',"shm-ln","Use shared memory rings between processes on the same machine", &options.trans_shm_ln, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'G',"udp-mc","Use Linux based UDP transport with IP multicast fan-out", &options.trans_udp_mc, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'K',"udp-pk","Use Q-Jump style broadcast with the server on AF_PACKET TPACKET_V3 rings (needs CAP_NET_RAW)", &options.trans_udp_pk, false);
+    ch_opt_addbi(CH_OPTION_FLAG,    'X',"udp-xd","Use Q-Jump style broadcast with the server on AF_XDP sockets, in generic mode if the driver has no XDP support (needs CAP_NET_ADMIN, CAP_NET_RAW and CAP_BPF)", &options.trans_udp_xd, false);
 
     //Qjump Transport options
     ch_opt_addii(CH_OPTION_OPTIONAL,'p',"port","Port to use for all transports", &options.port, 7331);
     ch_opt_addsi(CH_OPTION_OPTIONAL,'B',"broadcast","The broadcast IP address to use in UDP mode ini x.x.x.x format", &options.bcast, "127.0.0.0");
     ch_opt_addsi(CH_OPTION_OPTIONAL,'i',"iface","The interface name to use", &options.iface, "eth4");
+    ch_opt_addsi(CH_OPTION_OPTIONAL,'g',"mcast-group","The multicast group to use in x.x.x.x format", &options.mcast_group, "239.1.2.3");
+    ch_opt_addii(CH_OPTION_OPTIONAL,'y',"mcast-ttl","How many routers multicast messages may cross", &options.mcast_ttl, 1);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'d',"rdp-window","How many messages rdp-ln may have in flight on each connection before it waits for acks", &options.rdp_window, 1);
+    ch_opt_addbi(CH_OPTION_FLAG,    'N',"nack","Repair lost broadcasts with NACKs (udp-qj and udp-mc only)", &options.nack, false);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'V',"nack-drop","Percentage of broadcasts a NACK client throws away, to test repairs", &options.nack_drop, 0);
+    ch_opt_addbi(CH_OPTION_FLAG,    'Z',"shard","Server takes all clients on one port, with a SO_REUSEPORT socket per thread (udp-ln, rdp-ln and udp-qj only)", &options.shard, false);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'Y',"tstamp","Kernel timestamps on server sockets to split wire time from host time, 0 off, 1 software (udp-ln and tcp-ln only, without --window)", &options.tstamp, 0);
     ch_opt_addii(CH_OPTION_OPTIONAL,'m',"message-size","Size of the messages to use", &options.msize, 128);
 
     //Q2PC Logging
@@ -80,8 +126,14 @@ int main(int argc, char** argv)
 
     ch_opt_addii(CH_OPTION_OPTIONAL, 'w',"wait","How long to wait for client/server delay (us)", &options.waittime, 2000 * 1000);
     ch_opt_addii(CH_OPTION_OPTIONAL, 'o',"rto", "How long to wait before retransmitting a request (us)", &options.rto_us, 200 * 1000);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'j',"rto-min", "Lower bound on the learned retransmit timeout (us)", &options.rto_min_us, 1000);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'k',"rto-max", "Upper bound on the learned retransmit timeout (us)", &options.rto_max_us, 1000 * 1000);
     ch_opt_addii(CH_OPTION_OPTIONAL, 'R',"report-int", "reporting interval for statistics", &options.report_int, 100);
     ch_opt_addii(CH_OPTION_OPTIONAL, 'S',"stats-len", "length of stats to keep", &options.stats_len, 1000);
+    ch_opt_addbi(CH_OPTION_FLAG,     'A',"stats-stream", "Stream stats to a binary file from a background thread and keep running, stats-len sets the buffering", &options.stats_stream, false);
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'O',"stats-file", "Where to write the binary stats file, read it with q2pc_stats", &options.stats_file, "/tmp/q2pc_stats.bin");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'D',"metrics", "Publish live metrics to a shared memory page with this name (eg /q2pc_metrics), read it with q2pc_metrics", &options.metrics_shm, NULL);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'J',"metrics-port", "Serve live metrics in the Prometheus text format on 127.0.0.1 at this port, 0 means off", &options.metrics_port, 0);
     //Parse it all up
     ch_opt_parse(argc,argv);
 
@@ -128,14 +180,26 @@ int main(int argc, char** argv)
     transport_opt_count += options.trans_tcp_ln ? 1 : 0;
     transport_opt_count += options.trans_rdp_ln ? 1 : 0;
     transport_opt_count += options.trans_udp_qj ? 1 : 0;
+    transport_opt_count += options.trans_udp_mm ? 1 : 0;
+    transport_opt_count += options.trans_udp_ur ? 1 : 0;
+    transport_opt_count += options.trans_shm_ln ? 1 : 0;
+    transport_opt_count += options.trans_udp_mc ? 1 : 0;
+    transport_opt_count += options.trans_udp_pk ? 1 : 0;
+    transport_opt_count += options.trans_udp_xd ? 1 : 0;
 
     //Make sure only 1 choice has been made
     if(transport_opt_count > 1){
-        ch_log_fatal("Q2PC: Can only use one transport at a time, you've selected the following [%s%s%s%s%s ]\n ",
+        ch_log_fatal("Q2PC: Can only use one transport at a time, you've selected the following [%s%s%s%s%s%s%s%s%s%s ]\n ",
                 options.trans_udp_ln ? "udp-ln " : "",
                 options.trans_tcp_ln ? "tcp-ln " : "",
-                options.trans_tcp_ln ? "rdp-ln " : "",
-                options.trans_udp_qj ? "udp-qj " : ""
+                options.trans_rdp_ln ? "rdp-ln " : "",
+                options.trans_udp_qj ? "udp-qj " : "",
+                options.trans_udp_mm ? "udp-mm " : "",
+                options.trans_udp_ur ? "udp-ur " : "",
+                options.trans_shm_ln ? "shm-ln " : "",
+                options.trans_udp_mc ? "udp-mc " : "",
+                options.trans_udp_pk ? "udp-pk " : "",
+                options.trans_udp_xd ? "udp-xd " : ""
         );
     }
 
@@ -150,6 +214,12 @@ int main(int argc, char** argv)
     transport.type          = options.trans_tcp_ln ? tcp_ln : transport.type;
     transport.type          = options.trans_udp_qj ? udp_qj : transport.type;
     transport.type          = options.trans_rdp_ln ? rdp_ln : transport.type;
+    transport.type          = options.trans_udp_mm ? udp_mm : transport.type;
+    transport.type          = options.trans_udp_ur ? udp_ur : transport.type;
+    transport.type          = options.trans_shm_ln ? shm_ln : transport.type;
+    transport.type          = options.trans_udp_mc ? udp_mc : transport.type;
+    transport.type          = options.trans_udp_pk ? udp_pk : transport.type;
+    transport.type          = options.trans_udp_xd ? udp_xd : transport.type;
     transport.qjump_epoch   = options.qjump_epoch;
     transport.qjump_limit   = options.qjump_psize;
     transport.port          = options.port;
@@ -159,8 +229,19 @@ int main(int argc, char** argv)
     transport.client_id     = options.client_id;
     transport.bcast         = options.bcast;
     transport.iface         = options.iface;
+    transport.mcast_group   = options.mcast_group;
+    transport.mcast_ttl     = options.mcast_ttl;
+    transport.nack          = options.nack;
+    transport.nack_drop     = options.nack_drop;
+    transport.wait_us       = options.waittime;
     transport.rto_us        = options.rto_us;
+    transport.rto_min_us    = options.rto_min_us;
+    transport.rto_max_us    = options.rto_max_us;
+    transport.rdp_window    = options.rdp_window;
+    transport.txn_window    = options.window;
     transport.msize         = options.msize;
+    transport.shards        = options.shard ? MAX(options.threads, 1) : 0;
+    transport.tstamp        = options.tstamp;
 
 
     //Configure application options
@@ -176,15 +257,66 @@ int main(int argc, char** argv)
         ch_log_fatal("Q2PC: Configuration error, in client mode, you must specify a client id >0.\n");
     }
 
+    if(options.window < 1){
+        ch_log_fatal("Q2PC: Configuration error, the transaction window must be at least 1.\n");
+    }
+
+    if(options.batch < 1 || options.batch > INT16_MAX){
+        ch_log_fatal("Q2PC: Configuration error, the batch size must be in the range [1,%i].\n", INT16_MAX);
+    }
+
+    if(options.rate < 0 || options.rate > Q2PC_MAX_RATE){
+        ch_log_fatal("Q2PC: Configuration error, the rate must be in the range [0,%lli].\n", Q2PC_MAX_RATE);
+    }
+
+    if(options.nack && transport.type != udp_qj && transport.type != udp_mc){
+        ch_log_fatal("Q2PC: Configuration error, NACK repair only works with the udp-qj and udp-mc transports.\n");
+    }
+
+    if(options.nack_drop < 0 || options.nack_drop > 100 || (options.nack_drop && !options.nack)){
+        ch_log_fatal("Q2PC: Configuration error, the NACK drop percentage must be in the range [0,100], and needs --nack.\n");
+    }
+
+    if(options.shard && transport.type != udp_ln && transport.type != rdp_ln && transport.type != udp_qj){
+        ch_log_fatal("Q2PC: Configuration error, sharding only works with the udp-ln, rdp-ln and udp-qj transports.\n");
+    }
+
+    if(options.tstamp < 0 || options.tstamp > 1){
+        ch_log_fatal("Q2PC: Configuration error, timestamps must be 0 (off) or 1 (software).\n");
+    }
+
+    //Only the latest TX stamp is kept, which is the request being answered only if there is one request in flight
+    if(options.tstamp && options.window > 1){
+        ch_log_fatal("Q2PC: Configuration error, timestamps only work with a transaction window of 1.\n");
+    }
+
+    if(options.tstamp && ((transport.type != udp_ln && transport.type != tcp_ln) || options.shard)){
+        ch_log_fatal("Q2PC: Configuration error, timestamps only work with the udp-ln and tcp-ln transports, without sharding.\n");
+    }
+
+    if(options.metrics_port < 0 || options.metrics_port > 65535){
+        ch_log_fatal("Q2PC: Configuration error, the metrics port must be in the range [0,65535].\n");
+    }
+
+    if(options.rdp_window < 1 || options.rdp_window > Q2PC_RUDP_MAX_WINDOW){
+        ch_log_fatal("Q2PC: Configuration error, the rdp-ln window must be in the range [1,%i].\n", Q2PC_RUDP_MAX_WINDOW);
+    }
+
+    if(options.window > options.rdp_window && transport.type == rdp_ln){
+        ch_log_fatal("Q2PC: Configuration error, to pipeline transactions over rdp-ln the rdp-ln window must be at least as big as the transaction window.\n");
+    }
+
 
     /********************************************************/
     //real work begins here:
     /********************************************************/
+    q2pc_clock_init();
+
     if(options.client){
         run_client(&transport, options.client_id, options.waittime, options.msize);
     }
     else{
-        run_server(options.threads, options.server,&transport, options.waittime, options.report_int, options.stats_len, options.msize);
+        run_server(options.threads, options.server,&transport, options.waittime, options.report_int, options.stats_len, options.stats_stream, options.stats_file, options.metrics_shm, options.metrics_port, options.msize, options.window, options.batch, options.batch_wait, options.rate, options.epoll, options.poll_spin);
     }
 
     return 0;
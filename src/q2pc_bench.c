@@ -0,0 +1,484 @@
+//Loopback benchmark. Runs a q2pc server and its clients on this machine for every combination of transport, client
+//count, thread count and message size asked for, and prints a CSV line of throughput and latency for each run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../deps/chaste/chaste.h"
+#include "../deps/chaste/options/options.h"
+
+#include "protocol/q2pc_protocol.h"
+#include "stats/q2pc_stats_file.h"
+#include "stats/hdr_hist.h"
+#include "clock/q2pc_clock.h"
+
+USE_CH_LOGGER(CH_LOG_LVL_INFO,true,ch_log_tostderr,NULL);
+USE_CH_OPTIONS;
+
+#define MAX_ARGS        64
+#define MAX_LIST        32
+#define SERVER_START_MS 300  //Let the server get its sockets up before the clients go looking for it
+#define STOP_WAIT_MS    5000 //Then give up and kill it
+#define POLL_MS         10
+#define STATS_LEN       (64 * 1024) //Stats ring when streaming, so runs can be as long as they like
+
+static struct {
+    char* binary;
+    char* transports;
+    char* clients;
+    char* threads;
+    char* msizes;
+    i64 duration_ms;
+    i64 warmup_ms;
+    i64 port;
+    char* iface;
+    char* bcast;
+    char* dir;
+    char* extra;
+    char* output;
+    bool keep;
+} options;
+
+typedef struct {
+    const char* name;
+    const char* flag;
+} transport_t;
+
+//udp-pk and udp-xd need privileges, so they're only run if they're asked for
+static const transport_t transports[] = {
+    { "udp-ln", "-u" },
+    { "tcp-ln", "-t" },
+    { "rdp-ln", "-r" },
+    { "udp-qj", "-q" },
+    { "udp-mm", "-M" },
+    { "udp-ur", "-U" },
+    { "shm-ln", "-H" },
+    { "udp-mc", "-G" },
+    { "udp-pk", "-K" },
+    { "udp-xd", "-X" },
+};
+
+typedef struct {
+    char* argv[MAX_ARGS + 1];
+    i64 count;
+} args_t;
+
+typedef struct {
+    const char* status;
+    double seconds;
+    i64 rounds;
+    i64 votes;
+    i64 rtos;
+    hdr_hist phase1;
+    hdr_hist phase2;
+} result_t;
+
+
+static void args_add(args_t* args, const char* fmt, ...)
+{
+    if(args->count >= MAX_ARGS){
+        ch_log_fatal("Q2PC Bench: Too many arguments for q2pc, the limit is %i\n", MAX_ARGS);
+    }
+
+    char buff[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buff, sizeof(buff), fmt, ap);
+    va_end(ap);
+
+    args->argv[args->count++] = strdup(buff);
+}
+
+
+//Everything that every q2pc in the run gets
+static void args_common(args_t* args, const transport_t* trans, i64 port, i64 msize)
+{
+    args_add(args, "%s", trans->flag);
+    args_add(args, "-p");
+    args_add(args, "%li", port);
+    args_add(args, "-m");
+    args_add(args, "%li", msize);
+    args_add(args, "-i");
+    args_add(args, "%s", options.iface);
+    args_add(args, "-B");
+    args_add(args, "%s", options.bcast);
+
+    char* extra = strdup(options.extra);
+    char* save  = NULL;
+    for(char* arg = strtok_r(extra, " ", &save); arg; arg = strtok_r(NULL, " ", &save)){
+        args_add(args, "%s", arg);
+    }
+    free(extra);
+}
+
+
+static void args_free(args_t* args)
+{
+    for(i64 i = 0; i < args->count; i++){
+        free(args->argv[i]);
+    }
+    bzero(args, sizeof(args_t));
+}
+
+
+//Split a comma separated list. Returns how many items there are.
+static i64 parse_list(const char* what, const char* str, char** items)
+{
+    char* copy  = strdup(str);
+    char* save  = NULL;
+    i64 count   = 0;
+    for(char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+        if(count >= MAX_LIST){
+            ch_log_fatal("Q2PC Bench: Too many %s, the limit is %i\n", what, MAX_LIST);
+        }
+        items[count++] = strdup(item);
+    }
+    free(copy);
+
+    if(!count){
+        ch_log_fatal("Q2PC Bench: Need at least one of %s\n", what);
+    }
+
+    return count;
+}
+
+
+static i64 parse_ints(const char* what, const char* str, i64 min, i64* values)
+{
+    char* items[MAX_LIST];
+    const i64 count = parse_list(what, str, items);
+    for(i64 i = 0; i < count; i++){
+        char* end = NULL;
+        values[i] = strtol(items[i], &end, 10);
+        if(*end || values[i] < min){
+            ch_log_fatal("Q2PC Bench: \"%s\" is not a valid number of %s, it must be at least %li\n", items[i], what, min);
+        }
+        free(items[i]);
+    }
+
+    return count;
+}
+
+
+static const transport_t* find_transport(const char* name)
+{
+    for(size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++){
+        if(!strcmp(transports[i].name, name)){
+            return &transports[i];
+        }
+    }
+
+    ch_log_fatal("Q2PC Bench: Unknown transport \"%s\"\n", name);
+    return NULL;
+}
+
+
+static pid_t spawn(args_t* args, const char* log_path)
+{
+    args->argv[args->count] = NULL;
+
+    pid_t pid = fork();
+    if(pid < 0){
+        ch_log_fatal("Q2PC Bench: Could not fork: %s\n", strerror(errno));
+    }
+
+    if(pid == 0){
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0){
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+
+        execv(args->argv[0], args->argv);
+        fprintf(stderr, "Could not run %s: %s\n", args->argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    return pid;
+}
+
+
+//Wait up to wait_ms for a child to exit. Returns true if it has.
+static bool reap(pid_t pid, i64 wait_ms)
+{
+    const i64 deadline_us = q2pc_clock_us() + wait_ms * 1000;
+    while(1){
+        int status = 0;
+        const pid_t result = waitpid(pid, &status, WNOHANG);
+        if(result == pid || (result < 0 && errno == ECHILD)){
+            return true;
+        }
+
+        if(q2pc_clock_us() >= deadline_us){
+            return false;
+        }
+
+        usleep(POLL_MS * 1000);
+    }
+}
+
+
+static void stop(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    if(!reap(pid, STOP_WAIT_MS)){
+        ch_log_warn("Q2PC Bench: Process %i did not stop, killing it\n", pid);
+        kill(pid, SIGKILL);
+        reap(pid, STOP_WAIT_MS);
+    }
+}
+
+
+static bool is_vote(i64 type)
+{
+    return type == q2pc_vote_yes_msg || type == q2pc_vote_no_msg;
+}
+
+
+//Everything that finished before the warmup was over is left out
+static void analyse(const char* stats_path, i64 clients, result_t* result)
+{
+    struct stat st;
+    if(stat(stats_path, &st) || st.st_size < (i64)sizeof(q2pc_stats_hdr_t)){
+        result->status = "no-stats";
+        return;
+    }
+
+    stats_file_t file;
+    stats_file_open(&file, stats_path);
+    if(!file.count){
+        stats_file_close(&file);
+        result->status = "no-data";
+        return;
+    }
+
+    i64 first_us = INT64_MAX;
+    i64 last_us  = INT64_MIN;
+    for(i64 i = 0; i < file.count; i++){
+        const stat_t* stat = stats_file_record(&file, i);
+        first_us = MIN(first_us, stat->time_start);
+        last_us  = MAX(last_us, stat->time_end);
+    }
+
+    const i64 from_us = first_us + options.warmup_ms * 1000;
+    i64 acks = 0;
+    for(i64 i = 0; i < file.count; i++){
+        const stat_t* stat = stats_file_record(&file, i);
+        if(stat->time_end < from_us){
+            continue;
+        }
+
+        const i64 latency_us = stat->time_end - stat->time_start;
+        if(is_vote(stat->type)){
+            result->votes++;
+            hdr_hist_record(&result->phase1, latency_us);
+        }
+        else{
+            acks++;
+            hdr_hist_record(&result->phase2, latency_us);
+        }
+        result->rtos += stat->c_rtos + stat->s_rtos;
+    }
+    stats_file_close(&file);
+
+    //Every client acks every round, so acks over clients is the round count
+    result->rounds  = acks / MAX(clients, 1);
+    result->seconds = last_us > from_us ? (last_us - from_us) / 1000.0 / 1000.0 : 0;
+    result->status  = result->rounds ? "ok" : "no-data";
+}
+
+
+static void run(const transport_t* trans, i64 clients, i64 threads, i64 msize, i64 port, result_t* result)
+{
+    char stats_path[1024];
+    char log_path[1024];
+    snprintf(stats_path, sizeof(stats_path), "%s/q2pc_bench_stats.bin", options.dir);
+    unlink(stats_path);
+
+    ch_log_info("Q2PC Bench: %s with %li clients, %li threads and %liB messages on port %li\n", trans->name, clients,
+            threads, msize, port);
+
+    args_t args = {{0}};
+    args_add(&args, "%s", options.binary);
+    args_add(&args, "-s");
+    args_add(&args, "%li", clients);
+    args_add(&args, "-T");
+    args_add(&args, "%li", threads);
+    args_add(&args, "-A");
+    args_add(&args, "-S");
+    args_add(&args, "%i", STATS_LEN);
+    args_add(&args, "-O");
+    args_add(&args, "%s", stats_path);
+    args_common(&args, trans, port, msize);
+    snprintf(log_path, sizeof(log_path), "%s/q2pc_bench_server.log", options.dir);
+    const pid_t server = spawn(&args, log_path);
+    args_free(&args);
+
+    usleep(SERVER_START_MS * 1000);
+
+    pid_t* client_pids = (pid_t*)calloc(clients, sizeof(pid_t));
+    if(!client_pids){
+        ch_log_fatal("Q2PC Bench: Could not allocate %li client pids\n", clients);
+    }
+
+    for(i64 i = 0; i < clients; i++){
+        args_add(&args, "%s", options.binary);
+        args_add(&args, "-c");
+        args_add(&args, "127.0.0.1");
+        args_add(&args, "-C");
+        args_add(&args, "%li", i + 1);
+        args_common(&args, trans, port, msize);
+        snprintf(log_path, sizeof(log_path), "%s/q2pc_bench_client%li.log", options.dir, i + 1);
+        client_pids[i] = spawn(&args, log_path);
+        args_free(&args);
+    }
+
+    //A server that stops on its own has given up on the cluster
+    const bool early = reap(server, options.warmup_ms + options.duration_ms);
+    if(early){
+        ch_log_warn("Q2PC Bench: The server stopped early, see %s/q2pc_bench_server.log\n", options.dir);
+    }
+    else{
+        stop(server);
+    }
+
+    for(i64 i = 0; i < clients; i++){
+        stop(client_pids[i]);
+    }
+    free(client_pids);
+
+    analyse(stats_path, clients, result);
+    if(early){
+        result->status = "server-exited";
+    }
+
+    if(!options.keep){
+        unlink(stats_path);
+    }
+}
+
+
+static void print_header(FILE* out)
+{
+    fprintf(out, "transport,clients,threads,msg_size,status,seconds,rounds,rounds_per_s,votes_per_s,"
+            "phase1_p50_us,phase1_p99_us,phase1_p999_us,phase1_max_us,"
+            "phase2_p50_us,phase2_p99_us,phase2_p999_us,phase2_max_us,rtos\n");
+}
+
+
+static void print_hist(FILE* out, const hdr_hist* hist)
+{
+    if(!hdr_hist_count(hist)){
+        fprintf(out, ",,,,");
+        return;
+    }
+
+    fprintf(out, ",%li,%li,%li,%li",
+            hdr_hist_percentile(hist, 50),
+            hdr_hist_percentile(hist, 99),
+            hdr_hist_percentile(hist, 99.9),
+            hdr_hist_percentile(hist, 100));
+}
+
+
+static void print_result(FILE* out, const transport_t* trans, i64 clients, i64 threads, i64 msize, const result_t* result)
+{
+    fprintf(out, "%s,%li,%li,%li,%s,%0.3lf,%li,%0.1lf,%0.1lf", trans->name, clients, threads, msize, result->status,
+            result->seconds, result->rounds,
+            result->seconds > 0 ? result->rounds / result->seconds : 0.0,
+            result->seconds > 0 ? result->votes / result->seconds : 0.0);
+    print_hist(out, &result->phase1);
+    print_hist(out, &result->phase2);
+    fprintf(out, ",%li\n", result->rtos);
+    fflush(out);
+}
+
+
+int main(int argc, char** argv)
+{
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'b', "binary", "The q2pc binary to benchmark", &options.binary, "./q2pc");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 't', "transports", "Comma separated transports to run", &options.transports, "udp-ln,tcp-ln,rdp-ln,udp-qj");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'c', "clients", "Comma separated client counts to run", &options.clients, "1,2,4");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'T', "threads", "Comma separated server thread counts to run", &options.threads, "1");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'm', "message-sizes", "Comma separated message sizes to run", &options.msizes, "128");
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'd', "duration", "How long to measure each run for (ms)", &options.duration_ms, 3000);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'w', "warmup", "How long to run before measuring (ms)", &options.warmup_ms, 500);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'p', "port", "First port to use, each run moves on past the ports the last one used", &options.port, 17331);
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'i', "iface", "The interface name to pass to q2pc", &options.iface, "lo");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'B', "broadcast", "The broadcast address to pass to q2pc", &options.bcast, "127.255.255.255");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'D', "dir", "Where to put the logs and stats files of each run", &options.dir, "/tmp");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'x', "extra", "Space separated arguments to pass to the server and the clients", &options.extra, "");
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'o', "output", "Write the CSV to this file instead of standard out", &options.output, NULL);
+    ch_opt_addbi(CH_OPTION_FLAG,     'k', "keep", "Keep the stats file of the last run", &options.keep, false);
+    ch_opt_parse(argc,argv);
+
+    if(options.duration_ms < 1 || options.warmup_ms < 0){
+        ch_log_fatal("Q2PC Bench: The duration must be at least 1ms and the warmup can't be negative\n");
+    }
+
+    if(access(options.binary, X_OK)){
+        ch_log_fatal("Q2PC Bench: Can't run %s: %s\n", options.binary, strerror(errno));
+    }
+
+    char* trans_names[MAX_LIST];
+    i64 client_counts[MAX_LIST];
+    i64 thread_counts[MAX_LIST];
+    i64 msizes[MAX_LIST];
+    const i64 trans_count  = parse_list("transports", options.transports, trans_names);
+    const i64 client_runs  = parse_ints("clients", options.clients, 1, client_counts);
+    const i64 thread_runs  = parse_ints("threads", options.threads, 1, thread_counts);
+    const i64 msize_runs   = parse_ints("message sizes", options.msizes, 1, msizes);
+
+    const transport_t* trans[MAX_LIST];
+    for(i64 i = 0; i < trans_count; i++){
+        trans[i] = find_transport(trans_names[i]);
+        free(trans_names[i]);
+    }
+
+    FILE* out = stdout;
+    if(options.output){
+        out = fopen(options.output, "w");
+        if(!out){
+            ch_log_fatal("Q2PC Bench: Could not open %s: %s\n", options.output, strerror(errno));
+        }
+    }
+
+    q2pc_clock_init();
+
+    result_t* result = (result_t*)calloc(1, sizeof(result_t));
+    if(!result){
+        ch_log_fatal("Q2PC Bench: Could not allocate results\n");
+    }
+
+    print_header(out);
+
+    //Ports are never reused, so nothing is caught out by sockets the last run left in TIME_WAIT
+    i64 port = options.port;
+    for(i64 t = 0; t < trans_count; t++){
+        for(i64 c = 0; c < client_runs; c++){
+            for(i64 th = 0; th < thread_runs; th++){
+                for(i64 m = 0; m < msize_runs; m++){
+                    bzero(result, sizeof(result_t));
+                    run(trans[t], client_counts[c], thread_counts[th], msizes[m], port, result);
+                    print_result(out, trans[t], client_counts[c], thread_counts[th], msizes[m], result);
+                    port += client_counts[c] + 1;
+                }
+            }
+        }
+    }
+
+    free(result);
+    if(out != stdout){
+        fclose(out);
+    }
+
+    return 0;
+}
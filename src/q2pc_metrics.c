@@ -0,0 +1,107 @@
+//Reads the live metrics page that a q2pc server publishes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../deps/chaste/chaste.h"
+#include "../deps/chaste/options/options.h"
+
+#include "stats/q2pc_metrics.h"
+#include "clock/q2pc_clock.h"
+
+USE_CH_LOGGER(CH_LOG_LVL_INFO,true,ch_log_tostderr,NULL);
+USE_CH_OPTIONS;
+
+static struct {
+    char* name;
+    bool prometheus;
+    i64 watch_ms;
+} options;
+
+
+static void print_human(q2pc_metrics_t* snap)
+{
+    static const char* kinds[Q2PC_METRICS_KINDS] = { "phase1", "phase2", "e2e" };
+    static const char* steps[Q2PC_METRICS_STEPS] = { "send", "wait", "tally" };
+
+    printf("q2pc server %li: %li threads, %li clients, published %0.3lfs ago\n", snap->pid, snap->threads, snap->clients,
+            snap->ts_us ? (q2pc_clock_us() - snap->ts_us) / 1000.0 / 1000.0 : 0.0);
+    printf("%li requests, %li commits, %li rtos, running at %0.2lf req/s\n", snap->requests, snap->commits,
+            snap->total_rtos, snap->req_per_sec);
+
+    printf("%-12s %10s %10s %10s %10s\n", "Latency (us)", "p50", "p99", "p99.9", "max");
+    for(int kind = 0; kind < Q2PC_METRICS_KINDS; kind++){
+        const i64* pcts = snap->latency_us[kind];
+        printf("%-12s %10li %10li %10li %10li\n", kinds[kind], pcts[0], pcts[1], pcts[2], pcts[3]);
+    }
+
+    printf("%-12s", "Steps (ns)");
+    for(int step = 0; step < Q2PC_METRICS_STEPS; step++){
+        printf(" %21s", steps[step]);
+    }
+    printf("\n");
+    for(int phase = 0; phase < Q2PC_METRICS_PHASES; phase++){
+        printf("phase%-7i", phase + 1);
+        for(int step = 0; step < Q2PC_METRICS_STEPS; step++){
+            printf(" %10li/%10li", snap->step_ns[phase][step][0], snap->step_ns[phase][step][1]);
+        }
+        printf("\n");
+    }
+
+    q2pc_metrics_thread_t* threads = q2pc_metrics_threads(snap);
+    printf("%-12s %12s %12s %8s\n", "Thread", "votes", "polls", "idle");
+    for(i64 i = 0; i < snap->threads; i++){
+        printf("%-12li %12li %12li %7.2lf%%\n", i, threads[i].votes, threads[i].polls,
+                threads[i].polls ? 100.0 * threads[i].idle_polls / threads[i].polls : 0.0);
+    }
+
+    //Only the connections that have had trouble
+    i64* conn_rtos = q2pc_metrics_conn_rtos(snap);
+    for(i64 i = 0; i < snap->clients; i++){
+        if(conn_rtos[i]){
+            printf("Connection %li: %li rtos\n", i, conn_rtos[i]);
+        }
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'n', "name", "Name of the shared memory page the server publishes to", &options.name, Q2PC_METRICS_NAME);
+    ch_opt_addbi(CH_OPTION_FLAG,     'P', "prometheus", "Print in the Prometheus text format", &options.prometheus, false);
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'w', "watch", "Print again every so many ms, 0 means once", &options.watch_ms, 0);
+    ch_opt_parse(argc,argv);
+
+    q2pc_clock_init();
+
+    q2pc_metrics_t* metrics = q2pc_metrics_open(options.name);
+    if(!metrics){
+        return 1;
+    }
+
+    q2pc_metrics_t* snap = (q2pc_metrics_t*)malloc(metrics->page_len);
+    if(!snap){
+        ch_log_fatal("Could not allocate %uB for a copy of the metrics page\n", metrics->page_len);
+    }
+
+    while(1){
+        q2pc_metrics_read(metrics, snap);
+        if(options.prometheus){
+            q2pc_metrics_prom(snap, stdout);
+        }
+        else{
+            print_human(snap);
+        }
+        fflush(stdout);
+
+        if(options.watch_ms <= 0){
+            break;
+        }
+        printf("\n");
+        usleep(options.watch_ms * 1000);
+    }
+
+    free(snap);
+    q2pc_metrics_delete(metrics, options.name);
+    return 0;
+}
@@ -0,0 +1,283 @@
+//Offline analysis of the binary statistics files that the server writes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../deps/chaste/chaste.h"
+#include "../deps/chaste/options/options.h"
+
+#include "protocol/q2pc_protocol.h"
+#include "stats/q2pc_stats_file.h"
+#include "stats/hdr_hist.h"
+
+USE_CH_LOGGER(CH_LOG_LVL_INFO,true,ch_log_tostderr,NULL);
+USE_CH_OPTIONS;
+
+#define RETRANSMIT_BUCKETS 5 //0, 1, 2, 3 and 4 or more retransmits
+
+static struct {
+    char* filename;
+    i64 interval_ms;
+    bool dump;
+    bool no_clients;
+} options;
+
+typedef struct {
+    i64 votes;
+    i64 acks;
+    i64 latency_sum;
+    i64 latency_max;
+} interval_t;
+
+
+static void print_hist_header(const char* title)
+{
+    printf("%-16s %10s %9s %9s %9s %9s %9s\n", title, "count", "p50", "p90", "p99", "p99.9", "max");
+}
+
+
+static void print_hist(const char* name, const hdr_hist* hist)
+{
+    const i64 count = hdr_hist_count(hist);
+    if(!count){
+        printf("%-16s %10i %9s %9s %9s %9s %9s\n", name, 0, "-", "-", "-", "-", "-");
+        return;
+    }
+
+    printf("%-16s %10li %9li %9li %9li %9li %9li\n", name, count,
+            hdr_hist_percentile(hist, 50),
+            hdr_hist_percentile(hist, 90),
+            hdr_hist_percentile(hist, 99),
+            hdr_hist_percentile(hist, 99.9),
+            hdr_hist_percentile(hist, 100));
+}
+
+
+static hdr_hist* hists_new(i64 count)
+{
+    hdr_hist* result = (hdr_hist*)calloc(MAX(count, 1), sizeof(hdr_hist));
+    if(!result){
+        ch_log_fatal("Could not allocate %li histograms\n", count);
+    }
+
+    return result;
+}
+
+
+static bool is_vote(i64 type)
+{
+    return type == q2pc_vote_yes_msg || type == q2pc_vote_no_msg;
+}
+
+
+//The text format that the server used to write, for old scripts
+static void dump(const stats_file_t* file, i64 max_thread)
+{
+    i64* start_us = (i64*)calloc(max_thread + 1, sizeof(i64));
+    bool* started = (bool*)calloc(max_thread + 1, sizeof(bool));
+    if(!start_us || !started){
+        ch_log_fatal("Could not allocate memory for the dump\n");
+    }
+
+    for(i64 i = 0; i < file->count; i++){
+        const stat_t* stat = stats_file_record(file, i);
+        const i64 thread   = MAX(stat->thread_id, 0);
+        if(!started[thread]){
+            started[thread]  = true;
+            start_us[thread] = stat->time_start;
+        }
+
+        const i64 time_tx = stat->time_tx >= 0 ? stat->time_tx : stat->time_start;
+        printf("%li %li %li %li %li %li %li %li %li %li %li %li\n",
+                stat->time_start - start_us[thread],
+                stat->thread_id,
+                stat->client_id,
+                stat->c_rtos,
+                stat->s_rtos,
+                stat->time_start,
+                stat->time_end,
+                stat->time_end - stat->time_start,
+                stat->type,
+                stat->rto_us,
+                stat->time_rx >= 0 ? stat->time_rx - time_tx : -1,
+                stat->time_rx >= 0 ? stat->time_end - stat->time_rx : -1);
+    }
+
+    free(start_us);
+    free(started);
+}
+
+
+int main(int argc, char** argv)
+{
+    ch_opt_addsi(CH_OPTION_OPTIONAL, 'f', "file", "The statistics file to read", &options.filename, "/tmp/q2pc_stats.bin");
+    ch_opt_addii(CH_OPTION_OPTIONAL, 'i', "interval", "Width of the throughput over time buckets (ms)", &options.interval_ms, 1000);
+    ch_opt_addbi(CH_OPTION_FLAG,     'd', "dump", "Print every record in the old text format instead", &options.dump, false);
+    ch_opt_addbi(CH_OPTION_FLAG,     'n', "no-clients", "Leave out the per-client breakdown", &options.no_clients, false);
+    ch_opt_parse(argc,argv);
+
+    if(options.interval_ms < 1){
+        ch_log_fatal("Q2PC Stats: The interval must be at least 1ms\n");
+    }
+
+    stats_file_t file;
+    stats_file_open(&file, options.filename);
+
+    //First pass to find out how big everything is
+    i64 first_us   = INT64_MAX;
+    i64 last_us    = INT64_MIN;
+    i64 max_thread = MAX(file.hdr.threads - 1, 0);
+    i64 max_client = MAX(file.hdr.clients, 0);
+    for(i64 i = 0; i < file.count; i++){
+        const stat_t* stat = stats_file_record(&file, i);
+        first_us   = MIN(first_us, stat->time_start);
+        last_us    = MAX(last_us, stat->time_end);
+        max_thread = MAX(max_thread, stat->thread_id);
+        max_client = MAX(max_client, stat->client_id);
+    }
+
+    if(options.dump){
+        dump(&file, max_thread);
+        stats_file_close(&file);
+        return 0;
+    }
+
+    const i64 duration_us = file.count ? last_us - first_us : 0;
+    printf("%s: format version %u, %li records, %li threads, %li clients, %0.3lfs\n", options.filename,
+            file.hdr.version, file.count, file.hdr.threads, file.hdr.clients, duration_us / 1000.0 / 1000.0);
+    if(!file.count){
+        stats_file_close(&file);
+        return 0;
+    }
+
+    const i64 interval_us    = options.interval_ms * 1000;
+    const i64 interval_count = duration_us / interval_us + 1;
+    interval_t* intervals    = (interval_t*)calloc(interval_count, sizeof(interval_t));
+    if(!intervals){
+        ch_log_fatal("Could not allocate %li intervals\n", interval_count);
+    }
+
+    hdr_hist* phase1  = hists_new(1);
+    hdr_hist* phase2  = hists_new(1);
+    hdr_hist* wire    = hists_new(1);
+    hdr_hist* host    = hists_new(1);
+    hdr_hist* rto     = hists_new(1);
+    hdr_hist* threads = hists_new(max_thread + 1);
+    hdr_hist* clients = options.no_clients ? NULL : hists_new(max_client + 1);
+    i64* client_rtos  = (i64*)calloc(2 * (max_client + 1), sizeof(i64)); //[client][client side, server side]
+    i64 retransmits[2][RETRANSMIT_BUCKETS] = {{0}};
+    if(!client_rtos){
+        ch_log_fatal("Could not allocate retransmit counters\n");
+    }
+
+    for(i64 i = 0; i < file.count; i++){
+        const stat_t* stat   = stats_file_record(&file, i);
+        const i64 latency_us = stat->time_end - stat->time_start;
+        const bool vote      = is_vote(stat->type);
+
+        hdr_hist_record(vote ? phase1 : phase2, latency_us);
+        hdr_hist_record(&threads[MAX(stat->thread_id, 0)], latency_us);
+        if(clients){
+            hdr_hist_record(&clients[MAX(stat->client_id, 0)], latency_us);
+        }
+
+        if(stat->time_rx >= 0){
+            const i64 time_tx = stat->time_tx >= 0 ? stat->time_tx : stat->time_start;
+            hdr_hist_record(wire, stat->time_rx - time_tx);
+            hdr_hist_record(host, stat->time_end - stat->time_rx);
+        }
+
+        if(stat->rto_us >= 0){
+            hdr_hist_record(rto, stat->rto_us);
+        }
+
+        retransmits[0][MIN(MAX(stat->c_rtos, 0), RETRANSMIT_BUCKETS - 1)]++;
+        retransmits[1][MIN(MAX(stat->s_rtos, 0), RETRANSMIT_BUCKETS - 1)]++;
+        client_rtos[2 * MAX(stat->client_id, 0) + 0] += stat->c_rtos;
+        client_rtos[2 * MAX(stat->client_id, 0) + 1] += stat->s_rtos;
+
+        interval_t* interval   = &intervals[(stat->time_end - first_us) / interval_us];
+        interval->votes       += vote ? 1 : 0;
+        interval->acks        += vote ? 0 : 1;
+        interval->latency_sum += latency_us;
+        interval->latency_max  = MAX(interval->latency_max, latency_us);
+    }
+
+    printf("\n");
+    print_hist_header("Latency (us)");
+    print_hist("phase1", phase1);
+    print_hist("phase2", phase2);
+    if(hdr_hist_count(wire)){
+        print_hist("wire", wire);
+        print_hist("host", host);
+    }
+
+    //Every client acks every round, so acks over clients is the round rate
+    printf("\nThroughput over time\n");
+    printf("%10s %10s %10s %10s %10s %10s\n", "time_s", "votes/s", "acks/s", "rounds/s", "mean_us", "max_us");
+    const double per_sec = 1000.0 / options.interval_ms;
+    for(i64 i = 0; i < interval_count; i++){
+        const interval_t* interval = &intervals[i];
+        const i64 records = interval->votes + interval->acks;
+        printf("%10.3lf %10.0lf %10.0lf %10.1lf %10li %10li\n", (double)i * options.interval_ms / 1000,
+                interval->votes * per_sec,
+                interval->acks * per_sec,
+                interval->acks * per_sec / MAX(file.hdr.clients, 1),
+                records ? interval->latency_sum / records : 0,
+                interval->latency_max);
+    }
+
+    printf("\n");
+    print_hist_header("Thread (us)");
+    for(i64 i = 0; i <= max_thread; i++){
+        char name[32];
+        snprintf(name, sizeof(name), "%li", i);
+        print_hist(name, &threads[i]);
+    }
+
+    if(clients){
+        printf("\n");
+        printf("%-16s %10s %9s %9s %9s %9s %9s %10s %10s\n", "Client (us)", "count", "p50", "p90", "p99", "p99.9", "max", "c_rtos", "s_rtos");
+        for(i64 i = 0; i <= max_client; i++){
+            const i64 count = hdr_hist_count(&clients[i]);
+            if(!count){
+                continue;
+            }
+
+            printf("%-16li %10li %9li %9li %9li %9li %9li %10li %10li\n", i, count,
+                    hdr_hist_percentile(&clients[i], 50),
+                    hdr_hist_percentile(&clients[i], 90),
+                    hdr_hist_percentile(&clients[i], 99),
+                    hdr_hist_percentile(&clients[i], 99.9),
+                    hdr_hist_percentile(&clients[i], 100),
+                    client_rtos[2 * i + 0],
+                    client_rtos[2 * i + 1]);
+        }
+    }
+
+    printf("\nRetransmits per record\n");
+    printf("%-16s %10s %10s %10s %10s %10s\n", "", "0", "1", "2", "3", "4+");
+    const char* sides[2] = { "client", "server" };
+    for(int s = 0; s < 2; s++){
+        printf("%-16s %10li %10li %10li %10li %10li\n", sides[s],
+                retransmits[s][0], retransmits[s][1], retransmits[s][2], retransmits[s][3], retransmits[s][4]);
+    }
+
+    if(hdr_hist_count(rto)){
+        printf("\n");
+        print_hist_header("Learned RTO (us)");
+        print_hist("rto", rto);
+    }
+
+    free(intervals);
+    free(phase1);
+    free(phase2);
+    free(wire);
+    free(host);
+    free(rto);
+    free(threads);
+    free(clients);
+    free(client_rtos);
+    stats_file_close(&file);
+    return 0;
+}
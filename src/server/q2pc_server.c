@@ -10,7 +10,6 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
-#include <sys/time.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -20,6 +19,10 @@
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 #include "q2pc_server_worker.h"
+#include "q2pc_server_stats.h"
+#include "q2pc_server_metrics.h"
+#include "../clock/q2pc_clock.h"
+#include "../trace/q2pc_trace.h"
 
 
 
@@ -28,11 +31,19 @@ CH_ARRAY(TRANS_CONN)* cons       = NULL;
 CH_ARRAY(i64)* seqs              = NULL;
 volatile bool stop_signal        = false;
 volatile bool pause_signal       = false;
-volatile i64* votes_scoreboard   = NULL;
-volatile i64* votes_count        = NULL;
+volatile i64* votes_scoreboard   = NULL; //Indexed by [txn slot][client], tagged with the round each vote was for
+volatile i64* votes_count        = NULL; //Indexed by [thread][txn slot], tagged with the round being counted
+volatile i64* txn_rounds         = NULL; //Indexed by [txn slot], the round that is open on each slot
 volatile stat_t** stats_mem      = NULL;
+i64* stats_used                  = NULL; //Indexed by [thread], how many records of stats_mem the worker filled in
+thread_hists_t* thread_hists     = NULL; //Indexed by [thread]
+thread_counters_t* thread_counters = NULL; //Indexed by [thread]
 volatile bool ack_seen           = false;
 i64 msg_size                     = 0;
+i64 txn_window                   = 1;    //Number of transactions that can be in flight at once
+volatile u64* batch_votes        = NULL; //Indexed by [txn slot][batch word], the yes votes of every client ANDed together
+volatile u64* batch_client_votes = NULL; //Indexed by [txn slot][client][batch word], each written by the worker for that client
+i64 batch_words                  = 0;    //Words of batch bitmap per txn slot, 0 if not batching
 
 //File globals
 static pthread_t* threads        = NULL;
@@ -40,11 +51,44 @@ static i64 real_thread_count     = 0;
 static q2pc_trans* trans         = NULL;
 static i64 client_count          = 0;
 static i64* conn_rtofired_count  = NULL;
+static i64* conn_rtos            = NULL; //Indexed by [client], every RTO since start, for the metrics page
+static q2pc_trans_conn** ready_conns = NULL; //Connections that the transport says need looking at, if it can tell us
 
 
 static transport_e trans_type    = -1;
 static i64 stats_len             = 0;
+static bool stats_stream         = false; //Stats go out to a file as they are made, instead of into stats_mem
+static const char* stats_path    = NULL;
 static i64 total_rtos            = 0;
+static i64 batch_max             = 1;
+static i64 batch_wait_us         = 0;
+static i64 batch_rate            = 0;
+static i64* batch_lens           = NULL; //Logical transactions in each txn slot
+
+//Latency percentiles for the progress reports. Workers keep the phase 1 and 2 histograms, end to end is measured here.
+typedef enum { latency_phase1 = 0, latency_phase2, latency_e2e, latency_kinds } latency_e;
+static hdr_hist* e2e_hist         = NULL;
+static hdr_hist* latency_totals   = NULL; //Running totals at the last report, indexed by latency_e
+static hdr_hist* latency_interval = NULL;
+
+//Where the time goes inside a transaction. Each phase is split into steps at the boundaries in do_phase1/do_phase2,
+//and counts what it cost. Only the coordinator touches these, and every progress report starts them again.
+typedef enum { phase_1 = 0, phase_2, phases } phase_e;
+typedef enum { step_send = 0, step_wait, step_tally, steps } step_e; //Tally includes pausing the workers
+
+typedef struct {
+    hdr_hist step_ns[steps];
+    i64 bytes;  //Message bytes handed to the transport
+    i64 calls;  //Writes, flushes, readiness checks and ticks, roughly a syscall each on the socket transports
+    i64 spins;  //Passes over the connections or the scoreboard that found something still outstanding
+    i64 rtos;   //Retransmit timeouts that fired while sending
+} phase_stats_t;
+static phase_stats_t* phase_stats = NULL; //Indexed by phase_e
+
+//Live metrics. The progress reports fill in metrics_next, and it all goes out to the page at once.
+static q2pc_metrics_t* metrics      = NULL;
+static const char* metrics_name     = NULL;
+static q2pc_metrics_t metrics_next;
 #define MAX_RTOS (200L * 1000L)
 
 void cleanup()
@@ -62,54 +106,30 @@ void cleanup()
         trans->delete(trans);
     }
 
-    int fd = open("/tmp/q2pc_stats", O_WRONLY| O_CREAT | O_TRUNC,  S_IRWXU );
-    if(fd < 0){
-        ch_log_fatal("Could not open statistics output file error = %s\n", strerror(errno));
-    }
-
-    char tmp_line[1024] = {0};
-
-    /*
-     *     i64 thread_id;
-    i64 client_id;
-    i64 c_rtos;
-    i64 s_rtos;
-    i64 time_start;
-    i64 time_end;
-     */
-
     ch_log_info("Total RTOS=%li\n", total_rtos);
 
-    i64 start_us = 0;
+    metrics_http_stop();
+    q2pc_metrics_delete(metrics, metrics_name);
+    metrics = NULL;
 
-    ch_log_info("Writing stats to file...\n");
-    for(int i = 0; i < real_thread_count; i++){
-        for(int j = 0; j < stats_len / real_thread_count; j++){
-            if(j == 0){
-                start_us = stats_mem[i][j].time_start;
-            }
+    if(stats_stream){
+        stats_stream_stop();
+        return;
+    }
 
-            int len = snprintf(tmp_line,1024,"%li %li %li %li %li %li %li %li %li\n",
-                    stats_mem[i][j].time_start - start_us,
-                    stats_mem[i][j].thread_id,
-                    stats_mem[i][j].client_id,
-                    stats_mem[i][j].c_rtos,
-                    stats_mem[i][j].s_rtos,
-                    stats_mem[i][j].time_start,
-                    stats_mem[i][j].time_end,
-                    stats_mem[i][j].time_end -  stats_mem[i][j].time_start,
-                    stats_mem[i][j].type);
-            write(fd,tmp_line, len);
-        }
+    if(!stats_mem){
+        return;
+    }
 
+    ch_log_info("Writing stats to %s...\n", stats_path);
+    stats_file_write(stats_path, real_thread_count, client_count, (stat_t* const*)stats_mem, stats_used, real_thread_count);
+    for(int i = 0; i < real_thread_count; i++){
         free((void*)stats_mem[i]);
     }
 
     free(stats_mem);
-    ch_log_info("Writing stats to file...Done.\n");
-
-    close(fd);
-
+    free(stats_used);
+    ch_log_info("Writing stats to %s...Done.\n", stats_path);
 }
 
 
@@ -180,7 +200,7 @@ void do_connectall()
 
 
 
-void server_init(const i64 thread_count, const i64 c_count, const transport_s* transport, i64 stats_l)
+void server_init(const i64 thread_count, const i64 c_count, const transport_s* transport, i64 stats_l, bool stream, const char* stats_file, const char* metrics_shm, i64 metrics_port, i64 window, i64 batch, bool use_epoll, i64 spin_us)
 {
 
     //Signal handling for the main thread
@@ -192,13 +212,50 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
     client_count = c_count;
     trans_type   = transport->type;
     stats_len    = stats_l;
+    stats_stream = stream;
+    stats_path   = stats_file;
+    txn_window   = MAX(window, 1);
 
-    //Set up and init the voting scoreboard
-    posix_memalign((void*)&votes_scoreboard, sizeof(i64), sizeof(i64) * client_count);
+    //Set up and init the voting scoreboard, one row of clients for each transaction in the window
+    posix_memalign((void*)&votes_scoreboard, sizeof(i64), sizeof(i64) * client_count * txn_window);
     if(!votes_scoreboard){
         ch_log_fatal("Could not allocate memory for votes scoreboard\n");
     }
-    bzero((void*)votes_scoreboard,sizeof(i64) * client_count);
+    bzero((void*)votes_scoreboard,sizeof(i64) * client_count * txn_window);
+
+    posix_memalign((void*)&txn_rounds, sizeof(i64), sizeof(i64) * txn_window);
+    if(!txn_rounds){
+        ch_log_fatal("Could not allocate memory for txn rounds\n");
+    }
+    for(int i = 0; i < txn_window; i++){
+        txn_rounds[i] = -1;
+    }
+
+    //Set up the group commit bitmaps, one bit per logical transaction in each txn slot
+    batch_max   = MAX(batch, 1);
+    batch_words = batch_max > 1 ? Q2PC_BATCH_WORDS(batch_max) : 0;
+    if(batch_words){
+        if((i64)(sizeof(q2pc_msg) + Q2PC_BATCH_BYTES(batch_max)) > msg_size){
+            ch_log_fatal("A batch of %li transactions needs a message size of at least %li\n", batch_max, sizeof(q2pc_msg) + Q2PC_BATCH_BYTES(batch_max));
+        }
+
+        posix_memalign((void*)&batch_votes, sizeof(u64), sizeof(u64) * batch_words * txn_window);
+        if(!batch_votes){
+            ch_log_fatal("Could not allocate memory for batch votes\n");
+        }
+        bzero((void*)batch_votes,sizeof(u64) * batch_words * txn_window);
+
+        posix_memalign((void*)&batch_client_votes, sizeof(u64), sizeof(u64) * batch_words * client_count * txn_window);
+        if(!batch_client_votes){
+            ch_log_fatal("Could not allocate memory for client batch votes\n");
+        }
+        bzero((void*)batch_client_votes,sizeof(u64) * batch_words * client_count * txn_window);
+    }
+
+    batch_lens = (i64*)calloc(txn_window, sizeof(i64));
+    if(!batch_lens){
+        ch_log_fatal("Could not allocate memory for batch lengths\n");
+    }
 
     posix_memalign((void*)&conn_rtofired_count, sizeof(i64), sizeof(i64) * client_count);
     if(!conn_rtofired_count){
@@ -206,6 +263,11 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
     }
     bzero((void*)conn_rtofired_count,sizeof(i64) * client_count);
 
+    conn_rtos = (i64*)calloc(client_count, sizeof(i64));
+    if(!conn_rtos){
+        ch_log_fatal("Could not allocate memory for RTO counters\n");
+    }
+
 
     //Set up all the connections
     ch_log_info("Waiting for clients to connect...\n\r");
@@ -213,6 +275,13 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
     do_connectall();
     ch_log_info("Waiting for clients to connect... Done.\n");
 
+    if(trans->ready){
+        ready_conns = (q2pc_trans_conn**)calloc(client_count, sizeof(q2pc_trans_conn*));
+        if(!ready_conns){
+            ch_log_fatal("Could not allocate memory for ready connections\n");
+        }
+    }
+
 
     //Calculate the connection to thread mappings
     i64 cons_per_thread = MAX( (client_count + thread_count -1) / thread_count, 1);
@@ -220,11 +289,11 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
     i64 lo = 0;
     i64 hi = lo + cons_per_thread;
 
-    posix_memalign((void*)&votes_count, sizeof(i64), sizeof(i64) * real_thread_count);
+    posix_memalign((void*)&votes_count, sizeof(i64), sizeof(i64) * real_thread_count * txn_window);
     if(!votes_count){
         ch_log_fatal("Could not allocate memory for votes counter\n");
     }
-    bzero((void*)votes_count,sizeof(i64) * real_thread_count);
+    bzero((void*)votes_count,sizeof(i64) * real_thread_count * txn_window);
 
 
     ch_log_debug1("Allocating stats mem for %li threads with size %i\n", real_thread_count, sizeof(stat_t*));
@@ -233,6 +302,37 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
         ch_log_fatal("Could not allocate memory for stats arrays fired counter\n");
     }
     bzero((void*)stats_mem,sizeof(stat_t*) * real_thread_count);
+    stats_used = (i64*)calloc(real_thread_count, sizeof(i64));
+    if(!stats_used){
+        ch_log_fatal("Could not allocate memory for stats counts\n");
+    }
+
+    posix_memalign((void*)&thread_hists, 64, sizeof(thread_hists_t) * real_thread_count);
+    e2e_hist         = (hdr_hist*)calloc(1, sizeof(hdr_hist));
+    latency_totals   = (hdr_hist*)calloc(latency_kinds, sizeof(hdr_hist));
+    latency_interval = (hdr_hist*)calloc(1, sizeof(hdr_hist));
+    phase_stats      = (phase_stats_t*)calloc(phases, sizeof(phase_stats_t));
+    posix_memalign((void*)&thread_counters, 64, sizeof(thread_counters_t) * real_thread_count);
+    if(!thread_hists || !e2e_hist || !latency_totals || !latency_interval || !phase_stats || !thread_counters){
+        ch_log_fatal("Could not allocate memory for latency histograms\n");
+    }
+    bzero((void*)thread_hists,sizeof(thread_hists_t) * real_thread_count);
+    bzero((void*)thread_counters,sizeof(thread_counters_t) * real_thread_count);
+
+    //The HTTP endpoint works from a private page if there isn't a shared one
+    if(metrics_shm || metrics_port){
+        metrics_name = metrics_shm;
+        metrics      = q2pc_metrics_create(metrics_name, real_thread_count, client_count);
+        memcpy(&metrics_next, metrics, sizeof(q2pc_metrics_t));
+    }
+
+    if(metrics_port){
+        metrics_http_start(metrics, metrics_port);
+    }
+
+    if(stats_stream){
+        stats_stream_start(stats_path, real_thread_count, client_count, stats_len / real_thread_count);
+    }
 
 
     //Fire up the threads
@@ -250,6 +350,8 @@ void server_init(const i64 thread_count, const i64 c_count, const transport_s* t
         params->count       = client_count;
         params->thread_id   = i;
         params->stats_len   = stats_len / real_thread_count;
+        params->use_epoll   = use_epoll;
+        params->spin_us     = spin_us;
 
         pthread_create(threads + i, NULL, run_thread, (void*)params);
 
@@ -274,13 +376,37 @@ i64 delimit(char* buff, i64 len)
 
 
 
-static void send_request(q2pc_msg_type_t msg_type)
+//Record how long a step took, and start timing the next one
+static inline i64 phase_step(phase_e phase, step_e step, i64 ts_start_ns)
+{
+    const i64 ts_now_ns = q2pc_clock_ns();
+    hdr_hist_record(&phase_stats[phase].step_ns[step], ts_now_ns - ts_start_ns);
+    return ts_now_ns;
+}
+
+
+//Some transports queue the writes up and send them all at once
+static void flush_writes(phase_stats_t* stats)
+{
+    stats->calls += trans->flush ? 1 : 0;
+    if(trans->flush && trans->flush(trans)){
+        ch_log_error("Cannot complete write request, cluster failed\n");
+        term(0);
+    }
+}
+
+
+static void send_request(q2pc_msg_type_t msg_type, i64 txn_id, i64 batch_len, volatile u64* batch)
 {
     char* data;
     i64 len;
+    phase_stats_t* stats = &phase_stats[msg_type == q2pc_request_msg ? phase_1 : phase_2];
+    Q2PC_TRACE3(request_send, txn_id, msg_type, batch_len);
 
-    //UDP over q-jump uses broadcast on the write, so we only need to send once, and is reliable, so don't have to wait
-    if(trans_type == udp_qj){
+    //UDP over q-jump uses broadcast on the write, so we only need to send once, and is reliable, so don't have to wait.
+    //Multicast is the same, without the reliability. Either can have lost messages repaired with NACKs underneath us.
+    //The AF_PACKET transport is Q-Jump on the wire, it just builds the frames itself.
+    if(trans_type == udp_qj || trans_type == udp_mc || trans_type == udp_pk || trans_type == udp_xd){
         q2pc_trans_conn* conn = cons->first;
 
         if(conn->beg_write(conn,&data,&len)){
@@ -291,9 +417,7 @@ static void send_request(q2pc_msg_type_t msg_type)
             ch_log_fatal("Not enough space to send a Q2PC message. Needed %li, but found %li\n", msg_size, len);
         }
 
-        struct timeval ts_start   = {0};
-        gettimeofday(&ts_start, NULL);
-        const i64 ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
+        const i64 ts_start_us = q2pc_clock_us();
 
 
         q2pc_msg* msg = (q2pc_msg*)data;
@@ -302,8 +426,16 @@ static void send_request(q2pc_msg_type_t msg_type)
         msg->ts         = ts_start_us;
         msg->s_rto      = 0;
         msg->c_rto      = 0;
+        msg->txn_id     = txn_id;
+        msg->batch_len  = batch_len;
+        if(batch){
+            memcpy(q2pc_msg_batch(msg), (void*)batch, Q2PC_BATCH_BYTES(batch_len));
+        }
 
         conn->end_write(conn, msg_size);
+        stats->bytes += msg_size;
+        stats->calls++;
+        flush_writes(stats);
         return;
     }
 
@@ -321,9 +453,7 @@ static void send_request(q2pc_msg_type_t msg_type)
             ch_log_fatal("Not enough space to send a Q2PC message. Needed %li, but found %li\n", msg_size, len);
         }
 
-        struct timeval ts_start   = {0};
-        gettimeofday(&ts_start, NULL);
-        const i64 ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
+        const i64 ts_start_us = q2pc_clock_us();
 
         q2pc_msg* msg = (q2pc_msg*)data;
         msg->type       = msg_type;
@@ -331,6 +461,11 @@ static void send_request(q2pc_msg_type_t msg_type)
         msg->ts         = ts_start_us;
         msg->s_rto      = 0;
         msg->c_rto      = 0;
+        msg->txn_id     = txn_id;
+        msg->batch_len  = batch_len;
+        if(batch){
+            memcpy(q2pc_msg_batch(msg), (void*)batch, Q2PC_BATCH_BYTES(batch_len));
+        }
         ch_log_debug3("Set ts to %li\n", msg->ts) ;
 
     }
@@ -339,8 +474,20 @@ static void send_request(q2pc_msg_type_t msg_type)
     int commited = 0;
     bzero(conn_rtofired_count,sizeof(i64) * client_count);
 
+    bool first_pass = true;
+
     while(commited < client_count && !stop_signal){
-        for(int i = 0; i < client_count && !stop_signal; i++){
+        //Everything has to be written once, after that, transports that time their own acks can tell us which
+        //connections to look at, rather than us having to spin over all of them
+        const bool use_ready = ready_conns && !first_pass;
+        const i64 to_visit   = use_ready ? trans->ready(trans, ready_conns, client_count) : client_count;
+        stats->calls += use_ready ? 1 : 0;
+        stats->spins += first_pass ? 0 : 1;
+        first_pass = false;
+
+        for(int j = 0; j < to_visit && !stop_signal; j++){
+            q2pc_trans_conn* conn = use_ready ? ready_conns[j] : cons->first + j;
+            const i64 i = conn - cons->first;
 
             //This is naughty, I'm overloading this, with negative numbers meaning the value is sent
             if(conn_rtofired_count[i] < 0LL){
@@ -348,9 +495,8 @@ static void send_request(q2pc_msg_type_t msg_type)
                 continue;
             }
 
-            q2pc_trans_conn* conn = cons->first + i;
-
             int result = conn->end_write(conn, msg_size);
+            stats->calls++;
             switch (result) {
                 case Q2PC_RTOFIRED:
                     if(conn_rtofired_count[i] >= MAX_RTOS){ //HACK MAGIC NUMBER!
@@ -358,15 +504,20 @@ static void send_request(q2pc_msg_type_t msg_type)
                         term(0);
                     }
                     conn_rtofired_count[i]++;
+                    Q2PC_TRACE2(rto_fire, i, conn_rtofired_count[i]);
                     total_rtos++;
+                    conn_rtos[i]++;
+                    stats->rtos++;
                     continue;
                 case Q2PC_EAGAIN:
                     continue;
                 case Q2PC_ENONE:
                     conn_rtofired_count[i] = -1;
                     commited++;
+                    stats->bytes += msg_size;
                     continue;
                 case Q2PC_EFIN:
+                    Q2PC_TRACE2(conn_efin, i, -1);
                     ch_log_error("Cannot complete write request, cluster failed\n");
                     term(0);
                 default:
@@ -375,6 +526,8 @@ static void send_request(q2pc_msg_type_t msg_type)
             }
         }
     }
+
+    flush_writes(stats);
 }
 
 
@@ -382,72 +535,181 @@ static void send_request(q2pc_msg_type_t msg_type)
 
 typedef enum {  q2pc_request_success, q2pc_request_fail, q2pc_commit_success, q2pc_commit_fail, q2pc_cluster_fail } q2pc_commit_status_t;
 
-void wait_for_votes(i64 timeout_us)
+
+//What a client sent in the round that is open on a transaction's slot, q2pc_lost_msg if nothing has arrived yet
+static inline i64 txn_vote(i64 txn_id, i64 client)
 {
-    struct timeval ts_start = {0};
-    struct timeval ts_now   = {0};
-    i64 ts_start_us         = 0;
-    i64 ts_now_us           = 0;
+    const i64 slot = txn_id % txn_window;
+    const i64 cell = __atomic_load_n(&votes_scoreboard[slot * client_count + client], __ATOMIC_ACQUIRE);
+    return round_of(cell) == txn_rounds[slot] ? round_value(cell) : q2pc_lost_msg;
+}
+
+
+//Sum up the votes collected by all threads in the round that is open on a transaction's slot
+static i64 txn_votes(i64 txn_id)
+{
+    const i64 slot  = txn_id % txn_window;
+    const i64 round = txn_rounds[slot];
+    i64 total_votes = 0;
+    for(int i = 0; i < real_thread_count; i++){
+        const i64 votes = __atomic_load_n(&votes_count[i * txn_window + slot], __ATOMIC_ACQUIRE);
+        total_votes    += round_of(votes) == round ? round_value(votes) : 0;
+    }
+
+    return total_votes;
+}
+
+
+//Open the round for a phase of a transaction, before anything is sent. Workers stop counting whatever was left open
+//on the slot straight away, and the old cells and counters no longer match, so nothing needs to be cleared.
+static void txn_reset(i64 txn_id, phase_e phase)
+{
+    __atomic_store_n(&txn_rounds[txn_id % txn_window], Q2PC_ROUND(txn_id, phase), __ATOMIC_RELEASE);
+}
+
+
+//The group commit bitmap for a given transaction
+static inline volatile u64* txn_batch(i64 txn_id)
+{
+    return batch_votes + (txn_id % txn_window) * batch_words;
+}
+
+
+//Start a new group of logical transactions on a txn slot. All are assumed committed until a client votes no.
+static void batch_reset(i64 txn_id, i64 batch_len)
+{
+    batch_lens[txn_id % txn_window] = batch_len;
+    if(!batch_words){
+        return;
+    }
 
-    gettimeofday(&ts_start, NULL);
-    ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
+    volatile u64* batch = txn_batch(txn_id);
+    for(int i = 0; i < batch_words; i++){
+        const i64 bits = MIN(batch_len - i * 64, 64);
+        batch[i] = bits <= 0 ? 0 : bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    }
+}
+
+
+//AND the yes votes of every client into the txn slot's bitmap, once the round's votes are in. Each client's row is
+//written by its worker before the vote is tagged in the scoreboard, so a row is only read for a vote that counts.
+static void batch_tally(i64 txn_id)
+{
+    const i64 slot       = txn_id % txn_window;
+    volatile u64* batch  = txn_batch(txn_id);
+    for(int i = 0; i < client_count; i++){
+        const i64 vote = txn_vote(txn_id, i);
+        if(vote != q2pc_vote_yes_msg && vote != q2pc_vote_no_msg){
+            continue;
+        }
+
+        volatile u64* votes = batch_client_votes + (slot * client_count + i) * batch_words;
+        for(int w = 0; w < batch_words; w++){
+            batch[w] &= votes[w];
+        }
+    }
+}
+
+
+//The number of logical transactions in a txn slot that every client voted yes on
+static i64 batch_commits(i64 txn_id)
+{
+    if(!batch_words){
+        return 1;
+    }
+
+    i64 commits = 0;
+    volatile u64* batch = txn_batch(txn_id);
+    for(int i = 0; i < batch_words; i++){
+        commits += __builtin_popcountll(batch[i]);
+    }
+
+    return commits;
+}
+
+
+//Group commit stage. Collects up to batch_max pending logical transactions, or whatever has arrived once the oldest
+//has waited for batch_wait_us. Pending transactions arrive at batch_rate per second, or are always available if the
+//rate is 0 (closed loop). Returns the size of the batch to start now, or 0 if the batch is not ready yet.
+static i64 batch_collect(i64 issued, i64 ts_begin_us)
+{
+    if(!batch_rate){
+        return batch_max;
+    }
+
+    const i64 ts_now_us = q2pc_clock_us();
+
+    //Whole seconds and the rest are worked out apart, so a long run or a high rate can't overflow the multiply
+    const i64 elapsed_us = ts_now_us - ts_begin_us;
+    const i64 arrived    = elapsed_us / (1000 * 1000) * batch_rate + elapsed_us % (1000 * 1000) * batch_rate / (1000 * 1000);
+    const i64 pending = arrived - issued;
+    if(pending <= 0){
+        return 0;
+    }
+
+    if(pending >= batch_max){
+        return batch_max;
+    }
+
+    const i64 oldest_us = ts_begin_us + (issued + 1) / batch_rate * 1000 * 1000 + (issued + 1) % batch_rate * 1000 * 1000 / batch_rate;
+    if(ts_now_us - oldest_us >= batch_wait_us){
+        return pending;
+    }
+
+    return 0;
+}
+
+
+void wait_for_votes(i64 txn_id, i64 timeout_us, phase_e phase)
+{
+    phase_stats_t* stats    = &phase_stats[phase];
+    const i64 ts_start_us   = q2pc_clock_us();
+    i64 ts_now_us           = 0;
 
 
     //Wait to either timeout or for all votes to be counted
     ch_log_debug2("Q2PC Server: [M] Waiting for votes\n");
     while(1){
         if(timeout_us >= 0){
-             gettimeofday(&ts_now, NULL);
-             ts_now_us = ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+             ts_now_us = q2pc_clock_us();
              if(ts_now_us > ts_start_us + timeout_us){
                  ch_log_warn("Timed out waiting for client response(s)\n");
                  break;
              }
         }
 
-        i64 total_votes = 0;
-        for(int i = 0; i < real_thread_count; i++){
-            total_votes+= votes_count[i];
-        }
+        i64 total_votes = txn_votes(txn_id);
         if(total_votes >= client_count){
             ch_log_debug2("Q2PC Server: [M] Done, collected %li votes\n", total_votes);
             break;
         }
+
+        stats->spins++;
+        stats->calls += trans->tick ? 1 : 0;
+        if(trans->tick && trans->tick(trans)){
+            ch_log_error("Transport failed while waiting for votes\n");
+            term(0);
+        }
     }
 
 }
 
 
-q2pc_commit_status_t do_phase1(i64 cluster_timeout_us)
+//Count up the phase 1 votes for a transaction
+static q2pc_commit_status_t tally_phase1(i64 txn_id)
 {
-
     q2pc_commit_status_t result = q2pc_request_success;
 
-    //Init the scoreboard
-    for(int i = 0; i < client_count; i++){
-        __builtin_prefetch((char*)votes_scoreboard + i + 1);
-        votes_scoreboard[i] = q2pc_lost_msg;
-    }
-
-    //send out a broadcast message to all servers
-    ch_log_debug2("Q2PC Server: [M]--> request\n");
-    send_request(q2pc_request_msg);
-
-    //wait for all the responses
-    wait_for_votes(cluster_timeout_us);
-
-    //Stop all the receiver threads
-    dopause_all();
     for(int i = 0; i < client_count && !stop_signal; i++){
-        __builtin_prefetch((char*)votes_scoreboard + i + 1);
-        switch(votes_scoreboard[i]){
+        const i64 vote = txn_vote(txn_id, i);
+        switch(vote){
             case q2pc_vote_yes_msg:
                 ch_log_debug1("client %li voted yes.\n",i);
                 continue;
 
             case q2pc_vote_no_msg:
                 ch_log_debug1("client %li voted no.\n",i);
-                result = q2pc_request_fail;
+                result = result == q2pc_cluster_fail ? result : q2pc_request_fail;
                 break;
 
             case q2pc_lost_msg:
@@ -456,56 +718,33 @@ q2pc_commit_status_t do_phase1(i64 cluster_timeout_us)
                 break;
 
             default:
-                ch_log_debug1("Q2PC: Server [M] phase 1 - client %li sent an unexpected message type %i\n",i,votes_scoreboard[i]);
+                ch_log_debug1("Q2PC: Server [M] phase 1 - client %li sent an unexpected message type %li\n",i,vote);
                 ch_log_error("Protocol violation\n");
                 term(0);
         }
     }
 
-    for(int i = 0; i < real_thread_count; i++){
-        votes_count[i] = 0;
+    //With group commit, a no vote only cancels the logical transactions it was cast against
+    if(batch_words && result != q2pc_cluster_fail){
+        batch_tally(txn_id);
     }
 
-    unpause_all();
+    if(batch_words && result == q2pc_request_fail && batch_commits(txn_id)){
+        result = q2pc_request_success;
+    }
 
     return result;
 }
 
 
-q2pc_commit_status_t do_phase2(q2pc_commit_status_t phase1_status, i64 cluster_timeout_us)
+//Count up the phase 2 acknowledgements for a transaction
+static q2pc_commit_status_t tally_phase2(i64 txn_id, q2pc_commit_status_t phase1_status)
 {
-    //Init the scoreboard
-    for(int i = 0; i < client_count; i++){
-        __builtin_prefetch((char*)votes_scoreboard + i + 1);
-        votes_scoreboard[i] = q2pc_lost_msg;
-    }
-
-    switch(phase1_status){
-        case q2pc_request_success:
-            ch_log_debug2("Q2PC Server: [M]--> commit\n");
-            send_request(q2pc_commit_msg);
-            break;
-        case q2pc_request_fail:
-            ch_log_debug2("Q2PC Server: [M]--> cancel\n");
-            send_request(q2pc_cancel_msg);
-            break;
-        case q2pc_cluster_fail:
-            return q2pc_cluster_fail;
-        default:
-            ch_log_error("Internal error: unexpected result from phase 1\n");
-            term(0);
-    }
-
-    //wait for all the responses
-    wait_for_votes(cluster_timeout_us);
-
-    //Stop all the receiver threads
-    dopause_all();
     q2pc_commit_status_t result = q2pc_commit_success;
-    for(int i = 0; i < client_count && !stop_signal; i++){
-        __builtin_prefetch((char*)votes_scoreboard + i + 1);
 
-        switch(votes_scoreboard[i]){
+    for(int i = 0; i < client_count && !stop_signal; i++){
+        const i64 vote = txn_vote(txn_id, i);
+        switch(vote){
             case q2pc_ack_msg:
                 continue;
 
@@ -514,17 +753,11 @@ q2pc_commit_status_t do_phase2(q2pc_commit_status_t phase1_status, i64 cluster_t
                 result = q2pc_cluster_fail;
                 break;
             default:
-                ch_log_debug1("Q2PC: Server [M] phase 2 - client %li sent an unexpected message type %i\n",i,votes_scoreboard[i]);
+                ch_log_debug1("Q2PC: Server [M] phase 2 - client %li sent an unexpected message type %li\n",i,vote);
                 result = q2pc_cluster_fail;
         }
     }
 
-    for(int i = 0; i < real_thread_count; i++){
-        votes_count[i] = 0;
-    }
-
-    unpause_all();
-
     if(result == q2pc_cluster_fail){
         return q2pc_cluster_fail;
     }
@@ -539,58 +772,400 @@ q2pc_commit_status_t do_phase2(q2pc_commit_status_t phase1_status, i64 cluster_t
 
     //Unreachable
     return -1;
+}
+
+
+//Send out the phase 2 decision for a transaction. Returns false if there is nothing to send.
+static bool send_decision(i64 txn_id, q2pc_commit_status_t phase1_status)
+{
+    switch(phase1_status){
+        case q2pc_request_success:
+            ch_log_debug2("Q2PC Server: [M]--> commit (%li)\n", txn_id);
+            send_request(q2pc_commit_msg, txn_id, batch_words ? batch_lens[txn_id % txn_window] : 0, batch_words ? txn_batch(txn_id) : NULL);
+            return true;
+        case q2pc_request_fail:
+            ch_log_debug2("Q2PC Server: [M]--> cancel (%li)\n", txn_id);
+            send_request(q2pc_cancel_msg, txn_id, batch_words ? batch_lens[txn_id % txn_window] : 0, NULL);
+            return true;
+        case q2pc_cluster_fail:
+            return false;
+        default:
+            ch_log_error("Internal error: unexpected result from phase 1\n");
+            term(0);
+    }
+
+    //Unreachable
+    return false;
+}
+
+
+q2pc_commit_status_t do_phase1(i64 txn_id, i64 batch_len, i64 cluster_timeout_us)
+{
+    //Open the voting round
+    txn_reset(txn_id, phase_1);
+    batch_reset(txn_id, batch_len);
+
+    //send out a broadcast message to all servers
+    ch_log_debug2("Q2PC Server: [M]--> request (%li)\n", txn_id);
+    i64 ts_ns = q2pc_clock_ns();
+    send_request(q2pc_request_msg, txn_id, batch_words ? batch_len : 0, NULL);
+    ts_ns = phase_step(phase_1, step_send, ts_ns);
+
+    //wait for all the responses
+    wait_for_votes(txn_id, cluster_timeout_us, phase_1);
+    ts_ns = phase_step(phase_1, step_wait, ts_ns);
+
+    //Stop all the receiver threads
+    dopause_all();
+    q2pc_commit_status_t result = tally_phase1(txn_id);
+    unpause_all();
+    phase_step(phase_1, step_tally, ts_ns);
+    Q2PC_TRACE3(phase_decision, txn_id, 1, result);
+
+    return result;
+}
+
+
+q2pc_commit_status_t do_phase2(i64 txn_id, q2pc_commit_status_t phase1_status, i64 cluster_timeout_us)
+{
+    //Open the ack round
+    txn_reset(txn_id, phase_2);
+
+    i64 ts_ns = q2pc_clock_ns();
+    if(!send_decision(txn_id, phase1_status)){
+        return q2pc_cluster_fail;
+    }
+    ts_ns = phase_step(phase_2, step_send, ts_ns);
+
+    //wait for all the responses
+    wait_for_votes(txn_id, cluster_timeout_us, phase_2);
+    ts_ns = phase_step(phase_2, step_wait, ts_ns);
+
+    //Stop all the receiver threads
+    dopause_all();
+    q2pc_commit_status_t result = tally_phase2(txn_id, phase1_status);
+    unpause_all();
+    phase_step(phase_2, step_tally, ts_ns);
+    Q2PC_TRACE3(phase_decision, txn_id, 2, result);
+
+    return result;
+
+}
+
+
+//Returns the number of logical transactions committed
+static i64 txn_complete(i64 txn_id, q2pc_commit_status_t status)
+{
+    const i64 commits = status == q2pc_commit_success ? batch_commits(txn_id) : 0;
+    Q2PC_TRACE3(txn_outcome, txn_id, status, commits);
+
+    switch(status){
+        case q2pc_cluster_fail:     ch_log_error("Cluster failed\n"); term(0);break;
+        case q2pc_commit_success:   ch_log_debug1("Commit success!\n"); return commits;
+        case q2pc_commit_fail:      ch_log_debug1("Commit fail!\n"); break;
+        default:
+            ch_log_error("Internal error: unexpected result from phase 2\n");
+            term(0);
+    }
+
+    return 0;
+}
+
+
+//Percentiles of everything recorded since the last report. The worker histograms are merged without stopping them.
+static void report_latency(char* line, i64 line_len)
+{
+    static const char* names[latency_kinds] = { "phase1", "phase2", "e2e" };
+
+    i64 used = 0;
+    for(int kind = 0; kind < latency_kinds; kind++){
+        memset(latency_interval, 0, sizeof(hdr_hist));
+        if(kind == latency_e2e){
+            hdr_hist_merge(latency_interval, e2e_hist);
+        }
+        else{
+            for(int i = 0; i < real_thread_count; i++){
+                hdr_hist_merge(latency_interval, kind == latency_phase1 ? &thread_hists[i].phase1 : &thread_hists[i].phase2);
+            }
+        }
+
+        hdr_hist_sub(latency_interval, &latency_totals[kind]);
+        hdr_hist_merge(&latency_totals[kind], latency_interval);
+
+        i64* pcts = metrics_next.latency_us[kind];
+        pcts[0]   = hdr_hist_percentile(latency_interval, 50);
+        pcts[1]   = hdr_hist_percentile(latency_interval, 99);
+        pcts[2]   = hdr_hist_percentile(latency_interval, 99.9);
+        pcts[3]   = hdr_hist_percentile(latency_interval, 100);
+        //snprintf says how much it wanted to write, not how much it did
+        used += snprintf(line + used, line_len - used, " %s p50/p99/p99.9/max=%li/%li/%li/%lius", names[kind],
+                pcts[0], pcts[1], pcts[2], pcts[3]);
+        used  = MIN(used, line_len - 1);
+    }
+}
+
+
+//One line for each phase, with the step percentiles and what the phase cost per transaction, then start again
+static void report_phases(i64 requests)
+{
+    static const char* names[phases]      = { "phase1", "phase2" };
+    static const char* step_names[steps]  = { "send", "wait", "tally" };
+
+    for(int phase = 0; phase < phases; phase++){
+        phase_stats_t* stats = &phase_stats[phase];
+
+        char line[256] = {0};
+        i64 used = 0;
+        for(int step = 0; step < steps; step++){
+            i64* pcts = metrics_next.step_ns[phase][step];
+            pcts[0]   = hdr_hist_percentile(&stats->step_ns[step], 50);
+            pcts[1]   = hdr_hist_percentile(&stats->step_ns[step], 99);
+            //snprintf says how much it wanted to write, not how much it did
+            used += snprintf(line + used, sizeof(line) - used, " %s p50/p99=%li/%lins", step_names[step], pcts[0], pcts[1]);
+            used  = MIN(used, (i64)sizeof(line) - 1);
+        }
+
+        ch_log_info("  %s%s, per txn %0.1lfB %0.2lf calls %0.2lf spins %0.2lf rtos\n", names[phase], line,
+                (double)stats->bytes / requests, (double)stats->calls / requests,
+                (double)stats->spins / requests, (double)stats->rtos / requests);
+    }
+
+    bzero(phase_stats, sizeof(phase_stats_t) * phases);
+}
+
+
+//Copy everything out to the metrics page in one go, so readers see it all from the same moment
+static void publish_metrics(i64 ts_now_us)
+{
+    if(!metrics){
+        return;
+    }
+
+    q2pc_metrics_begin(metrics);
+    metrics->ts_us       = ts_now_us;
+    metrics->requests    = metrics_next.requests;
+    metrics->commits     = metrics_next.commits;
+    metrics->req_per_sec = metrics_next.req_per_sec;
+    memcpy(metrics->latency_us, metrics_next.latency_us, sizeof(metrics->latency_us));
+    memcpy(metrics->step_ns, metrics_next.step_ns, sizeof(metrics->step_ns));
+
+    q2pc_metrics_thread_t* threads_out = q2pc_metrics_threads(metrics);
+    for(int i = 0; i < real_thread_count; i++){
+        threads_out[i].votes      = __atomic_load_n(&thread_counters[i].votes, __ATOMIC_RELAXED);
+        threads_out[i].polls      = __atomic_load_n(&thread_counters[i].polls, __ATOMIC_RELAXED);
+        threads_out[i].idle_polls = __atomic_load_n(&thread_counters[i].idle_polls, __ATOMIC_RELAXED);
+    }
+
+    //Transports that retransmit between writes count their own RTOs, end_write never hears about those
+    i64* conn_rtos_out = q2pc_metrics_conn_rtos(metrics);
+    metrics->total_rtos = 0;
+    for(int i = 0; i < client_count; i++){
+        q2pc_trans_conn* conn = cons->first + i;
+        conn_rtos_out[i]     = conn->get_rtos ? conn->get_rtos(conn) : conn_rtos[i];
+        metrics->total_rtos += conn_rtos_out[i];
+    }
+
+    q2pc_metrics_end(metrics);
+}
+
+
+//Print out the request rate and latency percentiles every report_int requests
+static void report_progress(i64 requests, i64 report_int, i64* commits, i64* ts_start_us)
+{
+    if(!requests || (requests % report_int != 0) ){
+        return;
+    }
+
+    const i64 ts_now_us = q2pc_clock_us();
+
+    const i64 time_taken_us = ts_now_us - *ts_start_us;
+    double reqs_per_sec = (double)report_int / (double)(time_taken_us) * 1000 * 1000;
+
+    char latency_line[256] = {0};
+    report_latency(latency_line, sizeof(latency_line));
+
+    if(batch_words){
+        double commits_per_sec = (double)(*commits) / (double)(time_taken_us) * 1000 * 1000;
+        ch_log_info("Running at %0.2lf req/s, %0.2lf commits/s (%li)%s\n", reqs_per_sec, commits_per_sec, time_taken_us, latency_line);
+    }
+    else{
+        ch_log_info("Running at %0.2lf req/s (%li)%s\n", reqs_per_sec, time_taken_us, latency_line);
+    }
+    report_phases(report_int);
+
+    metrics_next.requests   += report_int;
+    metrics_next.commits    += *commits;
+    metrics_next.req_per_sec = reqs_per_sec;
+    publish_metrics(ts_now_us);
+
+    *commits     = 0;
+    *ts_start_us = ts_now_us;
+}
+
+
+//State for each transaction in the pipeline window
+typedef enum { txn_idle = 0, txn_phase1, txn_phase2 } txn_state_t;
+
+typedef struct {
+    txn_state_t state;
+    i64 ts_start_us;
+    i64 ts_txn_us; //When phase 1 started, for the end to end latency
+    i64 ts_step_ns; //When the current phase finished sending, for the phase breakdown
+    q2pc_commit_status_t phase1_status;
+} txn_slot_t;
+
+
+//Pipelined coordinator. Keeps up to txn_window transactions in flight. Each transaction moves from phase 1 to
+//phase 2 as soon as all of its votes are in, without waiting for the transactions around it.
+static void run_pipelined(i64 wait_time, i64 report_int, i64 ts_start_us)
+{
+    txn_slot_t* slots = (txn_slot_t*)calloc(txn_window, sizeof(txn_slot_t));
+    if(!slots){
+        ch_log_fatal("Could not allocate memory for transaction window\n");
+    }
+
+    i64 ts_now_us         = 0;
+    i64 oldest_txn        = 0;
+    i64 next_txn          = 0;
+    i64 requests          = 0;
+    i64 commits           = 0;
+    i64 issued            = 0;
+    const i64 ts_begin_us = ts_start_us;
+
+    while(!stop_signal){
+
+        //Fill up the window with new requests
+        while(next_txn - oldest_txn < txn_window && !stop_signal){
+            const i64 batch_len = batch_collect(issued, ts_begin_us);
+            if(!batch_len){
+                break;
+            }
+            issued += batch_len;
+
+            txn_slot_t* slot = slots + next_txn % txn_window;
 
+            slot->ts_start_us = q2pc_clock_us();
+            slot->ts_txn_us   = slot->ts_start_us;
+            slot->state       = txn_phase1;
+
+            txn_reset(next_txn, phase_1);
+            batch_reset(next_txn, batch_len);
+            ch_log_debug2("Q2PC Server: [M]--> request (%li)\n", next_txn);
+            const i64 ts_ns = q2pc_clock_ns();
+            send_request(q2pc_request_msg, next_txn, batch_words ? batch_len : 0, NULL);
+            slot->ts_step_ns = phase_step(phase_1, step_send, ts_ns);
+            next_txn++;
+        }
+
+        ts_now_us = q2pc_clock_us();
+
+        //Move along any transactions that have all of their votes in
+        for(i64 txn = oldest_txn; txn < next_txn && !stop_signal; txn++){
+            txn_slot_t* slot = slots + txn % txn_window;
+            if(slot->state == txn_idle){
+                continue;
+            }
+
+            if(txn_votes(txn) < client_count){
+                if(wait_time < 0 || ts_now_us <= slot->ts_start_us + wait_time){
+                    continue;
+                }
+                ch_log_warn("Timed out waiting for client response(s) on transaction %li\n", txn);
+            }
+
+            //Workers aren't paused here, the scoreboard row only counts the round that is open on it
+            const phase_e phase = slot->state == txn_phase1 ? phase_1 : phase_2;
+            i64 ts_ns = phase_step(phase, step_wait, slot->ts_step_ns);
+
+            if(slot->state == txn_phase1){
+                slot->phase1_status = tally_phase1(txn);
+                slot->ts_start_us   = ts_now_us;
+                slot->state         = txn_phase2;
+                ts_ns = phase_step(phase_1, step_tally, ts_ns);
+                Q2PC_TRACE3(phase_decision, txn, 1, slot->phase1_status);
+
+                txn_reset(txn, phase_2);
+                if(!send_decision(txn, slot->phase1_status)){
+                    txn_complete(txn, q2pc_cluster_fail);
+                }
+                slot->ts_step_ns = phase_step(phase_2, step_send, ts_ns);
+                continue;
+            }
+
+            const q2pc_commit_status_t status = tally_phase2(txn, slot->phase1_status);
+            phase_step(phase_2, step_tally, ts_ns);
+            Q2PC_TRACE3(phase_decision, txn, 2, status);
+            commits += txn_complete(txn, status);
+            hdr_hist_record(e2e_hist, ts_now_us - slot->ts_txn_us);
+            slot->state = txn_idle;
+
+            requests++;
+            report_progress(requests, report_int, &commits, &ts_start_us);
+        }
+
+        if(trans->tick && trans->tick(trans)){
+            ch_log_error("Transport failed while waiting for votes\n");
+            term(0);
+        }
+
+        //Retire finished transactions from the front of the window
+        while(oldest_txn < next_txn && slots[oldest_txn % txn_window].state == txn_idle){
+            oldest_txn++;
+        }
+    }
+
+    free(slots);
 }
 
-void run_server(const i64 thread_count, const i64 client_count,  const transport_s* transport, i64 wait_time, i64 report_int, i64 stats_len, i64 msize)
+
+void run_server(const i64 thread_count, const i64 client_count,  const transport_s* transport, i64 wait_time, i64 report_int, i64 stats_len, bool stats_stream, const char* stats_file, const char* metrics_shm, i64 metrics_port, i64 msize, i64 window, i64 batch, i64 batch_wait, i64 rate, bool use_epoll, i64 spin_us)
 {
 
     //Statistics keeping
-    struct timeval ts_start = {0};
-    struct timeval ts_now   = {0};
     i64 ts_start_us         = 0;
-    i64 ts_now_us           = 0;
     msg_size                = MAX((i64)sizeof(q2pc_msg),msize);
     ch_log_info("Using message size of %li\n", msg_size);
 
     //Set up all the threads, scoreboard, transport connections etc.
-    server_init(thread_count, client_count, transport, stats_len);
+    server_init(thread_count, client_count, transport, stats_len, stats_stream, stats_file, metrics_shm, metrics_port, window, batch, use_epoll, spin_us);
+    batch_wait_us = batch_wait;
+    batch_rate    = rate;
 
-    gettimeofday(&ts_start, NULL);
-    ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
+    ts_start_us = q2pc_clock_us();
+
+    if(txn_window > 1){
+        ch_log_info("Running with up to %li transactions in flight...\n", txn_window);
+        run_pipelined(wait_time, report_int, ts_start_us);
+        term(0);
+    }
 
     ch_log_info("Running...\n");
+    i64 commits = 0;
+    i64 issued  = 0;
+    const i64 ts_begin_us = ts_start_us;
     for(i64 requests = 0; !stop_signal; requests++){
 
-        if(requests && (requests % report_int == 0) ){
-            gettimeofday(&ts_now, NULL);
-            ts_now_us = ts_now.tv_sec * 1000 * 1000 + ts_now.tv_usec;
+        report_progress(requests, report_int, &commits, &ts_start_us);
 
-            const i64 time_taken_us = ts_now_us - ts_start_us;
-            double reqs_per_sec = (double)report_int / (double)(time_taken_us) * 1000 * 1000;
-
-            ch_log_info("Running at %0.2lf req/s (%li)\n", reqs_per_sec, time_taken_us);
-
-            gettimeofday(&ts_start, NULL);
-            ts_start_us = ts_start.tv_sec * 1000 * 1000 + ts_start.tv_usec;
+        //Wait for a batch of work to be ready
+        i64 batch_len = 0;
+        while(!(batch_len = batch_collect(issued, ts_begin_us)) && !stop_signal){
+            __asm__("pause");
         }
+        if(stop_signal){
+            break;
+        }
+        issued += batch_len;
 
-
+        const i64 ts_txn_us = q2pc_clock_us();
         q2pc_commit_status_t status;
-        status = do_phase1(wait_time);
-        status = do_phase2(status, wait_time);
+        status = do_phase1(requests, batch_len, wait_time);
+        status = do_phase2(requests, status, wait_time);
 
-        switch(status){
-            case q2pc_cluster_fail:     ch_log_error("Cluster failed\n"); term(0);break;
-            case q2pc_commit_success:   ch_log_debug1("Commit success!\n"); break;
-            case q2pc_commit_fail:      ch_log_debug1("Commit fail!\n"); break;
-            default:
-                ch_log_error("Internal error: unexpected result from phase 2\n");
-                term(0);
-        }
+        commits += txn_complete(requests, status);
+        hdr_hist_record(e2e_hist, q2pc_clock_us() - ts_txn_us);
     }
 
     term(0);
 
 }
-
@@ -11,5 +11,7 @@
 #include "../../deps/chaste/chaste.h"
 #include "../transport/q2pc_transport.h"
 
-void run_server(const i64 thread_count, const i64 client_count,  const transport_s* transport, i64 wait_time, i64 report_int, i64 stats, i64 msize);
+#define Q2PC_MAX_RATE (1000LL * 1000 * 1000) //Transactions per second, keeps the arrival sums well inside an i64
+
+void run_server(const i64 thread_count, const i64 client_count,  const transport_s* transport, i64 wait_time, i64 report_int, i64 stats, bool stats_stream, const char* stats_file, const char* metrics_shm, i64 metrics_port, i64 msize, i64 window, i64 batch, i64 batch_wait, i64 rate, bool use_epoll, i64 spin_us);
 #endif /* Q2PC_SERVER_H_ */
@@ -0,0 +1,147 @@
+//#LINKFLAGS=-lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "q2pc_server_metrics.h"
+
+#define ACCEPT_WAIT_MS  100 //Check for stop this often
+#define REQUEST_WAIT_MS 1000 //Give up on scrapers that don't send a request
+
+static const q2pc_metrics_t* page = NULL;
+static int listen_fd              = -1;
+static pthread_t server;
+static volatile bool server_stop  = false;
+
+
+//A scraper that hangs up part way through must not take the server down with a SIGPIPE, so this uses send() with
+//MSG_NOSIGNAL rather than write(). Returns false once the scraper has gone.
+static bool write_all(int fd, const char* data, i64 len)
+{
+    while(len > 0){
+        const i64 result = send(fd, data, len, MSG_NOSIGNAL);
+        if(result < 0 && errno == EINTR){
+            continue;
+        }
+
+        if(result <= 0){
+            ch_log_debug1("Metrics scraper went away: %s\n", strerror(errno));
+            return false;
+        }
+
+        data += result;
+        len  -= result;
+    }
+
+    return true;
+}
+
+
+//Every request gets the metrics, whatever it asked for. Scrapers only ever ask for one thing.
+static void serve(int fd, q2pc_metrics_t* snap)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char request[1024];
+    if(poll(&pfd, 1, REQUEST_WAIT_MS) <= 0 || read(fd, request, sizeof(request)) <= 0){
+        return;
+    }
+
+    char* body     = NULL;
+    size_t body_len = 0;
+    FILE* out      = open_memstream(&body, &body_len);
+    if(!out){
+        ch_log_warn("Could not format metrics: %s\n", strerror(errno));
+        return;
+    }
+
+    q2pc_metrics_read(page, snap);
+    q2pc_metrics_prom(snap, out);
+    fclose(out);
+
+    char head[256];
+    const int head_len = snprintf(head, sizeof(head),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            body_len);
+    if(write_all(fd, head, head_len)){
+        write_all(fd, body, body_len);
+    }
+    free(body);
+}
+
+
+static void* run_http(void* p)
+{
+    (void)p;
+
+    q2pc_metrics_t* snap = (q2pc_metrics_t*)malloc(page->page_len);
+    if(!snap){
+        ch_log_fatal("Could not allocate %uB for a copy of the metrics page\n", page->page_len);
+    }
+
+    while(!server_stop){
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if(poll(&pfd, 1, ACCEPT_WAIT_MS) <= 0){
+            continue;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0){
+            continue;
+        }
+
+        serve(fd, snap);
+        close(fd);
+    }
+
+    free(snap);
+    return NULL;
+}
+
+
+void metrics_http_start(const q2pc_metrics_t* metrics, i64 port)
+{
+    page      = metrics;
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        ch_log_fatal("Could not create metrics socket: %s\n", strerror(errno));
+    }
+
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons(port);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 8)){
+        ch_log_fatal("Could not listen for metrics scrapers on 127.0.0.1:%li: %s\n", port, strerror(errno));
+    }
+
+    if(pthread_create(&server, NULL, run_http, NULL)){
+        ch_log_fatal("Could not start metrics server thread\n");
+    }
+
+    ch_log_info("Serving metrics on http://127.0.0.1:%li/metrics\n", port);
+}
+
+
+void metrics_http_stop()
+{
+    if(listen_fd < 0){
+        return;
+    }
+
+    server_stop = true;
+    __sync_synchronize();
+    pthread_join(server, NULL);
+
+    close(listen_fd);
+    listen_fd = -1;
+}
@@ -0,0 +1,13 @@
+#ifndef Q2PC_SERVER_METRICS_H_
+#define Q2PC_SERVER_METRICS_H_
+
+#include "../../deps/chaste/chaste.h"
+#include "../stats/q2pc_metrics.h"
+
+//Serve the metrics page in the Prometheus text format over HTTP on 127.0.0.1:port, from a background thread that
+//reads the page the same way any other reader does. It never touches the hot path.
+void metrics_http_start(const q2pc_metrics_t* metrics, i64 port);
+
+void metrics_http_stop();
+
+#endif /* Q2PC_SERVER_METRICS_H_ */
@@ -0,0 +1,143 @@
+//#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "q2pc_server_stats.h"
+
+#define WRITER_IDLE_US 1000 //How long the writer sleeps when there is nothing to write
+
+stats_ring_t* stats_rings       = NULL;
+
+static i64 ring_count           = 0;
+static int stream_fd            = -1;
+static const char* stream_path  = NULL;
+static pthread_t writer;
+static volatile bool writer_stop = false;
+static i64 written              = 0;
+
+
+static void write_all(const char* data, i64 len)
+{
+    while(len > 0){
+        const i64 result = write(stream_fd, data, len);
+        if(result < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            ch_log_fatal("Could not write statistics to %s: %s\n", stream_path, strerror(errno));
+        }
+
+        data += result;
+        len  -= result;
+    }
+}
+
+
+//Write out everything in a ring, at most two writes because of the wrap around. Returns the number of records.
+static i64 drain(stats_ring_t* ring)
+{
+    const i64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    i64 tail       = ring->tail;
+    const i64 count = head - tail;
+
+    while(tail < head){
+        const i64 off   = tail % ring->len;
+        const i64 chunk = MIN(head - tail, ring->len - off);
+        write_all((const char*)&ring->records[off], chunk * sizeof(stat_t));
+        tail += chunk;
+    }
+
+    //Only now can the worker have the space back
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    written += count;
+    return count;
+}
+
+
+static void* run_writer(void* p)
+{
+    (void)p;
+
+    while(!writer_stop){
+        i64 count = 0;
+        for(i64 i = 0; i < ring_count; i++){
+            count += drain(&stats_rings[i]);
+        }
+
+        if(!count){
+            usleep(WRITER_IDLE_US);
+        }
+    }
+
+    //The workers have stopped, so this gets the last of it
+    for(i64 i = 0; i < ring_count; i++){
+        drain(&stats_rings[i]);
+    }
+
+    return NULL;
+}
+
+
+void stats_stream_start(const char* path, i64 threads, i64 clients, i64 ring_len)
+{
+    stream_path = path;
+    stream_fd   = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(stream_fd < 0){
+        ch_log_fatal("Could not open statistics stream %s: %s\n", path, strerror(errno));
+    }
+
+    //The record count is filled in when the stream stops
+    q2pc_stats_hdr_t hdr;
+    stats_file_hdr_init(&hdr, threads, clients);
+    write_all((const char*)&hdr, sizeof(hdr));
+
+    ring_count = threads;
+    posix_memalign((void*)&stats_rings, 64, sizeof(stats_ring_t) * ring_count);
+    if(!stats_rings){
+        ch_log_fatal("Could not allocate statistics rings\n");
+    }
+    bzero(stats_rings, sizeof(stats_ring_t) * ring_count);
+
+    for(i64 i = 0; i < ring_count; i++){
+        stats_rings[i].len     = MAX(ring_len, 1);
+        stats_rings[i].records = (stat_t*)calloc(stats_rings[i].len, sizeof(stat_t));
+        if(!stats_rings[i].records){
+            ch_log_fatal("Could not allocate %liB of memory for statistics ring\n", sizeof(stat_t) * stats_rings[i].len);
+        }
+    }
+
+    if(pthread_create(&writer, NULL, run_writer, NULL)){
+        ch_log_fatal("Could not start statistics writer thread\n");
+    }
+
+    ch_log_info("Streaming statistics to %s\n", path);
+}
+
+
+void stats_stream_stop()
+{
+    if(!stats_rings){
+        return;
+    }
+
+    writer_stop = true;
+    __sync_synchronize();
+    pthread_join(writer, NULL);
+
+    i64 dropped = 0;
+    for(i64 i = 0; i < ring_count; i++){
+        dropped += stats_rings[i].dropped;
+        free(stats_rings[i].records);
+    }
+
+    ch_log_info("Streamed %li statistics records to %s, dropped %li\n", written, stream_path, dropped);
+
+    stats_file_finish(stream_fd, written);
+    close(stream_fd);
+    free(stats_rings);
+    stats_rings = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef Q2PC_SERVER_STATS_H_
+#define Q2PC_SERVER_STATS_H_
+
+#include "../../deps/chaste/chaste.h"
+#include "q2pc_server_worker.h"
+
+//Streaming statistics. Each worker puts its records into its own single producer single consumer ring, and a
+//background thread writes them out to a file as they arrive, so runs can go on forever in a fixed amount of memory.
+//Workers never wait on the writer. If a ring is full the record is dropped and counted instead. The file is in the same
+//format as the one written at the end of a normal run.
+
+typedef struct {
+    volatile i64 head; //Next record for the worker to fill, only written by the worker
+    char pad0[56];
+    volatile i64 tail; //Next record for the writer to take, only written by the writer
+    char pad1[56];
+    stat_t* records;
+    i64 len;
+    i64 dropped;       //Only touched by the worker
+} stats_ring_t;
+
+extern stats_ring_t* stats_rings; //Indexed by [thread], NULL unless streaming
+
+
+//The next record for a worker to fill in, or NULL if the ring is full
+static inline stat_t* stats_ring_claim(stats_ring_t* ring)
+{
+    if(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->len){
+        ring->dropped++;
+        return NULL;
+    }
+
+    return &ring->records[ring->head % ring->len];
+}
+
+
+//Hand the claimed record over to the writer
+static inline void stats_ring_publish(stats_ring_t* ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+//Set up a ring of ring_len records for each thread and start the writer. Call before the workers start.
+void stats_stream_start(const char* path, i64 threads, i64 clients, i64 ring_len);
+
+//Write out whatever is left and stop the writer. Call once the workers have stopped.
+void stats_stream_stop();
+
+#endif /* Q2PC_SERVER_STATS_H_ */
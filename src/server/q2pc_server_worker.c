@@ -11,13 +11,17 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <errno.h>
 
 #include "q2pc_server.h"
 #include "../transport/q2pc_transport.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 #include "q2pc_server_worker.h"
+#include "q2pc_server_stats.h"
+#include "../clock/q2pc_clock.h"
+#include "../trace/q2pc_trace.h"
 
 //Globals that matter
 extern CH_ARRAY(TRANS_CONN)* cons;
@@ -28,114 +32,364 @@ extern volatile bool pause_signal;
 //static i64 real_thread_count            = 0;
 extern volatile i64* votes_scoreboard ;
 extern volatile i64* votes_count;
+extern volatile i64* txn_rounds;
 extern stat_t** stats_mem;
+extern i64* stats_used;
+extern thread_hists_t* thread_hists;
+extern thread_counters_t* thread_counters;
+extern i64 txn_window;
+extern volatile u64* batch_client_votes;
+extern i64 batch_words;
 //static q2pc_trans* trans                = NULL;
 //static volatile i64 seq_no              = 0;
 
 
 #define BARRIER()  __asm__ volatile("" ::: "memory")
+#define EPOLL_EVENTS      64
+#define EPOLL_BLOCK_MS    10 //Wake up this often when blocked to check for stop/pause signals
 
-void* run_thread( void* p)
+
+//Counters are read by the coordinator while we write them, but there is only ever one writer
+static inline void counter_add(i64* counter, i64 value)
 {
-    thread_params_t* params = (thread_params_t*)p;
-    i64 lo          = params->lo;
-    i64 hi          = params->hi;
-    i64 count       = params->count;
-    i64 thread_id   = params->thread_id;
-    i64 stats_len   = params->stats_len;
-    free(params);
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
 
-    i64 stats_idx = 0;
 
-    //ch_log_debug1("Allocating ")
-    stats_mem[thread_id] = calloc(stats_len, sizeof(stat_t));
-    if(!stats_mem[thread_id]){
-        ch_log_fatal("Could not allocate %liB of memory for statistics counter\n", sizeof(stat_t) * stats_len);
+//Count a pass looking for votes
+static inline void count_poll(i64 thread_id, bool idle)
+{
+    counter_add(&thread_counters[thread_id].polls, 1);
+    counter_add(&thread_counters[thread_id].idle_polls, idle ? 1 : 0);
+}
+
+//Read and count a single vote from a connection. Returns Q2PC_EFIN if the worker should stop.
+static int read_vote(q2pc_trans_conn* con, i64 i, i64 thread_id, i64 count, i64* stats_idx, i64 stats_len)
+{
+    char* data = NULL;
+    i64 len = 0;
+    i64 result = con->beg_read(con,&data, &len);
+    if(result){
+        if(result == Q2PC_EAGAIN){
+            return Q2PC_EAGAIN;
+        }
+
+        if(result == Q2PC_EFIN){
+            Q2PC_TRACE2(conn_efin, i, thread_id);
+            stop_signal = 1;
+            BARRIER();
+            ch_log_warn("Cannot read any more data from connection %li on thread %li. Stream has finished\n", i, thread_id);
+            usleep(1000); //A a bit for the signal to propagate
+            return Q2PC_EFIN;
+
+        }
+
     }
 
+    q2pc_msg* msg = (q2pc_msg*)data;
+    //Bounds check the answer
 
-    ch_log_debug3("Running worker thread\n");
-    while(!stop_signal){
+    if(msg->src_hostid < 1 || msg->src_hostid > count){
+        ch_log_warn("Client ID (%li) is out of the expected range [%i,%i]. Ignoring vote\n", msg->src_hostid, 1, count);
+        con->end_read(con);
+        return Q2PC_ENONE;
+    }
+
+    if(msg->txn_id < 0){
+        ch_log_warn("Transaction ID (%li) from client %i is invalid. Ignoring vote\n", msg->txn_id, msg->src_hostid);
+        con->end_read(con);
+        return Q2PC_ENONE;
+    }
+
+    if(msg->type != q2pc_vote_yes_msg && msg->type != q2pc_vote_no_msg && msg->type != q2pc_ack_msg){
+        ch_log_warn("Q2PC Server: [%li] <-- Unknown message (%i)   from (%i). Ignoring\n",thread_id, msg->type, msg->src_hostid );
+        con->end_read(con);
+        return Q2PC_ENONE;
+    }
+
+    //Anything for a round that isn't open on the slot is late, or early, and can't be counted
+    const i64 slot  = msg->txn_id % txn_window;
+    const i64 round = Q2PC_ROUND(msg->txn_id, msg->type == q2pc_ack_msg ? 1 : 0);
+    if(__atomic_load_n(&txn_rounds[slot], __ATOMIC_ACQUIRE) != round){
+        ch_log_debug1("Q2PC Server: [%li] Ignoring message type %i for txn %li from (%i), it is not the open round\n",
+                thread_id, msg->type, msg->txn_id, msg->src_hostid);
+        con->end_read(con);
+        return Q2PC_ENONE;
+    }
+
+    //Only the thread that owns a connection writes its cells, so a cell already tagged with this round is a duplicate
+    volatile i64* cell = &votes_scoreboard[slot * count + msg->src_hostid - 1];
+    if(round_of(*cell) == round){
+        ch_log_debug1("Q2PC Server: [%li] Ignoring duplicate message type %i for txn %li from (%i)\n", thread_id,
+                msg->type, msg->txn_id, msg->src_hostid);
+        con->end_read(con);
+        return Q2PC_ENONE;
+    }
+
+    //The coordinator can send the next request as soon as this vote is counted, so get the stamps while the latest
+    //TX stamp is still the one for the request being answered
+    i64 time_tx = -1;
+    i64 time_rx = -1;
+    if(con->get_tstamps){
+        con->get_tstamps(con, &time_tx, &time_rx);
+    }
+
+    //Group commit votes carry a bitmap of yes votes. Keep this client's before the vote is counted, the coordinator
+    //ANDs them together when it tallies. Words the client left off are yes votes.
+    if(batch_words && msg->type != q2pc_ack_msg){
+        const i64 words     = MIN(Q2PC_BATCH_WORDS(msg->batch_len), batch_words);
+        const char* batch   = q2pc_msg_batch(msg);
+        volatile u64* votes = batch_client_votes + (slot * count + msg->src_hostid - 1) * batch_words;
+        for(int w = 0; w < batch_words; w++){
+            u64 yes_votes = ~0ULL;
+            if(w < words){
+                memcpy(&yes_votes, batch + w * sizeof(u64), sizeof(u64));
+            }
+            votes[w] = yes_votes;
+        }
+    }
+
+    __atomic_store_n(cell, round_tag(round, msg->type), __ATOMIC_RELEASE);
+    switch(msg->type){
+        case q2pc_vote_yes_msg: ch_log_debug2("Q2PC Server: [%i]<-- vote yes from (%li)\n", thread_id, msg->src_hostid); break;
+        case q2pc_vote_no_msg:  ch_log_debug2("Q2PC Server: [%i]<-- vote no  from (%li)\n", thread_id, msg->src_hostid); break;
+        case q2pc_ack_msg:      ch_log_debug2("Q2PC Server: [%i]<-- ack      from (%li)\n", thread_id, msg->src_hostid); break;
+    }
+    Q2PC_TRACE4(vote_recv, thread_id, msg->src_hostid, msg->txn_id, msg->type);
+
+    //The counter only ever counts one round, the first vote of a new round starts it again
+    volatile i64* counter = &votes_count[thread_id * txn_window + slot];
+    const i64 votes       = round_of(*counter) == round ? round_value(*counter) + 1 : 1;
+    __atomic_store_n(counter, round_tag(round, votes), __ATOMIC_RELEASE);
+    counter_add(&thread_counters[thread_id].votes, 1);
+
+    const i64 ts_end_us = q2pc_clock_us();
+
+    ch_log_debug3("Got ts with %li\n", msg->ts) ;
+
+    switch(msg->type){
+        case q2pc_vote_yes_msg:
+        case q2pc_vote_no_msg:  hdr_hist_record(&thread_hists[thread_id].phase1, ts_end_us - msg->ts); break;
+        case q2pc_ack_msg:      hdr_hist_record(&thread_hists[thread_id].phase2, ts_end_us - msg->ts); break;
+        default:                break;
+    }
+
+    //When streaming, a full ring drops the record rather than holding up the vote
+    stat_t* stat = stats_rings ? stats_ring_claim(&stats_rings[thread_id]) : &stats_mem[thread_id][*stats_idx];
+    if(stat){
+        stat->time_end   = ts_end_us;
+        stat->thread_id  = thread_id;
+        stat->time_start = msg->ts;
+        stat->client_id  = msg->src_hostid;
+        stat->c_rtos     = msg->c_rto;
+        stat->s_rtos     = msg->s_rto;
+        stat->type       = msg->type;
+        stat->rto_us     = con->get_rto ? con->get_rto(con) : -1;
+        stat->time_tx    = time_tx;
+        stat->time_rx    = time_rx;
+
+        //Kernel stamps are in CLOCK_REALTIME, which our clock slowly drifts away from. Move them onto our clock with
+        //the offset between the two right now, so that host time (time_end - time_rx) is measured on one clock.
+        if(time_tx >= 0 || time_rx >= 0){
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            const i64 offset_us = ts_end_us - (ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000);
+            stat->time_tx      += time_tx >= 0 ? offset_us : 0;
+            stat->time_rx      += time_rx >= 0 ? offset_us : 0;
+        }
+
+        if(stats_rings){
+            stats_ring_publish(&stats_rings[thread_id]);
+        }
+    }
+
+    //Read buffers come from a pool shared by the whole transport, so msg can't be touched once it has gone back
+    ch_log_debug2("Q2PC Server: [%li] Vote count=%li (txn=%li)\n", thread_id, votes, msg->txn_id);
+    con->end_read(con);
+
+    if(!stats_rings){
+        (*stats_idx)++;
+        if(*stats_idx >= stats_len){
+            stop_signal = 1;
+            BARRIER();
+            ch_log_warn("Run out of stats memory in thread %li Exiting\n", thread_id);
+            usleep(1000); //A a bit for the signal to propagate
+            return Q2PC_EFIN;
+        }
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//Busy loop if we're told to stop processing for a moment
+static inline bool worker_paused()
+{
+    if(!pause_signal){
+        return false;
+    }
+
+    __asm__("pause");
+    return true;
+}
 
-        //Busy loop if we're told to stop processing for a moment
-        if(pause_signal){
-            votes_count[thread_id] = 0;
-            __asm__("pause");
+
+//Busy loop over every connection looking for data. Returns the number of stats records filled in.
+static i64 run_polling(i64 lo, i64 hi, i64 count, i64 thread_id, i64 stats_len)
+{
+    i64 stats_idx = 0;
+
+    while(!stop_signal){
+        if(worker_paused()){
             continue;
         }
 
-        //Otherwise, busy loop looking for data
+        bool idle = true;
         for(int i = lo; i < hi; i++){
             q2pc_trans_conn* con = cons->off(cons,i);
-            char* data = NULL;
-            i64 len = 0;
-            i64 result = con->beg_read(con,&data, &len);
-            if(result){
-                if(result == Q2PC_EAGAIN){
-                    continue;
-                }
-
-                if(result == Q2PC_EFIN){
-                    stop_signal = 1;
-                    BARRIER();
-                    ch_log_warn("Cannot read any more data from connection %li on thread %li. Stream has finished\n", i, thread_id);
-                    usleep(1000); //A a bit for the signal to propagate
-                    break;
-
-                }
+            const int result = read_vote(con, i, thread_id, count, &stats_idx, stats_len);
+            if(result == Q2PC_EFIN){
+                break;
+            }
+            idle = idle && result == Q2PC_EAGAIN;
+        }
+        count_poll(thread_id, idle);
+    }
+
+    return stats_idx;
+}
+
+
+//Only touch connections that epoll says are readable. Sockets are edge triggered, so once a connection is
+//readable we keep reading from it until it runs dry. When there is nothing to do, spin on epoll for spin_us and
+//then block in it. A negative spin_us spins forever. Returns the number of stats records filled in.
+static i64 run_epoll(i64 lo, i64 hi, i64 count, i64 thread_id, i64 stats_len, i64 spin_us)
+{
+    i64 stats_idx = 0;
+
+    int epoll_fd = epoll_create1(0);
+    if(epoll_fd < 0){
+        ch_log_fatal("Could not create epoll instance on thread %li (%s)\n", thread_id, strerror(errno));
+    }
+
+    for(int i = lo; i < hi; i++){
+        q2pc_trans_conn* con = cons->off(cons,i);
+        struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.u64 = i };
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, con->get_fd(con), &event)){
+            ch_log_fatal("Could not add connection %li to epoll on thread %li (%s)\n", i, thread_id, strerror(errno));
+        }
+    }
+
+    //Start with everything marked ready, in case data turned up before we registered
+    i64* ready_list = (i64*)calloc(MAX(hi - lo, 1), sizeof(i64));
+    bool* is_ready  = (bool*)calloc(MAX(hi - lo, 1), sizeof(bool));
+    if(!ready_list || !is_ready){
+        ch_log_fatal("Could not allocate ready list for thread %li\n", thread_id);
+    }
+    i64 ready_count = 0;
+    for(int i = lo; i < hi; i++){
+        ready_list[ready_count++] = i;
+        is_ready[i - lo] = true;
+    }
+
+    struct epoll_event events[EPOLL_EVENTS];
+    i64 idle_start_us     = -1;
+
+    while(!stop_signal){
+        if(worker_paused()){
+            continue;
+        }
+
+        //Take one message from each ready connection per round so that a busy connection can't starve the others
+        bool idle = true;
+        for(i64 r = 0; r < ready_count && !stop_signal; ){
+            const i64 i = ready_list[r];
+            int result = read_vote(cons->off(cons,i), i, thread_id, count, &stats_idx, stats_len);
+            if(result == Q2PC_EFIN){
+                break;
+            }
+            idle = idle && result == Q2PC_EAGAIN;
 
+            if(result == Q2PC_EAGAIN){
+                is_ready[i - lo] = false;
+                ready_list[r] = ready_list[--ready_count];
+                continue;
             }
 
-            q2pc_msg* msg = (q2pc_msg*)data;
-            //Bounds check the answer
+            r++;
+        }
+
+        count_poll(thread_id, idle);
+
+        int timeout_ms = 0;
+        if(!ready_count && spin_us >= 0){
+            const i64 ts_now_us = q2pc_clock_us();
+            idle_start_us = idle_start_us < 0 ? ts_now_us : idle_start_us;
+            timeout_ms = ts_now_us - idle_start_us >= spin_us ? EPOLL_BLOCK_MS : 0;
+        }
 
-            if(msg->src_hostid < 1 || msg->src_hostid > count){
-                ch_log_warn("Client ID (%li) is out of the expected range [%i,%i]. Ignoring vote\n", msg->src_hostid, 1, count);
-                //con->end_read(con);
+        int events_count = epoll_wait(epoll_fd, events, EPOLL_EVENTS, timeout_ms);
+        if(events_count < 0){
+            if(errno == EINTR){
                 continue;
             }
+            ch_log_fatal("epoll wait failed on thread %li (%s)\n", thread_id, strerror(errno));
+        }
 
-            votes_scoreboard[msg->src_hostid - 1] = msg->type;
-            switch(msg->type){
-                case q2pc_vote_yes_msg: ch_log_debug2("Q2PC Server: [%i]<-- vote yes from (%li)\n", thread_id, msg->src_hostid); break;
-                case q2pc_vote_no_msg:  ch_log_debug2("Q2PC Server: [%i]<-- vote no  from (%li)\n", thread_id, msg->src_hostid); break;
-                case q2pc_ack_msg:      ch_log_debug2("Q2PC Server: [%i]<-- ack      from (%li)\n", thread_id, msg->src_hostid); break;
-                default:
-                    ch_log_warn("Q2PC Server: [%i] <-- Unknown message (%i)   from (%li)\n",thread_id, msg->type, msg->src_hostid );
+        for(int e = 0; e < events_count; e++){
+            const i64 i = events[e].data.u64;
+            if(!is_ready[i - lo]){
+                is_ready[i - lo] = true;
+                ready_list[ready_count++] = i;
             }
-            con->end_read(con);
-            BARRIER(); //Make sure there is no memory reordering here
+        }
 
-            votes_count[thread_id]++;
-            BARRIER();
+        if(ready_count){
+            idle_start_us = -1;
+        }
+    }
 
-            struct timeval ts_end   = {0};
-            gettimeofday(&ts_end, NULL);
-            const i64 ts_end_us = ts_end.tv_sec * 1000 * 1000 + ts_end.tv_usec;
+    free(ready_list);
+    free((void*)is_ready);
+    close(epoll_fd);
+    return stats_idx;
+}
 
-            ch_log_debug3("Got ts with %li\n", msg->ts) ;
 
-            stats_mem[thread_id][stats_idx].time_end   = ts_end_us;
-            stats_mem[thread_id][stats_idx].thread_id  = thread_id;
-            stats_mem[thread_id][stats_idx].time_start = msg->ts;
-            stats_mem[thread_id][stats_idx].client_id  = msg->src_hostid;
-            stats_mem[thread_id][stats_idx].c_rtos     = msg->c_rto;
-            stats_mem[thread_id][stats_idx].s_rtos     = msg->s_rto;
-            stats_mem[thread_id][stats_idx].type       = msg->type;
+void* run_thread( void* p)
+{
+    thread_params_t* params = (thread_params_t*)p;
+    i64 lo          = params->lo;
+    i64 hi          = params->hi;
+    i64 count       = params->count;
+    i64 thread_id   = params->thread_id;
+    i64 stats_len   = params->stats_len;
+    bool use_epoll  = params->use_epoll;
+    i64 spin_us     = params->spin_us;
+    free(params);
 
+    //When streaming, records go into the rings instead
+    stats_mem[thread_id] = stats_rings ? NULL : calloc(stats_len, sizeof(stat_t));
+    if(!stats_mem[thread_id] && !stats_rings){
+        ch_log_fatal("Could not allocate %liB of memory for statistics counter\n", sizeof(stat_t) * stats_len);
+    }
 
-            stats_idx++;
-            if(stats_idx >= stats_len){
-                stop_signal = 1;
-                BARRIER();
-                ch_log_warn("Run out of stats memory in thread %li Exiting\n", thread_id);
-                usleep(1000); //A a bit for the signal to propagate
-                break;
-            }
+    //Epoll needs a file descriptor for every connection, some transports share them
+    for(int i = lo; i < hi && use_epoll; i++){
+        q2pc_trans_conn* con = cons->off(cons,i);
+        if(!con->get_fd || con->get_fd(con) < 0){
+            ch_log_warn("Connection %i has no file descriptor to wait on. Thread %li will poll instead\n", i, thread_id);
+            use_epoll = false;
+        }
+    }
 
-            ch_log_debug2("Q2PC Server: [%li] Vote count=%li\n", thread_id,votes_count[thread_id]);
 
-        }
+    ch_log_debug3("Running worker thread\n");
+    if(use_epoll){
+        stats_used[thread_id] = run_epoll(lo, hi, count, thread_id, stats_len, spin_us);
+    }
+    else{
+        stats_used[thread_id] = run_polling(lo, hi, count, thread_id, stats_len);
     }
 
 
@@ -8,6 +8,8 @@
 #ifndef Q2PC_SERVER_WORKER_H_
 #define Q2PC_SERVER_WORKER_H_
 
+#include "../stats/hdr_hist.h"
+#include "../stats/q2pc_stats_file.h"
 
 typedef struct{
     i64 lo;
@@ -15,17 +17,47 @@ typedef struct{
     i64 count;
     i64 thread_id;
     i64 stats_len;
+    bool use_epoll;
+    i64 spin_us;
 } thread_params_t;
 
+//Latencies seen by each worker, for the live percentiles in the progress reports
 typedef struct{
-    i64 thread_id;
-    i64 client_id;
-    i64 c_rtos;
-    i64 s_rtos;
-    i64 time_start;
-    i64 time_end;
-    i64 type;
-} stat_t;
+    hdr_hist phase1; //From sending the request to counting the vote, for every vote
+    hdr_hist phase2; //From sending the decision to counting the ack, for every ack
+} thread_hists_t;
+
+//Counters for the metrics page, each only written by its own worker
+typedef struct{
+    i64 votes;
+    i64 polls;      //Passes over the connections (polling), or around the epoll loop
+    i64 idle_polls; //Passes that read nothing
+    char pad[40];
+} thread_counters_t;
+
+//Scoreboard cells and vote counters are tagged with the round they were written in. A round is one phase of one
+//transaction: phase 0 collects the votes and phase 1 the acks. The coordinator opens a round on a txn slot by writing
+//it to txn_rounds. Workers only count messages for the round that is open on their slot, so a late or duplicated
+//vote from the transaction that last used the slot is dropped, and nothing has to be cleared while workers run.
+#define Q2PC_ROUND(txn_id, phase) ((txn_id) * 2 + (phase))
+#define Q2PC_ROUND_SHIFT          24
+
+static inline i64 round_tag(i64 round, i64 value)
+{
+    return ((round + 1) << Q2PC_ROUND_SHIFT) | value; //Zeroed memory is tagged with no round at all
+}
+
+
+static inline i64 round_of(i64 tagged)
+{
+    return (tagged >> Q2PC_ROUND_SHIFT) - 1;
+}
+
+
+static inline i64 round_value(i64 tagged)
+{
+    return tagged & ((1LL << Q2PC_ROUND_SHIFT) - 1);
+}
 
 
 void* run_thread( void* p);
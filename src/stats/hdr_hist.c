@@ -0,0 +1,66 @@
+#include "hdr_hist.h"
+
+
+//The largest value that lands in a bucket, so that percentiles are never under reported
+static i64 bucket_high(i64 idx)
+{
+    if(idx < 2 * HDR_SUB_COUNT){
+        return idx;
+    }
+
+    const i64 rest  = idx - 2 * HDR_SUB_COUNT;
+    const i64 shift = rest / HDR_SUB_COUNT + 1;
+    const i64 sub   = rest % HDR_SUB_COUNT + HDR_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+
+void hdr_hist_merge(hdr_hist* dst, const hdr_hist* src)
+{
+    for(i64 i = 0; i < HDR_BUCKETS; i++){
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+void hdr_hist_sub(hdr_hist* dst, const hdr_hist* src)
+{
+    for(i64 i = 0; i < HDR_BUCKETS; i++){
+        dst->counts[i] -= src->counts[i];
+    }
+}
+
+
+i64 hdr_hist_count(const hdr_hist* hist)
+{
+    i64 result = 0;
+    for(i64 i = 0; i < HDR_BUCKETS; i++){
+        result += hist->counts[i];
+    }
+
+    return result;
+}
+
+
+i64 hdr_hist_percentile(const hdr_hist* hist, double pct)
+{
+    const i64 total = hdr_hist_count(hist);
+    if(!total){
+        return -1;
+    }
+
+    //Round up, without needing libm
+    const double exact = pct / 100.0 * total;
+    i64 target = (i64)exact;
+    target     = MAX(target < exact ? target + 1 : target, 1);
+
+    i64 seen = 0;
+    for(i64 i = 0; i < HDR_BUCKETS; i++){
+        seen += hist->counts[i];
+        if(seen >= target){
+            return bucket_high(i);
+        }
+    }
+
+    return bucket_high(HDR_BUCKETS - 1);
+}
@@ -0,0 +1,54 @@
+#ifndef HDR_HIST_H_
+#define HDR_HIST_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//High dynamic range histograms of latencies. Values below 2^(HDR_SUB_BITS+1) get a bucket each, above that every
+//power of two is split into 2^HDR_SUB_BITS buckets, so any value is known to within 1%. Recording is a couple of
+//instructions and never allocates.
+//
+//Each histogram has a single writer. Other threads can merge it into their own copy at any time without locking,
+//they just might not see the very latest values.
+
+#define HDR_SUB_BITS    7
+#define HDR_SUB_COUNT   (1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS    32 //Values are clamped to [0, 2^HDR_MAX_BITS)
+#define HDR_BUCKETS     (2 * HDR_SUB_COUNT + (HDR_MAX_BITS - HDR_SUB_BITS - 1) * HDR_SUB_COUNT)
+
+typedef struct {
+    u64 counts[HDR_BUCKETS];
+} hdr_hist;
+
+
+static inline i64 hdr_hist_index(i64 value)
+{
+    if(value < 2 * HDR_SUB_COUNT){
+        return MAX(value, 0);
+    }
+
+    value = MIN(value, (1LL << HDR_MAX_BITS) - 1);
+    const i64 msb   = 63 - __builtin_clzll(value);
+    const i64 shift = msb - HDR_SUB_BITS;
+    return 2 * HDR_SUB_COUNT + (msb - HDR_SUB_BITS - 1) * HDR_SUB_COUNT + (value >> shift) - HDR_SUB_COUNT;
+}
+
+
+//Only to be called by the thread that owns the histogram
+static inline void hdr_hist_record(hdr_hist* hist, i64 value)
+{
+    u64* count = &hist->counts[hdr_hist_index(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+//dst += src. src can be written to at the same time by its owner.
+void hdr_hist_merge(hdr_hist* dst, const hdr_hist* src);
+
+//dst -= src, for turning two running totals into the values recorded in between
+void hdr_hist_sub(hdr_hist* dst, const hdr_hist* src);
+
+i64 hdr_hist_count(const hdr_hist* hist);
+
+//The value that pct percent of recorded values are at or below, or -1 if the histogram is empty. 100 gives the max.
+i64 hdr_hist_percentile(const hdr_hist* hist, double pct);
+
+#endif /* HDR_HIST_H_ */
@@ -0,0 +1,223 @@
+//#LINKFLAGS=-lrt
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "q2pc_metrics.h"
+
+
+static i64 page_len(i64 threads, i64 clients)
+{
+    return sizeof(q2pc_metrics_t) + threads * sizeof(q2pc_metrics_thread_t) + clients * sizeof(i64);
+}
+
+
+q2pc_metrics_t* q2pc_metrics_create(const char* name, i64 threads, i64 clients)
+{
+    const i64 len = page_len(threads, clients);
+
+    q2pc_metrics_t* metrics = NULL;
+    if(!name){
+        metrics = (q2pc_metrics_t*)calloc(1, len);
+        if(!metrics){
+            ch_log_fatal("Could not allocate %liB for the metrics page\n", len);
+        }
+    }
+    else{
+        //Whatever a previous run left behind goes first
+        shm_unlink(name);
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if(fd < 0){
+            ch_log_fatal("Could not create metrics page %s: %s\n", name, strerror(errno));
+        }
+
+        if(ftruncate(fd, len)){
+            ch_log_fatal("Could not size metrics page %s to %liB: %s\n", name, len, strerror(errno));
+        }
+
+        metrics = (q2pc_metrics_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(metrics == MAP_FAILED){
+            ch_log_fatal("Could not map metrics page %s: %s\n", name, strerror(errno));
+        }
+        close(fd);
+    }
+
+    metrics->version  = Q2PC_METRICS_VERSION;
+    metrics->page_len = len;
+    metrics->pid      = getpid();
+    metrics->threads  = threads;
+    metrics->clients  = clients;
+    memset(metrics->latency_us, -1, sizeof(metrics->latency_us));
+    memset(metrics->step_ns, -1, sizeof(metrics->step_ns));
+
+    //Readers check the magic last, so they never see a page that's half set up
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(metrics->magic, Q2PC_METRICS_MAGIC, sizeof(metrics->magic));
+
+    ch_log_info("Publishing metrics to %s\n", name ? name : "local memory");
+    return metrics;
+}
+
+
+void q2pc_metrics_delete(q2pc_metrics_t* metrics, const char* name)
+{
+    if(!metrics){
+        return;
+    }
+
+    if(!name){
+        free(metrics);
+        return;
+    }
+
+    munmap(metrics, metrics->page_len);
+}
+
+
+q2pc_metrics_t* q2pc_metrics_open(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0){
+        ch_log_error("Could not open metrics page %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (i64)sizeof(q2pc_metrics_t)){
+        ch_log_error("%s is not a metrics page\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    q2pc_metrics_t* metrics = (q2pc_metrics_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(metrics == MAP_FAILED){
+        ch_log_error("Could not map metrics page %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if(memcmp(metrics->magic, Q2PC_METRICS_MAGIC, sizeof(metrics->magic)) || metrics->version != Q2PC_METRICS_VERSION ||
+       metrics->page_len != page_len(metrics->threads, metrics->clients) || metrics->page_len > st.st_size){
+        ch_log_error("%s is not a version %i metrics page\n", name, Q2PC_METRICS_VERSION);
+        munmap(metrics, st.st_size);
+        return NULL;
+    }
+
+    return metrics;
+}
+
+
+void q2pc_metrics_begin(q2pc_metrics_t* metrics)
+{
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void q2pc_metrics_end(q2pc_metrics_t* metrics)
+{
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+void q2pc_metrics_read(const q2pc_metrics_t* metrics, q2pc_metrics_t* snap)
+{
+    while(1){
+        const u64 before = __atomic_load_n(&metrics->seq, __ATOMIC_ACQUIRE);
+        if(before & 1){
+            __asm__("pause");
+            continue;
+        }
+
+        memcpy(snap, (const void*)metrics, metrics->page_len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&metrics->seq, __ATOMIC_RELAXED) == before){
+            return;
+        }
+    }
+}
+
+
+static void prom_header(FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+//Values of -1 mean nothing was measured
+static void prom_value(FILE* out, i64 value)
+{
+    if(value < 0){
+        fprintf(out, "NaN\n");
+        return;
+    }
+
+    fprintf(out, "%li\n", value);
+}
+
+
+void q2pc_metrics_prom(q2pc_metrics_t* snap, FILE* out)
+{
+    static const char* kinds[Q2PC_METRICS_KINDS] = { "phase1", "phase2", "e2e" };
+    static const char* steps[Q2PC_METRICS_STEPS] = { "send", "wait", "tally" };
+    static const char* pcts[Q2PC_METRICS_PCTS]   = { "0.5", "0.99", "0.999", "1" };
+
+    prom_header(out, "q2pc_requests_total", "counter", "Transactions completed.");
+    fprintf(out, "q2pc_requests_total %li\n", snap->requests);
+    prom_header(out, "q2pc_commits_total", "counter", "Logical transactions committed.");
+    fprintf(out, "q2pc_commits_total %li\n", snap->commits);
+    prom_header(out, "q2pc_rtos_total", "counter", "Retransmit timeouts fired on all connections.");
+    fprintf(out, "q2pc_rtos_total %li\n", snap->total_rtos);
+    prom_header(out, "q2pc_requests_per_second", "gauge", "Transaction rate over the last report interval.");
+    fprintf(out, "q2pc_requests_per_second %0.2lf\n", snap->req_per_sec);
+    prom_header(out, "q2pc_published_timestamp_seconds", "gauge", "When the server last published these metrics.");
+    fprintf(out, "q2pc_published_timestamp_seconds %0.6lf\n", snap->ts_us / 1000.0 / 1000.0);
+
+    prom_header(out, "q2pc_latency_microseconds", "gauge", "Latency percentiles over the last report interval.");
+    for(int kind = 0; kind < Q2PC_METRICS_KINDS; kind++){
+        for(int pct = 0; pct < Q2PC_METRICS_PCTS; pct++){
+            fprintf(out, "q2pc_latency_microseconds{kind=\"%s\",quantile=\"%s\"} ", kinds[kind], pcts[pct]);
+            prom_value(out, snap->latency_us[kind][pct]);
+        }
+    }
+
+    prom_header(out, "q2pc_step_nanoseconds", "gauge", "Time spent in each step of each phase over the last report interval.");
+    for(int phase = 0; phase < Q2PC_METRICS_PHASES; phase++){
+        for(int step = 0; step < Q2PC_METRICS_STEPS; step++){
+            for(int pct = 0; pct < 2; pct++){
+                fprintf(out, "q2pc_step_nanoseconds{phase=\"%i\",step=\"%s\",quantile=\"%s\"} ", phase + 1, steps[step], pcts[pct]);
+                prom_value(out, snap->step_ns[phase][step][pct]);
+            }
+        }
+    }
+
+    q2pc_metrics_thread_t* threads = q2pc_metrics_threads(snap);
+    prom_header(out, "q2pc_thread_votes_total", "counter", "Votes and acks counted by each worker.");
+    for(i64 i = 0; i < snap->threads; i++){
+        fprintf(out, "q2pc_thread_votes_total{thread=\"%li\"} %li\n", i, threads[i].votes);
+    }
+    prom_header(out, "q2pc_thread_polls_total", "counter", "Times each worker went looking for votes.");
+    for(i64 i = 0; i < snap->threads; i++){
+        fprintf(out, "q2pc_thread_polls_total{thread=\"%li\"} %li\n", i, threads[i].polls);
+    }
+    prom_header(out, "q2pc_thread_idle_polls_total", "counter", "Times each worker went looking for votes and found none.");
+    for(i64 i = 0; i < snap->threads; i++){
+        fprintf(out, "q2pc_thread_idle_polls_total{thread=\"%li\"} %li\n", i, threads[i].idle_polls);
+    }
+    prom_header(out, "q2pc_thread_idle_ratio", "gauge", "Fraction of each worker's polls that found nothing, since start.");
+    for(i64 i = 0; i < snap->threads; i++){
+        fprintf(out, "q2pc_thread_idle_ratio{thread=\"%li\"} %0.4lf\n", i,
+                threads[i].polls ? (double)threads[i].idle_polls / threads[i].polls : 0.0);
+    }
+
+    i64* conn_rtos = q2pc_metrics_conn_rtos(snap);
+    prom_header(out, "q2pc_conn_rtos_total", "counter", "Retransmit timeouts fired on each connection.");
+    for(i64 i = 0; i < snap->clients; i++){
+        fprintf(out, "q2pc_conn_rtos_total{conn=\"%li\"} %li\n", i, conn_rtos[i]);
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef Q2PC_METRICS_H_
+#define Q2PC_METRICS_H_
+
+#include <stdio.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//Live metrics, published by the server into a page of shared memory that other processes can map and read without
+//ever holding the server up. There is a single writer. It makes the sequence number odd while it writes, and even
+//again when it's done, so a reader takes a copy and tries again if the sequence number was odd or changed under it.
+//
+//The page is a fixed header, then a q2pc_metrics_thread_t for each worker, then the RTO count for each connection.
+
+#define Q2PC_METRICS_MAGIC   "Q2PCMETR"
+#define Q2PC_METRICS_VERSION 1
+#define Q2PC_METRICS_NAME    "/q2pc_metrics"
+
+#define Q2PC_METRICS_PCTS    4 //p50, p99, p99.9 and max
+#define Q2PC_METRICS_KINDS   3 //Phase 1, phase 2 and end to end
+#define Q2PC_METRICS_PHASES  2
+#define Q2PC_METRICS_STEPS   3 //Send, wait and tally
+
+typedef struct{
+    char magic[8];
+    u32 version;
+    u32 page_len;
+    volatile u64 seq;
+    i64 pid;
+    i64 threads;
+    i64 clients;
+    i64 ts_us;          //When this was last published
+    i64 requests;       //Everything from here to the end of the page is since start, unless it says otherwise
+    i64 commits;
+    i64 total_rtos;
+    double req_per_sec; //Over the last report interval
+    i64 latency_us[Q2PC_METRICS_KINDS][Q2PC_METRICS_PCTS]; //Over the last report interval, -1 if nothing was seen
+    i64 step_ns[Q2PC_METRICS_PHASES][Q2PC_METRICS_STEPS][2]; //p50 and p99 over the last report interval
+} q2pc_metrics_t;
+
+typedef struct{
+    i64 votes;
+    i64 polls;      //Times the worker went looking for votes
+    i64 idle_polls; //Times it found nothing
+} q2pc_metrics_thread_t;
+
+
+static inline q2pc_metrics_thread_t* q2pc_metrics_threads(q2pc_metrics_t* metrics)
+{
+    return (q2pc_metrics_thread_t*)(metrics + 1);
+}
+
+
+static inline i64* q2pc_metrics_conn_rtos(q2pc_metrics_t* metrics)
+{
+    return (i64*)(q2pc_metrics_threads(metrics) + metrics->threads);
+}
+
+
+//Make a page in shared memory called name, or in private memory if name is NULL
+q2pc_metrics_t* q2pc_metrics_create(const char* name, i64 threads, i64 clients);
+
+//Let go of the page. One in shared memory stays there with the final values until the next run replaces it.
+void q2pc_metrics_delete(q2pc_metrics_t* metrics, const char* name);
+
+//Map in a page that another process published. Returns NULL if there isn't one.
+q2pc_metrics_t* q2pc_metrics_open(const char* name);
+
+//Bracket every change to the page
+void q2pc_metrics_begin(q2pc_metrics_t* metrics);
+void q2pc_metrics_end(q2pc_metrics_t* metrics);
+
+//Take a consistent copy of the page into snap, which must be metrics->page_len bytes long
+void q2pc_metrics_read(const q2pc_metrics_t* metrics, q2pc_metrics_t* snap);
+
+//Print a copy of the page in the Prometheus text exposition format
+void q2pc_metrics_prom(q2pc_metrics_t* snap, FILE* out);
+
+#endif /* Q2PC_METRICS_H_ */
@@ -0,0 +1,130 @@
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "q2pc_stats_file.h"
+
+
+void stats_file_hdr_init(q2pc_stats_hdr_t* hdr, i64 threads, i64 clients)
+{
+    bzero(hdr, sizeof(q2pc_stats_hdr_t));
+    memcpy(hdr->magic, Q2PC_STATS_MAGIC, sizeof(hdr->magic));
+    hdr->version     = Q2PC_STATS_VERSION;
+    hdr->record_size = sizeof(stat_t);
+    hdr->records     = -1;
+    hdr->threads     = threads;
+    hdr->clients     = clients;
+}
+
+
+void stats_file_write(const char* path, i64 threads, i64 clients, stat_t* const* parts, const i64* counts, i64 part_count)
+{
+    i64 records = 0;
+    for(i64 i = 0; i < part_count; i++){
+        records += parts[i] ? counts[i] : 0;
+    }
+
+    const i64 len = sizeof(q2pc_stats_hdr_t) + records * sizeof(stat_t);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0){
+        ch_log_fatal("Could not open statistics file %s: %s\n", path, strerror(errno));
+    }
+
+    if(ftruncate(fd, len)){
+        ch_log_fatal("Could not size statistics file %s to %liB: %s\n", path, len, strerror(errno));
+    }
+
+    char* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        ch_log_fatal("Could not map statistics file %s: %s\n", path, strerror(errno));
+    }
+
+    //The count goes in last, so a file cut short by a crash still reads as unfinished
+    q2pc_stats_hdr_t* hdr = (q2pc_stats_hdr_t*)map;
+    stats_file_hdr_init(hdr, threads, clients);
+
+    char* out = map + sizeof(q2pc_stats_hdr_t);
+    for(i64 i = 0; i < part_count; i++){
+        if(parts[i]){
+            memcpy(out, parts[i], counts[i] * sizeof(stat_t));
+            out += counts[i] * sizeof(stat_t);
+        }
+    }
+    hdr->records = records;
+
+    munmap(map, len);
+    close(fd);
+}
+
+
+void stats_file_finish(int fd, i64 records)
+{
+    if(pwrite(fd, &records, sizeof(records), offsetof(q2pc_stats_hdr_t, records)) != sizeof(records)){
+        ch_log_warn("Could not write the record count to the statistics file: %s\n", strerror(errno));
+    }
+}
+
+
+void stats_file_open(stats_file_t* file, const char* path)
+{
+    bzero(file, sizeof(stats_file_t));
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        ch_log_fatal("Could not open statistics file %s: %s\n", path, strerror(errno));
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)){
+        ch_log_fatal("Could not stat statistics file %s: %s\n", path, strerror(errno));
+    }
+
+    if(st.st_size < (i64)sizeof(q2pc_stats_hdr_t)){
+        ch_log_fatal("%s is too small to be a statistics file\n", path);
+    }
+
+    file->map_len = st.st_size;
+    file->map     = mmap(NULL, file->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(file->map == MAP_FAILED){
+        ch_log_fatal("Could not map statistics file %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+
+    memcpy(&file->hdr, file->map, sizeof(q2pc_stats_hdr_t));
+    if(memcmp(file->hdr.magic, Q2PC_STATS_MAGIC, sizeof(file->hdr.magic))){
+        ch_log_fatal("%s is not a statistics file\n", path);
+    }
+
+    if(file->hdr.version != Q2PC_STATS_VERSION){
+        ch_log_fatal("%s is statistics format version %u, but only version %u is understood\n", path, file->hdr.version, Q2PC_STATS_VERSION);
+    }
+
+    if(file->hdr.record_size < sizeof(stat_t)){
+        ch_log_fatal("%s has %uB records, expected at least %liB\n", path, file->hdr.record_size, sizeof(stat_t));
+    }
+
+    const i64 in_file = (file->map_len - (i64)sizeof(q2pc_stats_hdr_t)) / file->hdr.record_size;
+    if(file->hdr.records < 0){
+        ch_log_warn("%s was not finished cleanly, reading the %li whole records it holds\n", path, in_file);
+        file->count = in_file;
+    }
+    else if(file->hdr.records > in_file){
+        ch_log_warn("%s is truncated, expected %li records but it holds %li\n", path, file->hdr.records, in_file);
+        file->count = in_file;
+    }
+    else{
+        file->count = file->hdr.records;
+    }
+}
+
+
+void stats_file_close(stats_file_t* file)
+{
+    if(file->map && file->map != MAP_FAILED){
+        munmap((void*)file->map, file->map_len);
+    }
+    file->map = NULL;
+}
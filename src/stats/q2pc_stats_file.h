@@ -0,0 +1,64 @@
+#ifndef Q2PC_STATS_FILE_H_
+#define Q2PC_STATS_FILE_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//The statistics file is a fixed size header followed by packed stat_t records, in host byte order. New fields only
+//ever go on the end of a record and record_size says how big records really are, so a reader can step over fields it
+//doesn't know about. Anything that changes the meaning of existing fields bumps the version.
+
+#define Q2PC_STATS_MAGIC   "Q2PCSTAT"
+#define Q2PC_STATS_VERSION 1
+
+typedef struct{
+    char magic[8];
+    u32 version;
+    u32 record_size;
+    i64 records;     //-1 if the writer never finished, in which case the file size says how many there are
+    i64 threads;
+    i64 clients;
+    i64 reserved[3];
+} q2pc_stats_hdr_t;
+
+typedef struct{
+    i64 thread_id;
+    i64 client_id;
+    i64 c_rtos;
+    i64 s_rtos;
+    i64 time_start;
+    i64 time_end;
+    i64 type;
+    i64 rto_us; //Retransmit timeout learned for this client when the vote arrived, -1 if the transport has none
+    i64 time_tx; //Kernel timestamp of the request leaving, -1 if it wasn't stamped
+    i64 time_rx; //Kernel timestamp of the vote arriving, -1 if it wasn't stamped
+} stat_t;
+
+//A statistics file mapped in for reading
+typedef struct{
+    q2pc_stats_hdr_t hdr;
+    const char* map;
+    i64 map_len;
+    i64 count;
+} stats_file_t;
+
+
+//Fill in a header for a file that isn't finished yet
+void stats_file_hdr_init(q2pc_stats_hdr_t* hdr, i64 threads, i64 clients);
+
+//Write out a whole run in one go through a shared mapping. parts[i] holds counts[i] records, NULL parts are skipped.
+void stats_file_write(const char* path, i64 threads, i64 clients, stat_t* const* parts, const i64* counts, i64 part_count);
+
+//Mark a file that was written as a stream (header first, then records) as finished
+void stats_file_finish(int fd, i64 records);
+
+//Map in a file for reading and check its header. Dies if the file can't be used.
+void stats_file_open(stats_file_t* file, const char* path);
+void stats_file_close(stats_file_t* file);
+
+
+static inline const stat_t* stats_file_record(const stats_file_t* file, i64 idx)
+{
+    return (const stat_t*)(file->map + sizeof(q2pc_stats_hdr_t) + idx * file->hdr.record_size);
+}
+
+#endif /* Q2PC_STATS_FILE_H_ */
@@ -0,0 +1,52 @@
+#ifndef Q2PC_TRACE_H_
+#define Q2PC_TRACE_H_
+
+//Static tracepoints (USDT) on the commit path, for bpftrace, perf and SystemTap. For example
+//
+//    bpftrace -e 'usdt:./q2pc:q2pc:vote_recv { @votes[arg1] = count(); }'
+//    perf buildid-cache --add ./q2pc && perf record -e sdt_q2pc:txn_outcome ...
+//
+//With <sys/sdt.h> each probe is a single nop in the code and a note in the binary until a tracer attaches to it.
+//Arguments are still worked out, so probes only ever take values that are already at hand. Without the header, or
+//with Q2PC_NO_USDT defined, the probes go away entirely.
+//
+//Provider q2pc, probes and their arguments:
+//  Server
+//    request_send        (txn_id, msg_type, batch_len)   Coordinator starts sending a request or decision
+//    vote_recv           (thread, client, txn_id, type)   Worker counted a vote or ack
+//    phase_decision      (txn_id, phase, status)          Votes (phase 1) or acks (phase 2) tallied
+//    txn_outcome         (txn_id, status, commits)        Transaction finished, commits is logical commits
+//    rto_fire            (conn, rtos)                     Write to a client timed out, rtos so far this send
+//    conn_efin           (conn, thread)                   Connection finished, thread is -1 for the coordinator
+//  Client
+//    client_request_recv (client, txn_id, msg_type)       Request or decision arrived
+//    client_vote_send    (client, txn_id, msg_type)       Vote or ack is going out
+//    client_outcome      (client, txn_id, aborted)        Decision is about to be acked
+//    client_rto_fire     (client, txn_id, rtos)           Write to the server timed out
+//    client_conn_efin    (client)                         Connection to the server finished
+//  Transports
+//    rdp_rto_fire        (seq, rto_us)                    rdp-ln retransmit timeout, before backing off
+//    nack_request        (seq)                            Client asks for a missing broadcast
+//    nack_repair         (seq)                            Server resends a broadcast
+
+#if !defined(Q2PC_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define Q2PC_USDT 1
+#endif
+#endif
+
+#ifdef Q2PC_USDT
+#define Q2PC_TRACE1(name, a)          DTRACE_PROBE1(q2pc, name, a)
+#define Q2PC_TRACE2(name, a, b)       DTRACE_PROBE2(q2pc, name, a, b)
+#define Q2PC_TRACE3(name, a, b, c)    DTRACE_PROBE3(q2pc, name, a, b, c)
+#define Q2PC_TRACE4(name, a, b, c, d) DTRACE_PROBE4(q2pc, name, a, b, c, d)
+#else
+//sizeof keeps the arguments "used" without working them out
+#define Q2PC_TRACE1(name, a)          do{ (void)sizeof(a); } while(0)
+#define Q2PC_TRACE2(name, a, b)       do{ (void)sizeof(a); (void)sizeof(b); } while(0)
+#define Q2PC_TRACE3(name, a, b, c)    do{ (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while(0)
+#define Q2PC_TRACE4(name, a, b, c, d) do{ (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while(0)
+#endif
+
+#endif /* Q2PC_TRACE_H_ */
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "buff_pool.h"
+
+
+#define SLAB_BUFFS  256         //Buffers to allocate each time the pool runs dry
+#define MAX_SLABS   (16 * 1024) //Puts an upper bound of 4M buffers on the pool
+#define EMPTY       0xFFFFFFFFULL
+
+//Every buffer is preceded by a small header so that it can find its way home
+typedef struct {
+    u32 idx;
+    volatile u32 next;
+    u64 pad;
+} buff_hdr;
+
+struct buff_pool_s {
+    //Free list, a stack of buffer indices. The top 32 bits are a tag that changes on every update to avoid ABA.
+    volatile u64 head;
+
+    i64 buff_size;
+    i64 stride;
+
+    pthread_mutex_t grow_lock;
+    char* volatile slabs[MAX_SLABS];
+    volatile i64 slab_count;
+};
+
+
+static inline buff_hdr* get_hdr(buff_pool* pool, u64 idx)
+{
+    return (buff_hdr*)(pool->slabs[idx / SLAB_BUFFS] + (idx % SLAB_BUFFS) * pool->stride);
+}
+
+
+static inline void push(buff_pool* pool, buff_hdr* hdr)
+{
+    u64 old_head = pool->head;
+    u64 new_head;
+    do{
+        hdr->next = old_head & EMPTY;
+        new_head  = ((old_head >> 32) + 1) << 32 | hdr->idx;
+    } while(!__atomic_compare_exchange_n(&pool->head, &old_head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+//Add another slab to the pool and hand back one of its buffers
+static buff_hdr* grow(buff_pool* pool)
+{
+    pthread_mutex_lock(&pool->grow_lock);
+
+    //Someone else might have beaten us to it
+    if((pool->head & EMPTY) != EMPTY){
+        pthread_mutex_unlock(&pool->grow_lock);
+        return NULL;
+    }
+
+    if(pool->slab_count >= MAX_SLABS){
+        ch_log_fatal("Buffer pool exhausted, all %li buffers are in use\n", (i64)MAX_SLABS * SLAB_BUFFS);
+    }
+
+    char* slab = calloc(SLAB_BUFFS, pool->stride);
+    if(!slab){
+        ch_log_fatal("Could not allocate %li bytes for buffer pool slab\n", SLAB_BUFFS * pool->stride);
+    }
+
+    const i64 slab_idx = pool->slab_count;
+    pool->slabs[slab_idx] = slab;
+    __atomic_store_n(&pool->slab_count, slab_idx + 1, __ATOMIC_RELEASE);
+
+    for(int i = 0; i < SLAB_BUFFS; i++){
+        buff_hdr* hdr = (buff_hdr*)(slab + i * pool->stride);
+        hdr->idx = slab_idx * SLAB_BUFFS + i;
+    }
+
+    //Keep the first buffer for ourselves
+    for(int i = 1; i < SLAB_BUFFS; i++){
+        push(pool, (buff_hdr*)(slab + i * pool->stride));
+    }
+
+    pthread_mutex_unlock(&pool->grow_lock);
+    return (buff_hdr*)slab;
+}
+
+
+char* buff_pool_get(buff_pool* pool)
+{
+    u64 old_head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    for(;;){
+        const u64 idx = old_head & EMPTY;
+        if(idx == EMPTY){
+            buff_hdr* hdr = grow(pool);
+            if(hdr){
+                return (char*)(hdr + 1);
+            }
+
+            old_head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        //Slabs are never freed until the pool is, so it's safe to look at the next pointer even if we lose the race
+        buff_hdr* hdr = get_hdr(pool, idx);
+        const u64 new_head = ((old_head >> 32) + 1) << 32 | hdr->next;
+        if(__atomic_compare_exchange_n(&pool->head, &old_head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+            return (char*)(hdr + 1);
+        }
+    }
+}
+
+
+void buff_pool_put(buff_pool* pool, char* buff)
+{
+    if(!buff){
+        return;
+    }
+
+    push(pool, (buff_hdr*)buff - 1);
+}
+
+
+i64 buff_pool_buff_size(const buff_pool* pool)
+{
+    return pool->buff_size;
+}
+
+
+buff_pool* buff_pool_new(i64 buff_size)
+{
+    buff_pool* pool = calloc(1, sizeof(buff_pool));
+    if(!pool){
+        ch_log_fatal("Could not allocate buffer pool\n");
+    }
+
+    pool->head      = EMPTY;
+    pool->buff_size = buff_size;
+    pool->stride    = sizeof(buff_hdr) + ((buff_size + sizeof(buff_hdr) - 1) & ~(sizeof(buff_hdr) - 1));
+    pthread_mutex_init(&pool->grow_lock, NULL);
+
+    return pool;
+}
+
+
+void buff_pool_delete(buff_pool* pool)
+{
+    if(!pool){
+        return;
+    }
+
+    for(int i = 0; i < pool->slab_count; i++){
+        free(pool->slabs[i]);
+    }
+
+    pthread_mutex_destroy(&pool->grow_lock);
+    free(pool);
+}
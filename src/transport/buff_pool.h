@@ -0,0 +1,20 @@
+#ifndef BUFF_POOL_H_
+#define BUFF_POOL_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//A pool of fixed size message buffers shared by all the connections in a transport. Buffers are carved out of slabs
+//that are only allocated when the pool runs dry, so memory use follows the number of messages in flight rather than
+//the number of connections. Getting and putting buffers is lock free and safe from any thread.
+
+#define BUFF_POOL_HEADROOM 64 //Extra space in each buffer for headers added by layered transports (eg RUDP)
+
+typedef struct buff_pool_s buff_pool;
+
+buff_pool* buff_pool_new(i64 buff_size);
+char* buff_pool_get(buff_pool* pool);
+void buff_pool_put(buff_pool* pool, char* buff);
+i64 buff_pool_buff_size(const buff_pool* pool);
+void buff_pool_delete(buff_pool* pool);
+
+#endif /* BUFF_POOL_H_ */
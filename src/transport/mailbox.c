@@ -0,0 +1,32 @@
+#include <stdlib.h>
+
+#include "mailbox.h"
+
+
+void mailbox_init(mailbox* mb, i64 slots, i64 slot_size)
+{
+    mb->slots   = slots;
+    mb->head    = 0;
+    mb->tail    = 0;
+    mb->buffs   = calloc(slots, sizeof(char*));
+    mb->lens    = calloc(slots, sizeof(i64));
+    mb->storage = slot_size ? calloc(slots, slot_size) : NULL;
+    if(!mb->buffs || !mb->lens || (slot_size && !mb->storage)){
+        ch_log_fatal("Could not allocate a mailbox of %li slots\n", slots);
+    }
+
+    for(i64 i = 0; slot_size && i < slots; i++){
+        mb->buffs[i] = mb->storage + i * slot_size;
+    }
+}
+
+
+void mailbox_free(mailbox* mb)
+{
+    free(mb->buffs);
+    free(mb->lens);
+    free(mb->storage);
+    mb->buffs   = NULL;
+    mb->lens    = NULL;
+    mb->storage = NULL;
+}
@@ -0,0 +1,115 @@
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <string.h>
+
+#include "q2pc_transport.h"
+
+//A single producer single consumer ring of datagrams for one connection. The server transports that read every
+//client from a shared socket or ring (mmsg, io_uring, packet, XDP and the sharded UDP sockets) hand each datagram out
+//to the mailbox of the connection it belongs to, and the thread that owns the connection takes it from there.
+//Producers that can race each other have to serialise themselves. Slots either hold a copy of the datagram in storage
+//the mailbox owns (mailbox_claim/mailbox_copy), or a pointer to a buffer that belongs to someone else (mailbox_put).
+
+#define MAILBOX_HEADROOM 32 //Slots on top of the window, for connection and layer messages
+
+typedef struct {
+    char** buffs;
+    i64* lens;
+    i64 slots;
+    char* storage; //NULL if the mailbox only holds pointers
+    volatile i64 head;
+    volatile i64 tail;
+} mailbox;
+
+
+//A client only sends a vote and an ack for each transaction the server has in flight, so a mailbox this big can only
+//fill up if a client breaks the protocol
+static inline i64 mailbox_slots(const transport_s* transport)
+{
+    return 2 * MAX(transport->txn_window, 1) + MAILBOX_HEADROOM;
+}
+
+//slot_size 0 makes a mailbox of pointers, with no storage of its own
+void mailbox_init(mailbox* mb, i64 slots, i64 slot_size);
+void mailbox_free(mailbox* mb);
+
+
+static inline bool mailbox_empty(const mailbox* mb)
+{
+    return mb->tail == mb->head;
+}
+
+//Producer. The slot to receive the next datagram into, or NULL if the mailbox is full.
+static inline char* mailbox_claim(mailbox* mb)
+{
+    if(mb->head - mb->tail >= mb->slots){
+        return NULL;
+    }
+
+    return mb->buffs[mb->head % mb->slots];
+}
+
+//Producer. Hand the claimed slot over to the consumer.
+static inline void mailbox_publish(mailbox* mb, i64 len)
+{
+    mb->lens[mb->head % mb->slots] = len;
+    __sync_synchronize(); //Make sure the data is there before the consumer can see it
+    mb->head++;
+}
+
+//Producer. Returns false if the mailbox is full.
+static inline bool mailbox_copy(mailbox* mb, const char* data, i64 len)
+{
+    char* slot = mailbox_claim(mb);
+    if(!slot){
+        return false;
+    }
+
+    memcpy(slot, data, len);
+    mailbox_publish(mb, len);
+    return true;
+}
+
+//Producer, for mailboxes of pointers. Returns false if the mailbox is full, in which case buff still belongs to the
+//caller.
+static inline bool mailbox_put(mailbox* mb, char* buff, i64 len)
+{
+    if(mb->head - mb->tail >= mb->slots){
+        return false;
+    }
+
+    mb->buffs[mb->head % mb->slots] = buff;
+    mailbox_publish(mb, len);
+    return true;
+}
+
+//Consumer. Look at the oldest datagram without taking it out. Returns false if there isn't one.
+static inline bool mailbox_peek(mailbox* mb, char** data_o, i64* len_o)
+{
+    if(mailbox_empty(mb)){
+        return false;
+    }
+
+    __sync_synchronize();
+    const i64 slot = mb->tail % mb->slots;
+    *data_o = mb->buffs[slot];
+    *len_o  = mb->lens[slot];
+    return true;
+}
+
+//Consumer. Done with the oldest datagram, returns its buffer (so that a mailbox of pointers can give it back), or
+//NULL if the mailbox was empty.
+static inline char* mailbox_pop(mailbox* mb)
+{
+    if(mailbox_empty(mb)){
+        return NULL;
+    }
+
+    char* buff = mb->buffs[mb->tail % mb->slots];
+    __sync_synchronize(); //Finish with the slot before the producer can reuse it
+    mb->tail++;
+    return buff;
+}
+
+#endif /* MAILBOX_H_ */
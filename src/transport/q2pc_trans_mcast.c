@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "q2pc_trans_mcast.h"
+#include "conn_vector.h"
+#include "buff_pool.h"
+#include "sock_bind.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//Like the Q-Jump transport, the server fans out with a single send, but to an IP multicast group instead of the
+//broadcast address, so it works across routers and on a single host over loopback. Clients join the group on the
+//server port and send their votes back by unicast to port + client id.
+
+typedef struct {
+    int wr_fd; //Writing file descriptor, shared by all connections on the server
+    int rd_fd; //Reading file descriptor
+    bool owns_wr_fd;
+
+    buff_pool* pool; //Shared by all connections on the transport
+
+    //For the reader
+    void* read_buffer;
+    i64   read_buffer_used;
+    i64   read_buffer_size;
+
+    //For the writer
+    void* write_buffer;
+    i64   write_buffer_used;
+    i64   write_buffer_size;
+
+} q2pc_mcast_conn_priv;
+
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_buffer;
+        *len_o  = priv->read_buffer_used;
+        return Q2PC_ENONE;
+    }
+
+    priv->read_buffer = buff_pool_get(priv->pool);
+
+    int result = read(priv->rd_fd, priv->read_buffer, priv->read_buffer_size);
+    if(result <= 0){
+        buff_pool_put(priv->pool, priv->read_buffer); //Same as udp-ln, don't hold a buffer while idle
+        priv->read_buffer = NULL;
+    }
+
+    if(result < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+        }
+
+        if(errno == ECONNREFUSED){
+            ch_log_warn("MCAST beg read EFIN (%s)\n", strerror(errno));
+            return Q2PC_EFIN;
+        }
+
+        ch_log_fatal("MCAST read failed on fd=%i - %s\n",priv->rd_fd,strerror(errno));
+    }
+
+    if(result == 0){
+        return Q2PC_EFIN;
+    }
+
+    priv->read_buffer_used = result;
+
+    *data_o = priv->read_buffer;
+    *len_o  = priv->read_buffer_used;
+    ch_log_debug3("Got %li bytes\n", priv->read_buffer_used);
+
+
+    return Q2PC_ENONE;
+}
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+
+    //Only give the buffer back once a message has been consumed
+    if(priv->read_buffer_used){
+        buff_pool_put(priv->pool, priv->read_buffer);
+        priv->read_buffer = NULL;
+    }
+
+    priv->read_buffer_used = 0;
+    return 0;
+}
+
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->pool);
+    }
+
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return 0;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    char* data = priv->write_buffer;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    int result = Q2PC_ENONE;
+    while(len > 0){
+        i64 written =  write(priv->wr_fd, data ,len);
+        if(written < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                continue; //Keep trying until we succeed
+            }
+
+            ch_log_warn("MCAST write failed: %s\n",strerror(errno));
+            result = Q2PC_EFIN;
+            break;
+        }
+        data += written;
+        len -= written;
+    }
+
+    buff_pool_put(priv->pool, priv->write_buffer);
+    priv->write_buffer = NULL;
+    return result;
+
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+    return priv->rd_fd;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_mcast_conn_priv* priv = (q2pc_mcast_conn_priv*)this->priv;
+            buff_pool_put(priv->pool, priv->read_buffer);
+            buff_pool_put(priv->pool, priv->write_buffer);
+            close(priv->rd_fd);
+            if(priv->owns_wr_fd){ close(priv->wr_fd); }
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+typedef struct {
+    transport_s transport;
+
+    i64 connections;
+    buff_pool* pool;
+
+    int group_fd; //Server only, sends to the multicast group
+    struct in_addr group;
+    int ifindex;
+
+} q2pc_mcast_priv;
+
+
+static q2pc_mcast_conn_priv* new_conn_priv(buff_pool* pool)
+{
+    q2pc_mcast_conn_priv* new_priv = calloc(1,sizeof(q2pc_mcast_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    //Buffers come out of the pool as they are needed
+    new_priv->pool              = pool;
+    new_priv->read_buffer_size  = buff_pool_buff_size(pool);
+    new_priv->write_buffer_size = buff_pool_buff_size(pool);
+
+    return new_priv;
+}
+
+static q2pc_mcast_conn_priv* init_new_conn(q2pc_trans_conn* conn, buff_pool* pool)
+{
+    q2pc_mcast_conn_priv* new_priv = new_conn_priv(pool);
+
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
+
+    return new_priv;
+}
+
+
+static void safe_connect(int fd, struct sockaddr_in* addr)
+{
+    ch_log_debug3("Connecting on %i port=%i\n", fd, ntohs(addr->sin_port));
+    if( connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) ){
+        ch_log_fatal("MCAST connect failed: %s\n",strerror(errno));
+    }
+
+}
+
+
+
+static int new_socket()
+{
+    int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_fd < 0 ){
+        ch_log_fatal("Could not create MCAST socket (%s)\n", strerror(errno));
+    }
+
+    //Lets more than one client on the same host listen to the group port
+    int reuse_opt = 1;
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("MCAST set reuse address failed: %s\n",strerror(errno));
+    }
+
+    int flags = 0;
+    flags |= O_NONBLOCK;
+    if( fcntl(sock_fd, F_SETFL, flags) == -1){
+        ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",sock_fd,strerror(errno));
+    }
+
+    return sock_fd;
+
+}
+
+
+
+//Wait for all clients to connect
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_mcast_priv* trans_priv = (q2pc_mcast_priv*)this->priv;
+    q2pc_mcast_conn_priv* conn_priv = (q2pc_mcast_conn_priv*)conn->priv;
+
+    if(!conn_priv){
+
+        q2pc_mcast_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
+
+        struct sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family      = AF_INET;
+
+        if(trans_priv->transport.server){
+            //Listen to any address, on the client port number
+            trans_priv->connections++;
+
+            new_priv->rd_fd      = new_socket();
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
+            sock_wait_bind(new_priv->rd_fd, &addr, "MCAST server");
+
+            //Everyone shares the one group socket
+            new_priv->wr_fd      = trans_priv->group_fd;
+            new_priv->owns_wr_fd = false;
+        }
+        else{
+
+            //Listen to the group on the server port
+            new_priv->rd_fd      = new_socket();
+            addr.sin_addr.s_addr = INADDR_ANY;
+            addr.sin_port        = htons(trans_priv->transport.port);
+            sock_wait_bind(new_priv->rd_fd, &addr, "MCAST server");
+
+            struct ip_mreqn mreq;
+            memset(&mreq,0,sizeof(mreq));
+            mreq.imr_multiaddr = trans_priv->group;
+            mreq.imr_ifindex   = trans_priv->ifindex;
+            if(setsockopt(new_priv->rd_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))){
+                ch_log_fatal("Could not join multicast group %s on %s: %s\n",
+                        trans_priv->transport.mcast_group, trans_priv->transport.iface, strerror(errno));
+            }
+
+            //Send to the server on the server port
+            new_priv->wr_fd      = new_socket();
+            new_priv->owns_wr_fd = true;
+            addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
+            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
+            safe_connect(new_priv->wr_fd,&addr);
+        }
+
+        conn->priv = new_priv;
+
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_mcast_priv* priv = (q2pc_mcast_priv*)this->priv;
+            if(priv->group_fd > 0){ close(priv->group_fd); }
+            buff_pool_delete(priv->pool);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_mcast_priv* priv)
+{
+
+    ch_log_debug1("Constructing MCAST transport\n");
+
+    //Messages are at most msize bytes, plus whatever layered transports put in front of them
+    priv->pool = buff_pool_new(MAX(priv->transport.msize, (i64)sizeof(q2pc_msg)) + BUFF_POOL_HEADROOM);
+
+    if(!inet_aton(priv->transport.mcast_group, &priv->group) || !IN_MULTICAST(ntohl(priv->group.s_addr))){
+        ch_log_fatal("%s is not a valid multicast group address\n", priv->transport.mcast_group);
+    }
+
+    priv->ifindex = if_nametoindex(priv->transport.iface);
+    if(!priv->ifindex){
+        ch_log_fatal("Could not find interface %s: %s\n", priv->transport.iface, strerror(errno));
+    }
+
+    priv->group_fd = -1;
+    if(!priv->transport.server){
+        ch_log_debug1("Done constructing MCAST transport\n");
+        return;
+    }
+
+    priv->group_fd = new_socket();
+
+    struct ip_mreqn mreq;
+    memset(&mreq,0,sizeof(mreq));
+    mreq.imr_ifindex = priv->ifindex;
+    if(setsockopt(priv->group_fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq))){
+        ch_log_fatal("Could not set multicast interface %s on fd=%i: %s\n", priv->transport.iface, priv->group_fd, strerror(errno));
+    }
+
+    //Clients on this host need to see our messages too
+    u8 loop = 1;
+    if(setsockopt(priv->group_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))){
+        ch_log_fatal("Could not set multicast loopback on fd=%i: %s\n", priv->group_fd, strerror(errno));
+    }
+
+    u8 ttl = MAX(1, MIN(priv->transport.mcast_ttl, 255));
+    if(setsockopt(priv->group_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))){
+        ch_log_fatal("Could not set multicast TTL on fd=%i: %s\n", priv->group_fd, strerror(errno));
+    }
+
+    //Send to the group on the server port
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr   = priv->group;
+    addr.sin_port   = htons(priv->transport.port);
+    safe_connect(priv->group_fd,&addr);
+
+    ch_log_debug1("Done constructing MCAST transport\n");
+
+}
+
+
+q2pc_trans* q2pc_mcast_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate MCAST server structure\n");
+    }
+
+    q2pc_mcast_priv* priv = (q2pc_mcast_priv*)calloc(1,sizeof(q2pc_mcast_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate MCAST server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
@@ -0,0 +1,601 @@
+//sendmmsg() and recvmmsg() are GNU extensions
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_mmsg.h"
+#include "conn_vector.h"
+#include "sock_bind.h"
+#include "mailbox.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//The server uses a single socket for all clients. Writes are queued up on each connection and then sent out in one
+//sendmmsg() call when the transport is flushed. Reads are drained in bulk with recvmmsg() and handed out to per
+//connection mailboxes based on the source address of the datagram. Clients use a plain connected UDP socket.
+
+#define DRAIN_BATCH   64   //Datagrams to pull in with each recvmmsg() call
+#define SEND_BATCH    1024 //Max datagrams to push out with each sendmmsg() call (UIO_MAXIOV)
+
+struct q2pc_mmsg_priv_s;
+
+typedef struct {
+    struct q2pc_mmsg_priv_s* trans;
+    i64 idx;
+
+    int fd; //Only used by clients, the server shares the transport socket
+
+    //For the reader. The producer is whichever thread is draining the socket (serialised by the drain lock), the
+    //consumer is the thread that owns the connection.
+    mailbox mailbox;
+    i64 drain_seen;
+
+    //For the clients reader
+    void* read_buffer;
+    i64   read_buffer_used;
+    i64   read_buffer_size;
+
+    //For the writer
+    void* write_buffer;
+    i64   write_buffer_size;
+
+    bool is_connected;
+    struct sockaddr_in src_addr;
+
+} q2pc_mmsg_conn_priv;
+
+
+typedef struct q2pc_mmsg_priv_s {
+    transport_s transport;
+    int fd;
+    i64 slot_size;
+
+    //All of the server connections, in the order that they were created
+    q2pc_mmsg_conn_priv** conns;
+    i64 conns_count;
+    i64 conns_claimed;
+
+    //Source address to connection lookup table, open addressing with linear probing
+    u64* addr_keys;
+    i64* addr_conns;
+    i64  addr_table_size;
+
+    //For the drainer
+    pthread_mutex_t drain_lock;
+    volatile i64 drain_seq;
+    struct mmsghdr* rx_msgs;
+    struct iovec* rx_iovs;
+    struct sockaddr_in* rx_addrs;
+    char* rx_buffers;
+
+    //For the flusher
+    i64  tx_pending_count;
+    struct mmsghdr* tx_msgs;
+    struct iovec* tx_iovs;
+
+} q2pc_mmsg_priv;
+
+
+static inline u64 addr_key(const struct sockaddr_in* addr)
+{
+    return ((u64)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+
+//Find the connection that a datagram belongs to. Unknown senders are handed the next unclaimed connection.
+static q2pc_mmsg_conn_priv* addr_lookup(q2pc_mmsg_priv* priv, const struct sockaddr_in* addr)
+{
+    const u64 key  = addr_key(addr);
+    const i64 mask = priv->addr_table_size - 1;
+    i64 i = (i64)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+    for(; priv->addr_keys[i]; i = (i + 1) & mask){
+        if(priv->addr_keys[i] == key){
+            return priv->conns[priv->addr_conns[i]];
+        }
+    }
+
+    if(priv->conns_claimed >= priv->conns_count){
+        ch_log_warn("Datagram from unexpected address %s:%i. Ignoring\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        return NULL;
+    }
+
+    q2pc_mmsg_conn_priv* conn = priv->conns[priv->conns_claimed];
+    conn->src_addr     = *addr;
+    conn->is_connected = true;
+    ch_log_debug3("Connected %s:%i to connection %li\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), conn->idx);
+
+    priv->addr_keys[i]  = key;
+    priv->addr_conns[i] = priv->conns_claimed;
+    priv->conns_claimed++;
+
+    return conn;
+}
+
+
+//Pull in everything waiting on the server socket and hand it out to the connection mailboxes
+static int drain(q2pc_mmsg_priv* priv)
+{
+    if(pthread_mutex_trylock(&priv->drain_lock)){
+        return Q2PC_EAGAIN; //Someone else is already doing it
+    }
+
+    int result = Q2PC_EAGAIN;
+    while(1){
+        for(int i = 0; i < DRAIN_BATCH; i++){
+            priv->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        int count = recvmmsg(priv->fd, priv->rx_msgs, DRAIN_BATCH, MSG_DONTWAIT, NULL);
+        if(count < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+
+            ch_log_fatal("UDP recvmmsg failed on fd=%i with errno=%i (%s)\n",priv->fd, errno, strerror(errno));
+        }
+
+        for(int i = 0; i < count; i++){
+            if(priv->rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+                ch_log_warn("Datagram larger than %li bytes was truncated. Ignoring\n", priv->slot_size);
+                continue;
+            }
+
+            q2pc_mmsg_conn_priv* conn = addr_lookup(priv, priv->rx_addrs + i);
+            if(!conn){
+                continue;
+            }
+
+            if(!mailbox_copy(&conn->mailbox, priv->rx_iovs[i].iov_base, priv->rx_msgs[i].msg_len)){
+                ch_log_warn("Client on connection %li has sent more than its window allows. Dropping datagram\n", conn->idx);
+            }
+        }
+
+        result = Q2PC_ENONE;
+        if(count < DRAIN_BATCH){
+            break;
+        }
+    }
+
+    priv->drain_seq++;
+    pthread_mutex_unlock(&priv->drain_lock);
+    return result;
+}
+
+
+static int serv_conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+
+    if(mailbox_empty(&priv->mailbox)){
+        //Only drain if nobody else has since we last looked. This keeps it to one recvmmsg() per pass over the
+        //connections rather than one per connection.
+        const i64 drain_seq = priv->trans->drain_seq;
+        if(priv->drain_seen != drain_seq){
+            priv->drain_seen = drain_seq;
+            return Q2PC_EAGAIN;
+        }
+
+        drain(priv->trans);
+        priv->drain_seen = priv->trans->drain_seq;
+    }
+
+    if(!mailbox_peek(&priv->mailbox, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+    ch_log_debug3("Got %li bytes on connection %li\n", *len_o, priv->idx);
+
+    return Q2PC_ENONE;
+}
+
+
+static int serv_conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    mailbox_pop(&priv->mailbox);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return Q2PC_ENONE;
+}
+
+
+static int serv_flush(struct q2pc_trans_s* this);
+
+//Queue the write up. It will go out on the wire with everything else when the transport is flushed.
+static int serv_conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    q2pc_mmsg_priv* trans_priv = priv->trans;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    if(!priv->is_connected){
+        ch_log_warn("Cannot write to connection %li before the client has connected\n", priv->idx);
+        return Q2PC_EFIN;
+    }
+
+    //Every connection already has something queued, push it all out to make space
+    if(trans_priv->tx_pending_count >= trans_priv->conns_count){
+        q2pc_trans flusher = { .priv = trans_priv };
+        serv_flush(&flusher);
+    }
+
+    const i64 i = trans_priv->tx_pending_count;
+    trans_priv->tx_iovs[i].iov_base           = priv->write_buffer;
+    trans_priv->tx_iovs[i].iov_len            = len;
+    trans_priv->tx_msgs[i].msg_hdr.msg_name    = &priv->src_addr;
+    trans_priv->tx_msgs[i].msg_hdr.msg_namelen = sizeof(priv->src_addr);
+    trans_priv->tx_pending_count++;
+
+    return Q2PC_ENONE;
+}
+
+
+//Send all of the queued writes in as few system calls as possible
+static int serv_flush(struct q2pc_trans_s* this)
+{
+    q2pc_mmsg_priv* priv = (q2pc_mmsg_priv*)this->priv;
+
+    i64 sent = 0;
+    while(sent < priv->tx_pending_count){
+        const i64 count = MIN(priv->tx_pending_count - sent, SEND_BATCH);
+        int result = sendmmsg(priv->fd, priv->tx_msgs + sent, count, 0);
+        if(result < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                continue; //Keep trying until we succeed
+            }
+
+            ch_log_warn("UDP sendmmsg failed with errorno=%i: %s\n", errno, strerror(errno));
+            priv->tx_pending_count = 0;
+            return Q2PC_EFIN;
+        }
+
+        sent += result;
+    }
+
+    ch_log_debug3("Flushed %li datagrams\n", priv->tx_pending_count);
+    priv->tx_pending_count = 0;
+    return Q2PC_ENONE;
+}
+
+
+static int clnt_conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_buffer;
+        *len_o  = priv->read_buffer_used;
+        return Q2PC_ENONE;
+    }
+
+    int result = read(priv->fd, priv->read_buffer, priv->read_buffer_size);
+    if(result < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+        }
+
+        if(errno == ECONNREFUSED){
+            ch_log_warn("UDP beg read EFIN (%s)\n", strerror(errno));
+            return Q2PC_EFIN;
+        }
+
+        ch_log_fatal("udp read failed on fd=%i with errno=%i (%s)\n",priv->fd, errno, strerror(errno));
+    }
+
+    if(result == 0){
+        return Q2PC_EFIN;
+    }
+
+    priv->read_buffer_used = result;
+
+    *data_o = priv->read_buffer;
+    *len_o  = priv->read_buffer_used;
+
+    return Q2PC_ENONE;
+}
+
+
+static int clnt_conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    priv->read_buffer_used = 0;
+    return Q2PC_ENONE;
+}
+
+
+static int clnt_conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+    char* data = priv->write_buffer;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    while(len > 0){
+        i64 written =  write(priv->fd, data ,len);
+        if(written < 0){
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                continue; //Keep trying until we succeed
+            }
+
+            if(errno == ECONNREFUSED){
+                ch_log_debug3("UDP end write EFIN\n");
+                return Q2PC_EFIN;
+            }
+
+            ch_log_warn("UDP write failed with errorno=%i: %s\n", errno, strerror(errno));
+            return Q2PC_EFIN;
+        }
+        data += written;
+        len -= written;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_mmsg_conn_priv* priv = (q2pc_mmsg_conn_priv*)this->priv;
+
+            //Server connections share the transport socket and other threads may still be draining into them.
+            //The transport cleans them up when it is deleted.
+            if(priv->trans->transport.server){
+                return;
+            }
+
+            if(priv->read_buffer){ free(priv->read_buffer); }
+            if(priv->write_buffer){ free(priv->write_buffer); }
+            if(priv->fd > 0){ close(priv->fd); }
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+/***************************************************************************************************************************/
+
+
+static void* safe_calloc(i64 count, i64 size)
+{
+    void* result = calloc(count, size);
+    if(!result){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    return result;
+}
+
+
+static q2pc_mmsg_conn_priv* init_new_conn(q2pc_mmsg_priv* trans_priv, q2pc_trans_conn* conn)
+{
+    q2pc_mmsg_conn_priv* new_priv = safe_calloc(1,sizeof(q2pc_mmsg_conn_priv));
+    new_priv->trans             = trans_priv;
+    new_priv->fd                = -1;
+    new_priv->write_buffer      = safe_calloc(1,trans_priv->slot_size);
+    new_priv->write_buffer_size = trans_priv->slot_size;
+    new_priv->drain_seen        = -1;
+
+    conn->priv      = new_priv;
+    conn->beg_write = conn_beg_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = NULL; //The socket is shared, there is nothing per connection to wait on
+
+    if(trans_priv->transport.server){
+        mailbox_init(&new_priv->mailbox, mailbox_slots(&trans_priv->transport), trans_priv->slot_size);
+        conn->beg_read    = serv_conn_beg_read;
+        conn->end_read    = serv_conn_end_read;
+        conn->end_write   = serv_conn_end_write;
+    }
+    else{
+        new_priv->read_buffer      = safe_calloc(1,trans_priv->slot_size);
+        new_priv->read_buffer_size = trans_priv->slot_size;
+        conn->beg_read             = clnt_conn_beg_read;
+        conn->end_read             = clnt_conn_end_read;
+        conn->end_write            = clnt_conn_end_write;
+    }
+
+    return new_priv;
+}
+
+
+static int new_socket()
+{
+    int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_fd < 0 ){
+        ch_log_fatal("Could not create UDP socket (%s)\n", strerror(errno));
+    }
+
+    int reuse_opt = 1;
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("UDP set reuse address failed: %s\n",strerror(errno));
+    }
+
+    int flags = 0;
+    flags |= O_NONBLOCK;
+    if( fcntl(sock_fd, F_SETFL, flags) == -1){
+        ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",sock_fd,strerror(errno));
+    }
+
+    return sock_fd;
+}
+
+
+//Server connections are just slots that get bound to a client address when its first datagram turns up
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_mmsg_priv* trans_priv = (q2pc_mmsg_priv*)this->priv;
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    if(trans_priv->transport.server){
+        if(trans_priv->conns_count >= trans_priv->transport.client_count){
+            ch_log_fatal("Too many connections, expected at most %li\n", trans_priv->transport.client_count);
+        }
+
+        q2pc_mmsg_conn_priv* new_priv = init_new_conn(trans_priv, conn);
+        new_priv->idx = trans_priv->conns_count;
+        trans_priv->conns[trans_priv->conns_count] = new_priv;
+        trans_priv->conns_count++;
+
+        return Q2PC_ENONE;
+    }
+
+    q2pc_mmsg_conn_priv* new_priv = init_new_conn(trans_priv, conn);
+    new_priv->fd = new_socket();
+
+    //Send to the server on the shared server port
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
+    addr.sin_port        = htons(trans_priv->transport.port);
+    ch_log_debug3("Connecting to %i\n", ntohs(addr.sin_port));
+
+    if( connect(new_priv->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) ){
+        ch_log_fatal("UDP connect failed: %s\n",strerror(errno));
+    }
+    new_priv->is_connected = true;
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_mmsg_priv* priv = (q2pc_mmsg_priv*)this->priv;
+            for(int i = 0; i < priv->conns_count; i++){
+                mailbox_free(&priv->conns[i]->mailbox);
+                free(priv->conns[i]->write_buffer);
+                free(priv->conns[i]);
+            }
+            free(priv->conns);
+            free(priv->addr_keys);
+            free(priv->addr_conns);
+            free(priv->rx_msgs);
+            free(priv->rx_iovs);
+            free(priv->rx_addrs);
+            free(priv->rx_buffers);
+            free(priv->tx_msgs);
+            free(priv->tx_iovs);
+            if(priv->fd > 0){ close(priv->fd); }
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_mmsg_priv* priv)
+{
+
+    ch_log_debug1("Constructing UDP MMSG transport\n");
+
+    priv->fd        = -1;
+    priv->slot_size = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    if(!priv->transport.server){
+        ch_log_debug1("Done constructing UDP MMSG transport\n");
+        return;
+    }
+
+    const i64 count = MAX(priv->transport.client_count, 1);
+    priv->conns = safe_calloc(count, sizeof(q2pc_mmsg_conn_priv*));
+
+    priv->addr_table_size = 2;
+    while(priv->addr_table_size < count * 2){
+        priv->addr_table_size *= 2;
+    }
+    priv->addr_keys  = safe_calloc(priv->addr_table_size, sizeof(u64));
+    priv->addr_conns = safe_calloc(priv->addr_table_size, sizeof(i64));
+
+    priv->rx_msgs    = safe_calloc(DRAIN_BATCH, sizeof(struct mmsghdr));
+    priv->rx_iovs    = safe_calloc(DRAIN_BATCH, sizeof(struct iovec));
+    priv->rx_addrs   = safe_calloc(DRAIN_BATCH, sizeof(struct sockaddr_in));
+    priv->rx_buffers = safe_calloc(DRAIN_BATCH, priv->slot_size);
+    for(int i = 0; i < DRAIN_BATCH; i++){
+        priv->rx_iovs[i].iov_base          = priv->rx_buffers + i * priv->slot_size;
+        priv->rx_iovs[i].iov_len           = priv->slot_size;
+        priv->rx_msgs[i].msg_hdr.msg_iov    = priv->rx_iovs + i;
+        priv->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        priv->rx_msgs[i].msg_hdr.msg_name   = priv->rx_addrs + i;
+    }
+
+    priv->tx_msgs    = safe_calloc(count, sizeof(struct mmsghdr));
+    priv->tx_iovs    = safe_calloc(count, sizeof(struct iovec));
+    for(int i = 0; i < count; i++){
+        priv->tx_msgs[i].msg_hdr.msg_iov    = priv->tx_iovs + i;
+        priv->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    pthread_mutex_init(&priv->drain_lock, NULL);
+
+    //Listen to any address, on the shared server port
+    priv->fd = new_socket();
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(priv->transport.port);
+    sock_wait_bind(priv->fd, &addr, "UDP server");
+
+    ch_log_debug1("Done constructing UDP MMSG transport\n");
+
+}
+
+
+q2pc_trans* q2pc_mmsg_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate UDP MMSG server structure\n");
+    }
+
+    q2pc_mmsg_priv* priv = (q2pc_mmsg_priv*)calloc(1,sizeof(q2pc_mmsg_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate UDP MMSG server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+    if(priv->transport.server){
+        result->flush = serv_flush;
+    }
+
+    return result;
+}
@@ -0,0 +1,575 @@
+//#LINKFLAGS=-lpthread
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_nack.h"
+#include "q2pc_trans_qj.h"
+#include "q2pc_trans_mcast.h"
+#include "conn_vector.h"
+#include "../clock/q2pc_clock.h"
+#include "../trace/q2pc_trace.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//Repair layer for the broadcast transports (udp-qj and udp-mc). Every broadcast from the server carries a sequence
+//number and is kept in a history ring. Clients deliver broadcasts strictly in order, holding back anything that
+//arrives early, and send a NACK to the server for each sequence number they are missing. The server resends
+//NACKed messages to the whole group, clients drop the duplicates. If the server has been quiet for an RTO it sends
+//a small session message with the last sequence number so that clients can tell when the tail of a burst has been
+//lost. Broadcasts still cost a single send no matter how many clients there are.
+//
+//Heartbeats are paced by the RTO, but never so slowly that fewer than NACK_RETRIES of them fit inside the server's
+//wait timeout (-w). Otherwise the server would give up on a phase before a lost broadcast could be repaired. Clients
+//NACK on every heartbeat, so the server's wait sets the retry pace, whatever the clients were started with.
+
+#define HISTORY_SLOTS 1024 //Broadcasts the server keeps around for repairs
+#define HOLD_SLOTS    64   //Out of order broadcasts a client can hold on to
+#define NACK_RETRIES  4    //Repair attempts that must fit inside one wait timeout
+
+typedef enum {
+    nack_data = 0,  //A normal message
+    nack_session,   //Server heartbeat, seq is the last broadcast sent
+    nack_request,   //Client repair request, seq is the broadcast that is missing
+} nack_kind_t;
+
+typedef struct __attribute__((__packed__)) {
+    i64 seq;
+    i16 kind;
+} nack_hdr;
+
+
+struct q2pc_nack_priv_s;
+
+typedef struct {
+    i64 seq; //-1 if the slot is empty
+    i64 len;
+    i64 nack_ts_us; //When we last asked for this sequence number
+    char* data;
+} hold_slot;
+
+typedef struct {
+    q2pc_trans_conn base;
+    struct q2pc_nack_priv_s* trans;
+
+    char* write_data;
+
+    //Client side ordering
+    i64 expected_seq;
+    hold_slot hold[HOLD_SLOTS];
+    hold_slot* reading_hold; //Set if the current read came out of the hold back queue
+    bool reading_base;
+
+} q2pc_nack_conn_priv;
+
+
+typedef struct {
+    i64 seq;
+    i64 len;
+    char* data;
+} history_slot;
+
+typedef struct q2pc_nack_priv_s {
+    transport_s transport;
+    q2pc_trans* base;
+    i64 slot_size;
+    i64 repair_us; //Gap between heartbeats, and between NACKs for the same broadcast
+
+    //Server side broadcast history. The main thread adds to it, worker threads read from it to answer NACKs.
+    pthread_mutex_t lock;
+    history_slot* history;
+    volatile i64 next_seq;
+    i64 last_send_us;
+
+    //Repairs and heartbeats go out on a connection of their own so that they don't tread on the main broadcast
+    q2pc_trans_conn repair;
+    bool repair_connected;
+
+    i64 repairs;
+    i64 nacks_sent;
+
+    //Client side loss injection for testing repairs
+    unsigned drop_seed;
+    i64 drops;
+} q2pc_nack_priv;
+
+
+//Send a raw layer message on a base connection
+static int send_raw(q2pc_trans_conn* base, nack_kind_t kind, i64 seq, const char* data, i64 len)
+{
+    char* buff;
+    i64 buff_len;
+    int result = base->beg_write(base, &buff, &buff_len);
+    if(result){
+        return result;
+    }
+
+    if(len + (i64)sizeof(nack_hdr) > buff_len){
+        ch_log_fatal("NACK message of %li bytes does not fit in the base buffer (%li)\n", len + sizeof(nack_hdr), buff_len);
+    }
+
+    nack_hdr* hdr = (nack_hdr*)buff;
+    hdr->seq  = seq;
+    hdr->kind = kind;
+    if(data && len){
+        memcpy(buff + sizeof(nack_hdr), data, len);
+    }
+
+    return base->end_write(base, len + sizeof(nack_hdr));
+}
+
+
+//Must be called with the lock held
+static q2pc_trans_conn* get_repair_conn(q2pc_nack_priv* priv)
+{
+    //Connect lazily, once all of the clients have their connections, so that we don't steal anyone's port
+    if(!priv->repair_connected){
+        if(priv->base->connect(priv->base, &priv->repair)){
+            ch_log_fatal("Could not create NACK repair connection\n");
+        }
+        priv->repair_connected = true;
+    }
+
+    return &priv->repair;
+}
+
+
+static void do_repair(q2pc_nack_priv* priv, i64 seq)
+{
+    pthread_mutex_lock(&priv->lock);
+
+    history_slot* slot = priv->history + seq % HISTORY_SLOTS;
+    if(seq < 0 || seq >= priv->next_seq || slot->seq != seq){
+        ch_log_warn("Cannot repair broadcast %li, it is no longer in the history (next=%li)\n", seq, priv->next_seq);
+        pthread_mutex_unlock(&priv->lock);
+        return;
+    }
+
+    ch_log_debug2("Repairing broadcast %li\n", seq);
+    Q2PC_TRACE1(nack_repair, seq);
+    send_raw(get_repair_conn(priv), nack_data, seq, slot->data, slot->len);
+    priv->repairs++;
+
+    pthread_mutex_unlock(&priv->lock);
+}
+
+
+/***************************************************************************************************************************/
+
+static int serv_conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+
+    for(;;){
+        char* data;
+        i64 len;
+        int result = priv->base.beg_read(&priv->base, &data, &len);
+        if(result){
+            return result;
+        }
+
+        if(len < (i64)sizeof(nack_hdr)){
+            ch_log_warn("Dropping runt NACK message of %li bytes\n", len);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        nack_hdr* hdr = (nack_hdr*)data;
+        if(hdr->kind == nack_request){
+            do_repair(priv->trans, hdr->seq);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        *data_o = data + sizeof(nack_hdr);
+        *len_o  = len - sizeof(nack_hdr);
+        return Q2PC_ENONE;
+    }
+}
+
+
+static int serv_conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+    q2pc_nack_priv* trans = priv->trans;
+
+    if(len > trans->slot_size){
+        ch_log_fatal("NACK write of %li bytes is bigger than the history slot size %li\n", len, trans->slot_size);
+    }
+
+    pthread_mutex_lock(&trans->lock);
+    const i64 seq = trans->next_seq;
+    history_slot* slot = trans->history + seq % HISTORY_SLOTS;
+    memcpy(slot->data, priv->write_data, len);
+    slot->len = len;
+    slot->seq = seq;
+    trans->next_seq++;
+    trans->last_send_us = q2pc_clock_us();
+    pthread_mutex_unlock(&trans->lock);
+
+    nack_hdr* hdr = (nack_hdr*)(priv->write_data - sizeof(nack_hdr));
+    hdr->seq  = seq;
+    hdr->kind = nack_data;
+
+    return priv->base.end_write(&priv->base, len + sizeof(nack_hdr));
+}
+
+
+/***************************************************************************************************************************/
+
+static void send_nacks(q2pc_nack_conn_priv* priv, i64 upto_seq, bool heartbeat)
+{
+    const i64 now_us = q2pc_clock_us();
+    const i64 last   = MIN(upto_seq, priv->expected_seq + HOLD_SLOTS - 1);
+    for(i64 seq = priv->expected_seq; seq <= last; seq++){
+        hold_slot* slot = priv->hold + seq % HOLD_SLOTS;
+        if(slot->seq == seq){
+            continue; //Already have it
+        }
+
+        //Don't ask again until the last request has had a chance to be answered. Heartbeats are already paced.
+        if(!heartbeat && slot->nack_ts_us && now_us < slot->nack_ts_us + priv->trans->repair_us){
+            continue;
+        }
+        slot->nack_ts_us = now_us;
+
+        ch_log_debug2("Client missing broadcast %li, sending NACK\n", seq);
+        Q2PC_TRACE1(nack_request, seq);
+        if(send_raw(&priv->base, nack_request, seq, NULL, 0)){
+            ch_log_warn("Could not send NACK for broadcast %li\n", seq);
+        }
+        priv->trans->nacks_sent++;
+    }
+}
+
+
+static int clnt_conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+
+    for(;;){
+        //Anything held back that is now in order goes first
+        hold_slot* next = priv->hold + priv->expected_seq % HOLD_SLOTS;
+        if(next->seq == priv->expected_seq){
+            priv->reading_hold = next;
+            *data_o = next->data;
+            *len_o  = next->len;
+            return Q2PC_ENONE;
+        }
+
+        char* data;
+        i64 len;
+        int result = priv->base.beg_read(&priv->base, &data, &len);
+        if(result){
+            return result;
+        }
+
+        if(len < (i64)sizeof(nack_hdr)){
+            ch_log_warn("Dropping runt NACK message of %li bytes\n", len);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        nack_hdr* hdr = (nack_hdr*)data;
+        if(hdr->kind == nack_data && priv->trans->transport.nack_drop &&
+                rand_r(&priv->trans->drop_seed) % 100 < priv->trans->transport.nack_drop){
+            ch_log_debug2("Test dropping broadcast %li\n", hdr->seq);
+            priv->trans->drops++;
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        if(hdr->kind == nack_session){
+            ch_log_debug3("Server session message, last broadcast was %li\n", hdr->seq);
+            send_nacks(priv, hdr->seq, true);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        //Duplicate, we've seen this one already
+        if(hdr->seq < priv->expected_seq){
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        //Something went missing, hang on to this one if we can and ask for the rest
+        if(hdr->seq > priv->expected_seq){
+            if(hdr->seq < priv->expected_seq + HOLD_SLOTS){
+                hold_slot* slot = priv->hold + hdr->seq % HOLD_SLOTS;
+                slot->len = MIN(len - (i64)sizeof(nack_hdr), priv->trans->slot_size);
+                memcpy(slot->data, data + sizeof(nack_hdr), slot->len);
+                slot->seq = hdr->seq;
+            }
+            send_nacks(priv, hdr->seq - 1, false);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        priv->reading_base = true;
+        *data_o = data + sizeof(nack_hdr);
+        *len_o  = len - sizeof(nack_hdr);
+        return Q2PC_ENONE;
+    }
+}
+
+
+static int clnt_conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+
+    if(priv->reading_hold){
+        priv->reading_hold->seq        = -1;
+        priv->reading_hold->nack_ts_us = 0;
+        priv->reading_hold             = NULL;
+        priv->expected_seq++;
+        return Q2PC_ENONE;
+    }
+
+    if(priv->reading_base){
+        priv->reading_base = false;
+        priv->hold[priv->expected_seq % HOLD_SLOTS].nack_ts_us = 0;
+        priv->expected_seq++;
+    }
+
+    return priv->base.end_read(&priv->base);
+}
+
+
+static int clnt_conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+
+    nack_hdr* hdr = (nack_hdr*)(priv->write_data - sizeof(nack_hdr));
+    hdr->seq  = 0;
+    hdr->kind = nack_data;
+
+    return priv->base.end_write(&priv->base, len + sizeof(nack_hdr));
+}
+
+
+/***************************************************************************************************************************/
+
+static int serv_conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+    return priv->base.end_read(&priv->base);
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+    int result = priv->base.beg_write(&priv->base, data_o, len_o);
+    if(result){
+        return result;
+    }
+
+    (*data_o) += sizeof(nack_hdr);
+    (*len_o)  -= sizeof(nack_hdr);
+    priv->write_data = (*data_o);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+    return priv->base.get_fd ? priv->base.get_fd(&priv->base) : -1;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_nack_conn_priv* priv = (q2pc_nack_conn_priv*)this->priv;
+            priv->base.delete(&priv->base);
+            for(int i = 0; i < HOLD_SLOTS; i++){
+                free(priv->hold[i].data);
+            }
+            free(this->priv);
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+//Wait for all clients to connect
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_nack_priv* trans_priv = (q2pc_nack_priv*)this->priv;
+    q2pc_nack_conn_priv* conn_priv = (q2pc_nack_conn_priv*)conn->priv;
+
+    if(!conn_priv){
+        conn_priv = calloc(1,sizeof(q2pc_nack_conn_priv));
+        if(!conn_priv){
+            ch_log_fatal("Malloc failed!\n");
+        }
+        conn_priv->trans = trans_priv;
+
+        conn->priv      = conn_priv;
+        conn->beg_write = conn_beg_write;
+        conn->delete    = conn_delete;
+        conn->get_fd    = conn_get_fd;
+
+        if(trans_priv->transport.server){
+            conn->beg_read  = serv_conn_beg_read;
+            conn->end_read  = serv_conn_end_read;
+            conn->end_write = serv_conn_end_write;
+        }
+        else{
+            conn->beg_read  = clnt_conn_beg_read;
+            conn->end_read  = clnt_conn_end_read;
+            conn->end_write = clnt_conn_end_write;
+
+            for(int i = 0; i < HOLD_SLOTS; i++){
+                conn_priv->hold[i].seq  = -1;
+                conn_priv->hold[i].data = calloc(1, trans_priv->slot_size);
+                if(!conn_priv->hold[i].data){
+                    ch_log_fatal("Malloc failed!\n");
+                }
+            }
+        }
+
+        if(trans_priv->base->connect(trans_priv->base,&conn_priv->base)){
+            ch_log_fatal("Could not create broadcast base for NACK\n");
+        }
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//Let the clients know where we're up to if we've been quiet for a while, so that they can spot a lost tail
+static int serv_tick(struct q2pc_trans_s* this)
+{
+    q2pc_nack_priv* priv = (q2pc_nack_priv*)this->priv;
+    if(!priv->next_seq){
+        return Q2PC_ENONE;
+    }
+
+    const i64 now_us = q2pc_clock_us();
+    if(now_us < priv->last_send_us + priv->repair_us){
+        return Q2PC_ENONE;
+    }
+
+    pthread_mutex_lock(&priv->lock);
+    ch_log_debug2("Sending NACK session message, last broadcast was %li\n", priv->next_seq - 1);
+    int result = send_raw(get_repair_conn(priv), nack_session, priv->next_seq - 1, NULL, 0);
+    priv->last_send_us = now_us;
+    pthread_mutex_unlock(&priv->lock);
+
+    return result;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_nack_priv* priv = (q2pc_nack_priv*)this->priv;
+            if(priv->transport.server){
+                ch_log_info("NACK repairs sent=%li\n", priv->repairs);
+            }
+            else{
+                ch_log_info("NACK requests sent=%li, test drops=%li\n", priv->nacks_sent, priv->drops);
+            }
+
+            if(priv->repair_connected){
+                priv->repair.delete(&priv->repair);
+            }
+
+            if(priv->history){
+                for(int i = 0; i < HISTORY_SLOTS; i++){
+                    free(priv->history[i].data);
+                }
+                free(priv->history);
+            }
+
+            priv->base->delete(priv->base);
+            pthread_mutex_destroy(&priv->lock);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_nack_priv* priv)
+{
+    ch_log_debug1("Constructing NACK transport\n");
+
+    //The base stream needs to know where our header ends to find the message inside
+    transport_s base_transport = priv->transport;
+    base_transport.hdr_len += sizeof(nack_hdr);
+
+    switch(priv->transport.type){
+        case udp_qj: priv->base = q2pc_qj_construct(&base_transport);     break;
+        case udp_mc: priv->base = q2pc_mcast_construct(&base_transport);  break;
+        default: ch_log_fatal("NACK repair only works over broadcast transports\n");
+    }
+
+    priv->slot_size = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    priv->drop_seed = priv->transport.client_id;
+
+    //Leave room for the retries to go out strictly before the wait is up
+    priv->repair_us = priv->transport.rto_us;
+    if(priv->transport.wait_us / (NACK_RETRIES + 1) < priv->repair_us){
+        priv->repair_us = MAX(priv->transport.wait_us / (NACK_RETRIES + 1), 1);
+        ch_log_info("NACK repairs every %lius, so that %i of them fit in the %lius wait\n", priv->repair_us,
+                NACK_RETRIES, priv->transport.wait_us);
+    }
+    pthread_mutex_init(&priv->lock, NULL);
+
+    if(priv->transport.server){
+        priv->history = calloc(HISTORY_SLOTS, sizeof(history_slot));
+        if(!priv->history){
+            ch_log_fatal("Could not allocate NACK history\n");
+        }
+
+        for(int i = 0; i < HISTORY_SLOTS; i++){
+            priv->history[i].seq  = -1;
+            priv->history[i].data = calloc(1, priv->slot_size);
+            if(!priv->history[i].data){
+                ch_log_fatal("Could not allocate NACK history\n");
+            }
+        }
+    }
+
+    ch_log_debug1("Done constructing NACK transport\n");
+}
+
+
+q2pc_trans* q2pc_nack_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate NACK server structure\n");
+    }
+
+    q2pc_nack_priv* priv = (q2pc_nack_priv*)calloc(1,sizeof(q2pc_nack_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate NACK server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+    if(priv->transport.server){
+        result->tick = serv_tick;
+    }
+
+    return result;
+}
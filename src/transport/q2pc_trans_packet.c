@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_packet.h"
+#include "q2pc_trans_qj.h"
+#include "buff_pool.h"
+#include "udp_frame.h"
+#include "mailbox.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//A Q-Jump style broadcast transport where the server skips the socket layer. It owns an AF_PACKET socket with
+//TPACKET_V3 RX and TX rings mapped into user space, and builds the Ethernet/IP/UDP frames itself. Broadcasts are
+//written straight into the TX ring and kicked out with a single send() when the transport is flushed. Votes are
+//picked out by a BPF filter in the kernel, land in RX ring blocks, and are handed out to per connection mailboxes
+//by src_hostid, with no system call per packet. Frames still go through the qdisc, so Q-Jump priorities apply.
+//On the wire this is the same as udp-qj, so clients are plain udp-qj clients. Over loopback, the kernel drops the
+//frames we inject as martians unless net.ipv4.conf.lo.accept_local and net.ipv4.conf.lo.route_localnet are both 1.
+
+
+#define RX_BLOCK_SIZE   (1 << 16)
+#define RX_BLOCK_COUNT  64
+#define RX_FRAME_SIZE   2048        //Only used to size the ring, V3 packs frames into blocks as they come
+#define RX_BLOCK_TOV_MS 1           //Longest a partly full block waits before the kernel hands it over to us
+
+#define TX_BLOCK_SIZE   (1 << 16)
+#define TX_BLOCK_COUNT  4
+
+//Where the frame goes in a TX ring slot, unless PACKET_TX_HAS_OFF is set
+#define TX_DATA_OFFSET  (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct q2pc_packet_priv_s;
+
+typedef struct {
+    struct q2pc_packet_priv_s* trans;
+    i64 idx;
+
+    int sink_fd; //Holds the port open so the kernel doesn't send back port unreachables, we never read it
+
+    //For the reader. The producer is whichever thread is draining the RX ring (serialised by the drain lock), the
+    //consumer is the thread that owns the connection.
+    mailbox mailbox;
+
+    //For the writer
+    void* write_buffer;
+    i64   write_buffer_size;
+
+} q2pc_packet_conn_priv;
+
+
+typedef struct q2pc_packet_priv_s {
+    transport_s transport;
+    int fd;
+    i64 slot_size;
+    buff_pool* pool;
+
+    //All of the server connections, connection i is client i + 1. They are handed out in order as they are connected.
+    q2pc_packet_conn_priv** conns;
+    i64 conns_count;
+    i64 connections;
+
+    char* ring;
+    i64 ring_size;
+
+    //For the drainer
+    pthread_mutex_t drain_lock;
+    char* rx_ring;
+    i64 rx_block;
+
+    //For the writer and flusher, only ever used by the thread sending requests
+    char* tx_ring;
+    i64 tx_frame_size;
+    i64 tx_frame_count;
+    i64 tx_head;
+    i64 tx_pending;
+    udp_frame_hdr tx_template;
+    u16 tx_ip_id;
+
+} q2pc_packet_priv;
+
+
+//Hand a frame from the RX ring to the mailbox of the client that sent it
+static void deliver(q2pc_packet_priv* priv, const char* frame, i64 len)
+{
+    //The BPF filter has already checked that this is an unfragmented UDP datagram for one of our ports
+    i64 data_len = 0;
+    const char* data = udp_frame_payload(frame, len, &data_len);
+    if(!data){
+        return;
+    }
+
+    if(data_len < (i64)sizeof(q2pc_msg)){
+        ch_log_warn("Datagram of %li bytes is too short for a Q2PC message. Ignoring\n", data_len);
+        return;
+    }
+
+    if(data_len > priv->slot_size){
+        ch_log_warn("Datagram larger than %li bytes. Ignoring\n", priv->slot_size);
+        return;
+    }
+
+    const i64 hostid = ((const q2pc_msg*)data)->src_hostid;
+    if(hostid < 1 || hostid > priv->conns_count){
+        ch_log_warn("Datagram from unexpected client id %li, expected [1,%li]. Ignoring\n", hostid, priv->conns_count);
+        return;
+    }
+
+    q2pc_packet_conn_priv* conn = priv->conns[hostid - 1];
+    if(!mailbox_copy(&conn->mailbox, data, data_len)){
+        ch_log_warn("Client on connection %li has sent more than its window allows. Dropping datagram\n", conn->idx);
+    }
+}
+
+
+//Walk every block the kernel has handed over and give them straight back once the frames are in the mailboxes
+static void drain(q2pc_packet_priv* priv)
+{
+    if(pthread_mutex_trylock(&priv->drain_lock)){
+        return; //Someone else is already doing it
+    }
+
+    while(1){
+        struct tpacket_block_desc* block = (struct tpacket_block_desc*)(priv->rx_ring + priv->rx_block * RX_BLOCK_SIZE);
+        if(!(block->hdr.bh1.block_status & TP_STATUS_USER)){
+            break;
+        }
+        __sync_synchronize(); //Don't look at the frames until we know the kernel is done with them
+
+        struct tpacket3_hdr* pkt = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
+        for(u32 i = 0; i < block->hdr.bh1.num_pkts; i++){
+            deliver(priv, (char*)pkt + pkt->tp_mac, pkt->tp_snaplen);
+            pkt = (struct tpacket3_hdr*)((char*)pkt + pkt->tp_next_offset);
+        }
+
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        priv->rx_block = (priv->rx_block + 1) % RX_BLOCK_COUNT;
+    }
+
+    pthread_mutex_unlock(&priv->drain_lock);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_packet_conn_priv* priv = (q2pc_packet_conn_priv*)this->priv;
+
+    //Looking at the RX ring is just a memory read, so there is no need to ration it like recvmmsg()
+    if(mailbox_empty(&priv->mailbox)){
+        drain(priv->trans);
+    }
+
+    if(!mailbox_peek(&priv->mailbox, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+    ch_log_debug3("Got %li bytes on connection %li\n", *len_o, priv->idx);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_packet_conn_priv* priv = (q2pc_packet_conn_priv*)this->priv;
+    mailbox_pop(&priv->mailbox);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_packet_conn_priv* priv = (q2pc_packet_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->trans->pool);
+    }
+
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return Q2PC_ENONE;
+}
+
+
+//Ask the kernel to send everything queued up in the TX ring
+static int kick(q2pc_packet_priv* priv)
+{
+    if(!priv->tx_pending){
+        return Q2PC_ENONE;
+    }
+
+    if(send(priv->fd, NULL, 0, MSG_DONTWAIT) < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS){
+            return Q2PC_ENONE; //The frames are still in the ring, they will go with the next kick
+        }
+
+        ch_log_warn("AF_PACKET send failed with errorno=%i: %s\n", errno, strerror(errno));
+        return Q2PC_EFIN;
+    }
+
+    priv->tx_pending = 0;
+    return Q2PC_ENONE;
+}
+
+
+static struct tpacket3_hdr* next_tx_frame(q2pc_packet_priv* priv)
+{
+    //Frames don't cross blocks, so there can be a gap at the end of each one
+    const i64 frames_per_block = TX_BLOCK_SIZE / priv->tx_frame_size;
+    const i64 block            = priv->tx_head / frames_per_block;
+    const i64 frame            = priv->tx_head % frames_per_block;
+    struct tpacket3_hdr* hdr   = (struct tpacket3_hdr*)(priv->tx_ring + block * TX_BLOCK_SIZE + frame * priv->tx_frame_size);
+
+    //Wait for the kernel to finish with the slot, pushing it along if we were the ones holding it up
+    while(1){
+        const u32 status = *(volatile u32*)&hdr->tp_status;
+        if(status == TP_STATUS_AVAILABLE){
+            break;
+        }
+
+        if(status & TP_STATUS_WRONG_FORMAT){
+            ch_log_fatal("AF_PACKET rejected a badly formed frame in the TX ring\n");
+        }
+
+        if(kick(priv)){
+            return NULL;
+        }
+    }
+
+    priv->tx_head = (priv->tx_head + 1) % priv->tx_frame_count;
+    return hdr;
+}
+
+
+//Every write is a broadcast to all of the clients. It is framed into the TX ring and goes out on the next flush.
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_packet_conn_priv* conn_priv = (q2pc_packet_conn_priv*)this->priv;
+    q2pc_packet_priv* priv = conn_priv->trans;
+
+    if(len > conn_priv->write_buffer_size || len > priv->slot_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    struct tpacket3_hdr* tx_hdr = next_tx_frame(priv);
+    if(!tx_hdr){
+        buff_pool_put(priv->pool, conn_priv->write_buffer);
+        conn_priv->write_buffer = NULL;
+        return Q2PC_EFIN;
+    }
+
+    char* frame    = (char*)tx_hdr + TX_DATA_OFFSET;
+    tx_hdr->tp_len = udp_frame_build(frame, &priv->tx_template, priv->tx_ip_id++, conn_priv->write_buffer, len);
+    tx_hdr->tp_next_offset = 0;
+    __sync_synchronize(); //The frame has to be there before the kernel can see it
+    tx_hdr->tp_status      = TP_STATUS_SEND_REQUEST;
+    priv->tx_pending++;
+
+    buff_pool_put(priv->pool, conn_priv->write_buffer);
+    conn_priv->write_buffer = NULL;
+    return Q2PC_ENONE;
+}
+
+
+//The ring is shared, so there is nothing to wait on for one connection
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    (void)this;
+    return -1;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            //The rest belongs to the transport
+            q2pc_packet_conn_priv* priv = (q2pc_packet_conn_priv*)this->priv;
+            buff_pool_put(priv->trans->pool, priv->write_buffer);
+            priv->write_buffer = NULL;
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+
+//Wait for all clients to connect. Everything was set up with the transport, so clients that turn up before their
+//connection is asked for aren't lost, this just hands them out in order.
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_packet_priv* trans_priv = (q2pc_packet_priv*)this->priv;
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    if(trans_priv->connections >= trans_priv->conns_count){
+        ch_log_fatal("More connections than the %li clients the PACKET transport was set up for\n", trans_priv->conns_count);
+    }
+
+    conn->priv      = trans_priv->conns[trans_priv->connections++];
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
+
+    return Q2PC_ENONE;
+}
+
+
+static int serv_flush(struct q2pc_trans_s* this)
+{
+    q2pc_packet_priv* priv = (q2pc_packet_priv*)this->priv;
+    return kick(priv);
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_packet_priv* priv = (q2pc_packet_priv*)this->priv;
+
+            struct tpacket_stats_v3 stats = {0};
+            socklen_t stats_len = sizeof(stats);
+            if(!getsockopt(priv->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &stats_len)){
+                ch_log_info("AF_PACKET rx packets=%u drops=%u freezes=%u\n", stats.tp_packets, stats.tp_drops, stats.tp_freeze_q_cnt);
+            }
+
+            for(i64 i = 0; i < priv->conns_count; i++){
+                close(priv->conns[i]->sink_fd);
+                mailbox_free(&priv->conns[i]->mailbox);
+                free(priv->conns[i]);
+            }
+
+            munmap(priv->ring, priv->ring_size);
+            close(priv->fd);
+            pthread_mutex_destroy(&priv->drain_lock);
+            buff_pool_delete(priv->pool);
+            free(priv->conns);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+//Only let through unfragmented UDP datagrams from other hosts to the client ports [port + 1, port + client_count]
+static void attach_filter(q2pc_packet_priv* priv)
+{
+    const u32 lo = priv->transport.port + 1;
+    const u32 hi = priv->transport.port + priv->conns_count;
+
+    struct sock_filter code[] = {
+        /* 0 */ BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   PACKET_OUTGOING, 11, 0),
+        /* 2 */ BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, offsetof(struct ethhdr, h_proto)),
+        /* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   ETH_P_IP, 0, 9),
+        /* 4 */ BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, sizeof(struct ethhdr) + offsetof(struct iphdr, protocol)),
+        /* 5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_UDP, 0, 7),
+        /* 6 */ BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, sizeof(struct ethhdr) + offsetof(struct iphdr, frag_off)),
+        /* 7 */ BPF_JUMP(BPF_JMP | BPF_JSET| BPF_K,   0x1FFF, 5, 0),
+        /* 8 */ BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, sizeof(struct ethhdr)),
+        /* 9 */ BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, sizeof(struct ethhdr) + offsetof(struct udphdr, dest)),
+        /*10 */ BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,   lo, 0, 2),
+        /*11 */ BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,   hi, 1, 0),
+        /*12 */ BPF_STMT(BPF_RET | BPF_K,             0xFFFFFFFF),
+        /*13 */ BPF_STMT(BPF_RET | BPF_K,             0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if(setsockopt(priv->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))){
+        ch_log_fatal("Could not attach AF_PACKET filter: %s\n", strerror(errno));
+    }
+}
+
+
+static void setup_rings(q2pc_packet_priv* priv)
+{
+    int version = TPACKET_V3;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))){
+        ch_log_fatal("Could not set TPACKET_V3 on AF_PACKET socket: %s\n", strerror(errno));
+    }
+
+    struct tpacket_req3 rx_req;
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size      = RX_BLOCK_SIZE;
+    rx_req.tp_block_nr        = RX_BLOCK_COUNT;
+    rx_req.tp_frame_size      = RX_FRAME_SIZE;
+    rx_req.tp_frame_nr        = (RX_BLOCK_SIZE / RX_FRAME_SIZE) * RX_BLOCK_COUNT;
+    rx_req.tp_retire_blk_tov  = RX_BLOCK_TOV_MS;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req))){
+        ch_log_fatal("Could not set up AF_PACKET RX ring: %s\n", strerror(errno));
+    }
+
+    //TX rings in V3 are made of fixed size frames, just big enough for the headers and the biggest message
+    priv->tx_frame_size = TPACKET_ALIGN(TX_DATA_OFFSET + sizeof(udp_frame_hdr) + priv->slot_size);
+    if(priv->tx_frame_size > TX_BLOCK_SIZE){
+        ch_log_fatal("Messages of %li bytes are too big for the AF_PACKET TX ring\n", priv->slot_size);
+    }
+    priv->tx_frame_count = (TX_BLOCK_SIZE / priv->tx_frame_size) * TX_BLOCK_COUNT;
+
+    struct tpacket_req3 tx_req;
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = TX_BLOCK_SIZE;
+    tx_req.tp_block_nr   = TX_BLOCK_COUNT;
+    tx_req.tp_frame_size = priv->tx_frame_size;
+    tx_req.tp_frame_nr   = priv->tx_frame_count;
+    if(setsockopt(priv->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req))){
+        ch_log_fatal("Could not set up AF_PACKET TX ring: %s\n", strerror(errno));
+    }
+
+    //Both rings come from the one mapping, RX first
+    priv->ring_size = (i64)RX_BLOCK_SIZE * RX_BLOCK_COUNT + (i64)TX_BLOCK_SIZE * TX_BLOCK_COUNT;
+    priv->ring = mmap(NULL, priv->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, priv->fd, 0);
+    if(priv->ring == MAP_FAILED){
+        ch_log_fatal("Could not map AF_PACKET rings: %s\n", strerror(errno));
+    }
+
+    priv->rx_ring = priv->ring;
+    priv->tx_ring = priv->ring + (i64)RX_BLOCK_SIZE * RX_BLOCK_COUNT;
+}
+
+
+static void init(q2pc_packet_priv* priv)
+{
+
+    ch_log_debug1("Constructing PACKET transport\n");
+
+    priv->slot_size   = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    priv->pool        = buff_pool_new(priv->slot_size + BUFF_POOL_HEADROOM);
+    priv->conns_count = MAX(priv->transport.client_count, 1);
+    priv->conns       = calloc(priv->conns_count, sizeof(q2pc_packet_conn_priv*));
+    if(!priv->conns){
+        ch_log_fatal("Malloc failed!\n");
+    }
+    pthread_mutex_init(&priv->drain_lock, NULL);
+
+    for(i64 i = 0; i < priv->conns_count; i++){
+        q2pc_packet_conn_priv* conn = calloc(1,sizeof(q2pc_packet_conn_priv));
+        if(!conn){
+            ch_log_fatal("Malloc failed!\n");
+        }
+
+        mailbox_init(&conn->mailbox, mailbox_slots(&priv->transport), priv->slot_size);
+
+        conn->trans             = priv;
+        conn->idx               = i;
+        conn->write_buffer_size = buff_pool_buff_size(priv->pool);
+        conn->sink_fd           = udp_frame_sink(priv->transport.port + i + 1);
+        priv->conns[i]          = conn;
+    }
+
+    //No protocol until the filter and rings are in place, so that nothing turns up before we are ready for it
+    priv->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if(priv->fd < 0){
+        ch_log_fatal("Could not create AF_PACKET socket, this needs CAP_NET_RAW (%s)\n", strerror(errno));
+    }
+
+    //Same priority as the Q-Jump sockets, so the qdisc treats us the same
+    int priority = 7;
+    if(setsockopt(priv->fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(int)) < 0) {
+        ch_log_fatal("PACKET set priority failed: %s\n",strerror(errno));
+    }
+
+    attach_filter(priv);
+    setup_rings(priv);
+    //Everything in the broadcast frame except the lengths, IP id and checksum is the same every time
+    udp_frame_template(&priv->tx_template, priv->transport.iface, priv->transport.bcast, priv->transport.port);
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family   = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex  = if_nametoindex(priv->transport.iface);
+    if(!addr.sll_ifindex){
+        ch_log_fatal("Could not find interface %s: %s\n", priv->transport.iface, strerror(errno));
+    }
+
+    if(bind(priv->fd, (struct sockaddr*)&addr, sizeof(addr))){
+        ch_log_fatal("Could not bind AF_PACKET socket to %s: %s\n", priv->transport.iface, strerror(errno));
+    }
+
+    ch_log_debug1("Done constructing PACKET transport\n");
+
+}
+
+
+q2pc_trans* q2pc_packet_construct(const transport_s* transport)
+{
+    //Nothing changes on the wire, so clients don't need to know
+    if(!transport->server){
+        return q2pc_qj_construct(transport);
+    }
+
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate PACKET server structure\n");
+    }
+
+    q2pc_packet_priv* priv = (q2pc_packet_priv*)calloc(1,sizeof(q2pc_packet_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate PACKET server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->flush         = serv_flush;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
@@ -0,0 +1,8 @@
+#ifndef Q2PC_TRANS_PACKET_H_
+#define Q2PC_TRANS_PACKET_H_
+
+#include "q2pc_transport.h"
+
+q2pc_trans* q2pc_packet_construct(const transport_s* transport);
+
+#endif /* Q2PC_TRANS_PACKET_H_ */
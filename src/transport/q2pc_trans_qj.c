@@ -18,6 +18,9 @@
 
 #include "q2pc_trans_qj.h"
 #include "conn_vector.h"
+#include "buff_pool.h"
+#include "udp_shard.h"
+#include "sock_bind.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
@@ -25,6 +28,8 @@ typedef struct {
     int wr_fd; //Writing file descriptor
     int rd_fd; //Reading file descriptor
 
+    buff_pool* pool; //Shared by all connections on the transport
+
     //For the reader
     void* read_buffer;
     i64   read_buffer_used;
@@ -35,6 +40,10 @@ typedef struct {
     i64   write_buffer_used;
     i64   write_buffer_size;
 
+    //When sharding, reads come in through the shared sockets instead of rd_fd
+    udp_shard_set* shards;
+    i64 shard_idx;
+
 } q2pc_qj_conn_priv;
 
 
@@ -43,10 +52,19 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
     if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_buffer;
+        *len_o  = priv->read_buffer_used;
         return Q2PC_ENONE;
     }
 
+    priv->read_buffer = buff_pool_get(priv->pool);
+
     int result = read(priv->rd_fd, priv->read_buffer, priv->read_buffer_size);
+    if(result <= 0){
+        buff_pool_put(priv->pool, priv->read_buffer); //Same as udp-ln, don't hold a buffer while idle
+        priv->read_buffer = NULL;
+    }
+
     if(result < 0){
         if(errno == EAGAIN || errno == EWOULDBLOCK){
             return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
@@ -72,6 +90,13 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
 static int conn_end_read(struct q2pc_trans_conn_s* this)
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+
+    //Only give the buffer back once a message has been consumed
+    if(priv->read_buffer_used){
+        buff_pool_put(priv->pool, priv->read_buffer);
+        priv->read_buffer = NULL;
+    }
+
     priv->read_buffer_used = 0;
     return 0;
 }
@@ -81,6 +106,10 @@ static int conn_end_read(struct q2pc_trans_conn_s* this)
 static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->pool);
+    }
+
     *data_o = priv->write_buffer;
     *len_o  = priv->write_buffer_size;
     return 0;
@@ -105,8 +134,32 @@ static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
         len -= written;
     }
 
+    buff_pool_put(priv->pool, priv->write_buffer);
+    priv->write_buffer = NULL;
+    return 0;
+
+}
+
+
+static int conn_beg_read_shard(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    return udp_shard_read(priv->shards, priv->shard_idx, data_o, len_o);
+}
+
+
+static int conn_end_read_shard(struct q2pc_trans_conn_s* this)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    udp_shard_release(priv->shards, priv->shard_idx);
     return 0;
+}
 
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
+    return priv->rd_fd;
 }
 
 
@@ -115,8 +168,8 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
     if(this){
         if(this->priv){
             q2pc_qj_conn_priv* priv = (q2pc_qj_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            //if(priv->write_buffer){ free(priv->write_buffer); } --Not necessary since r+w are allocated together
+            buff_pool_put(priv->pool, priv->read_buffer);
+            buff_pool_put(priv->pool, priv->write_buffer);
             free(this->priv);
         }
 
@@ -134,37 +187,30 @@ typedef struct {
     transport_s transport;
 
     i64 connections;
+    buff_pool* pool;
+    udp_shard_set* shards; //Server only, when sharding
 
 } q2pc_qj_priv;
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
-static q2pc_qj_conn_priv* new_conn_priv()
+static q2pc_qj_conn_priv* new_conn_priv(buff_pool* pool)
 {
     q2pc_qj_conn_priv* new_priv = calloc(1,sizeof(q2pc_qj_conn_priv));
     if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
 
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
-
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
-
+    //Buffers come out of the pool as they are needed
+    new_priv->pool              = pool;
+    new_priv->read_buffer_size  = buff_pool_buff_size(pool);
+    new_priv->write_buffer_size = buff_pool_buff_size(pool);
 
     return new_priv;
-
 }
 
-static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn, buff_pool* pool)
 {
-    q2pc_qj_conn_priv* new_priv = new_conn_priv();
+    q2pc_qj_conn_priv* new_priv = new_conn_priv(pool);
 
 
     conn->priv      = new_priv;
@@ -173,6 +219,7 @@ static q2pc_qj_conn_priv* init_new_conn(q2pc_trans_conn* conn)
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
     conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
 
     return new_priv;
 }
@@ -188,34 +235,6 @@ static void safe_connect(int fd, struct sockaddr_in* addr)
 }
 
 
-static void safe_wait_bind(int fd, struct sockaddr_in* addr)
-{
-
-    ch_log_debug3("Binding on %i port=%i\n", fd, ntohs(addr->sin_port));
-
-    if(bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) ){
-        uint64_t i = 0;
-
-        //Will wait up to two minutes trying if the address is in use.
-        //Helpful for quick restarts of apps as Linux keeps some state
-        //around for a while.
-        const int64_t seconds_per_try = 5;
-        const int64_t seconds_total = 120;
-        for(i = 0; i < seconds_total / seconds_per_try && errno == EADDRINUSE; i++){
-            ch_log_debug1("%i] %s --> sleeping for %i seconds...\n",i, strerror(errno), seconds_per_try);
-            sleep(seconds_per_try);
-            bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-        }
-
-        if(errno){
-            ch_log_fatal("QJ server bind failed: %s\n",strerror(errno));
-        }
-        else{
-            ch_log_debug1("Successfully bound after delay.\n");
-        }
-    }
-
-}
 
 static int new_socket()
 {
@@ -255,23 +274,38 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 
     if(!conn_priv){
 
-        q2pc_qj_conn_priv* new_priv = init_new_conn(conn);
+        q2pc_qj_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
 
-        int sock_rd_fd = new_socket();
+        const bool sharded = trans_priv->transport.server && trans_priv->transport.shards;
+        int sock_rd_fd = sharded ? -1 : new_socket();
         int sock_wr_fd = new_socket();
 
         struct sockaddr_in addr;
         memset(&addr,0,sizeof(addr));
         addr.sin_family      = AF_INET;
 
-        if(trans_priv->transport.server){
-            //Listen to any address, on the client port number
+        if(sharded){
+            //Every client talks to the port after the broadcast port, the shard set works out who is who
+            if(!trans_priv->shards){
+                trans_priv->shards = udp_shard_new(&trans_priv->transport, trans_priv->transport.port + 1, trans_priv->pool);
+            }
+
+            new_priv->shards    = trans_priv->shards;
+            new_priv->shard_idx = trans_priv->connections;
+            conn->beg_read      = conn_beg_read_shard;
+            conn->end_read      = conn_end_read_shard;
             trans_priv->connections++;
+        }
 
-            addr.sin_addr.s_addr = INADDR_ANY;
-            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
-            safe_wait_bind(sock_rd_fd,&addr);
-            new_priv->rd_fd = sock_rd_fd;
+        if(trans_priv->transport.server){
+            if(!sharded){
+                //Listen to any address, on the client port number
+                trans_priv->connections++;
+
+                addr.sin_addr.s_addr = INADDR_ANY;
+                addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
+                sock_wait_bind(sock_rd_fd, &addr, "QJ server");
+            }
 
             //Send to the client(s) on the broadcast port
             addr.sin_addr.s_addr = inet_addr(trans_priv->transport.bcast);
@@ -298,11 +332,12 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
             //Listen to any address, on the server broadcast port
             addr.sin_addr.s_addr = INADDR_ANY;
             addr.sin_port        = htons(trans_priv->transport.port);
-            safe_wait_bind(sock_rd_fd,&addr);
+            sock_wait_bind(sock_rd_fd, &addr, "QJ server");
 
-            //Send to the server on the server port
+            //Send to the server on the server port, which is shared when the server is sharding
+            const i64 port_offset = trans_priv->transport.shards ? 1 : trans_priv->transport.client_id;
             addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
-            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
+            addr.sin_port        = htons(trans_priv->transport.port + port_offset);
             safe_connect(sock_wr_fd,&addr);
         }
 
@@ -322,7 +357,9 @@ static void serv_delete(struct q2pc_trans_s* this)
     if(this){
 
         if(this->priv){
-            //q2pc_qj_priv* priv = (q2pc_qj_priv*)this->priv;
+            q2pc_qj_priv* priv = (q2pc_qj_priv*)this->priv;
+            udp_shard_delete(priv->shards);
+            buff_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -332,13 +369,14 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_qj_priv* priv)
 {
 
-    (void)priv;
     ch_log_debug1("Constructing QJ transport\n");
 
+    //Messages are at most msize bytes, plus whatever layered transports put in front of them
+    priv->pool = buff_pool_new(MAX(priv->transport.msize, (i64)sizeof(q2pc_msg)) + BUFF_POOL_HEADROOM);
+
     ch_log_debug1("Done constructing QJ transport\n");
 
 }
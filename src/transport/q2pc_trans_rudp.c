@@ -13,6 +13,7 @@
  *      Author: mgrosvenor
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -22,121 +23,499 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <pthread.h>
-#include <sys/time.h>
 
 #include "q2pc_trans_rudp.h"
 #include "q2pc_trans_udp.h"
 #include "conn_vector.h"
+#include "buff_pool.h"
+#include "timer_wheel.h"
+#include "../clock/q2pc_clock.h"
+#include "../trace/q2pc_trace.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
+//Every message carries a header with its own sequence number, and a cumulative and selective ack for the other
+//direction, so acks ride along on whatever is going back the other way. When nothing is, a header on its own is sent.
+typedef struct __attribute__((packed)) {
+    i64 seq;    //Sequence number of this message, or -1 if it only carries acks
+    i64 ack;    //The next sequence number we are expecting, acks everything before it
+    u64 sack;   //Selective acks, bit n set means that ack + 1 + n has also arrived
+} rudp_hdr;
+
+#define DUPACK_THRESH 3 //Duplicate acks before we assume a message is lost and fast retransmit it
+
 typedef struct {
+    char* buff;         //Send slots hold the header followed by the message, receive slots just the message
+    i64 len;            //0 if the slot is free
+    i64 seq;
+    i64 sent_us;        //When it was last (re)sent
+    bool retransmitted;
+    bool sacked;
+} rudp_slot;
+
+
+struct q2pc_rudp_priv_s;
+
+typedef struct q2pc_rudp_conn_priv_s {
     q2pc_trans_conn base;
+    q2pc_trans_conn* conn;          //The connection we are the guts of, handed back to the caller by ready()
+    struct q2pc_rudp_priv_s* trans;
     bool is_server;
-    volatile i64 seq_no;
 
+    //The reader and the writer can be on different threads (the server reads votes on the workers), so the window
+    //state is protected by this, as is writing to the base stream, since acks can now go out from either side.
+    pthread_mutex_t mutex;
+
+    i64 window;
+    i64 slot_size;
+
+    //Send side, everything in [snd_una, snd_nxt) has been sent, but not acked
+    rudp_slot* snd;
+    volatile i64 snd_una;
+    i64 snd_nxt;
+    i64 dupacks;
+    bool write_pending;     //A slot has been handed out by beg_write, but not sent yet
+    bool ack_outstanding;   //end_write has sent the message and is waiting for room in the window
+
+    //Receive side, everything before rcv_nxt has arrived, everything before rcv_dlv has been handed up. Messages
+    //waiting to be handed up, or that arrived ahead of a gap, wait in the receive slots.
+    rudp_slot* rcv;
+    i64 rcv_nxt;
+    i64 rcv_dlv;
+    i64 ack_pending_us;     //When something arrived that we have not sent an ack for yet, 0 if nothing has
+    i64 ack_delay_us;       //How long to wait for a message to piggyback an ack on before sending one on its own
+
+    //What we have handed up, either still in the base stream's buffer, or in one of our receive slots
     char* read_data;
     i64 read_data_len;
+    bool read_base;
+    rudp_slot* read_slot;
+
+    //Adaptive retransmit timeout (Jacobson/Karels). The RTO starts at the configured value, is learned from round
+    //trip samples and backs off exponentially each time it fires, always staying inside [rto_min_us, rto_max_us].
+    volatile i64 rto_timeout_us;
+    volatile i64 rtos;      //Every time it has fired, whichever thread was driving the timer
+    i64 rto_min_us;
+    i64 rto_max_us;
+    i64 srtt_us;            //Smoothed round trip time, -1 until we have the first sample
+    i64 rttvar_us;          //Round trip time variation
+
+    //Retransmit timer for the oldest unacked message, and a place on the transport's list of connections that have
+    //had an ack arrive
+    timer_wheel_node timer;
+    bool timer_expired;
+    volatile i64 ack_queued;
+    struct q2pc_rudp_conn_priv_s* volatile ack_next;
+    i64 ready_round;
 
-    char* write_data;
+} q2pc_rudp_conn_priv;
 
-    pthread_mutex_t mutex;
 
-    struct timeval ts_start;
-    struct timeval ts_now;
-    i64 ts_start_us;
-    i64 ts_now_us;
+typedef struct q2pc_rudp_priv_s {
+    transport_s transport;
+    q2pc_trans* base;
 
-    bool ack_outstanding;
-    i64 current_seq;
+    //All of the outstanding acks are timed on a single wheel. Once the caller starts asking which connections are
+    //ready, or ticking us, the wheel is the only thing that decides when an RTO fires.
+    timer_wheel* wheel;
+    bool wheel_driven;
+    i64 ready_round;
 
-    i64 rto_timeout_us;
+    //Lock free stack of connections that have seen an ack since the last call to ready(). Pushed to by whichever
+    //thread happens to read the ack, and emptied in one go by ready().
+    q2pc_rudp_conn_priv* volatile acked;
 
-} q2pc_rudp_conn_priv;
+    //Every connection, so that they can be freed once nobody can be servicing them any more
+    q2pc_rudp_conn_priv** conns;
+    i64 conns_count;
+    i64 conns_max;
+
+    volatile i64 rtos;
+    volatile i64 fast_retransmits;
+} q2pc_rudp_priv;
 
 
 #define BARRIER()  __asm__ volatile("" ::: "memory")
 #define PAUSE()    __asm__ volatile("pause")
 
 
+//Fold a new round trip time sample into the estimate and work out the new RTO (RFC 6298)
+static void rtt_sample(q2pc_rudp_conn_priv* priv, i64 rtt_us)
+{
+    if(priv->srtt_us < 0){
+        priv->srtt_us   = rtt_us;
+        priv->rttvar_us = rtt_us / 2;
+    }
+    else{
+        const i64 err   = rtt_us - priv->srtt_us;
+        priv->rttvar_us = priv->rttvar_us + ((err < 0 ? -err : err) - priv->rttvar_us) / 4;
+        priv->srtt_us   = priv->srtt_us + err / 8;
+    }
 
-static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+    const i64 rto_us = priv->srtt_us + MAX(1, 4 * priv->rttvar_us);
+    priv->rto_timeout_us = MAX(priv->rto_min_us, MIN(rto_us, priv->rto_max_us));
+    ch_log_debug3("RTT sample=%lius srtt=%lius rttvar=%lius rto=%lius\n", rtt_us, priv->srtt_us, priv->rttvar_us, priv->rto_timeout_us);
+}
+
+
+//Let the coordinator know that this connection has something to look at, without it having to poll
+static void ack_push(q2pc_rudp_conn_priv* priv)
 {
-    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    //pthread_mutex_lock(&priv->mutex);
+    if(!__sync_bool_compare_and_swap(&priv->ack_queued, 0, 1)){
+        return; //Already on the list
+    }
 
-    //There is already data waiting, so exit early
-    if(priv->read_data && priv->read_data_len){
-        (*data_o) = priv->read_data + sizeof(priv->seq_no);
-        (*len_o)  = priv->read_data_len - sizeof(priv->seq_no);
-        //pthread_mutex_unlock(&priv->mutex);
-        return Q2PC_ENONE;
+    q2pc_rudp_priv* trans = priv->trans;
+    q2pc_rudp_conn_priv* head = NULL;
+    do{
+        head = trans->acked;
+        priv->ack_next = head;
+    } while(!__sync_bool_compare_and_swap(&trans->acked, head, priv));
+}
+
+
+/*
+ * Everything from here to the connection functions expects the connection mutex to be held
+ */
+
+//Fill in the acks for the other direction. Anything we send carries them, so there is no longer an ack pending.
+static void fill_hdr(q2pc_rudp_conn_priv* priv, rudp_hdr* hdr, i64 seq)
+{
+    hdr->seq  = seq;
+    hdr->ack  = priv->rcv_nxt;
+    hdr->sack = 0;
+    for(i64 n = 0; n < priv->window - 1; n++){
+        const i64 sack_seq = priv->rcv_nxt + 1 + n;
+        const rudp_slot* slot = &priv->rcv[sack_seq % priv->window];
+        if(slot->len && slot->seq == sack_seq){
+            hdr->sack |= 1ULL << n;
+        }
     }
 
-    int result = priv->base.beg_read(&priv->base,data_o, len_o);
+    priv->ack_pending_us = 0;
+}
+
+
+static int base_send(q2pc_rudp_conn_priv* priv, const char* buff, i64 len)
+{
+    char* data = NULL;
+    i64 data_len = 0;
+    int result = priv->base.beg_write(&priv->base, &data, &data_len);
     if(result){
+        ch_log_warn("Base stream returned error %li\n", result);
+        return result;
+    }
+
+    if(len > data_len){
+        ch_log_fatal("RUDP write of %li bytes is too big for the base stream (%li)\n", len, data_len);
+    }
+    memcpy(data, buff, len);
 
+    result = priv->base.end_write(&priv->base, len);
+    if(result){
         if(result == Q2PC_EFIN){
-            ch_log_debug3("RUDP beg read EFIN\n");
+            ch_log_debug3("RUDP end write EFIN\n");
+            return Q2PC_EFIN;
         }
 
-        if(result != Q2PC_EAGAIN && result != Q2PC_EFIN){
-            ch_log_warn("Base stream returned error %li\n", result);
-        }
+        ch_log_warn("Base stream returned error %i\n", result);
+    }
 
-        //ch_log_warn("No data exit\n");
-        priv->base.end_read(&priv->base);
-        //pthread_mutex_unlock(&priv->mutex);
-        return result;
+    return result;
+}
+
+
+static int send_ack(q2pc_rudp_conn_priv* priv)
+{
+    rudp_hdr hdr = {0};
+    fill_hdr(priv, &hdr, -1);
+    return base_send(priv, (char*)&hdr, sizeof(hdr));
+}
+
+
+static int ack_if_due(q2pc_rudp_conn_priv* priv, i64 now_us)
+{
+    if(priv->ack_pending_us && now_us - priv->ack_pending_us >= priv->ack_delay_us){
+        return send_ack(priv);
     }
 
+    return Q2PC_ENONE;
+}
 
-    i64 seq_no = *(i64*)(*data_o);
+
+static int retransmit(q2pc_rudp_conn_priv* priv, rudp_slot* slot, i64 now_us)
+{
+    //XXX HACK!
+    q2pc_msg* rto_msg = (q2pc_msg*)(slot->buff + sizeof(rudp_hdr));
     if(priv->is_server){
-        ch_log_debug3("Server got message with seq_no=%li\n", seq_no);
-        if(seq_no != priv->seq_no){
-            ch_log_debug1("Server dropping message with seq_no %li != %li\n", seq_no, priv->seq_no);
-            priv->base.end_read(&priv->base);
-            //pthread_mutex_unlock(&priv->mutex);
-            return Q2PC_EAGAIN;
+        rto_msg->c_rto++;
+        ch_log_debug3("Set c_rto to %i\n", rto_msg->c_rto) ;
+    }
+    else{
+        rto_msg->s_rto++;
+        ch_log_debug3("Set s_rto to %i\n", rto_msg->s_rto) ;
+    }
+
+    //Bring the acks up to date while we are at it
+    fill_hdr(priv, (rudp_hdr*)slot->buff, slot->seq);
+    slot->sent_us       = now_us;
+    slot->retransmitted = true;
+
+    return base_send(priv, slot->buff, slot->len);
+}
+
+
+//The oldest unacked message has timed out. Resend it and back off until we get a clean sample again.
+static int rto_fire(q2pc_rudp_conn_priv* priv, i64 now_us)
+{
+    ch_log_debug3("Retransmit timeout fired on seq_no=%li after %lius\n", priv->snd_una, priv->rto_timeout_us);
+    Q2PC_TRACE2(rdp_rto_fire, priv->snd_una, priv->rto_timeout_us);
+
+    priv->rto_timeout_us = MIN(priv->rto_timeout_us * 2, priv->rto_max_us);
+    __sync_fetch_and_add(&priv->trans->rtos, 1);
+    __sync_fetch_and_add(&priv->rtos, 1);
+    return retransmit(priv, &priv->snd[priv->snd_una % priv->window], now_us);
+}
+
+
+static void on_ack(q2pc_rudp_conn_priv* priv, const rudp_hdr* hdr, i64 now_us)
+{
+    if(hdr->ack > priv->snd_una && hdr->ack <= priv->snd_nxt){
+        //Karn's algorithm, samples from retransmitted messages are ambiguous so ignore them
+        const rudp_slot* newest = &priv->snd[(hdr->ack - 1) % priv->window];
+        if(!newest->retransmitted){
+            rtt_sample(priv, now_us - newest->sent_us);
+        }
+
+        for(i64 seq = priv->snd_una; seq < hdr->ack; seq++){
+            priv->snd[seq % priv->window].len = 0;
         }
 
-        ch_log_debug3("Seq no is now %li --> %li\n", priv->seq_no, priv->seq_no + 1);
-        priv->seq_no++;
+        ch_log_debug3("Got ack for seq=[%li,%li)\n", priv->snd_una, hdr->ack);
+        priv->snd_una = hdr->ack;
+        priv->dupacks = 0;
         BARRIER(); //Make this thread safe so that every one sees this update
+        ack_push(priv);
+    }
+    else if(hdr->seq < 0 && hdr->ack == priv->snd_una && priv->snd_una < priv->snd_nxt){
+        priv->dupacks++;
     }
-    else{
-        ch_log_debug3("Client got message with seq_no=%li\n", seq_no);
 
-        if(seq_no <= priv->seq_no){
-            ch_log_debug1("Client dropping message with seq_no=%li <= %li\n", seq_no, priv->seq_no);
-            priv->base.end_read(&priv->base);
-            //pthread_mutex_unlock(&priv->mutex);
-            return Q2PC_EAGAIN;
+    i64 highest_sacked = -1;
+    for(u64 sack = hdr->sack; sack; sack &= sack - 1){
+        const i64 seq = hdr->ack + 1 + __builtin_ctzll(sack);
+        if(seq >= priv->snd_una && seq < priv->snd_nxt){
+            priv->snd[seq % priv->window].sacked = true;
+            highest_sacked = seq;
         }
+    }
 
-        ch_log_debug3("Seq no is now %li --> %li\n", priv->seq_no, seq_no);
-        priv->seq_no = seq_no;
-        BARRIER(); //Make this thread safe so that every one sees this update
+    if(priv->dupacks == DUPACK_THRESH){
+        //Anything below the highest selective ack that has not been acked itself has probably been lost
+        ch_log_debug3("Fast retransmit from seq=%li\n", priv->snd_una);
+        const i64 hi = MAX(highest_sacked, priv->snd_una);
+        for(i64 seq = priv->snd_una; seq <= hi && seq < priv->snd_nxt; seq++){
+            rudp_slot* slot = &priv->snd[seq % priv->window];
+            if(!slot->sacked){
+                retransmit(priv, slot, now_us);
+            }
+        }
+        __sync_fetch_and_add(&priv->trans->fast_retransmits, 1);
+    }
+}
 
+
+//Returns Q2PC_ENONE if the message is the next one to hand up and nothing is queued ahead of it, so it can be handed
+//up straight out of the base stream's buffer. Otherwise it is queued in a receive slot (or dropped) and returns
+//Q2PC_EAGAIN. If queue_all is set, messages are always queued.
+static int on_data(q2pc_rudp_conn_priv* priv, const rudp_hdr* hdr, const char* data, i64 len, bool queue_all, i64 now_us)
+{
+    const i64 seq = hdr->seq;
+    if(seq < 0){
+        return Q2PC_EAGAIN; //Just acks
     }
 
-    priv->read_data     = (*data_o) ;
-    priv->read_data_len = (*len_o)  ;
+    if(seq < priv->rcv_nxt || seq >= priv->rcv_dlv + priv->window){
+        //Either a duplicate because our ack got lost, or too far ahead. Either way, tell the sender where we are.
+        ch_log_debug1("Dropping message with seq_no=%li outside of [%li,%li)\n", seq, priv->rcv_nxt, priv->rcv_dlv + priv->window);
+        send_ack(priv);
+        return Q2PC_EAGAIN;
+    }
 
-    (*data_o) = priv->read_data + sizeof(priv->seq_no);
-    (*len_o)  = priv->read_data_len - sizeof(priv->seq_no);
+    if(!queue_all && seq == priv->rcv_nxt && priv->rcv_dlv == priv->rcv_nxt){
+        priv->rcv_nxt++;
+        priv->rcv_dlv++;
+        priv->ack_pending_us = priv->ack_pending_us ? priv->ack_pending_us : now_us;
+        return Q2PC_ENONE;
+    }
 
-    //pthread_mutex_unlock(&priv->mutex);
-    return Q2PC_ENONE;
+    rudp_slot* slot = &priv->rcv[seq % priv->window];
+    if(slot->len){
+        return Q2PC_EAGAIN; //Already have it, or the slot is still being read, the sender will try again
+    }
+
+    if(len > priv->slot_size){
+        ch_log_warn("Dropping RUDP message of %li bytes, too big for a receive slot (%li)\n", len, priv->slot_size);
+        return Q2PC_EAGAIN;
+    }
+    memcpy(slot->buff, data, len);
+    slot->len = len;
+    slot->seq = seq;
+
+    const i64 rcv_nxt = priv->rcv_nxt;
+    while(priv->rcv[priv->rcv_nxt % priv->window].len && priv->rcv[priv->rcv_nxt % priv->window].seq == priv->rcv_nxt){
+        priv->rcv_nxt++;
+    }
+
+    //Arriving ahead of a gap means something was lost, let the sender know straight away so it can fast retransmit
+    if(seq != rcv_nxt){
+        send_ack(priv);
+    }
+    else{
+        priv->ack_pending_us = priv->ack_pending_us ? priv->ack_pending_us : now_us;
+    }
+
+    return Q2PC_EAGAIN;
+}
+
+
+/*
+ * Connection functions
+ */
+
+//Hand up the next message if it is waiting in a receive slot
+static bool deliver_slot(q2pc_rudp_conn_priv* priv, char** data_o, i64* len_o)
+{
+    pthread_mutex_lock(&priv->mutex);
+    rudp_slot* slot = &priv->rcv[priv->rcv_dlv % priv->window];
+    if(!slot->len || slot->seq != priv->rcv_dlv){
+        pthread_mutex_unlock(&priv->mutex);
+        return false;
+    }
+
+    priv->rcv_dlv++;
+    pthread_mutex_unlock(&priv->mutex);
+
+    priv->read_slot     = slot;
+    priv->read_data     = slot->buff;
+    priv->read_data_len = slot->len;
+
+    (*data_o) = priv->read_data;
+    (*len_o)  = priv->read_data_len;
+    return true;
+}
+
+
+//Nothing to read, see if there are any timers that need looking at while we are here
+static void idle(q2pc_rudp_conn_priv* priv)
+{
+    //Once the wheel is in charge of retransmits, the only thing left for us is the delayed ack
+    const bool check_rto = !priv->trans->wheel_driven && priv->snd_una < priv->snd_nxt;
+    if(!priv->ack_pending_us && !check_rto){
+        return;
+    }
+
+    const i64 now_us = q2pc_clock_us();
+    pthread_mutex_lock(&priv->mutex);
+    ack_if_due(priv, now_us);
+    if(check_rto && priv->snd_una < priv->snd_nxt && now_us >= priv->snd[priv->snd_una % priv->window].sent_us + priv->rto_timeout_us){
+        rto_fire(priv, now_us);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+
+    //There is already data waiting, so exit early
+    if(priv->read_data){
+        (*data_o) = priv->read_data;
+        (*len_o)  = priv->read_data_len;
+        return Q2PC_ENONE;
+    }
+
+    if(deliver_slot(priv, data_o, len_o)){
+        return Q2PC_ENONE;
+    }
+
+    //Keep going until the base stream runs dry, edge triggered callers only wake up again on new data
+    while(1){
+        int result = priv->base.beg_read(&priv->base,data_o, len_o);
+        if(result){
+
+            if(result == Q2PC_EFIN){
+                ch_log_debug3("RUDP beg read EFIN\n");
+            }
+
+            if(result != Q2PC_EAGAIN && result != Q2PC_EFIN){
+                ch_log_warn("Base stream returned error %li\n", result);
+            }
+
+            priv->base.end_read(&priv->base);
+            if(result == Q2PC_EAGAIN){
+                idle(priv);
+            }
+            return result;
+        }
 
+        if(*len_o < (i64)sizeof(rudp_hdr)){
+            ch_log_warn("Dropping runt RUDP message of %li bytes\n", *len_o);
+            priv->base.end_read(&priv->base);
+            continue;
+        }
+
+        const rudp_hdr* hdr = (rudp_hdr*)(*data_o);
+        const char* data    = (*data_o) + sizeof(rudp_hdr);
+        const i64 len       = (*len_o) - sizeof(rudp_hdr);
+        const i64 now_us    = q2pc_clock_us();
+        ch_log_debug3("Got message with seq_no=%li ack=%li sack=%lx\n", hdr->seq, hdr->ack, hdr->sack);
+
+        pthread_mutex_lock(&priv->mutex);
+        on_ack(priv, hdr, now_us);
+        result = on_data(priv, hdr, data, len, false, now_us);
+        pthread_mutex_unlock(&priv->mutex);
+
+        if(result == Q2PC_ENONE){
+            priv->read_base     = true;
+            priv->read_data     = (char*)data;
+            priv->read_data_len = len;
+
+            (*data_o) = priv->read_data;
+            (*len_o)  = priv->read_data_len;
+            return Q2PC_ENONE;
+        }
+
+        priv->base.end_read(&priv->base);
 
+        //That may have filled the gap in front of a queued message
+        if(deliver_slot(priv, data_o, len_o)){
+            return Q2PC_ENONE;
+        }
+    }
+
+    //Unreachable
+    return Q2PC_EAGAIN;
 }
 
+
 static int conn_end_read(struct q2pc_trans_conn_s* this)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    int result = priv->base.end_read(&priv->base);
+    int result = Q2PC_ENONE;
+
+    if(priv->read_base){
+        result = priv->base.end_read(&priv->base);
+        priv->read_base = false;
+    }
+
+    if(priv->read_slot){
+        pthread_mutex_lock(&priv->mutex);
+        priv->read_slot->len = 0;
+        pthread_mutex_unlock(&priv->mutex);
+        priv->read_slot = NULL;
+    }
 
     priv->read_data     = NULL;
     priv->read_data_len = 0;
@@ -145,140 +524,200 @@ static int conn_end_read(struct q2pc_trans_conn_s* this)
 }
 
 
-static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+//Read everything waiting in the base stream, for the acks. Any messages are queued up for beg_read to hand up later.
+static int pump(q2pc_rudp_conn_priv* priv)
 {
-    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-    int result = priv->base.beg_write(&priv->base, data_o, len_o);
-    if(result){
-        ch_log_warn("Base stream returned error %li\n", result);
-        return result;
+    //The base stream would just give us the same message back again
+    if(priv->read_base){
+        return Q2PC_ENONE;
     }
 
+    while(1){
+        char* rd_data = NULL;
+        i64 rd_len = 0;
+        int result = priv->base.beg_read(&priv->base, &rd_data, &rd_len);
+        if(result){
+            priv->base.end_read(&priv->base);
+            return result == Q2PC_EAGAIN ? Q2PC_ENONE : result;
+        }
 
-    i64* seq_no = (i64*)(*data_o);
-    *seq_no = priv->seq_no;
+        if(rd_len >= (i64)sizeof(rudp_hdr)){
+            const rudp_hdr* hdr = (rudp_hdr*)rd_data;
+            const i64 now_us    = q2pc_clock_us();
+            pthread_mutex_lock(&priv->mutex);
+            on_ack(priv, hdr, now_us);
+            on_data(priv, hdr, rd_data + sizeof(rudp_hdr), rd_len - sizeof(rudp_hdr), true, now_us);
+            pthread_mutex_unlock(&priv->mutex);
+        }
 
-    if(priv->is_server){
-        ch_log_debug3("Server made message with seq_no=%li\n", *seq_no);
-    }
-    else{
-        ch_log_debug3("Client made message with seq_no=%li\n", *seq_no);
+        priv->base.end_read(&priv->base);
     }
 
+    //Unreachable
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+
+    //end_write only returns once there is room in the window, so this should never happen
+    if(priv->snd_nxt - priv->snd_una >= priv->window){
+        ch_log_warn("RUDP send window is full (%li messages)\n", priv->window);
+        return Q2PC_EAGAIN;
+    }
 
-    (*data_o) += sizeof(priv->seq_no);
-    (*len_o)  -= sizeof(priv->seq_no);
-    priv->write_data = (*data_o);
+    rudp_slot* slot = &priv->snd[priv->snd_nxt % priv->window];
+    ch_log_debug3("Made message with seq_no=%li\n", priv->snd_nxt);
 
+    (*data_o) = slot->buff + sizeof(rudp_hdr);
+    (*len_o)  = priv->slot_size - sizeof(rudp_hdr);
+    priv->write_pending = true;
 
     return Q2PC_ENONE;
 }
 
 
+//Sends the message and then returns Q2PC_ENONE as soon as there is room in the window for another. With a window of
+//1, that means waiting for it to be acked (stop-and-wait). While waiting, returns Q2PC_EAGAIN, or Q2PC_RTOFIRED if it
+//had to retransmit.
 static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
 {
     q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
 
-    if(!priv->ack_outstanding){
-        ch_log_debug3("Committing write to base stream\n");
-        int result = priv->base.end_write(&priv->base, len + sizeof(priv->seq_no));
-
-        if(result){
-            ch_log_warn("Base stream returned error %li\n", result);
-            return result;
+    if(priv->write_pending){
+        if(len + (i64)sizeof(rudp_hdr) > priv->slot_size){
+            ch_log_fatal("RUDP write of %li bytes is too big for the send window (%li)\n", len, priv->slot_size - sizeof(rudp_hdr));
         }
 
-        gettimeofday(&priv->ts_start, NULL);
-        priv->ts_start_us = priv->ts_start.tv_sec * 1000 * 1000 + priv->ts_start.tv_usec;
-        ch_log_debug3("Time now = %li\n", priv->ts_start_us);
-        priv->current_seq = priv->seq_no;
+        const i64 now_us = q2pc_clock_us();
+        pthread_mutex_lock(&priv->mutex);
+        rudp_slot* slot     = &priv->snd[priv->snd_nxt % priv->window];
+        slot->seq           = priv->snd_nxt;
+        slot->len           = len + sizeof(rudp_hdr);
+        slot->sent_us       = now_us;
+        slot->retransmitted = false;
+        slot->sacked        = false;
+        fill_hdr(priv, (rudp_hdr*)slot->buff, slot->seq);
+
+        const bool first = priv->snd_una == priv->snd_nxt;
+        priv->snd_nxt++;
 
+        ch_log_debug3("Committing write of seq_no=%li to base stream\n", slot->seq);
+        int result = base_send(priv, slot->buff, slot->len);
+        pthread_mutex_unlock(&priv->mutex);
+
+        priv->write_pending   = false;
         priv->ack_outstanding = true;
+        priv->timer_expired   = false;
+        if(first){
+            timer_wheel_arm(priv->trans->wheel, &priv->timer, now_us + priv->rto_timeout_us);
+        }
 
+        if(result){
+            return result;
+        }
     }
 
-    //Try to stimulate a a seq_no change
+    if(!priv->ack_outstanding){
+        return Q2PC_ENONE;
+    }
+
+    //Try to stimulate an ack, the client has nobody else reading for it
     if(priv->is_server) {
-        char* rd_data;
-        i64 rd_len;
-        int result = conn_beg_read(this,&rd_data,&rd_len);
-        if(result == Q2PC_EFIN){
-            return result;
+        if(pump(priv) == Q2PC_EFIN){
+            return Q2PC_EFIN;
         }
     }
 
-    if(priv->current_seq != priv->seq_no){
-        ch_log_debug3("Got ack for seq=%li\n", priv->current_seq);
+    if(priv->snd_nxt - priv->snd_una < priv->window){
         priv->ack_outstanding = false;
+        priv->timer_expired   = false;
+        if(priv->snd_una == priv->snd_nxt){
+            timer_wheel_cancel(&priv->timer);
+        }
         return Q2PC_ENONE; //Winner!
     }
 
-    gettimeofday(&priv->ts_now, NULL);
-    priv->ts_now_us = priv->ts_now.tv_sec * 1000 * 1000 + priv->ts_now.tv_usec;
-    if(priv->ts_now_us < priv->ts_start_us + priv->rto_timeout_us){
-        return Q2PC_EAGAIN;
+    //Once the wheel is in charge we are only called when the timer has expired or an ack has arrived, otherwise we
+    //have to go and look at the clock ourselves
+    const i64 now_us = q2pc_clock_us();
+    pthread_mutex_lock(&priv->mutex);
+    if(priv->trans->wheel_driven){
+        if(!priv->timer_expired){
+            pthread_mutex_unlock(&priv->mutex);
+            return Q2PC_EAGAIN;
+        }
     }
+    else{
+        ack_if_due(priv, now_us);
+        if(now_us < priv->snd[priv->snd_una % priv->window].sent_us + priv->rto_timeout_us){
+            pthread_mutex_unlock(&priv->mutex);
+            return Q2PC_EAGAIN;
+        }
+    }
+    priv->timer_expired = false;
 
-    ch_log_debug3("Time now %li > %li (diff=%li > %li)\n", priv->ts_now_us, priv->ts_start_us, priv->ts_now_us - priv->ts_start_us, priv->rto_timeout_us);
-
-    //ch_log_warn("Retransmit timeout fired on seq_no=%lu\n", priv->seq_no);
+    int result = rto_fire(priv, now_us);
+    pthread_mutex_unlock(&priv->mutex);
 
-    //XXX HACK!
-    if(priv->is_server){
-        ((q2pc_msg*)priv->write_data)->c_rto++;
-        ch_log_debug3("Set c_rto to %i\n", ((q2pc_msg*)priv->write_data)->c_rto) ;
-    }
-    else{
-        ((q2pc_msg*)priv->write_data)->s_rto++;
-        ch_log_debug3("Set s_rto to %i\n", ((q2pc_msg*)priv->write_data)->s_rto) ;
+    timer_wheel_arm(priv->trans->wheel, &priv->timer, now_us + priv->rto_timeout_us);
+    if(result == Q2PC_EFIN){
+        return Q2PC_EFIN;
     }
 
-    int result = priv->base.end_write(&priv->base, len + sizeof(priv->seq_no));
-    if(result){
+    return Q2PC_RTOFIRED;
+}
 
-        if(result == Q2PC_EFIN){
-            ch_log_debug3("RUDP end write EFIN\n");
-            return Q2PC_EFIN;
-        }
 
-        ch_log_warn("Base stream returned error %i\n", result);
-    }
+static i64 conn_get_rto(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return priv->rto_timeout_us;
+}
 
-    gettimeofday(&priv->ts_start, NULL);
-    priv->ts_start_us = priv->ts_start.tv_sec * 1000 * 1000 + priv->ts_start.tv_usec;
-    ch_log_debug3("Time now = %li\n", priv->ts_start_us);
 
-    return Q2PC_RTOFIRED;
+static i64 conn_get_rtos(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return __atomic_load_n(&priv->rtos, __ATOMIC_RELAXED);
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
+    return priv->base.get_fd ? priv->base.get_fd(&priv->base) : -1;
 }
 
 
 static void conn_delete(struct q2pc_trans_conn_s* this)
 {
-    if(this){
-        if(this->priv){
-            q2pc_rudp_conn_priv* priv = (q2pc_rudp_conn_priv*)this->priv;
-            priv->base.delete(&priv->base);
-            free(this->priv);
-        }
+    //Connections sit on the shared timer wheel and the acked list, which the coordinator may still be servicing
+    //while the workers shut down. The transport cleans them up when it is deleted.
+    (void)this;
+}
+
 
-        //XXX HACK!
-        //free(this);
+static void conn_free(q2pc_rudp_conn_priv* priv)
+{
+    priv->base.delete(&priv->base);
+    if(priv->snd){
+        free(priv->snd[0].buff);
     }
+    free(priv->snd);
+    free(priv->rcv);
+    pthread_mutex_destroy(&priv->mutex);
+    free(priv);
 }
 
 
 
 /***************************************************************************************************************************/
 
-typedef struct {
 
-    transport_s transport;
-    q2pc_trans* base;
-} q2pc_rudp_priv;
 
-
-
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
 static q2pc_rudp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
 {
     q2pc_rudp_conn_priv* new_priv = calloc(1,sizeof(q2pc_rudp_conn_priv));
@@ -292,6 +731,10 @@ static q2pc_rudp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
     conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
+    conn->get_rto   = conn_get_rto;
+    conn->get_rtos  = conn_get_rtos;
+    new_priv->conn  = conn;
 
     return new_priv;
 }
@@ -306,15 +749,40 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 
     if(!conn_priv){
         conn_priv                   = init_new_conn(conn);
+        conn_priv->trans            = trans_priv;
         conn_priv->is_server        = !trans_priv->transport.server;
-        conn_priv->seq_no           = conn_priv->is_server ? 0 : -1; //Set to -1 for clients
+        conn_priv->window           = MAX(1, MIN(trans_priv->transport.rdp_window, Q2PC_RUDP_MAX_WINDOW));
+        conn_priv->slot_size        = MAX(trans_priv->transport.msize, (i64)sizeof(q2pc_msg)) + BUFF_POOL_HEADROOM;
         conn_priv->read_data        = NULL;
         conn_priv->read_data_len    = 0;
-        conn_priv->rto_timeout_us   = trans_priv->transport.rto_us;
+        conn_priv->rto_min_us       = trans_priv->transport.rto_min_us;
+        conn_priv->rto_max_us       = MAX(trans_priv->transport.rto_max_us, conn_priv->rto_min_us);
+        conn_priv->rto_timeout_us   = MAX(conn_priv->rto_min_us, MIN(trans_priv->transport.rto_us, conn_priv->rto_max_us));
+        conn_priv->srtt_us          = -1;
+        conn_priv->rttvar_us        = 0;
+        conn_priv->ack_delay_us     = conn_priv->rto_min_us / 2;
         conn_priv->ack_outstanding  = false;
+        pthread_mutex_init(&conn_priv->mutex, NULL);
+
+        //One block of buffers for both windows, send slots first
+        conn_priv->snd = (rudp_slot*)calloc(conn_priv->window, sizeof(rudp_slot));
+        conn_priv->rcv = (rudp_slot*)calloc(conn_priv->window, sizeof(rudp_slot));
+        char* buffs    = (char*)calloc(2 * conn_priv->window, conn_priv->slot_size);
+        if(!conn_priv->snd || !conn_priv->rcv || !buffs){
+            ch_log_fatal("Malloc failed!\n");
+        }
+        for(i64 i = 0; i < conn_priv->window; i++){
+            conn_priv->snd[i].buff = buffs + i * conn_priv->slot_size;
+            conn_priv->rcv[i].buff = buffs + (conn_priv->window + i) * conn_priv->slot_size;
+        }
 
         conn->priv           = conn_priv;
 
+        if(trans_priv->conns_count >= trans_priv->conns_max){
+            ch_log_fatal("Too many RUDP connections, expected at most %li\n", trans_priv->conns_max);
+        }
+        trans_priv->conns[trans_priv->conns_count++] = conn_priv;
+
         if(trans_priv->base->connect(trans_priv->base,&conn_priv->base)){
             ch_log_fatal("Could not create UDP base for RUDP\n");
         }
@@ -324,13 +792,123 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 }
 
 
+typedef struct {
+    q2pc_trans_conn** conns; //NULL when ticking, expired timers are dealt with straight away
+    i64 max;
+    i64 count;
+    i64 round;
+    i64 now_us;
+} ready_list;
+
+
+static void ready_add(ready_list* list, q2pc_rudp_conn_priv* conn_priv)
+{
+    if(!list->conns){
+        return;
+    }
+
+    //A connection can have its ack arrive and its timer expire in the same round, only hand it out once
+    if(conn_priv->ready_round == list->round){
+        return;
+    }
+    conn_priv->ready_round = list->round;
+
+    if(list->count >= list->max){
+        ch_log_fatal("More ready RUDP connections than space to return them (%li)\n", list->max);
+    }
+    list->conns[list->count++] = conn_priv->conn;
+}
+
+
+static void on_expired(timer_wheel_node* node, void* arg)
+{
+    ready_list* list = (ready_list*)arg;
+    q2pc_rudp_conn_priv* conn_priv = (q2pc_rudp_conn_priv*)((char*)node - offsetof(q2pc_rudp_conn_priv, timer));
+
+    //If the caller is waiting in end_write, let it do the retransmit so that it can count it
+    if(list->conns && conn_priv->ack_outstanding){
+        conn_priv->timer_expired = true;
+        ready_add(list, conn_priv);
+        return;
+    }
+
+    pthread_mutex_lock(&conn_priv->mutex);
+    if(conn_priv->snd_una < conn_priv->snd_nxt){
+        rto_fire(conn_priv, list->now_us);
+        timer_wheel_arm(conn_priv->trans->wheel, &conn_priv->timer, list->now_us + conn_priv->rto_timeout_us);
+    }
+    pthread_mutex_unlock(&conn_priv->mutex);
+}
+
+
+//Catch up with the acks that have arrived, moving each connection's timer on to its oldest unacked message, and
+//then run any timers that have expired
+static void service(q2pc_rudp_priv* priv, ready_list* list)
+{
+    priv->wheel_driven = true;
+    list->now_us       = q2pc_clock_us();
+
+    q2pc_rudp_conn_priv* conn_priv = __sync_lock_test_and_set(&priv->acked, NULL);
+    while(conn_priv){
+        q2pc_rudp_conn_priv* next = conn_priv->ack_next;
+        __sync_lock_release(&conn_priv->ack_queued); //Can go back on the list as soon as we have its next pointer
+
+        pthread_mutex_lock(&conn_priv->mutex);
+        if(conn_priv->snd_una == conn_priv->snd_nxt){
+            timer_wheel_cancel(&conn_priv->timer);
+        }
+        else{
+            const rudp_slot* oldest = &conn_priv->snd[conn_priv->snd_una % conn_priv->window];
+            timer_wheel_arm(priv->wheel, &conn_priv->timer, oldest->sent_us + conn_priv->rto_timeout_us);
+        }
+        pthread_mutex_unlock(&conn_priv->mutex);
+
+        ready_add(list, conn_priv);
+        conn_priv = next;
+    }
+
+    timer_wheel_advance(priv->wheel, list->now_us, on_expired, list);
+}
+
+
+//Hand back every connection that has had an ack arrive, or its retransmit timer expire, since we were last called
+static i64 serv_ready(struct q2pc_trans_s* this, q2pc_trans_conn** conns_o, i64 max)
+{
+    q2pc_rudp_priv* priv = (q2pc_rudp_priv*)this->priv;
+    ready_list list = { .conns = conns_o, .max = max, .count = 0, .round = ++priv->ready_round };
+    service(priv, &list);
+
+    return list.count;
+}
+
+
+//Between writes nobody is waiting in end_write, so retransmit anything that times out ourselves
+static int serv_tick(struct q2pc_trans_s* this)
+{
+    q2pc_rudp_priv* priv = (q2pc_rudp_priv*)this->priv;
+    ready_list list = { .conns = NULL };
+    service(priv, &list);
+
+    return Q2PC_ENONE;
+}
+
+
 static void serv_delete(struct q2pc_trans_s* this)
 {
     if(this){
 
         if(this->priv){
             q2pc_rudp_priv* priv = (q2pc_rudp_priv*)this->priv;
+            ch_log_info("RUDP retransmits rto=%li fast=%li\n", priv->rtos, priv->fast_retransmits);
+
+            //By now the workers have been joined, so nothing else can be touching the connections
+            for(i64 i = 0; i < priv->conns_count; i++){
+                conn_free(priv->conns[i]);
+            }
+            free(priv->conns);
+
             priv->base->delete(priv->base);
+            timer_wheel_delete(priv->wheel);
             free(this->priv);
         }
 
@@ -344,7 +922,18 @@ static void init(q2pc_rudp_priv* priv)
 {
 
     ch_log_debug1("Constructing RUDP transport\n");
-    priv->base = q2pc_udp_construct(&priv->transport);
+    //The base stream needs to know where our header ends to find the message inside
+    transport_s base_transport = priv->transport;
+    base_transport.hdr_len += sizeof(rudp_hdr);
+    priv->base = q2pc_udp_construct(&base_transport);
+    priv->wheel = timer_wheel_new(q2pc_clock_us());
+
+    //Clients only ever have the one connection to the server
+    priv->conns_max = priv->transport.server ? priv->transport.client_count : 1;
+    priv->conns     = (q2pc_rudp_conn_priv**)calloc(priv->conns_max, sizeof(q2pc_rudp_conn_priv*));
+    if(!priv->conns){
+        ch_log_fatal("Could not allocate RUDP connection list\n");
+    }
     ch_log_debug1("Done constructing RUDP transport\n");
 
 }
@@ -364,6 +953,8 @@ q2pc_trans* q2pc_rudp_construct(const transport_s* transport)
 
     result->priv          = priv;
     result->connect       = doconnect;
+    result->ready         = serv_ready;
+    result->tick          = serv_tick;
     result->delete        = serv_delete;
     memcpy(&priv->transport,transport, sizeof(transport_s));
     init(priv);
@@ -10,6 +10,8 @@
 
 #include "q2pc_transport.h"
 
+#define Q2PC_RUDP_MAX_WINDOW 64 //Selective acks cover one window past the cumulative ack in a 64 bit map
+
 q2pc_trans* q2pc_rudp_construct(const transport_s* transport);
 
 #endif /* Q2PC_TRANS_RUDP_H_ */
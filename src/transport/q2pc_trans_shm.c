@@ -0,0 +1,384 @@
+//#LINKFLAGS=-lrt
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "q2pc_trans_shm.h"
+#include "conn_vector.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//Transport for clients that live on the same machine as the server. The server creates a shared memory segment
+//named after the port with a pair of single producer single consumer rings for each client, one in each direction.
+//Client n uses ring pair n-1. Reads and writes hand out pointers straight into the ring slots, so there are no
+//copies and no system calls on the data path.
+
+#define SHM_MAGIC      0x51325043534D3032ULL //"Q2PCSM02"
+#define SHM_RING_SLOTS 256  //Must be a power of 2
+#define SHM_LINE       64   //Keep the producer and consumer counters on separate cache lines
+
+typedef struct {
+    volatile i64 head;      //Written by the producer
+    char pad0[SHM_LINE - sizeof(i64)];
+    volatile i64 tail;      //Written by the consumer
+    char pad1[SHM_LINE - sizeof(i64)];
+    volatile i64 closed;    //Set when the producer goes away
+    char pad2[SHM_LINE - sizeof(i64)];
+    i64 lens[SHM_RING_SLOTS];
+    //Followed by SHM_RING_SLOTS * slot_size bytes of slot data
+} shm_ring_t;
+
+typedef struct {
+    volatile u64 magic;     //Written last by the server, once the segment is ready to use, and cleared when it goes
+    i64 ring_count;
+    i64 slot_size;
+    i64 ring_size;
+    i64 server_pid;         //So clients can tell a live segment from one that a crashed server left behind
+    char pad[SHM_LINE - sizeof(u64) - 4 * sizeof(i64)];
+    //Followed by ring_count pairs of rings, to client then to server
+} shm_header_t;
+
+
+typedef struct {
+    shm_ring_t* rd_ring;
+    shm_ring_t* wr_ring;
+    i64 slot_size;
+
+    //Positions that have been handed out by beg_read/beg_write but not yet committed
+    i64 rd_pos;
+    i64 wr_pos;
+} q2pc_shm_conn_priv;
+
+
+typedef struct {
+    transport_s transport;
+    char name[64];
+
+    shm_header_t* header;
+    i64 segment_size;
+
+    i64 connections;
+    q2pc_trans_conn* client_conn;
+} q2pc_shm_priv;
+
+
+
+static inline char* ring_slot(shm_ring_t* ring, i64 slot_size, i64 pos)
+{
+    return (char*)(ring + 1) + (pos & (SHM_RING_SLOTS - 1)) * slot_size;
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+    shm_ring_t* ring = priv->rd_ring;
+
+    const i64 tail = ring->tail;
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail){
+        return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ? Q2PC_EFIN : Q2PC_EAGAIN;
+    }
+
+    priv->rd_pos = tail;
+    *data_o = ring_slot(ring, priv->slot_size, tail);
+    *len_o  = ring->lens[tail & (SHM_RING_SLOTS - 1)];
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+    shm_ring_t* ring = priv->rd_ring;
+
+    //Nothing was handed out
+    if(priv->rd_pos != ring->tail){
+        return Q2PC_ENONE;
+    }
+
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    priv->rd_pos = -1;
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+    shm_ring_t* ring = priv->wr_ring;
+
+    //Wait for the reader to make some space. It is on the same machine, so this won't be long.
+    const i64 head = ring->head;
+    while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= SHM_RING_SLOTS){
+        __asm__ volatile("pause");
+    }
+
+    priv->wr_pos = head;
+    *data_o = ring_slot(ring, priv->slot_size, head);
+    *len_o  = priv->slot_size;
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+    shm_ring_t* ring = priv->wr_ring;
+
+    if(len > priv->slot_size){
+        ch_log_fatal("SHM write of %li bytes is bigger than the slot size %li\n", len, priv->slot_size);
+    }
+
+    ring->lens[priv->wr_pos & (SHM_RING_SLOTS - 1)] = len;
+    __atomic_store_n(&ring->head, priv->wr_pos + 1, __ATOMIC_RELEASE);
+
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_shm_conn_priv* priv = (q2pc_shm_conn_priv*)this->priv;
+            __atomic_store_n(&priv->wr_ring->closed, 1, __ATOMIC_RELEASE);
+            free(this->priv);
+            this->priv = NULL;
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+static inline shm_ring_t* get_ring(q2pc_shm_priv* priv, i64 idx)
+{
+    return (shm_ring_t*)((char*)(priv->header + 1) + idx * priv->header->ring_size);
+}
+
+
+//Let a client conect
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_shm_priv* priv = (q2pc_shm_priv*)this->priv;
+
+    i64 pair = -1;
+    if(priv->transport.server){
+        pair = priv->connections;
+        priv->connections++;
+    }
+    else{
+        pair = priv->transport.client_id - 1;
+    }
+
+    if(pair < 0 || pair >= priv->header->ring_count){
+        ch_log_fatal("SHM connection %li is out of range, the server only has rings for %li clients\n",
+                pair + 1, priv->header->ring_count);
+    }
+
+    q2pc_shm_conn_priv* new_priv = calloc(1,sizeof(q2pc_shm_conn_priv));
+    if(!new_priv){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    shm_ring_t* to_client = get_ring(priv, pair * 2);
+    shm_ring_t* to_server = get_ring(priv, pair * 2 + 1);
+    new_priv->rd_ring   = priv->transport.server ? to_server : to_client;
+    new_priv->wr_ring   = priv->transport.server ? to_client : to_server;
+    new_priv->slot_size = priv->header->slot_size;
+    new_priv->rd_pos    = -1;
+    new_priv->wr_pos    = -1;
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = NULL; //Nothing to wait on, readers have to poll the ring
+
+    if(!priv->transport.server){
+        priv->client_conn = conn;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+        if(this->priv){
+            q2pc_shm_priv* priv = (q2pc_shm_priv*)this->priv;
+            if(priv->client_conn){
+                conn_delete(priv->client_conn);
+            }
+
+            if(priv->header){
+                if(priv->transport.server){
+                    __atomic_store_n(&priv->header->magic, 0, __ATOMIC_RELEASE);
+                }
+                munmap(priv->header, priv->segment_size);
+            }
+
+            if(priv->transport.server){
+                shm_unlink(priv->name);
+            }
+            free(this->priv);
+        }
+
+        free(this);
+    }
+}
+
+
+static void* safe_map(int fd, i64 size)
+{
+    void* result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(result == MAP_FAILED){
+        ch_log_fatal("SHM could not map %li bytes of shared memory: %s\n", size, strerror(errno));
+    }
+
+    return result;
+}
+
+
+static void init_server(q2pc_shm_priv* priv)
+{
+    const i64 slot_size  = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    const i64 ring_size  = ((sizeof(shm_ring_t) + SHM_RING_SLOTS * slot_size) + SHM_LINE - 1) & ~(SHM_LINE - 1);
+    const i64 ring_count = MAX(priv->transport.client_count, 1);
+    priv->segment_size   = sizeof(shm_header_t) + ring_count * 2 * ring_size;
+
+    //Throw away anything left over from a previous run
+    shm_unlink(priv->name);
+    int fd = shm_open(priv->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0){
+        ch_log_fatal("SHM could not create shared memory segment %s: %s\n", priv->name, strerror(errno));
+    }
+
+    if(ftruncate(fd, priv->segment_size)){
+        ch_log_fatal("SHM could not size shared memory segment %s to %li: %s\n", priv->name, priv->segment_size, strerror(errno));
+    }
+
+    //Fresh segments are zero filled, so all the rings start out empty
+    priv->header = safe_map(fd, priv->segment_size);
+    close(fd);
+
+    priv->header->ring_count = ring_count;
+    priv->header->slot_size  = slot_size;
+    priv->header->ring_size  = ring_size;
+    priv->header->server_pid = getpid();
+    __atomic_store_n(&priv->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+
+//Is the server that made a segment still running?
+static bool owner_alive(i64 pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+
+static void init_client(q2pc_shm_priv* priv)
+{
+    //The server might not be up yet, give it a while. A crashed server leaves a segment behind that looks ready, so
+    //only take one whose server is still running, and keep looking in case a new server replaces it.
+    const int64_t seconds_total = 120;
+    bool warned = false;
+    for(int64_t i = 0; i < seconds_total * 10; i++){
+        int fd = shm_open(priv->name, O_RDWR, 0600);
+        if(fd < 0){
+            if(errno != ENOENT){
+                ch_log_fatal("SHM could not open shared memory segment %s: %s\n", priv->name, strerror(errno));
+            }
+            usleep(100 * 1000);
+            continue;
+        }
+
+        //The server may not have sized it yet
+        struct stat st;
+        if(fstat(fd, &st) || st.st_size < (i64)sizeof(shm_header_t)){
+            close(fd);
+            usleep(100 * 1000);
+            continue;
+        }
+
+        //Map the header first to find out how big the whole thing is
+        shm_header_t* header   = safe_map(fd, sizeof(shm_header_t));
+        const bool ready       = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC;
+        const i64 server_pid   = header->server_pid;
+        const i64 segment_size = sizeof(shm_header_t) + header->ring_count * 2 * header->ring_size;
+        munmap(header, sizeof(shm_header_t));
+
+        if(ready && owner_alive(server_pid)){
+            priv->segment_size = segment_size;
+            priv->header       = safe_map(fd, priv->segment_size);
+            close(fd);
+            return;
+        }
+
+        if(ready && !warned){
+            ch_log_warn("SHM segment %s was left behind by server %li, which has gone. Waiting for a new server\n",
+                    priv->name, server_pid);
+            warned = true;
+        }
+
+        close(fd);
+        usleep(100 * 1000);
+    }
+
+    ch_log_fatal("SHM gave up waiting for the server to create %s\n", priv->name);
+}
+
+
+static void init(q2pc_shm_priv* priv)
+{
+    ch_log_debug1("Constructing SHM transport\n");
+
+    snprintf(priv->name, sizeof(priv->name), "/q2pc-%u", priv->transport.port);
+    if(priv->transport.server){
+        init_server(priv);
+    }
+    else{
+        init_client(priv);
+    }
+
+    ch_log_debug1("Done constructing SHM transport\n");
+}
+
+
+q2pc_trans* q2pc_shm_construct(const transport_s* transport)
+{
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate SHM server structure\n");
+    }
+
+    q2pc_shm_priv* priv = (q2pc_shm_priv*)calloc(1,sizeof(q2pc_shm_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate SHM server private structure\n");
+    }
+
+    result->priv    = priv;
+    result->connect = doconnect;
+    result->delete  = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+    return result;
+}
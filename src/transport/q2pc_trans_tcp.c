@@ -4,6 +4,9 @@
  *  Created on: Apr 9, 2014
  *      Author: mgrosvenor
  */
+//memfd_create() is a GNU extension
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -11,19 +14,25 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "q2pc_trans_tcp.h"
 #include "conn_vector.h"
+#include "buff_pool.h"
+#include "sock_tstamp.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
 typedef struct {
     int fd;
 
-    //For the reader
-    void* read_buffer;
-    i64   read_buffer_used;
-    i64   read_buffer_size;
+    buff_pool* pool; //Shared by all connections on the transport
+
+    //For the reader, a ring mapped twice back to back so that anything in it can be read contiguously
+    char* ring;
+    i64   ring_size;
+    i64   ring_head; //Next byte to hand out. Head and tail are taken mod ring_size to find offsets
+    i64   ring_tail; //Next byte to read() into
 
     //For the writer
     void* write_buffer;
@@ -31,12 +40,13 @@ typedef struct {
     i64   write_buffer_size;
 
     //For the delimiter
-    void* delim_buffer;
-    i64   delim_buffer_used;
-    i64   delim_buffer_size;
-    void* delim_result;
+    char* delim_result;
     i64   delim_result_len;
 
+    //Kernel timestamps, server only
+    i64 tstamp;
+    i64 tx_us;
+    i64 rx_us;
 
 } q2pc_tcp_conn_priv;
 
@@ -44,14 +54,18 @@ typedef struct {
 i64 delimit(char* buff, i64 len);
 
 
-static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+//Read as much as will fit straight into the free part of the ring
+static int ring_fill(q2pc_tcp_conn_priv* priv)
 {
-    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    if( priv->read_buffer && priv->read_buffer_used){
-        return Q2PC_ENONE;
+    const i64 used = priv->ring_tail - priv->ring_head;
+    const i64 space = priv->ring_size - used;
+    if(space <= 0){
+        ch_log_fatal("TCP ring of %li bytes is full without a complete message\n", priv->ring_size);
     }
 
-    int result = read(priv->fd, priv->read_buffer, priv->read_buffer_size);
+    //When a read picks up more than one message, they all get the stamp of the last segment
+    char* tail = priv->ring + priv->ring_tail % priv->ring_size;
+    int result = priv->tstamp ? sock_tstamp_recv(priv->fd, tail, space, NULL, NULL, &priv->rx_us) : read(priv->fd, tail, space);
     if(result < 0){
         if(errno == EAGAIN || errno == EWOULDBLOCK){
             return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
@@ -68,21 +82,14 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
         return Q2PC_EFIN;
     }
 
-    priv->read_buffer_used = result;
-
-    *data_o = priv->read_buffer;
-    *len_o  = priv->read_buffer_used;
-
+    ch_log_debug2("Read another %i bytes to %p\n", result, tail);
+    priv->ring_tail += result;
     return Q2PC_ENONE;
 }
 
-static int conn_end_read(struct q2pc_trans_conn_s* this)
-{
-    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-    priv->read_buffer_used = 0;
-    return Q2PC_ENONE;
-}
 
+//Messages are handed out as pointers straight into the ring. Because the ring is mapped twice, a message that wraps
+//around the end is still contiguous, so there is never any need to copy or move data around.
 static int conn_beg_delimit(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
@@ -94,70 +101,32 @@ static int conn_beg_delimit(struct q2pc_trans_conn_s* this, char** data_o, i64*
         return Q2PC_ENONE;
     }
 
-    if(priv->delim_buffer_used){
-        int64_t delimit_size = delimit(priv->delim_buffer, priv->delim_buffer_used);
-        if(delimit_size > 0 && delimit_size <= priv->delim_buffer_used){
-
-            priv->delim_result     = priv->delim_buffer;
-            priv->delim_result_len = delimit_size;
-            *data_o                = priv->delim_result;
-            *len_o                 = priv->delim_result_len;
-
-
-            return Q2PC_ENONE; //Success!!
+    //Keep reading until there is a whole message or the socket runs dry, so that edge triggered callers don't miss
+    //data that is already waiting.
+    for(;;){
+        char* head = priv->ring + priv->ring_head % priv->ring_size;
+        const i64 used = priv->ring_tail - priv->ring_head;
+        if(used){
+            i64 delimit_size = delimit(head, used);
+            if(delimit_size > 0 && delimit_size <= used){
+                priv->delim_result     = head;
+                priv->delim_result_len = delimit_size;
+                *data_o                = priv->delim_result;
+                *len_o                 = priv->delim_result_len;
+
+                ch_log_debug2("Found message size=%lu\n", *len_o);
+                return Q2PC_ENONE; //Success!!
+            }
         }
-    }
-
-    char* data;
-    i64 len;
-    int result = conn_beg_read(this, &data,&len);
-    if(result != Q2PC_ENONE){
-        return result;
-    }
-
-
-    ch_log_debug2("Read another %lu bytes to %p\n", len, data);
 
-    while(len > priv->delim_buffer_size - priv->delim_buffer_used){
-        ch_log_debug2("Growing working buffer from %lu to %lu\n", priv->delim_buffer_size, priv->delim_buffer_size * 2 );
-        priv->delim_buffer_size *= 2;
-        priv->delim_buffer = realloc(priv->delim_buffer, priv->delim_buffer_size);
-    }
-
-    ch_log_debug2("Adding %lu bytes at %p (offset=%lu)\n",
-            len,
-            (char*)priv->delim_buffer + priv->delim_buffer_used,
-            priv->delim_buffer_used
-    );
-
-    memcpy((char*)priv->delim_buffer + priv->delim_buffer_used, data, len);
-    priv->delim_buffer_used += len;
-    conn_end_read(this);
-
-    int64_t delimit_size = delimit(priv->delim_buffer, priv->delim_buffer_used);
-    if(delimit_size > 0 && delimit_size <= priv->delim_buffer_used){
-        priv->delim_result     = priv->delim_buffer;
-        *data_o                = priv->delim_buffer;
-        priv->delim_result_len = delimit_size;
-        *len_o                 = delimit_size;
-
-        ch_log_debug2("Found message size=%lu\n", *len_o);
-        return Q2PC_ENONE;
+        int result = ring_fill(priv);
+        if(result != Q2PC_ENONE){
+            return result;
+        }
     }
-
-    //This is naughty, it says there isn't any data here, try again later, which is kind of true.
-    return Q2PC_EAGAIN;
 }
 
 
-//** Warning: This is a complicated function with a lot of edge cases. It's vital to performance and
-//            correctness to get this one right!
-//
-// We enter this function as a result of a successful call to begin delimit. Begin delimit may have succeeded
-// for one of two reasons, 1) either new data was read and the delimiter was successful, or, 2) we have
-// optimistically found another delimited result in a previous call to end delimit(). In the first case,
-// priv->delimit_buffer_used is at least equal to the size of priv->delim_result_len, in the second case,
-// priv->delimit_buffer size is smaller.
 static int conn_end_delimit(struct q2pc_trans_conn_s* this)
 {
     q2pc_tcp_conn_priv* priv = this->priv;
@@ -165,63 +134,16 @@ static int conn_end_delimit(struct q2pc_trans_conn_s* this)
         return 0;
     }
 
+    priv->ring_head += priv->delim_result_len;
 
-    char* result_head_next = (char*)priv->delim_result + priv->delim_result_len;
-
-    //Handle case 1)
-    //New data was read and the delimiter was successful
-    if(priv->delim_result_len <= priv->delim_buffer_used){
-
-        //This is how much is now left over
-        priv->delim_buffer_used -= priv->delim_result_len;
-
-        //If there is nothing left over, give up and bug out
-        if(!priv->delim_buffer_used){
-            priv->delim_result_len= 0;
-            priv->delim_result= NULL;
-            return 0;
-        }
-
-        //Something is left over we can optimistically check if there happens to be another packet ready to go.
-        //The reduces the number of memmoves and significantly improves performance especially with TCP where the
-        //read size can be *huge*. (>4MB with TSO turned on)
-        i64 delimit_size = delimit(result_head_next, priv->delim_buffer_used);
-        if(delimit_size && delimit_size <= priv->delim_buffer_used){
-            //Ready for the next round with data available! No memmove required!
-            priv->delim_result = result_head_next;
-            priv->delim_result_len = delimit_size;
-            return 0;
-        }
-
-        //Nope, ok, bite the bullet and move stuff around. We'll need to call read() and get some more data
-        //printf("Doing mem move of %lu from %p to %p (total=%lu)\n", priv->delim_buffer_used, result_head_next, priv->delim_buffer, result_head_next - priv->delim_buffer);
-        memmove(priv->delim_buffer, result_head_next, priv->delim_buffer_used);
-    }
-
-    //XXX: I can't see a reason why this case would ever trigger. I know it took me a long time to write this, so something must trigger it, but I don't know what it is.
-    //Handle case 2)
-    //There is some data leftover, but less than the last result buffer size.
-    else{
-
-        //Optimistically check if there is a new packet in this left over. Remember, packets are not all the same
-        //size, so a samll packet could follow a big packet.
-        i64 delimit_size = delimit(result_head_next, priv->delim_buffer_used);
-        if(delimit_size && delimit_size <= priv->delim_buffer_used){
-            //Ready for the next round with data available! Yay! No memmove required!
-            priv->delim_result = result_head_next;
-            priv->delim_result_len = delimit_size;
-            return 0;
-        }
-
-        //Nope, ok, bite the bullet and move stuff around. We'll need to call read() and get some more data
-        //printf("Doing mem move of %lu from %p to %p (total=%lu)\n", priv->delim_buffer_used, result_head_next, priv->delim_buffer, result_head_next - priv->delim_buffer);
-        memmove(priv->delim_buffer, result_head_next, priv->delim_buffer_used);
-
+    //Keep the counters small if we can, this is free when the ring is empty
+    if(priv->ring_head == priv->ring_tail){
+        priv->ring_head = 0;
+        priv->ring_tail = 0;
     }
 
-    //Ready for the next round, there is no new delimited packet available, so reset everything and get ready for a call to read()
-    priv->delim_result_len= 0;
-    priv->delim_result= NULL;
+    priv->delim_result_len = 0;
+    priv->delim_result     = NULL;
     return 0;
 
 }
@@ -231,12 +153,23 @@ static int conn_end_delimit(struct q2pc_trans_conn_s* this)
 static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->pool);
+    }
+
     *data_o = priv->write_buffer;
     *len_o  = priv->write_buffer_size;
     return 0;
 }
 
 
+static inline void release_write(q2pc_tcp_conn_priv* priv)
+{
+    buff_pool_put(priv->pool, priv->write_buffer);
+    priv->write_buffer = NULL;
+}
+
+
 static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
 {
     q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
@@ -255,10 +188,12 @@ static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
             }
 
             if(errno == ECONNREFUSED){
+                release_write(priv);
                 return Q2PC_EFIN;
             }
 
             ch_log_warn("TCP write failed: %s\n",strerror(errno));
+            release_write(priv);
             return Q2PC_EFIN;
         }
 
@@ -266,18 +201,37 @@ static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
         len -= written;
     }
 
+    release_write(priv);
     return Q2PC_ENONE;
 
 }
 
 
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
+    return priv->fd;
+}
+
+
+//The TX stamp is for the latest request written to this client, which is the one being answered unless requests are
+//pipelined
+static void conn_get_tstamps(struct q2pc_trans_conn_s* this, i64* tx_us_o, i64* rx_us_o)
+{
+    q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
+    priv->tx_us = MAX(priv->tx_us, sock_tstamp_last_tx(priv->fd));
+    *tx_us_o = priv->tx_us;
+    *rx_us_o = priv->rx_us;
+}
+
+
 static void conn_delete(struct q2pc_trans_conn_s* this)
 {
     if(this){
         if(this->priv){
             q2pc_tcp_conn_priv* priv = (q2pc_tcp_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            if(priv->delim_buffer){ free(priv->delim_buffer); }
+            buff_pool_put(priv->pool, priv->write_buffer);
+            if(priv->ring){ munmap(priv->ring, 2 * priv->ring_size); }
             close(priv->fd);
             free(this->priv);
         }
@@ -295,6 +249,7 @@ typedef struct {
     int fd;
 
     transport_s transport;
+    buff_pool* pool;
 
 } q2pc_tcp_priv;
 
@@ -302,32 +257,52 @@ typedef struct {
 
 
 
-static q2pc_tcp_conn_priv* new_conn_priv()
+#define RING_MSGS 64 //Messages that can be waiting in a connection's read ring
+
+//Map the same memory twice, back to back, so that reads and writes that run off the end of the ring wrap around
+static char* new_mirrored_ring(i64 size)
 {
-    q2pc_tcp_conn_priv* new_priv = calloc(1,sizeof(q2pc_tcp_conn_priv));
-    if(!new_priv){
-        ch_log_fatal("Malloc failed!\n");
+    int fd = memfd_create("q2pc_tcp_ring", 0);
+    if(fd < 0){
+        ch_log_fatal("Could not create TCP ring memory (%s)\n", strerror(errno));
     }
 
-    #define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
+    if(ftruncate(fd, size)){
+        ch_log_fatal("Could not size TCP ring memory to %li (%s)\n", size, strerror(errno));
+    }
+
+    //Reserve enough address space for both copies, then map the memory over each half of it
+    char* ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED){
+        ch_log_fatal("Could not reserve %li bytes for TCP ring (%s)\n", 2 * size, strerror(errno));
+    }
+
+    if(mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED){
+        ch_log_fatal("Could not map TCP ring (%s)\n", strerror(errno));
     }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
 
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
+    close(fd);
+    return ring;
+}
 
 
-    void* working_buff = calloc(1,BUFF_SIZE);
-    if(!working_buff){
+static q2pc_tcp_conn_priv* new_conn_priv(buff_pool* pool)
+{
+    q2pc_tcp_conn_priv* new_priv = calloc(1,sizeof(q2pc_tcp_conn_priv));
+    if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
-    new_priv->delim_buffer = working_buff;
-    new_priv->delim_buffer_size = BUFF_SIZE;
+
+    //Buffers come out of the pool as they are needed
+    new_priv->pool              = pool;
+    new_priv->write_buffer_size = buff_pool_buff_size(pool);
+
+    //Room for a window's worth of messages, rounded up to whole pages so that the ring can be mirrored
+    const i64 page_size = sysconf(_SC_PAGESIZE);
+    new_priv->ring_size = RING_MSGS * buff_pool_buff_size(pool);
+    new_priv->ring_size = (new_priv->ring_size + page_size - 1) / page_size * page_size;
+    new_priv->ring      = new_mirrored_ring(new_priv->ring_size);
 
     return new_priv;
 
@@ -350,7 +325,7 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
         fd = priv->fd;
     }
 
-    q2pc_tcp_conn_priv* new_priv = new_conn_priv();
+    q2pc_tcp_conn_priv* new_priv = new_conn_priv(priv->pool);
 
     new_priv->fd = fd;
     int flags = 0;
@@ -365,6 +340,15 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
     conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
+
+    if(priv->transport.server && priv->transport.tstamp){
+        sock_tstamp_enable(fd, priv->transport.tstamp);
+        new_priv->tstamp  = priv->transport.tstamp;
+        new_priv->tx_us   = -1;
+        new_priv->rx_us   = -1;
+        conn->get_tstamps = conn_get_tstamps;
+    }
 
     return 0;
 }
@@ -376,6 +360,7 @@ static void serv_delete(struct q2pc_trans_s* this)
         if(this->priv){
             q2pc_tcp_priv* priv = (q2pc_tcp_priv*)this->priv;
             close(priv->fd);
+            buff_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -385,16 +370,12 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_tcp_priv* priv)
 {
 
     ch_log_debug1("Constructing TCP transport\n");
 
-    void* write_all_buff = calloc(1,BUFF_SIZE);
-    if(!write_all_buff){
-        ch_log_fatal("Malloc for new write all buffer failed!\n");
-    }
+    priv->pool = buff_pool_new(MAX(priv->transport.msize, (i64)sizeof(q2pc_msg)) + BUFF_POOL_HEADROOM);
 
     priv->fd = socket(AF_INET,SOCK_STREAM,0);
     if (priv->fd < 0 ){
@@ -17,12 +17,18 @@
 
 #include "q2pc_trans_udp.h"
 #include "conn_vector.h"
+#include "buff_pool.h"
+#include "udp_shard.h"
+#include "sock_tstamp.h"
+#include "sock_bind.h"
 #include "../errors/errors.h"
 #include "../protocol/q2pc_protocol.h"
 
 typedef struct {
     int fd; //Reading file descriptor
 
+    buff_pool* pool; //Shared by all connections on the transport
+
     //For the reader
     void* read_buffer;
     i64   read_buffer_used;
@@ -36,6 +42,15 @@ typedef struct {
     bool is_connected;
     struct sockaddr_in src_addr;
 
+    //When sharding, reads and writes go through the shared sockets instead of fd
+    udp_shard_set* shards;
+    i64 shard_idx;
+
+    //Kernel timestamps, server only
+    i64 tstamp;
+    i64 tx_us;
+    i64 rx_us;
+
 } q2pc_udp_conn_priv;
 
 //Forward declaration
@@ -46,14 +61,23 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
     if( priv->read_buffer && priv->read_buffer_used){
+        *data_o = priv->read_buffer;
+        *len_o  = priv->read_buffer_used;
         return Q2PC_ENONE;
     }
 
+    priv->read_buffer = buff_pool_get(priv->pool);
+
     int result = -1 ;
     if(unlikely(!priv->is_connected)){
         //ch_log_debug3("Connecting with rcv from\n");
         socklen_t addr_len = sizeof(priv->src_addr);
-        result = recvfrom(priv->fd,priv->read_buffer, priv->read_buffer_size, 0, (struct sockaddr*)&priv->src_addr, &addr_len);
+        if(priv->tstamp){
+            result = sock_tstamp_recv(priv->fd,priv->read_buffer, priv->read_buffer_size, (struct sockaddr*)&priv->src_addr, &addr_len, &priv->rx_us);
+        }
+        else{
+            result = recvfrom(priv->fd,priv->read_buffer, priv->read_buffer_size, 0, (struct sockaddr*)&priv->src_addr, &addr_len);
+        }
 
         if(result > 0){
             safe_connect(priv->fd,&priv->src_addr);
@@ -62,11 +86,21 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
         }
 
     }
+    else if(priv->tstamp){
+        result = sock_tstamp_recv(priv->fd, priv->read_buffer, priv->read_buffer_size, NULL, NULL, &priv->rx_us);
+    }
     else{
         result = read(priv->fd, priv->read_buffer, priv->read_buffer_size);
         //ch_log_debug3("Read to %i bytes\n",result);
     }
 
+    //Give the buffer straight back if there was nothing to read, so idle connections don't sit on pool buffers. The
+    //pool is LIFO, so the next poll gets the same (still cache hot) buffer back.
+    if(result <= 0){
+        buff_pool_put(priv->pool, priv->read_buffer);
+        priv->read_buffer = NULL;
+    }
+
     if(result < 0){
         if(errno == EAGAIN || errno == EWOULDBLOCK){
             return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
@@ -99,6 +133,13 @@ static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len
 static int conn_end_read(struct q2pc_trans_conn_s* this)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+
+    //Only give the buffer back once a message has been consumed
+    if(priv->read_buffer_used){
+        buff_pool_put(priv->pool, priv->read_buffer);
+        priv->read_buffer = NULL;
+    }
+
     priv->read_buffer_used = 0;
     return 0;
 }
@@ -108,12 +149,23 @@ static int conn_end_read(struct q2pc_trans_conn_s* this)
 static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->pool);
+    }
+
     *data_o = priv->write_buffer;
     *len_o  = priv->write_buffer_size;
     return 0;
 }
 
 
+static inline void release_write(q2pc_udp_conn_priv* priv)
+{
+    buff_pool_put(priv->pool, priv->write_buffer);
+    priv->write_buffer = NULL;
+}
+
+
 static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
 {
     q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
@@ -133,30 +185,90 @@ static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
 
             if(errno == ECONNREFUSED){
                 ch_log_debug3("UDP end write EFIN\n");
+                release_write(priv);
                 return Q2PC_EFIN;
             }
 
             ch_log_warn("UDP write failed with errorno=%i: %s\n", errno, strerror(errno));
+            release_write(priv);
             return Q2PC_EFIN;
         }
         data += written;
         len -= written;
     }
 
+    release_write(priv);
     return Q2PC_ENONE;
 
 }
 
 
+static int conn_beg_read_shard(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    return udp_shard_read(priv->shards, priv->shard_idx, data_o, len_o);
+}
+
+
+static int conn_end_read_shard(struct q2pc_trans_conn_s* this)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    udp_shard_release(priv->shards, priv->shard_idx);
+    return 0;
+}
+
+
+static int conn_end_write_shard(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    int result = udp_shard_send(priv->shards, priv->shard_idx, priv->write_buffer, len);
+    release_write(priv);
+    return result;
+}
+
+
+//The sockets are shared, so there is nothing to wait on for one connection
+static int conn_get_fd_shard(struct q2pc_trans_conn_s* this)
+{
+    (void)this;
+    return -1;
+}
+
+
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    return priv->fd;
+}
+
+
+//The TX stamp is for the latest request written to this client, which is the one being answered unless requests are
+//pipelined
+static void conn_get_tstamps(struct q2pc_trans_conn_s* this, i64* tx_us_o, i64* rx_us_o)
+{
+    q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
+    priv->tx_us = MAX(priv->tx_us, sock_tstamp_last_tx(priv->fd));
+    *tx_us_o = priv->tx_us;
+    *rx_us_o = priv->rx_us;
+}
+
+
 static void conn_delete(struct q2pc_trans_conn_s* this)
 {
     if(this){
         if(this->priv){
             q2pc_udp_conn_priv* priv = (q2pc_udp_conn_priv*)this->priv;
-            if(priv->read_buffer){ free(priv->read_buffer); }
-            //if(priv->write_buffer){ free(priv->write_buffer); } --Not necessary since r+w are allocated together
+            buff_pool_put(priv->pool, priv->read_buffer);
+            buff_pool_put(priv->pool, priv->write_buffer);
+            if(!priv->shards){
+                close(priv->fd);
+            }
             free(this->priv);
-            close(priv->fd);
         }
 
         //XXX HACK!
@@ -171,39 +283,32 @@ static void conn_delete(struct q2pc_trans_conn_s* this)
 typedef struct {
     transport_s transport;
     i64 connections;
+    buff_pool* pool;
+    udp_shard_set* shards; //Server only, when sharding
 
 } q2pc_udp_priv;
 
 
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because it feels right
-static q2pc_udp_conn_priv* new_conn_priv()
+static q2pc_udp_conn_priv* new_conn_priv(buff_pool* pool)
 {
     q2pc_udp_conn_priv* new_priv = calloc(1,sizeof(q2pc_udp_conn_priv));
     if(!new_priv){
         ch_log_fatal("Malloc failed!\n");
     }
 
-    void* read_buff = calloc(2,BUFF_SIZE);
-    if(!read_buff){
-        ch_log_fatal("Malloc failed!\n");
-    }
-    new_priv->read_buffer = read_buff;
-    new_priv->read_buffer_size = BUFF_SIZE;
-
-    void* write_buff = (char*)read_buff + BUFF_SIZE;
-    new_priv->write_buffer = write_buff;
-    new_priv->write_buffer_size = BUFF_SIZE;
-
+    //Buffers come out of the pool as they are needed
+    new_priv->pool              = pool;
+    new_priv->read_buffer_size  = buff_pool_buff_size(pool);
+    new_priv->write_buffer_size = buff_pool_buff_size(pool);
 
     return new_priv;
-
 }
 
-static q2pc_udp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
+static q2pc_udp_conn_priv* init_new_conn(q2pc_trans_conn* conn, buff_pool* pool)
 {
-    q2pc_udp_conn_priv* new_priv = new_conn_priv();
+    q2pc_udp_conn_priv* new_priv = new_conn_priv(pool);
 
 
     conn->priv      = new_priv;
@@ -212,6 +317,7 @@ static q2pc_udp_conn_priv* init_new_conn(q2pc_trans_conn* conn)
     conn->beg_write = conn_beg_write;
     conn->end_write = conn_end_write;
     conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
 
     return new_priv;
 }
@@ -226,46 +332,32 @@ static void safe_connect(int fd, struct sockaddr_in* addr)
 }
 
 
-static void safe_wait_bind(int fd, struct sockaddr_in* addr)
-{
-
-    ch_log_debug3("Binding on %i port=%i\n", fd, ntohs(addr->sin_port));
-
-    if(bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) ){
-        uint64_t i = 0;
-
-        //Will wait up to two minutes trying if the address is in use.
-        //Helpful for quick restarts of apps as Linux keeps some state
-        //around for a while.
-        const int64_t seconds_per_try = 5;
-        const int64_t seconds_total = 120;
-        for(i = 0; i < seconds_total / seconds_per_try && errno == EADDRINUSE; i++){
-            ch_log_debug1("%i] %s --> sleeping for %i seconds...\n",i, strerror(errno), seconds_per_try);
-            sleep(seconds_per_try);
-            bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-        }
-
-        if(errno){
-            ch_log_fatal("UDP server bind failed: %s\n",strerror(errno));
-        }
-        else{
-            ch_log_debug1("Successfully bound after delay.\n");
-        }
-    }
-
-}
-
-
-
 //Wait for all clients to connect
 static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
 {
     q2pc_udp_priv* trans_priv = (q2pc_udp_priv*)this->priv;
     q2pc_udp_conn_priv* conn_priv = (q2pc_udp_conn_priv*)conn->priv;
 
-    if(!conn_priv){
+    if(!conn_priv && trans_priv->transport.server && trans_priv->transport.shards){
+        //Every client talks to the same port, the shard set works out who is who
+        if(!trans_priv->shards){
+            trans_priv->shards = udp_shard_new(&trans_priv->transport, trans_priv->transport.port, trans_priv->pool);
+        }
+
+        q2pc_udp_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
+        new_priv->fd        = -1;
+        new_priv->shards    = trans_priv->shards;
+        new_priv->shard_idx = trans_priv->connections - 1;
+        conn->beg_read      = conn_beg_read_shard;
+        conn->end_read      = conn_end_read_shard;
+        conn->end_write     = conn_end_write_shard;
+        conn->get_fd        = conn_get_fd_shard;
+
+        trans_priv->connections++;
+    }
+    else if(!conn_priv){
 
-        q2pc_udp_conn_priv* new_priv = init_new_conn(conn);
+        q2pc_udp_conn_priv* new_priv = init_new_conn(conn, trans_priv->pool);
 
         new_priv->fd = socket(AF_INET,SOCK_DGRAM,0);
         if(new_priv->fd < 0 ){
@@ -283,7 +375,15 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
             new_priv->src_addr.sin_family      = AF_INET;
             new_priv->src_addr.sin_addr.s_addr = INADDR_ANY;
             new_priv->src_addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
-            safe_wait_bind(new_priv->fd,&new_priv->src_addr);
+            sock_wait_bind(new_priv->fd, &new_priv->src_addr, "UDP server");
+
+            if(trans_priv->transport.tstamp){
+                sock_tstamp_enable(new_priv->fd, trans_priv->transport.tstamp);
+                new_priv->tstamp = trans_priv->transport.tstamp;
+                new_priv->tx_us  = -1;
+                new_priv->rx_us  = -1;
+                conn->get_tstamps = conn_get_tstamps;
+            }
 
             trans_priv->connections++;
         }
@@ -296,7 +396,9 @@ static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
             addr.sin_family      = AF_INET;
             addr.sin_addr.s_addr = INADDR_ANY;
             addr.sin_addr.s_addr = inet_addr(trans_priv->transport.ip);
-            addr.sin_port        = htons(trans_priv->transport.port + trans_priv->transport.client_id);
+            //A sharded server takes every client on the one port
+            const i64 port_offset = trans_priv->transport.shards ? 0 : trans_priv->transport.client_id;
+            addr.sin_port        = htons(trans_priv->transport.port + port_offset);
 
             safe_connect(new_priv->fd,&addr);
         }
@@ -325,7 +427,9 @@ static void serv_delete(struct q2pc_trans_s* this)
     if(this){
 
         if(this->priv){
-            //q2pc_udp_priv* priv = (q2pc_udp_priv*)this->priv;
+            q2pc_udp_priv* priv = (q2pc_udp_priv*)this->priv;
+            udp_shard_delete(priv->shards);
+            buff_pool_delete(priv->pool);
             free(this->priv);
         }
 
@@ -335,7 +439,6 @@ static void serv_delete(struct q2pc_trans_s* this)
 }
 
 
-#define BUFF_SIZE (4096 * 1024) //A 4MB buffer. Just because
 static void init(q2pc_udp_priv* priv)
 {
 
@@ -344,6 +447,9 @@ static void init(q2pc_udp_priv* priv)
     //Keep track of port numbers
     priv->connections = 1;
 
+    //Messages are at most msize bytes, plus whatever layered transports put in front of them
+    priv->pool = buff_pool_new(MAX(priv->transport.msize, (i64)sizeof(q2pc_msg)) + BUFF_POOL_HEADROOM);
+
     ch_log_debug1("Done constructing UDP transport\n");
 
 }
@@ -0,0 +1,662 @@
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_uring.h"
+#include "q2pc_trans_udp.h"
+#include "conn_vector.h"
+#include "sock_bind.h"
+#include "mailbox.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//Server side UDP transport built on io_uring. Each client still gets its own socket on port + client id, so clients
+//just use the plain UDP transport. The server queues the whole fan-out as fixed buffer writes out of one registered
+//region and submits them in a single io_uring_enter() when flushed. Every connection has a multishot receive armed
+//that picks buffers out of a shared provided buffer ring, so votes are reaped straight off the completion queue
+//without any system calls at all.
+
+#define BUFF_GROUP    0    //Provided buffer group id for receives
+#define BUFFS_PER_CONN 4   //Receive buffers to provide for each connection
+
+#define UD_RECV  (1ULL << 62) //Completion types, packed into the top of the user data along with the connection index
+#define UD_WRITE (1ULL << 61)
+#define UD_IDX_MASK ((1ULL << 32) - 1)
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct q2pc_uring_priv_s;
+
+typedef struct {
+    struct q2pc_uring_priv_s* trans;
+    i64 idx;
+    int fd;
+
+    //For the reader. The producer is whichever thread is reaping the completion queue (serialised by the cq lock),
+    //the consumer is the thread that owns the connection.
+    mailbox mailbox;
+    volatile bool is_fin;
+
+    //For the writer, a slice of the registered write region
+    char* write_buffer;
+    i64   write_buffer_size;
+    volatile bool write_inflight;
+
+    bool is_connected;
+    struct sockaddr_in src_addr;
+
+} q2pc_uring_conn_priv;
+
+
+typedef struct q2pc_uring_priv_s {
+    transport_s transport;
+    i64 slot_size;
+    i64 connections;
+
+    q2pc_uring_conn_priv** conns;
+    i64 conns_count;
+
+    int ring_fd;
+
+    //Submission queue
+    pthread_mutex_t sq_lock;
+    void* sq_ring;
+    i64 sq_ring_size;
+    u32* sq_head;
+    u32* sq_tail;
+    u32  sq_mask;
+    u32  sq_entries;
+    u32* sq_array;
+    u32* sq_flags;
+    struct io_uring_sqe* sqes;
+    i64 sqes_size;
+    u32 sq_pending;
+
+    //Completion queue
+    pthread_mutex_t cq_lock;
+    void* cq_ring;
+    i64 cq_ring_size;
+    u32* cq_head;
+    u32* cq_tail;
+    u32  cq_mask;
+    struct io_uring_cqe* cqes;
+
+    //Provided buffers for receives
+    struct io_uring_buf_ring* buf_ring;
+    u32   buf_count;
+    char* buf_region;
+
+    //Registered region for writes
+    char* write_region;
+
+} q2pc_uring_priv;
+
+
+static int uring_setup(u32 entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int uring_enter(int ring_fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int uring_register(int ring_fd, u32 opcode, void* arg, u32 nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+
+//Push everything in the submission queue to the kernel. Call with the sq lock held.
+static void sq_submit(q2pc_uring_priv* priv)
+{
+    while(priv->sq_pending){
+        int result = uring_enter(priv->ring_fd, priv->sq_pending, 0, 0);
+        if(result < 0){
+            if(errno == EAGAIN || errno == EBUSY || errno == EINTR){
+                continue; //Keep trying until we succeed
+            }
+
+            ch_log_fatal("io_uring submit failed with errno=%i (%s)\n", errno, strerror(errno));
+        }
+
+        priv->sq_pending -= result;
+    }
+}
+
+
+//Get the next free submission queue entry. Call with the sq lock held.
+static struct io_uring_sqe* sq_get(q2pc_uring_priv* priv)
+{
+    u32 tail = *priv->sq_tail;
+    if(tail - load_acquire(priv->sq_head) >= priv->sq_entries){
+        sq_submit(priv);
+        while(tail - load_acquire(priv->sq_head) >= priv->sq_entries){
+            __asm__ volatile("pause");
+        }
+    }
+
+    const u32 idx = tail & priv->sq_mask;
+    struct io_uring_sqe* sqe = priv->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    priv->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+
+//Make an entry from sq_get() visible to the kernel. Call with the sq lock held.
+static void sq_commit(q2pc_uring_priv* priv)
+{
+    store_release(priv->sq_tail, *priv->sq_tail + 1);
+    priv->sq_pending++;
+}
+
+
+static void arm_recv(q2pc_uring_priv* priv, q2pc_uring_conn_priv* conn)
+{
+    pthread_mutex_lock(&priv->sq_lock);
+    struct io_uring_sqe* sqe = sq_get(priv);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFF_GROUP;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->msg_flags = MSG_TRUNC; //So the result is the real length of the datagram, even if it didn't fit
+    sqe->user_data = UD_RECV | conn->idx;
+    sq_commit(priv);
+    sq_submit(priv);
+    pthread_mutex_unlock(&priv->sq_lock);
+}
+
+
+//Hand a receive buffer back to the kernel. Call with the cq lock held.
+static void buf_recycle(q2pc_uring_priv* priv, u16 bid)
+{
+    const u16 tail = priv->buf_ring->tail;
+    struct io_uring_buf* buf = &priv->buf_ring->bufs[tail & (priv->buf_count - 1)];
+    buf->addr = (u64)(uintptr_t)(priv->buf_region + bid * priv->slot_size);
+    buf->len  = priv->slot_size;
+    buf->bid  = bid;
+    store_release(&priv->buf_ring->tail, tail + 1);
+}
+
+
+//Reap everything on the completion queue, handing datagrams out to the connection mailboxes
+static int reap(q2pc_uring_priv* priv)
+{
+    if(pthread_mutex_trylock(&priv->cq_lock)){
+        return Q2PC_EAGAIN; //Someone else is already doing it
+    }
+
+    //If the completion queue ever overflows, the kernel holds on to the extra entries until we ask for them
+    if(unlikely(load_acquire(priv->sq_flags) & IORING_SQ_CQ_OVERFLOW)){
+        uring_enter(priv->ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+    }
+
+    u32 head = *priv->cq_head;
+    const u32 tail = load_acquire(priv->cq_tail);
+    for(; head != tail; head++){
+        const struct io_uring_cqe* cqe = priv->cqes + (head & priv->cq_mask);
+        const i64 idx = cqe->user_data & UD_IDX_MASK;
+        q2pc_uring_conn_priv* conn = priv->conns[idx];
+
+        if(cqe->user_data & UD_WRITE){
+            if(cqe->res < 0){
+                ch_log_warn("io_uring write failed on connection %li (%s)\n", idx, strerror(-cqe->res));
+                conn->is_fin = true;
+            }
+            conn->write_inflight = false;
+            continue;
+        }
+
+        if(cqe->flags & IORING_CQE_F_BUFFER){
+            const u16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if(cqe->res > priv->slot_size){
+                ch_log_warn("Datagram of %iB on connection %li is bigger than the %liB buffers. Dropping it\n", cqe->res,
+                        idx, priv->slot_size);
+            }
+            else if(cqe->res > 0 && !mailbox_copy(&conn->mailbox, priv->buf_region + bid * priv->slot_size, cqe->res)){
+                ch_log_warn("Client on connection %li has sent more than its window allows. Dropping datagram\n", idx);
+            }
+            buf_recycle(priv, bid);
+        }
+
+        if(cqe->res < 0 && cqe->res != -ENOBUFS){
+            if(cqe->res == -ECONNREFUSED){
+                ch_log_warn("UDP beg read EFIN (%s)\n", strerror(-cqe->res));
+                conn->is_fin = true;
+                continue;
+            }
+
+            ch_log_fatal("io_uring receive failed on connection %li with errno=%i (%s)\n", idx, -cqe->res, strerror(-cqe->res));
+        }
+
+        //The kernel stops a multishot receive if it runs out of buffers (or for its own reasons). Start it again.
+        if(!(cqe->flags & IORING_CQE_F_MORE) && !conn->is_fin){
+            arm_recv(priv, conn);
+        }
+    }
+
+    store_release(priv->cq_head, head);
+    pthread_mutex_unlock(&priv->cq_lock);
+    return Q2PC_ENONE;
+}
+
+
+static void safe_connect(int fd, struct sockaddr_in* addr)
+{
+    if( connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) ){
+        ch_log_fatal("UDP connect failed: %s\n",strerror(errno));
+    }
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_uring_conn_priv* priv = (q2pc_uring_conn_priv*)this->priv;
+
+    //Until the client turns up we don't know who to connect to, so use a plain old recvfrom()
+    if(unlikely(!priv->is_connected)){
+        socklen_t addr_len = sizeof(priv->src_addr);
+        //MSG_TRUNC so that the result is the real length of the datagram, the same as the multishot receives
+        int result = recvfrom(priv->fd, mailbox_claim(&priv->mailbox), priv->trans->slot_size, MSG_TRUNC, (struct sockaddr*)&priv->src_addr, &addr_len);
+        if(result < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return Q2PC_EAGAIN; //Reading would have blocked, we don't want this
+            }
+
+            ch_log_fatal("udp read failed on fd=%i with errno=%i (%s)\n",priv->fd, errno, strerror(errno));
+        }
+
+        safe_connect(priv->fd,&priv->src_addr);
+        ch_log_debug3("Connected to %i\n", ntohs(priv->src_addr.sin_port));
+        priv->is_connected = true;
+
+        if(result > priv->trans->slot_size){
+            ch_log_warn("Datagram of %iB on connection %li is bigger than the %liB buffers. Dropping it\n", result,
+                    priv->idx, priv->trans->slot_size);
+        }
+        else{
+            mailbox_publish(&priv->mailbox, result);
+        }
+
+        arm_recv(priv->trans, priv);
+    }
+
+    if(mailbox_empty(&priv->mailbox)){
+        reap(priv->trans);
+    }
+
+    if(!mailbox_peek(&priv->mailbox, data_o, len_o)){
+        return priv->is_fin ? Q2PC_EFIN : Q2PC_EAGAIN;
+    }
+    ch_log_debug3("Got %li bytes on connection %li\n", *len_o, priv->idx);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_uring_conn_priv* priv = (q2pc_uring_conn_priv*)this->priv;
+    mailbox_pop(&priv->mailbox);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_uring_conn_priv* priv = (q2pc_uring_conn_priv*)this->priv;
+
+    //The kernel may still own the buffer from the last write
+    while(priv->write_inflight){
+        reap(priv->trans);
+    }
+
+    if(priv->is_fin){
+        return Q2PC_EFIN;
+    }
+
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return Q2PC_ENONE;
+}
+
+
+//Queue up a write out of the registered region. It goes to the kernel when the transport is flushed.
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_uring_conn_priv* priv = (q2pc_uring_conn_priv*)this->priv;
+    q2pc_uring_priv* trans_priv = priv->trans;
+
+    if(len > priv->write_buffer_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    priv->write_inflight = true;
+
+    pthread_mutex_lock(&trans_priv->sq_lock);
+    struct io_uring_sqe* sqe = sq_get(trans_priv);
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->fd        = priv->fd;
+    sqe->addr      = (u64)(uintptr_t)priv->write_buffer;
+    sqe->len       = len;
+    sqe->buf_index = 0;
+    sqe->user_data = UD_WRITE | priv->idx;
+    sq_commit(trans_priv);
+    pthread_mutex_unlock(&trans_priv->sq_lock);
+
+    return Q2PC_ENONE;
+}
+
+
+//Send the whole fan-out to the kernel in one go
+static int serv_flush(struct q2pc_trans_s* this)
+{
+    q2pc_uring_priv* priv = (q2pc_uring_priv*)this->priv;
+    pthread_mutex_lock(&priv->sq_lock);
+    sq_submit(priv);
+    pthread_mutex_unlock(&priv->sq_lock);
+    return Q2PC_ENONE;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    //Connections share the ring and other threads may still be reaping into them. The transport cleans them up when
+    //it is deleted.
+    (void)this;
+}
+
+
+/***************************************************************************************************************************/
+
+
+static void* safe_calloc(i64 count, i64 size)
+{
+    void* result = calloc(count, size);
+    if(!result){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    return result;
+}
+
+
+//Connections are bound to port + connection number, just like the plain UDP transport
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_uring_priv* trans_priv = (q2pc_uring_priv*)this->priv;
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    if(trans_priv->conns_count >= trans_priv->transport.client_count){
+        ch_log_fatal("Too many connections, expected at most %li\n", trans_priv->transport.client_count);
+    }
+
+    q2pc_uring_conn_priv* new_priv = safe_calloc(1,sizeof(q2pc_uring_conn_priv));
+    new_priv->trans             = trans_priv;
+    new_priv->idx               = trans_priv->conns_count;
+    new_priv->write_buffer      = trans_priv->write_region + new_priv->idx * trans_priv->slot_size;
+    new_priv->write_buffer_size = trans_priv->slot_size;
+    new_priv->is_connected      = false;
+    mailbox_init(&new_priv->mailbox, mailbox_slots(&trans_priv->transport), trans_priv->slot_size);
+
+    new_priv->fd = socket(AF_INET,SOCK_DGRAM,0);
+    if(new_priv->fd < 0 ){
+        ch_log_fatal("Could not create UDP socket (%s)\n", strerror(errno));
+    }
+
+    int reuse_opt = 1;
+    if(setsockopt(new_priv->fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("UDP set reuse address failed: %s\n",strerror(errno));
+    }
+
+    //Listen to any address, on the client port
+    new_priv->src_addr.sin_family      = AF_INET;
+    new_priv->src_addr.sin_addr.s_addr = INADDR_ANY;
+    new_priv->src_addr.sin_port        = htons(trans_priv->transport.port + trans_priv->connections);
+    sock_wait_bind(new_priv->fd, &new_priv->src_addr, "UDP server");
+    trans_priv->connections++;
+
+    int flags = 0;
+    flags |= O_NONBLOCK;
+    if( fcntl(new_priv->fd, F_SETFL, flags) == -1){
+        ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",new_priv->fd,strerror(errno));
+    }
+
+    trans_priv->conns[trans_priv->conns_count] = new_priv;
+    trans_priv->conns_count++;
+
+    conn->priv      = new_priv;
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = NULL; //Reads complete through the shared ring, there is nothing per connection to wait on
+
+    return Q2PC_ENONE;
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_uring_priv* priv = (q2pc_uring_priv*)this->priv;
+
+            //Closing the ring cancels anything still outstanding
+            close(priv->ring_fd);
+
+            for(int i = 0; i < priv->conns_count; i++){
+                close(priv->conns[i]->fd);
+                mailbox_free(&priv->conns[i]->mailbox);
+                free(priv->conns[i]);
+            }
+            free(priv->conns);
+
+            munmap(priv->sqes, priv->sqes_size);
+            if(priv->cq_ring != priv->sq_ring){
+                munmap(priv->cq_ring, priv->cq_ring_size);
+            }
+            munmap(priv->sq_ring, priv->sq_ring_size);
+
+            free(priv->buf_ring);
+            free(priv->buf_region);
+            free(priv->write_region);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static void init(q2pc_uring_priv* priv)
+{
+
+    ch_log_debug1("Constructing io_uring transport\n");
+
+    const i64 count  = MAX(priv->transport.client_count, 1);
+    priv->slot_size   = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    priv->connections = 1; //Keep track of port numbers
+    priv->conns       = safe_calloc(count, sizeof(q2pc_uring_conn_priv*));
+
+    //Enough room to queue up the whole fan-out plus re-arming all of the receives
+    u32 entries = 8;
+    while(entries < 2 * count){
+        entries *= 2;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = MAX(entries * (BUFFS_PER_CONN + 2), 4096);
+    priv->ring_fd = uring_setup(entries, &params);
+    if(priv->ring_fd < 0){
+        ch_log_fatal("Could not set up io_uring (%s)\n", strerror(errno));
+    }
+
+    //Map in the rings
+    priv->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    priv->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        priv->sq_ring_size = MAX(priv->sq_ring_size, priv->cq_ring_size);
+        priv->cq_ring_size = priv->sq_ring_size;
+    }
+
+    priv->sq_ring = mmap(NULL, priv->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, priv->ring_fd, IORING_OFF_SQ_RING);
+    if(priv->sq_ring == MAP_FAILED){
+        ch_log_fatal("Could not map io_uring submission queue (%s)\n", strerror(errno));
+    }
+
+    priv->cq_ring = priv->sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        priv->cq_ring = mmap(NULL, priv->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, priv->ring_fd, IORING_OFF_CQ_RING);
+        if(priv->cq_ring == MAP_FAILED){
+            ch_log_fatal("Could not map io_uring completion queue (%s)\n", strerror(errno));
+        }
+    }
+
+    priv->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    priv->sqes = mmap(NULL, priv->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, priv->ring_fd, IORING_OFF_SQES);
+    if(priv->sqes == MAP_FAILED){
+        ch_log_fatal("Could not map io_uring submission entries (%s)\n", strerror(errno));
+    }
+
+    priv->sq_head    = (u32*)((char*)priv->sq_ring + params.sq_off.head);
+    priv->sq_tail    = (u32*)((char*)priv->sq_ring + params.sq_off.tail);
+    priv->sq_mask    = *(u32*)((char*)priv->sq_ring + params.sq_off.ring_mask);
+    priv->sq_entries = *(u32*)((char*)priv->sq_ring + params.sq_off.ring_entries);
+    priv->sq_array   = (u32*)((char*)priv->sq_ring + params.sq_off.array);
+    priv->sq_flags   = (u32*)((char*)priv->sq_ring + params.sq_off.flags);
+    priv->cq_head    = (u32*)((char*)priv->cq_ring + params.cq_off.head);
+    priv->cq_tail    = (u32*)((char*)priv->cq_ring + params.cq_off.tail);
+    priv->cq_mask    = *(u32*)((char*)priv->cq_ring + params.cq_off.ring_mask);
+    priv->cqes       = (struct io_uring_cqe*)((char*)priv->cq_ring + params.cq_off.cqes);
+
+    pthread_mutex_init(&priv->sq_lock, NULL);
+    pthread_mutex_init(&priv->cq_lock, NULL);
+
+    //Register one region for all of the write buffers
+    priv->write_region = safe_calloc(count, priv->slot_size);
+    struct iovec write_iov = { .iov_base = priv->write_region, .iov_len = count * priv->slot_size };
+    if(uring_register(priv->ring_fd, IORING_REGISTER_BUFFERS, &write_iov, 1) < 0){
+        ch_log_fatal("Could not register io_uring write buffers (%s)\n", strerror(errno));
+    }
+
+    //Set up the provided buffer ring for receives
+    priv->buf_count = 8;
+    while(priv->buf_count < count * BUFFS_PER_CONN){
+        priv->buf_count *= 2;
+    }
+    priv->buf_count = MIN(priv->buf_count, 32768); //Kernel limit
+
+    if(posix_memalign((void**)&priv->buf_ring, 4096, priv->buf_count * sizeof(struct io_uring_buf))){
+        ch_log_fatal("Could not allocate io_uring buffer ring\n");
+    }
+    memset(priv->buf_ring, 0, priv->buf_count * sizeof(struct io_uring_buf));
+    priv->buf_region = safe_calloc(priv->buf_count, priv->slot_size);
+
+    struct io_uring_buf_reg buf_reg;
+    memset(&buf_reg, 0, sizeof(buf_reg));
+    buf_reg.ring_addr    = (u64)(uintptr_t)priv->buf_ring;
+    buf_reg.ring_entries = priv->buf_count;
+    buf_reg.bgid         = BUFF_GROUP;
+    if(uring_register(priv->ring_fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0){
+        ch_log_fatal("Could not register io_uring buffer ring (%s), udp-ur needs Linux 6.0 or newer\n", strerror(errno));
+    }
+
+    for(u32 i = 0; i < priv->buf_count; i++){
+        buf_recycle(priv, i);
+    }
+
+    ch_log_debug1("Done constructing io_uring transport\n");
+
+}
+
+
+//Multishot receives need Linux 6.0, and io_uring can be turned off altogether (kernel.io_uring_disabled, seccomp).
+//Returns false, with the reason in why, if this kernel can't run the transport.
+static bool uring_supported(char* why, i64 why_len)
+{
+    struct utsname uts;
+    int major = 0;
+    int minor = 0;
+    if(uname(&uts) || sscanf(uts.release, "%i.%i", &major, &minor) != 2){
+        snprintf(why, why_len, "could not work out the kernel version");
+        return false;
+    }
+
+    if(major < 6){
+        snprintf(why, why_len, "Linux %s is too old, multishot receives need 6.0 or newer", uts.release);
+        return false;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = uring_setup(1, &params);
+    if(fd < 0){
+        snprintf(why, why_len, "io_uring is not available (%s)", strerror(errno));
+        return false;
+    }
+    close(fd);
+
+    return true;
+}
+
+
+q2pc_trans* q2pc_uring_construct(const transport_s* transport)
+{
+    //Clients talk to the server over plain UDP sockets
+    if(!transport->server){
+        return q2pc_udp_construct(transport);
+    }
+
+    //Which means the server can fall back to plain UDP sockets too, without the clients ever knowing
+    char why[256];
+    if(!uring_supported(why, sizeof(why))){
+        ch_log_error("Cannot use the io_uring transport: %s. Falling back to udp-ln\n", why);
+        return q2pc_udp_construct(transport);
+    }
+
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate io_uring server structure\n");
+    }
+
+    q2pc_uring_priv* priv = (q2pc_uring_priv*)calloc(1,sizeof(q2pc_uring_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate io_uring server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->flush         = serv_flush;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
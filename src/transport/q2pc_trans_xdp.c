@@ -0,0 +1,752 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "q2pc_trans_xdp.h"
+#include "q2pc_trans_qj.h"
+#include "buff_pool.h"
+#include "udp_frame.h"
+#include "mailbox.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+//A Q-Jump style broadcast transport where the server takes its traffic straight off the driver with AF_XDP. There is
+//an XDP socket, with its own UMEM and fill, completion, RX and TX rings, on each receive queue of the interface. A
+//small XDP program redirects UDP datagrams for the client ports into the socket for the queue they arrived on, and
+//passes everything else up the stack. Broadcasts are framed into UMEM and go out through the TX ring of the first
+//queue. Drivers without native XDP support fall back to generic (SKB) mode, which works on any interface including
+//veth and loopback, and sockets fall back to copy mode if zero copy isn't available. On the wire this is the same as
+//udp-qj, so clients are plain udp-qj clients. Over loopback, the kernel drops the frames we send as martians unless
+//net.ipv4.conf.lo.accept_local and net.ipv4.conf.lo.route_localnet are both 1.
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+
+#define UMEM_FRAME_SIZE 2048
+#define RING_SIZE       2048        //Every ring is the same size, so none of them can ever overflow
+#define RX_FRAMES       RING_SIZE   //The first half of UMEM goes to the fill ring, the rest is for sending
+#define TX_FRAMES       RING_SIZE
+#define UMEM_FRAMES     (RX_FRAMES + TX_FRAMES)
+
+
+typedef struct {
+    volatile u32* producer;
+    volatile u32* consumer;
+    volatile u32* flags;
+    void* descs;
+    void* map;
+    i64 map_len;
+} xsk_ring;
+
+
+typedef struct {
+    int fd;
+    i64 queue;
+    bool zero_copy;
+
+    char* umem;
+    xsk_ring fill;
+    xsk_ring comp;
+    xsk_ring rx;
+    xsk_ring tx;
+
+    pthread_mutex_t drain_lock;
+
+    //For the writer and flusher, only ever used by the thread sending requests
+    u64 tx_free[TX_FRAMES];
+    i64 tx_free_count;
+    i64 tx_pending;
+
+} xsk_queue;
+
+
+struct q2pc_xdp_priv_s;
+
+typedef struct {
+    struct q2pc_xdp_priv_s* trans;
+    i64 idx;
+
+    int sink_fd; //Holds the port open so the kernel doesn't send back port unreachables, we never read it
+
+    //For the reader. The producer is whichever thread is draining an RX ring (serialised by the mailbox lock), the
+    //consumer is the thread that owns the connection.
+    mailbox mailbox;
+    pthread_mutex_t mailbox_lock; //Different queues can be drained at the same time
+
+    //For the writer
+    void* write_buffer;
+    i64   write_buffer_size;
+
+} q2pc_xdp_conn_priv;
+
+
+typedef struct q2pc_xdp_priv_s {
+    transport_s transport;
+    i64 slot_size;
+    buff_pool* pool;
+    int ifindex;
+
+    //All of the server connections, connection i is client i + 1. They are handed out in order as they are connected.
+    q2pc_xdp_conn_priv** conns;
+    i64 conns_count;
+    i64 connections;
+
+    xsk_queue* queues;
+    i64 queues_count;
+
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+
+    udp_frame_hdr tx_template;
+    u16 tx_ip_id;
+
+} q2pc_xdp_priv;
+
+
+//Hand a frame from an RX ring to the mailbox of the client that sent it
+static void deliver(q2pc_xdp_priv* priv, const char* frame, i64 len)
+{
+    i64 data_len = 0;
+    const char* data = udp_frame_payload(frame, len, &data_len);
+    if(!data){
+        return;
+    }
+
+    if(data_len < (i64)sizeof(q2pc_msg)){
+        ch_log_warn("Datagram of %li bytes is too short for a Q2PC message. Ignoring\n", data_len);
+        return;
+    }
+
+    if(data_len > priv->slot_size){
+        ch_log_warn("Datagram larger than %li bytes. Ignoring\n", priv->slot_size);
+        return;
+    }
+
+    const i64 hostid = ((const q2pc_msg*)data)->src_hostid;
+    if(hostid < 1 || hostid > priv->conns_count){
+        ch_log_warn("Datagram from unexpected client id %li, expected [1,%li]. Ignoring\n", hostid, priv->conns_count);
+        return;
+    }
+
+    q2pc_xdp_conn_priv* conn = priv->conns[hostid - 1];
+    pthread_mutex_lock(&conn->mailbox_lock);
+    const bool delivered = mailbox_copy(&conn->mailbox, data, data_len);
+    pthread_mutex_unlock(&conn->mailbox_lock);
+
+    if(!delivered){
+        ch_log_warn("Client on connection %li has sent more than its window allows. Dropping datagram\n", conn->idx);
+    }
+}
+
+
+//Take everything off the RX ring and give the frames straight back to the fill ring
+static void drain(q2pc_xdp_priv* priv, xsk_queue* q)
+{
+    //Don't bother with the lock if there is nothing there
+    if(*q->rx.producer == *q->rx.consumer){
+        return;
+    }
+
+    if(pthread_mutex_trylock(&q->drain_lock)){
+        return; //Someone else is already doing it
+    }
+
+    const u32 prod = *q->rx.producer;
+    __sync_synchronize(); //Don't look at the descriptors until we know the kernel is done with them
+
+    u32 cons      = *q->rx.consumer;
+    u32 fill_prod = *q->fill.producer;
+    for(; cons != prod; cons++, fill_prod++){
+        const struct xdp_desc* desc = (struct xdp_desc*)q->rx.descs + (cons & (RING_SIZE - 1));
+        deliver(priv, q->umem + desc->addr, desc->len);
+        ((u64*)q->fill.descs)[fill_prod & (RING_SIZE - 1)] = desc->addr - desc->addr % UMEM_FRAME_SIZE;
+    }
+
+    __sync_synchronize();
+    *q->fill.producer = fill_prod;
+    *q->rx.consumer   = cons;
+
+    pthread_mutex_unlock(&q->drain_lock);
+}
+
+
+static int conn_beg_read(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+
+    //The NIC decides which queue a client lands on, so any of them could have something for us
+    if(mailbox_empty(&priv->mailbox)){
+        for(i64 i = 0; i < priv->trans->queues_count; i++){
+            drain(priv->trans, &priv->trans->queues[i]);
+        }
+    }
+
+    if(!mailbox_peek(&priv->mailbox, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+    ch_log_debug3("Got %li bytes on connection %li\n", *len_o, priv->idx);
+
+    return Q2PC_ENONE;
+}
+
+
+static int conn_end_read(struct q2pc_trans_conn_s* this)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    mailbox_pop(&priv->mailbox);
+    return Q2PC_ENONE;
+}
+
+
+static int conn_beg_write(struct q2pc_trans_conn_s* this, char** data_o, i64* len_o)
+{
+    q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+    if(!priv->write_buffer){
+        priv->write_buffer = buff_pool_get(priv->trans->pool);
+    }
+
+    *data_o = priv->write_buffer;
+    *len_o  = priv->write_buffer_size;
+    return Q2PC_ENONE;
+}
+
+
+//Ask the kernel to send everything queued up in the TX ring. In copy mode it only takes a few at a time.
+static int kick(xsk_queue* q)
+{
+    while(q->tx_pending){
+        if(sendto(q->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0){
+            q->tx_pending = 0;
+            break;
+        }
+
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EBUSY || errno == ENOBUFS){
+            continue; //Keep trying until we succeed
+        }
+
+        ch_log_warn("AF_XDP send failed with errorno=%i: %s\n", errno, strerror(errno));
+        return Q2PC_EFIN;
+    }
+
+    return Q2PC_ENONE;
+}
+
+
+//Take back frames that the kernel has finished sending
+static void reap(xsk_queue* q)
+{
+    const u32 prod = *q->comp.producer;
+    __sync_synchronize();
+
+    u32 cons = *q->comp.consumer;
+    for(; cons != prod; cons++){
+        q->tx_free[q->tx_free_count++] = ((u64*)q->comp.descs)[cons & (RING_SIZE - 1)];
+    }
+
+    __sync_synchronize();
+    *q->comp.consumer = cons;
+}
+
+
+//Every write is a broadcast to all of the clients. It is framed into UMEM and goes out on the next flush.
+static int conn_end_write(struct q2pc_trans_conn_s* this, i64 len)
+{
+    q2pc_xdp_conn_priv* conn_priv = (q2pc_xdp_conn_priv*)this->priv;
+    q2pc_xdp_priv* priv = conn_priv->trans;
+    xsk_queue* q = &priv->queues[0];
+
+    if(len > conn_priv->write_buffer_size || len > priv->slot_size){
+        ch_log_fatal("Error: Wrote more data than the buffer could handle. Memory corruption is likely\n ");
+    }
+
+    reap(q);
+    while(!q->tx_free_count){
+        if(kick(q)){
+            buff_pool_put(priv->pool, conn_priv->write_buffer);
+            conn_priv->write_buffer = NULL;
+            return Q2PC_EFIN;
+        }
+        reap(q);
+    }
+
+    const u64 addr = q->tx_free[--q->tx_free_count];
+    const u32 prod = *q->tx.producer;
+    struct xdp_desc* desc = (struct xdp_desc*)q->tx.descs + (prod & (RING_SIZE - 1));
+    desc->addr    = addr;
+    desc->len     = udp_frame_build(q->umem + addr, &priv->tx_template, priv->tx_ip_id++, conn_priv->write_buffer, len);
+    desc->options = 0;
+
+    __sync_synchronize(); //The frame has to be there before the kernel can see it
+    *q->tx.producer = prod + 1;
+    q->tx_pending++;
+
+    buff_pool_put(priv->pool, conn_priv->write_buffer);
+    conn_priv->write_buffer = NULL;
+    return Q2PC_ENONE;
+}
+
+
+//The rings are shared, so there is nothing to wait on for one connection
+static int conn_get_fd(struct q2pc_trans_conn_s* this)
+{
+    (void)this;
+    return -1;
+}
+
+
+static void conn_delete(struct q2pc_trans_conn_s* this)
+{
+    if(this){
+        if(this->priv){
+            //The rest belongs to the transport
+            q2pc_xdp_conn_priv* priv = (q2pc_xdp_conn_priv*)this->priv;
+            buff_pool_put(priv->trans->pool, priv->write_buffer);
+            priv->write_buffer = NULL;
+        }
+
+        //XXX HACK!
+        //free(this);
+    }
+}
+
+
+
+/***************************************************************************************************************************/
+
+
+//Wait for all clients to connect. Everything was set up with the transport, so clients that turn up before their
+//connection is asked for aren't lost, this just hands them out in order.
+static int doconnect(struct q2pc_trans_s* this, q2pc_trans_conn* conn)
+{
+    q2pc_xdp_priv* trans_priv = (q2pc_xdp_priv*)this->priv;
+    if(conn->priv){
+        return Q2PC_ENONE;
+    }
+
+    if(trans_priv->connections >= trans_priv->conns_count){
+        ch_log_fatal("More connections than the %li clients the XDP transport was set up for\n", trans_priv->conns_count);
+    }
+
+    conn->priv      = trans_priv->conns[trans_priv->connections++];
+    conn->beg_read  = conn_beg_read;
+    conn->end_read  = conn_end_read;
+    conn->beg_write = conn_beg_write;
+    conn->end_write = conn_end_write;
+    conn->delete    = conn_delete;
+    conn->get_fd    = conn_get_fd;
+
+    return Q2PC_ENONE;
+}
+
+
+static int serv_flush(struct q2pc_trans_s* this)
+{
+    q2pc_xdp_priv* priv = (q2pc_xdp_priv*)this->priv;
+    return kick(&priv->queues[0]);
+}
+
+
+static void serv_delete(struct q2pc_trans_s* this)
+{
+    if(this){
+
+        if(this->priv){
+            q2pc_xdp_priv* priv = (q2pc_xdp_priv*)this->priv;
+
+            //Take the program off the interface first, so nothing is redirected to sockets that have gone
+            close(priv->link_fd);
+            close(priv->prog_fd);
+            close(priv->map_fd);
+
+            for(i64 i = 0; i < priv->queues_count; i++){
+                xsk_queue* q = &priv->queues[i];
+
+                struct xdp_statistics stats = {0};
+                socklen_t stats_len = sizeof(stats);
+                if(!getsockopt(q->fd, SOL_XDP, XDP_STATISTICS, &stats, &stats_len)){
+                    ch_log_info("AF_XDP queue %li (%s) rx dropped=%llu ring full=%llu fill empty=%llu\n", q->queue,
+                            q->zero_copy ? "zero copy" : "copy", stats.rx_dropped, stats.rx_ring_full, stats.rx_fill_ring_empty_descs);
+                }
+
+                munmap(q->fill.map, q->fill.map_len);
+                munmap(q->comp.map, q->comp.map_len);
+                munmap(q->rx.map, q->rx.map_len);
+                munmap(q->tx.map, q->tx.map_len);
+                close(q->fd);
+                munmap(q->umem, (i64)UMEM_FRAMES * UMEM_FRAME_SIZE);
+                pthread_mutex_destroy(&q->drain_lock);
+            }
+
+            for(i64 i = 0; i < priv->conns_count; i++){
+                close(priv->conns[i]->sink_fd);
+                pthread_mutex_destroy(&priv->conns[i]->mailbox_lock);
+                mailbox_free(&priv->conns[i]->mailbox);
+                free(priv->conns[i]);
+            }
+
+            buff_pool_delete(priv->pool);
+            free(priv->queues);
+            free(priv->conns);
+            free(this->priv);
+        }
+
+        free(this);
+    }
+
+}
+
+
+static int sys_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+//Just enough of an eBPF assembler for the redirect program
+#define INSN(c, d, s, o, i)     ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)         INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)         INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)         INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define TO_HOST16(d)            INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LDX_MEM(sz, d, s, o)    INSN(BPF_LDX | sz | BPF_MEM, d, s, o, 0)
+#define JMP_REG(op, d, s, o)    INSN(BPF_JMP | op | BPF_X, d, s, o, 0)
+#define JMP_IMM(op, d, i, o)    INSN(BPF_JMP | op | BPF_K, d, 0, o, i)
+#define LD_MAP_FD(d, fd)        INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(f)                 INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()                  INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+
+//Redirect unfragmented UDP datagrams for the client ports [port + 1, port + client_count] to the socket for the queue
+//they came in on, and pass everything else. If there is no socket on the queue, they are passed too.
+static void load_program(q2pc_xdp_priv* priv)
+{
+    const i32 lo = priv->transport.port + 1;
+    const i32 hi = priv->transport.port + priv->conns_count;
+
+    struct bpf_insn code[] = {
+        /* 0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+        /* 1 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)),
+        /* 2 */ LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)),
+        /* 3 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+        /* 4 */ ADD64_IMM(BPF_REG_4, sizeof(udp_frame_hdr)),
+        /* 5 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 20),
+        /* 6 */ LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, offsetof(udp_frame_hdr, eth.h_proto)),
+        /* 7 */ TO_HOST16(BPF_REG_4),
+        /* 8 */ JMP_IMM(BPF_JNE, BPF_REG_4, ETH_P_IP, 17),
+        /* 9 */ LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_2, sizeof(struct ethhdr)),
+        /*10 */ JMP_IMM(BPF_JNE, BPF_REG_4, 0x45, 15), //IPv4 with no options
+        /*11 */ LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_2, offsetof(udp_frame_hdr, ip.protocol)),
+        /*12 */ JMP_IMM(BPF_JNE, BPF_REG_4, IPPROTO_UDP, 13),
+        /*13 */ LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, offsetof(udp_frame_hdr, ip.frag_off)),
+        /*14 */ TO_HOST16(BPF_REG_4),
+        /*15 */ JMP_IMM(BPF_JSET, BPF_REG_4, 0x3FFF, 10),
+        /*16 */ LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, offsetof(udp_frame_hdr, udp.dest)),
+        /*17 */ TO_HOST16(BPF_REG_4),
+        /*18 */ JMP_IMM(BPF_JLT, BPF_REG_4, lo, 7),
+        /*19 */ JMP_IMM(BPF_JGT, BPF_REG_4, hi, 6),
+        /*20 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)),
+        /*21 */ LD_MAP_FD(BPF_REG_1, priv->map_fd),
+        /*23 */ MOV64_IMM(BPF_REG_3, XDP_PASS), //What to do if there is no socket on the queue
+        /*24 */ CALL(BPF_FUNC_redirect_map),
+        /*25 */ EXIT(),
+        /*26 */ MOV64_IMM(BPF_REG_0, XDP_PASS),
+        /*27 */ EXIT(),
+    };
+
+    static char log[64 * 1024];
+    const char* license = "GPL";
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type            = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns                = (u64)(uintptr_t)code;
+    attr.insn_cnt             = sizeof(code) / sizeof(code[0]);
+    attr.license              = (u64)(uintptr_t)license;
+    attr.log_buf              = (u64)(uintptr_t)log;
+    attr.log_size             = sizeof(log);
+    attr.log_level            = 1;
+    priv->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if(priv->prog_fd < 0){
+        ch_log_fatal("Could not load XDP program, this needs CAP_BPF and CAP_NET_ADMIN (%s)\n%s\n", strerror(errno), log);
+    }
+}
+
+
+//Native mode if the driver can do it, otherwise generic mode, which works everywhere but runs after the SKB is built
+static void attach_program(q2pc_xdp_priv* priv)
+{
+    const u32 modes[]       = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    const char* mode_names[] = { "native", "generic" };
+
+    for(int i = 0; i < 2; i++){
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd        = priv->prog_fd;
+        attr.link_create.target_ifindex = priv->ifindex;
+        attr.link_create.attach_type    = BPF_XDP;
+        attr.link_create.flags          = modes[i];
+        priv->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if(priv->link_fd >= 0){
+            ch_log_debug1("Attached XDP program to %s in %s mode\n", priv->transport.iface, mode_names[i]);
+            return;
+        }
+
+        ch_log_debug1("Could not attach XDP program to %s in %s mode: %s\n", priv->transport.iface, mode_names[i], strerror(errno));
+    }
+
+    ch_log_fatal("Could not attach XDP program to %s: %s\n", priv->transport.iface, strerror(errno));
+}
+
+
+static void map_ring(xsk_queue* q, xsk_ring* ring, const struct xdp_ring_offset* off, i64 desc_size, u64 pgoff)
+{
+    ring->map_len = off->desc + RING_SIZE * desc_size;
+    ring->map     = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, pgoff);
+    if(ring->map == MAP_FAILED){
+        ch_log_fatal("Could not map AF_XDP ring on queue %li: %s\n", q->queue, strerror(errno));
+    }
+
+    ring->producer = (u32*)((char*)ring->map + off->producer);
+    ring->consumer = (u32*)((char*)ring->map + off->consumer);
+    ring->flags    = (u32*)((char*)ring->map + off->flags);
+    ring->descs    = (char*)ring->map + off->desc;
+}
+
+
+static void setup_queue(q2pc_xdp_priv* priv, xsk_queue* q, i64 queue)
+{
+    q->queue = queue;
+    pthread_mutex_init(&q->drain_lock, NULL);
+
+    q->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if(q->fd < 0){
+        ch_log_fatal("Could not create AF_XDP socket, this needs CAP_NET_RAW (%s)\n", strerror(errno));
+    }
+
+    q->umem = mmap(NULL, (i64)UMEM_FRAMES * UMEM_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(q->umem == MAP_FAILED){
+        ch_log_fatal("Could not allocate AF_XDP UMEM: %s\n", strerror(errno));
+    }
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr       = (u64)(uintptr_t)q->umem;
+    reg.len        = (u64)UMEM_FRAMES * UMEM_FRAME_SIZE;
+    reg.chunk_size = UMEM_FRAME_SIZE;
+    reg.headroom   = 0;
+    if(setsockopt(q->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg))){
+        ch_log_fatal("Could not register AF_XDP UMEM: %s\n", strerror(errno));
+    }
+
+    const int ring_size = RING_SIZE;
+    if(setsockopt(q->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) ||
+       setsockopt(q->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) ||
+       setsockopt(q->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) ||
+       setsockopt(q->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size))){
+        ch_log_fatal("Could not set up AF_XDP rings: %s\n", strerror(errno));
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if(getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len)){
+        ch_log_fatal("Could not get AF_XDP ring offsets: %s\n", strerror(errno));
+    }
+
+    map_ring(q, &q->fill, &off.fr, sizeof(u64), XDP_UMEM_PGOFF_FILL_RING);
+    map_ring(q, &q->comp, &off.cr, sizeof(u64), XDP_UMEM_PGOFF_COMPLETION_RING);
+    map_ring(q, &q->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    map_ring(q, &q->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+
+    //Receive into the first half of UMEM, send from the second
+    for(i64 i = 0; i < RX_FRAMES; i++){
+        ((u64*)q->fill.descs)[i] = i * UMEM_FRAME_SIZE;
+    }
+    __sync_synchronize();
+    *q->fill.producer = RX_FRAMES;
+
+    for(i64 i = 0; i < TX_FRAMES; i++){
+        q->tx_free[q->tx_free_count++] = (RX_FRAMES + i) * UMEM_FRAME_SIZE;
+    }
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family   = AF_XDP;
+    addr.sxdp_ifindex  = priv->ifindex;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags    = XDP_ZEROCOPY;
+    q->zero_copy       = true;
+    if(bind(q->fd, (struct sockaddr*)&addr, sizeof(addr))){
+        ch_log_debug1("No zero copy AF_XDP on %s queue %li, using copy mode (%s)\n", priv->transport.iface, queue, strerror(errno));
+        addr.sxdp_flags = XDP_COPY;
+        q->zero_copy    = false;
+        if(bind(q->fd, (struct sockaddr*)&addr, sizeof(addr))){
+            ch_log_fatal("Could not bind AF_XDP socket to %s queue %li: %s\n", priv->transport.iface, queue, strerror(errno));
+        }
+    }
+
+    u32 key = queue;
+    u32 value = q->fd;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = priv->map_fd;
+    attr.key    = (u64)(uintptr_t)&key;
+    attr.value  = (u64)(uintptr_t)&value;
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)){
+        ch_log_fatal("Could not add AF_XDP socket for queue %li to the XSK map: %s\n", queue, strerror(errno));
+    }
+}
+
+
+//One socket for each queue that the NIC might put a client on. Loopback and veth just have the one.
+static i64 count_queues(const char* iface)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0){
+        return 1;
+    }
+
+    struct ethtool_channels channels;
+    memset(&channels, 0, sizeof(channels));
+    channels.cmd = ETHTOOL_GCHANNELS;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", iface);
+    ifr.ifr_data = (void*)&channels;
+
+    i64 result = 1;
+    if(!ioctl(fd, SIOCETHTOOL, &ifr)){
+        result = MAX(1, (i64)MAX(channels.combined_count, channels.rx_count));
+    }
+
+    close(fd);
+    return result;
+}
+
+
+static void init(q2pc_xdp_priv* priv)
+{
+
+    ch_log_debug1("Constructing XDP transport\n");
+
+    priv->slot_size   = MAX(priv->transport.msize, (i64)sizeof(q2pc_msg));
+    priv->pool        = buff_pool_new(priv->slot_size + BUFF_POOL_HEADROOM);
+    priv->conns_count = MAX(priv->transport.client_count, 1);
+
+    //Copy mode puts XDP_PACKET_HEADROOM in front of everything it receives
+    if((i64)sizeof(udp_frame_hdr) + priv->slot_size > UMEM_FRAME_SIZE - XDP_PACKET_HEADROOM){
+        ch_log_fatal("Messages of %li bytes are too big for AF_XDP UMEM frames\n", priv->slot_size);
+    }
+
+    priv->ifindex = if_nametoindex(priv->transport.iface);
+    if(!priv->ifindex){
+        ch_log_fatal("Could not find interface %s: %s\n", priv->transport.iface, strerror(errno));
+    }
+
+    priv->conns = calloc(priv->conns_count, sizeof(q2pc_xdp_conn_priv*));
+    if(!priv->conns){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    for(i64 i = 0; i < priv->conns_count; i++){
+        q2pc_xdp_conn_priv* conn = calloc(1,sizeof(q2pc_xdp_conn_priv));
+        if(!conn){
+            ch_log_fatal("Malloc failed!\n");
+        }
+
+        mailbox_init(&conn->mailbox, mailbox_slots(&priv->transport), priv->slot_size);
+
+        conn->trans             = priv;
+        conn->idx               = i;
+        conn->write_buffer_size = buff_pool_buff_size(priv->pool);
+        conn->sink_fd           = udp_frame_sink(priv->transport.port + i + 1);
+        pthread_mutex_init(&conn->mailbox_lock, NULL);
+        priv->conns[i]          = conn;
+    }
+
+    priv->queues_count = count_queues(priv->transport.iface);
+    priv->queues       = calloc(priv->queues_count, sizeof(xsk_queue));
+    if(!priv->queues){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(u32);
+    attr.value_size  = sizeof(u32);
+    attr.max_entries = priv->queues_count;
+    priv->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if(priv->map_fd < 0){
+        ch_log_fatal("Could not create XSK map, this needs CAP_BPF (%s)\n", strerror(errno));
+    }
+
+    for(i64 i = 0; i < priv->queues_count; i++){
+        setup_queue(priv, &priv->queues[i], i);
+    }
+
+    //Everything in the broadcast frame except the lengths, IP id and checksum is the same every time
+    udp_frame_template(&priv->tx_template, priv->transport.iface, priv->transport.bcast, priv->transport.port);
+
+    //Only start redirecting once all the sockets are there
+    load_program(priv);
+    attach_program(priv);
+
+    ch_log_debug1("Done constructing XDP transport on %li queues\n", priv->queues_count);
+
+}
+
+
+q2pc_trans* q2pc_xdp_construct(const transport_s* transport)
+{
+    //Nothing changes on the wire, so clients don't need to know
+    if(!transport->server){
+        return q2pc_qj_construct(transport);
+    }
+
+    q2pc_trans* result = (q2pc_trans*)calloc(1,sizeof(q2pc_trans));
+    if(!result){
+        ch_log_fatal("Could not allocate XDP server structure\n");
+    }
+
+    q2pc_xdp_priv* priv = (q2pc_xdp_priv*)calloc(1,sizeof(q2pc_xdp_priv));
+    if(!priv){
+        ch_log_fatal("Could not allocate XDP server private structure\n");
+    }
+
+    result->priv          = priv;
+    result->connect       = doconnect;
+    result->flush         = serv_flush;
+    result->delete        = serv_delete;
+    memcpy(&priv->transport,transport, sizeof(transport_s));
+    init(priv);
+
+
+    return result;
+}
@@ -11,6 +11,13 @@
 #include "q2pc_trans_udp.h"
 #include "q2pc_trans_rudp.h"
 #include "q2pc_trans_qj.h"
+#include "q2pc_trans_mmsg.h"
+#include "q2pc_trans_uring.h"
+#include "q2pc_trans_shm.h"
+#include "q2pc_trans_mcast.h"
+#include "q2pc_trans_nack.h"
+#include "q2pc_trans_packet.h"
+#include "q2pc_trans_xdp.h"
 
 
 q2pc_trans* trans_factory(const transport_s* transport)
@@ -19,7 +26,13 @@ q2pc_trans* trans_factory(const transport_s* transport)
         case tcp_ln: return q2pc_tcp_construct(transport);
         case udp_ln: return q2pc_udp_construct(transport);
         case rdp_ln: return q2pc_rudp_construct(transport);
-        case udp_qj: return q2pc_qj_construct(transport);
+        case udp_qj: return transport->nack ? q2pc_nack_construct(transport) : q2pc_qj_construct(transport);
+        case udp_mm: return q2pc_mmsg_construct(transport);
+        case udp_ur: return q2pc_uring_construct(transport);
+        case shm_ln: return q2pc_shm_construct(transport);
+        case udp_mc: return transport->nack ? q2pc_nack_construct(transport) : q2pc_mcast_construct(transport);
+        case udp_pk: return q2pc_packet_construct(transport);
+        case udp_xd: return q2pc_xdp_construct(transport);
         default: ch_log_fatal("Not implemented\n");
     }
 
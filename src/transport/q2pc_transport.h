@@ -13,7 +13,7 @@
 #include "conn_vector.h"
 
 
-typedef enum { udp_ln = 0, tcp_ln, rdp_ln, udp_qj } transport_e;
+typedef enum { udp_ln = 0, tcp_ln, rdp_ln, udp_qj, udp_mm, udp_ur, shm_ln, udp_mc, udp_pk, udp_xd } transport_e;
 
 typedef struct {
     transport_e type;
@@ -26,8 +26,20 @@ typedef struct {
     i64 client_id;
     char* bcast;
     char* iface;
+    char* mcast_group;
+    i64 mcast_ttl;
+    bool nack;
+    i64 nack_drop;  //Percentage of broadcasts a NACK client throws away, to test repairs
+    i64 wait_us;    //How long the server waits on a phase before giving up
     i64 rto_us;
+    i64 rto_min_us;
+    i64 rto_max_us;
+    i64 rdp_window;
+    i64 txn_window; //Transactions the server has in flight at once, which bounds what each client can send it
     i64 msize;
+    i64 shards;     //Server SO_REUSEPORT sockets on a single port, 0 for one port per client
+    i64 hdr_len;    //Bytes that layered transports put in front of each q2pc_msg
+    i64 tstamp;     //Kernel timestamps on server sockets, off or software (see sock_tstamp_e)
 
 } transport_s;
 
@@ -41,6 +53,20 @@ typedef struct q2pc_trans_conn_s {
 
     void (*delete)(struct q2pc_trans_conn_s* this);
 
+    //Optional. Returns a file descriptor that becomes readable when there is data to read, or -1 if there isn't one.
+    int (*get_fd)(struct q2pc_trans_conn_s* this);
+
+    //Optional. Returns the current retransmit timeout in microseconds, for transports that retransmit.
+    i64 (*get_rto)(struct q2pc_trans_conn_s* this);
+
+    //Optional. Returns how many retransmit timeouts have fired on the connection so far, including the ones the
+    //transport dealt with by itself, outside of end_write.
+    i64 (*get_rtos)(struct q2pc_trans_conn_s* this);
+
+    //Optional. Gives the kernel timestamps in microseconds of the latest write and of the message being read, or -1
+    //for either one that wasn't stamped. Only there for transports that have timestamps turned on.
+    void (*get_tstamps)(struct q2pc_trans_conn_s* this, i64* tx_us_o, i64* rx_us_o);
+
     void* priv;
 } q2pc_trans_conn;
 
@@ -48,6 +74,18 @@ typedef struct q2pc_trans_conn_s {
 typedef struct q2pc_trans_s {
     int (*connect)(struct q2pc_trans_s* this, q2pc_trans_conn* conn);
 
+    //Optional. Transports that queue up writes send them all out when flushed.
+    int (*flush)(struct q2pc_trans_s* this);
+
+    //Optional. Called regularly by the server while it waits for votes, for transports that have timers to run.
+    int (*tick)(struct q2pc_trans_s* this);
+
+    //Optional. Fills conns_o with up to max connections whose pending write needs end_write() called on it again,
+    //because an ack has arrived or a retransmit timer has expired, and returns how many. Once a caller starts using
+    //this, connections not returned by it will not make progress, so it must be used for every write after that.
+    //Transports without it need every connection with a pending write to be polled.
+    i64 (*ready)(struct q2pc_trans_s* this, q2pc_trans_conn** conns_o, i64 max);
+
     void (*delete)(struct q2pc_trans_s* this);
 
     void* priv;
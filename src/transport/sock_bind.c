@@ -0,0 +1,31 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sock_bind.h"
+
+
+#define SECONDS_PER_TRY 5
+#define SECONDS_TOTAL   120
+
+void sock_wait_bind(int fd, const struct sockaddr_in* addr, const char* what)
+{
+    ch_log_debug3("Binding on %i port=%i\n", fd, ntohs(addr->sin_port));
+
+    i64 tries = 0;
+    while(bind(fd, (const struct sockaddr*)addr, sizeof(struct sockaddr_in))){
+        if(errno != EADDRINUSE || tries >= SECONDS_TOTAL / SECONDS_PER_TRY){
+            ch_log_fatal("%s bind failed: %s\n", what, strerror(errno));
+        }
+
+        ch_log_debug1("%li] %s --> sleeping for %i seconds...\n", tries, strerror(errno), SECONDS_PER_TRY);
+        sleep(SECONDS_PER_TRY);
+        tries++;
+    }
+
+    if(tries){
+        ch_log_debug1("Successfully bound after delay.\n");
+    }
+}
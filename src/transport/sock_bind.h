@@ -0,0 +1,12 @@
+#ifndef SOCK_BIND_H_
+#define SOCK_BIND_H_
+
+#include <netinet/in.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//Bind fd to addr. If the address is still in use, which Linux does for a while after an app quits, keep trying for up
+//to two minutes so that quick restarts work. Anything else is fatal, what names the socket in the error.
+void sock_wait_bind(int fd, const struct sockaddr_in* addr, const char* what);
+
+#endif /* SOCK_BIND_H_ */
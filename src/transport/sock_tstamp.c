@@ -0,0 +1,100 @@
+#include <string.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <errno.h>
+
+#include "sock_tstamp.h"
+
+
+#define SW_FLAGS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+
+typedef union {
+    char buff[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct cmsghdr align;
+} cmsg_buff;
+
+
+void sock_tstamp_enable(int fd, i64 mode)
+{
+    if(mode == sock_tstamp_off){
+        return;
+    }
+
+    //Only the stamp comes back on the error queue, not a copy of the whole packet
+    int flags = SW_FLAGS | SOF_TIMESTAMPING_OPT_TSONLY;
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))){
+        ch_log_fatal("Could not turn on timestamps for fd=%i: %s\n", fd, strerror(errno));
+    }
+}
+
+
+//Software stamps are in ts[0]
+static i64 find_stamp(struct msghdr* msg)
+{
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)){
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING){
+            continue;
+        }
+
+        struct scm_timestamping stamps;
+        memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+        const struct timespec* ts = &stamps.ts[0];
+        if(ts->tv_sec){
+            return ts->tv_sec * 1000 * 1000 + ts->tv_nsec / 1000;
+        }
+    }
+
+    return -1;
+}
+
+
+i64 sock_tstamp_recv(int fd, void* buff, i64 len, struct sockaddr* addr, socklen_t* addr_len, i64* ts_us_o)
+{
+    struct iovec iov = { .iov_base = buff, .iov_len = len };
+    cmsg_buff control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name       = addr;
+    msg.msg_namelen    = addr_len ? *addr_len : 0;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buff;
+    msg.msg_controllen = sizeof(control.buff);
+
+    const i64 result = recvmsg(fd, &msg, 0);
+    if(result < 0){
+        return result;
+    }
+
+    if(addr_len){
+        *addr_len = msg.msg_namelen;
+    }
+
+    *ts_us_o = find_stamp(&msg);
+    return result;
+}
+
+
+i64 sock_tstamp_last_tx(int fd)
+{
+    i64 result = -1;
+
+    for(;;){
+        cmsg_buff control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control.buff;
+        msg.msg_controllen = sizeof(control.buff);
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            break; //Nothing left, or a real error that the next read or write will find
+        }
+
+        const i64 ts_us = find_stamp(&msg);
+        result = MAX(result, ts_us);
+    }
+
+    return result;
+}
@@ -0,0 +1,23 @@
+#ifndef SOCK_TSTAMP_H_
+#define SOCK_TSTAMP_H_
+
+#include <sys/socket.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//Kernel timestamps on sockets, so that time on the wire can be told apart from time spent in our own queues and
+//polling loops. Stamps are taken in software as packets enter and leave the network stack, in CLOCK_REALTIME. NIC
+//hardware stamps are not used, they are in the NIC's own clock and can't be compared with anything we read here.
+
+typedef enum { sock_tstamp_off = 0, sock_tstamp_sw } sock_tstamp_e;
+
+//Turn on RX and TX stamps for fd
+void sock_tstamp_enable(int fd, i64 mode);
+
+//Like recvfrom(), but also gives the time the data arrived in *ts_us_o, or -1 if it wasn't stamped
+i64 sock_tstamp_recv(int fd, void* buff, i64 len, struct sockaddr* addr, socklen_t* addr_len, i64* ts_us_o);
+
+//Empties the error queue of fd and returns the latest TX stamp that was on it, or -1 if there weren't any
+i64 sock_tstamp_last_tx(int fd);
+
+#endif /* SOCK_TSTAMP_H_ */
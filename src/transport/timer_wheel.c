@@ -0,0 +1,137 @@
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+
+//Level 0 has one slot per tick for the current epoch of 256 ticks. Level 1 has one slot per epoch for the next 64
+//epochs, about 4 seconds with 250us ticks. Timers further out than that wait in the last level 1 slot and are put
+//back in when it comes due.
+#define L0_BITS     8
+#define L1_BITS     6
+#define L0_SLOTS    (1 << L0_BITS)
+#define L1_SLOTS    (1 << L1_BITS)
+#define L0_MASK     (L0_SLOTS - 1)
+#define L1_MASK     (L1_SLOTS - 1)
+
+struct timer_wheel_s {
+    timer_wheel_node* l0[L0_SLOTS];
+    timer_wheel_node* l1[L1_SLOTS];
+    i64 now_tick; //The next tick to be processed, everything before this has already expired
+};
+
+
+static void insert(timer_wheel* wheel, timer_wheel_node* node)
+{
+    if(node->tick < wheel->now_tick){
+        node->tick = wheel->now_tick;
+    }
+
+    const i64 epoch     = node->tick >> L0_BITS;
+    const i64 now_epoch = wheel->now_tick >> L0_BITS;
+
+    timer_wheel_node** slot = NULL;
+    if(epoch == now_epoch){
+        slot = &wheel->l0[node->tick & L0_MASK];
+    }
+    else{
+        slot = &wheel->l1[MIN(epoch, now_epoch + L1_SLOTS - 1) & L1_MASK];
+    }
+
+    node->next  = *slot;
+    node->pprev = slot;
+    if(node->next){
+        node->next->pprev = &node->next;
+    }
+    *slot = node;
+}
+
+
+//Move the timers for the epoch we are just entering down into level 0
+static void cascade(timer_wheel* wheel)
+{
+    const i64 epoch = wheel->now_tick >> L0_BITS;
+    timer_wheel_node* node = wheel->l1[epoch & L1_MASK];
+    wheel->l1[epoch & L1_MASK] = NULL;
+
+    while(node){
+        timer_wheel_node* next = node->next;
+        insert(wheel, node);
+        node = next;
+    }
+}
+
+
+timer_wheel* timer_wheel_new(i64 now_us)
+{
+    timer_wheel* wheel = (timer_wheel*)calloc(1, sizeof(timer_wheel));
+    if(!wheel){
+        ch_log_fatal("Could not allocate timer wheel\n");
+    }
+
+    wheel->now_tick = now_us / TIMER_WHEEL_TICK_US;
+    return wheel;
+}
+
+
+void timer_wheel_arm(timer_wheel* wheel, timer_wheel_node* node, i64 deadline_us)
+{
+    timer_wheel_cancel(node);
+
+    //Round up so that we never fire before the deadline
+    node->tick = (deadline_us + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+    insert(wheel, node);
+}
+
+
+void timer_wheel_cancel(timer_wheel_node* node)
+{
+    if(!node->pprev){
+        return;
+    }
+
+    *node->pprev = node->next;
+    if(node->next){
+        node->next->pprev = node->pprev;
+    }
+
+    node->next  = NULL;
+    node->pprev = NULL;
+}
+
+
+bool timer_wheel_armed(const timer_wheel_node* node)
+{
+    return node->pprev != NULL;
+}
+
+
+void timer_wheel_advance(timer_wheel* wheel, i64 now_us, timer_wheel_expired_f expired, void* arg)
+{
+    const i64 target = now_us / TIMER_WHEEL_TICK_US;
+
+    while(wheel->now_tick <= target){
+        if((wheel->now_tick & L0_MASK) == 0){
+            cascade(wheel);
+        }
+
+        timer_wheel_node* node = wheel->l0[wheel->now_tick & L0_MASK];
+        wheel->l0[wheel->now_tick & L0_MASK] = NULL;
+
+        //Move on first, so that anything re-armed from the callback lands in a future slot
+        wheel->now_tick++;
+
+        while(node){
+            timer_wheel_node* next = node->next;
+            node->next  = NULL;
+            node->pprev = NULL;
+            expired(node, arg);
+            node = next;
+        }
+    }
+}
+
+
+void timer_wheel_delete(timer_wheel* wheel)
+{
+    free(wheel);
+}
@@ -0,0 +1,30 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include "../../deps/chaste/chaste.h"
+
+//A two level hierarchical timer wheel. Timers are intrusive nodes that live inside the structure they time, so arming
+//and cancelling is O(1) and never allocates. Advancing the wheel only touches the slots that have come due, so the
+//cost of finding expired timers follows the number that expired, not the number armed. Timers never fire early, but
+//may fire up to one tick late. The wheel is not thread safe, it belongs to whichever thread arms and advances it.
+
+#define TIMER_WHEEL_TICK_US 250
+
+typedef struct timer_wheel_node_s {
+    struct timer_wheel_node_s* next;
+    struct timer_wheel_node_s** pprev;
+    i64 tick;
+} timer_wheel_node;
+
+typedef struct timer_wheel_s timer_wheel;
+
+typedef void (*timer_wheel_expired_f)(timer_wheel_node* node, void* arg);
+
+timer_wheel* timer_wheel_new(i64 now_us);
+void timer_wheel_arm(timer_wheel* wheel, timer_wheel_node* node, i64 deadline_us);
+void timer_wheel_cancel(timer_wheel_node* node);
+bool timer_wheel_armed(const timer_wheel_node* node);
+void timer_wheel_advance(timer_wheel* wheel, i64 now_us, timer_wheel_expired_f expired, void* arg);
+void timer_wheel_delete(timer_wheel* wheel);
+
+#endif /* TIMER_WHEEL_H_ */
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "udp_frame.h"
+#include "sock_bind.h"
+
+
+static u16 ip_checksum(const void* data, i64 len)
+{
+    const u16* words = (const u16*)data;
+    u32 sum = 0;
+    for(; len > 1; len -= 2){
+        sum += *words++;
+    }
+
+    while(sum >> 16){
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return ~sum;
+}
+
+
+void udp_frame_template(udp_frame_hdr* tmpl, const char* iface, const char* dst_ip, u16 port)
+{
+    memset(tmpl, 0, sizeof(udp_frame_hdr));
+
+    //Need an IP socket to ask about the interface
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0){
+        ch_log_fatal("Could not create socket to look up %s: %s\n", iface, strerror(errno));
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", iface);
+    if(ioctl(fd, SIOCGIFHWADDR, &ifr)){
+        ch_log_fatal("Could not get the hardware address of %s: %s\n", iface, strerror(errno));
+    }
+
+    memset(tmpl->eth.h_dest, 0xFF, ETH_ALEN);
+    memcpy(tmpl->eth.h_source, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    tmpl->eth.h_proto = htons(ETH_P_IP);
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", iface);
+    ifr.ifr_addr.sa_family = AF_INET;
+    if(ioctl(fd, SIOCGIFADDR, &ifr)){
+        ch_log_fatal("Could not get the IP address of %s: %s\n", iface, strerror(errno));
+    }
+    close(fd);
+
+    tmpl->ip.version  = 4;
+    tmpl->ip.ihl      = sizeof(struct iphdr) / 4;
+    tmpl->ip.ttl      = 64;
+    tmpl->ip.protocol = IPPROTO_UDP;
+    tmpl->ip.saddr    = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr;
+    tmpl->ip.daddr    = inet_addr(dst_ip);
+
+    tmpl->udp.source  = htons(port);
+    tmpl->udp.dest    = htons(port);
+    tmpl->udp.check   = 0;
+}
+
+
+i64 udp_frame_build(char* frame, const udp_frame_hdr* tmpl, u16 ip_id, const char* data, i64 len)
+{
+    udp_frame_hdr* hdr = (udp_frame_hdr*)frame;
+    memcpy(hdr, tmpl, sizeof(udp_frame_hdr));
+    memcpy(frame + sizeof(udp_frame_hdr), data, len);
+
+    hdr->ip.tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + len);
+    hdr->ip.id      = htons(ip_id);
+    hdr->ip.check   = ip_checksum(&hdr->ip, sizeof(struct iphdr));
+    hdr->udp.len    = htons(sizeof(struct udphdr) + len);
+
+    return sizeof(udp_frame_hdr) + len;
+}
+
+
+const char* udp_frame_payload(const char* frame, i64 len, i64* data_len_o)
+{
+    if(len < (i64)(sizeof(struct ethhdr) + sizeof(struct iphdr))){
+        return NULL;
+    }
+
+    const struct ethhdr* eth = (const struct ethhdr*)frame;
+    const struct iphdr* ip   = (const struct iphdr*)(frame + sizeof(struct ethhdr));
+    if(eth->h_proto != htons(ETH_P_IP) || ip->protocol != IPPROTO_UDP || (ntohs(ip->frag_off) & 0x3FFF)){
+        return NULL;
+    }
+
+    const i64 udp_off = sizeof(struct ethhdr) + ip->ihl * 4;
+    if(len < udp_off + (i64)sizeof(struct udphdr)){
+        return NULL;
+    }
+
+    const struct udphdr* udp = (const struct udphdr*)(frame + udp_off);
+    const i64 data_off       = udp_off + sizeof(struct udphdr);
+    *data_len_o = MIN((i64)ntohs(udp->len) - (i64)sizeof(struct udphdr), len - data_off);
+
+    return frame + data_off;
+}
+
+
+int udp_frame_sink(i64 port)
+{
+    int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_fd < 0 ){
+        ch_log_fatal("Could not create UDP sink socket (%s)\n", strerror(errno));
+    }
+
+    int reuse_opt = 1;
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("UDP set reuse address failed: %s\n",strerror(errno));
+    }
+
+    struct sock_filter drop_all[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+    struct sock_fprog prog = { .len = 1, .filter = drop_all };
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))){
+        ch_log_fatal("Could not attach filter to UDP sink socket: %s\n", strerror(errno));
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(port);
+    sock_wait_bind(sock_fd, &addr, "UDP sink");
+
+    return sock_fd;
+}
@@ -0,0 +1,33 @@
+#ifndef UDP_FRAME_H_
+#define UDP_FRAME_H_
+
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+
+#include "../../deps/chaste/chaste.h"
+
+//Ethernet/IP/UDP framing for the transports that put frames on the wire themselves (AF_PACKET and AF_XDP). Frames
+//are built from a template that is filled in once from the interface, so only the lengths, IP id and checksum
+//change per message. There is no UDP checksum, which IPv4 allows.
+
+typedef struct __attribute__((__packed__)) {
+    struct ethhdr eth;
+    struct iphdr ip;
+    struct udphdr udp;
+} udp_frame_hdr;
+
+//Fill in a template for broadcasts from the given interface to dst_ip:port, from the same port
+void udp_frame_template(udp_frame_hdr* tmpl, const char* iface, const char* dst_ip, u16 port);
+
+//Build a frame from the template in front of len bytes of data, returning the length of the frame
+i64 udp_frame_build(char* frame, const udp_frame_hdr* tmpl, u16 ip_id, const char* data, i64 len);
+
+//Find the UDP payload in a frame and its length, or NULL if this isn't a whole UDP datagram over IPv4
+const char* udp_frame_payload(const char* frame, i64 len, i64* data_len_o);
+
+//A UDP socket on the port that throws away everything it gets. Frames that are taken off the wire before the socket
+//layer still go up the stack on some paths, and this stops the kernel from answering them with port unreachables.
+int udp_frame_sink(i64 port);
+
+#endif /* UDP_FRAME_H_ */
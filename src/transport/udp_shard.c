@@ -0,0 +1,422 @@
+//recvmmsg() is a GNU extension
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "udp_shard.h"
+#include "mailbox.h"
+#include "../errors/errors.h"
+#include "../protocol/q2pc_protocol.h"
+
+
+#define DRAIN_BATCH 64 //Datagrams to pull in with each recvmmsg() call
+
+typedef struct {
+    //A mailbox of pool buffers. Normally only the shard that the client is steered to delivers here, but layer messages
+    //too short to steer can turn up on another shard, so producers take the lock. The consumer doesn't need it.
+    mailbox mailbox;
+    volatile i64 lock;
+
+    i64 drain_seen; //Consumer only
+
+    struct sockaddr_in addr;
+    volatile bool connected;
+} shard_conn;
+
+
+typedef struct {
+    int fd;
+
+    pthread_mutex_t drain_lock;
+    volatile i64 drain_seq;
+    struct mmsghdr msgs[DRAIN_BATCH];
+    struct iovec iovs[DRAIN_BATCH];
+    struct sockaddr_in addrs[DRAIN_BATCH];
+    char* buffs[DRAIN_BATCH];
+} shard;
+
+
+struct udp_shard_set_s {
+    buff_pool* pool;
+    i64 hostid_off;         //Where src_hostid is in each datagram, after any layered transport headers
+
+    shard* shards;
+    i64 shards_count;
+    i64 conns_per_shard;
+
+    shard_conn* conns;
+    i64 conns_count;
+
+    //Source address to connection lookup table, open addressing with linear probing. Entries are only ever added,
+    //under the lock, with the value written before the key so that lookups don't need the lock.
+    pthread_mutex_t addr_lock;
+    volatile u64* addr_keys;
+    i64* addr_conns;
+    i64 addr_table_size;
+};
+
+
+static inline u64 addr_key(const struct sockaddr_in* addr)
+{
+    return ((u64)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+
+static inline i64 addr_hash(udp_shard_set* set, u64 key)
+{
+    return (i64)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (set->addr_table_size - 1);
+}
+
+
+static shard_conn* addr_lookup(udp_shard_set* set, const struct sockaddr_in* addr)
+{
+    const u64 key  = addr_key(addr);
+    const i64 mask = set->addr_table_size - 1;
+    for(i64 i = addr_hash(set, key); set->addr_keys[i]; i = (i + 1) & mask){
+        if(set->addr_keys[i] == key){
+            return &set->conns[set->addr_conns[i]];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void addr_insert(udp_shard_set* set, const struct sockaddr_in* addr, i64 idx)
+{
+    const u64 key  = addr_key(addr);
+    const i64 mask = set->addr_table_size - 1;
+
+    pthread_mutex_lock(&set->addr_lock);
+    i64 i = addr_hash(set, key);
+    for(; set->addr_keys[i]; i = (i + 1) & mask){
+        if(set->addr_keys[i] == key){
+            pthread_mutex_unlock(&set->addr_lock);
+            return;
+        }
+    }
+
+    set->addr_conns[i] = idx;
+    __sync_synchronize();
+    set->addr_keys[i] = key;
+    pthread_mutex_unlock(&set->addr_lock);
+}
+
+
+//Work out which connection a datagram belongs to, from its src_hostid if it is long enough to have one
+static shard_conn* demux(udp_shard_set* set, const char* data, i64 len, const struct sockaddr_in* addr)
+{
+    if(len < set->hostid_off + (i64)sizeof(i16)){
+        shard_conn* conn = addr_lookup(set, addr);
+        if(!conn){
+            ch_log_debug1("Short datagram from unknown address %s:%i. Ignoring\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        }
+        return conn;
+    }
+
+    const i64 hostid = *(i16*)(data + set->hostid_off);
+    if(hostid < 1 || hostid > set->conns_count){
+        ch_log_warn("Datagram from unexpected client id %li, expected [1,%li]. Ignoring\n", hostid, set->conns_count);
+        return NULL;
+    }
+
+    shard_conn* conn = &set->conns[hostid - 1];
+    if(unlikely(!conn->connected)){
+        conn->addr = *addr;
+        __sync_synchronize(); //Make sure the address is there before anyone can see we are connected
+        conn->connected = true;
+        addr_insert(set, addr, hostid - 1);
+        ch_log_debug3("Connected %s:%i to connection %li\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), hostid - 1);
+    }
+
+    return conn;
+}
+
+
+static bool deliver(shard_conn* conn, char* buff, i64 len)
+{
+    while(__sync_lock_test_and_set(&conn->lock, 1)){
+        __asm__ volatile("pause");
+    }
+
+    const bool delivered = mailbox_put(&conn->mailbox, buff, len);
+
+    __sync_lock_release(&conn->lock);
+    return delivered;
+}
+
+
+//Pull in everything waiting on a shard socket and hand it out to the connection mailboxes
+static void drain(udp_shard_set* set, shard* shrd)
+{
+    if(pthread_mutex_trylock(&shrd->drain_lock)){
+        return; //Someone else is already doing it
+    }
+
+    const i64 buff_size = buff_pool_buff_size(set->pool);
+    while(1){
+        for(int i = 0; i < DRAIN_BATCH; i++){
+            if(!shrd->buffs[i]){
+                shrd->buffs[i] = buff_pool_get(set->pool);
+            }
+            shrd->iovs[i].iov_base                = shrd->buffs[i];
+            shrd->iovs[i].iov_len                 = buff_size;
+            shrd->msgs[i].msg_hdr.msg_iov         = &shrd->iovs[i];
+            shrd->msgs[i].msg_hdr.msg_iovlen      = 1;
+            shrd->msgs[i].msg_hdr.msg_name        = &shrd->addrs[i];
+            shrd->msgs[i].msg_hdr.msg_namelen     = sizeof(struct sockaddr_in);
+        }
+
+        int count = recvmmsg(shrd->fd, shrd->msgs, DRAIN_BATCH, MSG_DONTWAIT, NULL);
+        if(count < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+
+            ch_log_fatal("UDP recvmmsg failed on fd=%i with errno=%i (%s)\n", shrd->fd, errno, strerror(errno));
+        }
+
+        for(int i = 0; i < count; i++){
+            if(shrd->msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+                ch_log_warn("Datagram larger than %li bytes was truncated. Ignoring\n", buff_size);
+                continue;
+            }
+
+            shard_conn* conn = demux(set, shrd->buffs[i], shrd->msgs[i].msg_len, shrd->addrs + i);
+            if(!conn){
+                continue;
+            }
+
+            if(!deliver(conn, shrd->buffs[i], shrd->msgs[i].msg_len)){
+                ch_log_warn("Client on connection %li has sent more than its window allows. Dropping datagram\n", conn - set->conns);
+                continue;
+            }
+            shrd->buffs[i] = NULL; //The mailbox has it now
+        }
+
+        if(count < DRAIN_BATCH){
+            break;
+        }
+    }
+
+    shrd->drain_seq++;
+    pthread_mutex_unlock(&shrd->drain_lock);
+}
+
+
+int udp_shard_read(udp_shard_set* set, i64 idx, char** data_o, i64* len_o)
+{
+    if(idx >= set->conns_count){
+        return Q2PC_EAGAIN; //Write only connection, nobody can send to it
+    }
+
+    shard_conn* conn = &set->conns[idx];
+    if(mailbox_empty(&conn->mailbox)){
+        //Only drain if nobody else has since we last looked. This keeps it to one recvmmsg() per shard for each
+        //pass over the connections, rather than one per connection.
+        shard* shrd = &set->shards[idx / set->conns_per_shard];
+        const i64 drain_seq = shrd->drain_seq;
+        if(conn->drain_seen != drain_seq){
+            conn->drain_seen = drain_seq;
+            return Q2PC_EAGAIN;
+        }
+
+        drain(set, shrd);
+        conn->drain_seen = shrd->drain_seq;
+    }
+
+    if(!mailbox_peek(&conn->mailbox, data_o, len_o)){
+        return Q2PC_EAGAIN;
+    }
+    ch_log_debug3("Got %li bytes on connection %li\n", *len_o, idx);
+
+    return Q2PC_ENONE;
+}
+
+
+void udp_shard_release(udp_shard_set* set, i64 idx)
+{
+    if(idx >= set->conns_count){
+        return;
+    }
+
+    buff_pool_put(set->pool, mailbox_pop(&set->conns[idx].mailbox));
+}
+
+
+int udp_shard_send(udp_shard_set* set, i64 idx, const char* data, i64 len)
+{
+    if(idx >= set->conns_count || !set->conns[idx].connected){
+        ch_log_warn("Cannot write to connection %li before the client has connected\n", idx);
+        return Q2PC_EFIN;
+    }
+
+    //Any socket on the port will do, use the one for the thread that owns the connection
+    shard_conn* conn = &set->conns[idx];
+    const int fd = set->shards[idx / set->conns_per_shard].fd;
+    while(1){
+        i64 written = sendto(fd, data, len, 0, (struct sockaddr*)&conn->addr, sizeof(conn->addr));
+        if(written < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                continue; //Keep trying until we succeed
+            }
+
+            ch_log_warn("UDP sendto failed with errorno=%i: %s\n", errno, strerror(errno));
+            return Q2PC_EFIN;
+        }
+
+        return Q2PC_ENONE;
+    }
+}
+
+
+//Ask the kernel to pick the socket from the src_hostid, (hostid - 1) / conns_per_shard. The field is little endian,
+//and BPF loads are big endian, so it is put together a byte at a time. Datagrams too short to have one fail the load,
+//and end up on shard 0.
+static void attach_steering(udp_shard_set* set, int fd)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, set->hostid_off + 1),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K,   8),
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, set->hostid_off),
+        BPF_STMT(BPF_ALU | BPF_OR  | BPF_X,   0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K,   1),
+        BPF_STMT(BPF_ALU | BPF_DIV | BPF_K,   set->conns_per_shard),
+        BPF_STMT(BPF_RET | BPF_A,             0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    //Not fatal, the kernel will hash flows across the sockets instead, and we hand them over between threads
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))){
+        ch_log_warn("Could not attach SO_REUSEPORT steering program, falling back to flow hashing (%s)\n", strerror(errno));
+    }
+}
+
+
+static int new_socket(i64 port)
+{
+    int sock_fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (sock_fd < 0 ){
+        ch_log_fatal("Could not create UDP socket (%s)\n", strerror(errno));
+    }
+
+    int reuse_opt = 1;
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("UDP set reuse address failed: %s\n",strerror(errno));
+    }
+
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_opt, sizeof(int)) < 0) {
+        ch_log_fatal("UDP set reuse port failed: %s\n",strerror(errno));
+    }
+
+    int flags = 0;
+    flags |= O_NONBLOCK;
+    if( fcntl(sock_fd, F_SETFL, flags) == -1){
+        ch_log_fatal("Could not set non-blocking on fd=%i: %s\n",sock_fd,strerror(errno));
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(port);
+    ch_log_debug3("Binding shard on %i port=%li\n", sock_fd, port);
+    if(bind(sock_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in))){
+        ch_log_fatal("UDP shard bind failed on port %li: %s\n", port, strerror(errno));
+    }
+
+    return sock_fd;
+}
+
+
+static void* safe_calloc(i64 count, i64 size)
+{
+    void* result = calloc(count, size);
+    if(!result){
+        ch_log_fatal("Malloc failed!\n");
+    }
+
+    return result;
+}
+
+
+udp_shard_set* udp_shard_new(const transport_s* transport, i64 port, buff_pool* pool)
+{
+    udp_shard_set* set = safe_calloc(1, sizeof(udp_shard_set));
+    set->pool       = pool;
+    set->hostid_off = transport->hdr_len + offsetof(q2pc_msg, src_hostid);
+
+    //Same split of connections over threads as the server uses
+    set->conns_count     = MAX(transport->client_count, 1);
+    set->conns_per_shard = MAX((set->conns_count + transport->shards - 1) / transport->shards, 1);
+    set->shards_count    = (set->conns_count + set->conns_per_shard - 1) / set->conns_per_shard;
+
+    set->conns = safe_calloc(set->conns_count, sizeof(shard_conn));
+    for(i64 i = 0; i < set->conns_count; i++){
+        set->conns[i].drain_seen = -1;
+        mailbox_init(&set->conns[i].mailbox, mailbox_slots(transport), 0);
+    }
+
+    set->addr_table_size = 2;
+    while(set->addr_table_size < set->conns_count * 2){
+        set->addr_table_size *= 2;
+    }
+    set->addr_keys  = safe_calloc(set->addr_table_size, sizeof(u64));
+    set->addr_conns = safe_calloc(set->addr_table_size, sizeof(i64));
+    pthread_mutex_init(&set->addr_lock, NULL);
+
+    set->shards = safe_calloc(set->shards_count, sizeof(shard));
+    for(i64 i = 0; i < set->shards_count; i++){
+        set->shards[i].fd = new_socket(port);
+        pthread_mutex_init(&set->shards[i].drain_lock, NULL);
+    }
+
+    //The program indexes sockets in the order that they joined the group, so only attach once they all have
+    attach_steering(set, set->shards[0].fd);
+
+    ch_log_debug1("Bound %li shards on port %li with %li connections each\n", set->shards_count, port, set->conns_per_shard);
+    return set;
+}
+
+
+void udp_shard_delete(udp_shard_set* set)
+{
+    if(!set){
+        return;
+    }
+
+    for(i64 i = 0; i < set->shards_count; i++){
+        for(int j = 0; j < DRAIN_BATCH; j++){
+            buff_pool_put(set->pool, set->shards[i].buffs[j]);
+        }
+        close(set->shards[i].fd);
+        pthread_mutex_destroy(&set->shards[i].drain_lock);
+    }
+
+    for(i64 i = 0; i < set->conns_count; i++){
+        while(!mailbox_empty(&set->conns[i].mailbox)){
+            udp_shard_release(set, i);
+        }
+        mailbox_free(&set->conns[i].mailbox);
+    }
+
+    pthread_mutex_destroy(&set->addr_lock);
+    free(set->shards);
+    free(set->conns);
+    free((void*)set->addr_keys);
+    free(set->addr_conns);
+    free(set);
+}
@@ -0,0 +1,21 @@
+#ifndef UDP_SHARD_H_
+#define UDP_SHARD_H_
+
+#include "q2pc_transport.h"
+#include "buff_pool.h"
+
+//Server side receive path that puts every client on a single port. One SO_REUSEPORT socket is bound for each worker
+//thread, and the kernel is asked to steer each datagram to the socket of the thread that owns the client, based on
+//the src_hostid in the message. Datagrams are drained in bulk into pool buffers and handed out to per connection
+//mailboxes by src_hostid (or by source address, for layer messages too short to carry one). Connection idx belongs
+//to client id idx + 1, and lives on the same thread as the server worker that reads it.
+
+typedef struct udp_shard_set_s udp_shard_set;
+
+udp_shard_set* udp_shard_new(const transport_s* transport, i64 port, buff_pool* pool);
+int udp_shard_read(udp_shard_set* set, i64 idx, char** data_o, i64* len_o);
+void udp_shard_release(udp_shard_set* set, i64 idx);
+int udp_shard_send(udp_shard_set* set, i64 idx, const char* data, i64 len);
+void udp_shard_delete(udp_shard_set* set);
+
+#endif /* UDP_SHARD_H_ */